@@ -22,6 +22,11 @@
 //            It uses this native USB port for Serial Debug output which left the hardware UART 
 //            for RS485 comms.
 //
+//            The library builds every device role by default. To build only the AIU, put an
+//            NceCabBusUserConfig.h containing
+//              #define NCE_CAB_BUS_PRESET  NCE_CAB_BUS_PRESET_AIU
+//            in the NceCabBus library's src folder, see "Selecting Device Roles" in the README
+//
 // required libraries:
 //            Bounce2 library can be installed using the Arduino Library Manager
 //-------------------------------------------------------------------------------------------------------*/
@@ -64,7 +69,7 @@
 
 // The Array below maps Arduino Pins to AUI Inputs, change as required 
 //                     AIU Input Numbers  1 2 3 4 5 6 7  8  9 10 11 12 13 14
-uint8_t aiuInputPins[NUM_AIU_INPUTS] =   {2,3,5,6,7,8,9,10,16,14,15,18,19,20};
+const uint8_t aiuInputPins[NUM_AIU_INPUTS] PROGMEM =   {2,3,5,6,7,8,9,10,16,14,15,18,19,20};
 
 // Change the #define below to set the Number of Debounce milliseconds for the AIU Inputs 
 #define DEBOUNCE_MS        20
@@ -84,7 +89,7 @@ void sendRS485Bytes(uint8_t *values, uint8_t length)
   digitalWrite(RS485_TX_ENABLE_PIN, LOW);
 
 #ifdef DEBUG_RS485_BYTES  
-  DebugMonSerial.print("T:");
+  DebugMonSerial.print(F("T:"));
   for(uint8_t i = 0; i < length; i++)
   {
     uint8_t value = values[i];
@@ -126,7 +131,7 @@ void setup() {
 
   for(uint8_t i = 0; i < NUM_AIU_INPUTS; i++)
   {
-    aiuInputs[i].attach(aiuInputPins[i], INPUT_PULLUP);       //setup the bounce instance for the current button
+    aiuInputs[i].attach(pgm_read_byte(&aiuInputPins[i]), INPUT_PULLUP);       //setup the bounce instance for the current button
     aiuInputs[i].interval(DEBOUNCE_MS);
 #ifdef AIU_INPUT_INVERT
     cabBus.setAuiIoBitState(i, !aiuInputs[i].read());  
@@ -151,7 +156,7 @@ void loop() {
       DebugMonSerial.println();
     }
       
-    DebugMonSerial.print("R:");
+    DebugMonSerial.print(F("R:"));
     DebugMonSerial.print(rxByte, HEX);
     DebugMonSerial.print(' ');
 #endif
@@ -173,11 +178,11 @@ void loop() {
 #endif
 
 #ifdef DEBUG_INPUT_CHANGES    
-    DebugMonSerial.print("Input Changed: Index: ");
+    DebugMonSerial.print(F("Input Changed: Index: "));
     DebugMonSerial.print(aiuInputIndex);
-    DebugMonSerial.print(" Pin: ");
-    DebugMonSerial.print(aiuInputPins[aiuInputIndex]);
-    DebugMonSerial.print(" State: ");
+    DebugMonSerial.print(F(" Pin: "));
+    DebugMonSerial.print(pgm_read_byte(&aiuInputPins[aiuInputIndex]));
+    DebugMonSerial.print(F(" State: "));
     DebugMonSerial.println(newPinState);
 #endif    
     
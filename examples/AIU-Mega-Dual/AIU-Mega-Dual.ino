@@ -10,6 +10,7 @@
 // author:    Alex Shepherd
 // webpage:   http://mrrwa.org/
 // history:   2019-04-28 Initial Version
+//            2026-10-19 One NceCabBusListener object per AIU instead of globals per bus
 //-------------------------------------------------------------------------------------------------------
 // purpose:   Demonstrate how to use the NceCabBus library to build a Auxiliary Input Unit (AIU) device
 //
@@ -66,18 +67,12 @@
 
 // The Array below maps Arduino Pins to AUI Inputs, change as required 
 //                     AIU Input Numbers    1  2  3  4  5  6  7  8  9 10 11 12 13 14
-uint8_t aiuInputPins1[NUM_AIU_INPUTS] =   { 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,20,21};
-uint8_t aiuInputPins2[NUM_AIU_INPUTS] =   {54,55,56,57,58,59,60,61,62,63,63,65,66,67};
+const uint8_t aiuInputPins1[NUM_AIU_INPUTS] PROGMEM =   { 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,20,21};
+const uint8_t aiuInputPins2[NUM_AIU_INPUTS] PROGMEM =   {54,55,56,57,58,59,60,61,62,63,63,65,66,67};
 
 // Change the #define below to set the Number of Debounce milliseconds for the AIU Inputs 
 #define DEBOUNCE_MS        20
 
-Bounce * aiuInputs1 = new Bounce[NUM_AIU_INPUTS];
-Bounce * aiuInputs2 = new Bounce[NUM_AIU_INPUTS];
-
-NceCabBus cabBus1;
-NceCabBus cabBus2;
-
 void sendRS485Bytes(uint8_t *values, uint8_t length)
 {
   // Seem to need a short delay to make sure the RS485 Master has disable Tx and is ready for our response
@@ -89,7 +84,7 @@ void sendRS485Bytes(uint8_t *values, uint8_t length)
   digitalWrite(RS485_TX_ENABLE_PIN, LOW);
 
 #ifdef DEBUG_RS485_BYTES  
-  DebugMonSerial.print("T:");
+  DebugMonSerial.print(F("T:"));
   for(uint8_t i = 0; i < length; i++)
   {
     uint8_t value = values[i];
@@ -103,6 +98,77 @@ void sendRS485Bytes(uint8_t *values, uint8_t length)
 #endif
 }
 
+  // Each AIU keeps its own Cab Bus state, input pins and debouncers. The library calls its
+  // sendRS485Bytes() member directly so no global is needed per bus
+class AiuNode : public NceCabBusListener<AiuNode>
+{
+  public:
+    AiuNode(uint8_t cabAddress, const uint8_t *inputPins) : cabAddress(cabAddress), inputPins(inputPins), inputIndex(0) {}
+
+    NceCabBus cabBus;
+
+    void begin(void)
+    {
+      cabBus.setCabType(CAB_TYPE_AIU);
+      cabBus.setCabAddress(cabAddress);
+      attachCabBus(cabBus);
+
+      for(uint8_t i = 0; i < NUM_AIU_INPUTS; i++)
+      {
+        inputs[i].attach(pgm_read_byte(&inputPins[i]), INPUT_PULLUP);       //setup the bounce instance for the current button
+        inputs[i].interval(DEBOUNCE_MS);
+#ifdef AIU_INPUT_INVERT
+        cabBus.setAuiIoBitState(i, !inputs[i].read());  
+#else
+        cabBus.setAuiIoBitState(i, inputs[i].read());  
+#endif
+      }
+    }
+
+    void sendRS485Bytes(uint8_t *values, uint8_t length)
+    {
+      ::sendRS485Bytes(values, length);
+    }
+
+      // Debounce a single aiuInput per call and update the AIU State in the library
+    void updateNextInput(void)
+    {
+      if(inputs[inputIndex].update()) // Check for a change
+      {
+        uint8_t newPinState = inputs[inputIndex].read();
+#ifdef AIU_INPUT_INVERT
+        newPinState = !newPinState;
+#endif
+
+#ifdef DEBUG_INPUT_CHANGES    
+        DebugMonSerial.print(F("Input Changed: Address: "));
+        DebugMonSerial.print(cabAddress);
+        DebugMonSerial.print(F(" Index: "));
+        DebugMonSerial.print(inputIndex+1);
+        DebugMonSerial.print(F(" Pin: "));
+        DebugMonSerial.print(pgm_read_byte(&inputPins[inputIndex]));
+        DebugMonSerial.print(F(" State: "));
+        DebugMonSerial.println(newPinState);
+#endif    
+        
+        cabBus.setAuiIoBitState(inputIndex, newPinState);
+      }
+
+      inputIndex++;
+      if(inputIndex >= NUM_AIU_INPUTS)
+        inputIndex = 0;
+    }
+
+  private:
+    uint8_t cabAddress;
+    const uint8_t *inputPins;
+    Bounce inputs[NUM_AIU_INPUTS];
+    uint8_t inputIndex;
+};
+
+AiuNode aiuNode1(CAB_BUS_ADDRESS_1, aiuInputPins1);
+AiuNode aiuNode2(CAB_BUS_ADDRESS_2, aiuInputPins2);
+
 void setup() {
   uint32_t startMillis = millis();
   const char* splashMsg = "NCE AIU Example";
@@ -114,8 +180,8 @@ void setup() {
   if(DebugMonSerial)
   {
 #ifdef DEBUG_LIBRARY    
-    cabBus1.setLogger(&DebugMonSerial);
-    cabBus2.setLogger(&DebugMonSerial);
+    aiuNode1.cabBus.setLogger(&DebugMonSerial);
+    aiuNode2.cabBus.setLogger(&DebugMonSerial);
 #endif
     DebugMonSerial.println();
     DebugMonSerial.println(splashMsg);
@@ -126,38 +192,11 @@ void setup() {
   digitalWrite(RS485_TX_ENABLE_PIN, LOW);
   RS485Serial.begin(9600, SERIAL_8N2);
 
-  cabBus1.setCabType(CAB_TYPE_AIU);
-  cabBus1.setCabAddress(CAB_BUS_ADDRESS_1);
-  cabBus1.setRS485SendBytesHandler(&sendRS485Bytes);
-
-  cabBus2.setCabType(CAB_TYPE_AIU);
-  cabBus2.setCabAddress(CAB_BUS_ADDRESS_2);
-  cabBus2.setRS485SendBytesHandler(&sendRS485Bytes);
-
-  for(uint8_t i = 0; i < NUM_AIU_INPUTS; i++)
-  {
-    aiuInputs1[i].attach(aiuInputPins1[i], INPUT_PULLUP);       //setup the bounce instance for the current button
-    aiuInputs1[i].interval(DEBOUNCE_MS);
-
-    aiuInputs2[i].attach(aiuInputPins2[i], INPUT_PULLUP);       //setup the bounce instance for the current button
-    aiuInputs2[i].interval(DEBOUNCE_MS);
-#ifdef AIU_INPUT_INVERT
-    cabBus1.setAuiIoBitState(i, !aiuInputs1[i].read());  
-    cabBus2.setAuiIoBitState(i, !aiuInputs2[i].read());  
-#else
-    cabBus1.setAuiIoBitState(i, aiuInputs1[i].read());  
-    cabBus2.setAuiIoBitState(i, aiuInputs2[i].read());  
-#endif
-  }
+  aiuNode1.begin();
+  aiuNode2.begin();
 }
 
-  // We'll keep an AIU Input Index outside the loop() function so we can update one auiInput per loop
-uint16_t aiuInputIndex = 0;
-
 void loop() {
-//   DebugMonSerial.println("Looping ");
-// digitalWrite(RS485_TX_ENABLE_PIN, LOW);
-
   while(RS485Serial.available())
   {
     uint8_t rxByte = RS485Serial.read();
@@ -169,66 +208,24 @@ void loop() {
       DebugMonSerial.println();
     }
       
-    DebugMonSerial.print("R:");
+    DebugMonSerial.print(F("R:"));
     DebugMonSerial.print(rxByte, HEX);
     DebugMonSerial.print(' ');
 #endif
 
-    cabBus1.processByte(rxByte);
-    cabBus2.processByte(rxByte);
+    aiuNode1.cabBus.processByte(rxByte);
+    aiuNode2.cabBus.processByte(rxByte);
   }
 
 
     // If we've been Polled and are currently executing Commands then skip other loop() processing
     // so we don't delay any command/response procesing
-  if(cabBus1.getCabState() == CAB_STATE_EXEC_MY_CMD)
+  if(aiuNode1.cabBus.getCabState() == CAB_STATE_EXEC_MY_CMD)
     return;
 
-  if(cabBus2.getCabState() == CAB_STATE_EXEC_MY_CMD)
+  if(aiuNode2.cabBus.getCabState() == CAB_STATE_EXEC_MY_CMD)
     return;
     
-//   DebugMonSerial.println("Processing ");
-   
-    // Debounce a single aiuInput for set 1 and update the AIU State in the library
-  if(aiuInputs1[aiuInputIndex].update()) // Check for a change
-  {
-    uint8_t newPinState = aiuInputs1[aiuInputIndex].read();
-#ifdef AIU_INPUT_INVERT
-    newPinState = !newPinState;
-#endif
-
-#ifdef DEBUG_INPUT_CHANGES    
-    DebugMonSerial.print("Input 1 Changed: Index: ");
-    DebugMonSerial.print(aiuInputIndex+1);
-    DebugMonSerial.print(" Pin: ");
-    DebugMonSerial.print(aiuInputPins1[aiuInputIndex]);
-    DebugMonSerial.print(" State: ");
-    DebugMonSerial.println(newPinState);
-#endif    
-    
-    cabBus1.setAuiIoBitState(aiuInputIndex, newPinState);
-  }
-  
-    // Debounce a single aiuInput for set 2 and update the AIU State in the library
-  if(aiuInputs2[aiuInputIndex].update()) // Check for a change
-  {
-    uint8_t newPinState = aiuInputs2[aiuInputIndex].read();
-#ifdef AIU_INPUT_INVERT
-    newPinState = !newPinState;
-#endif
-
-#ifdef DEBUG_INPUT_CHANGES    
-    DebugMonSerial.print("Input 2 Changed: Index: ");
-    DebugMonSerial.print(aiuInputIndex+1);
-    DebugMonSerial.print(" Pin: ");
-    DebugMonSerial.print(aiuInputPins2[aiuInputIndex]);
-    DebugMonSerial.print(" State: ");
-    DebugMonSerial.println(newPinState);
-#endif    
-    
-    cabBus2.setAuiIoBitState(aiuInputIndex, newPinState);
-  }
-  aiuInputIndex++;
-  if(aiuInputIndex >= NUM_AIU_INPUTS)
-    aiuInputIndex = 0;
+  aiuNode1.updateNextInput();
+  aiuNode2.updateNextInput();
 }  // End loop
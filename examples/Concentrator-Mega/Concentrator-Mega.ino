@@ -0,0 +1,100 @@
+/*-------------------------------------------------------------------------------------------------------
+// Model Railroading with Arduino - NCE Cab Bus Concentrator Example
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at: http://www.gnu.org/licenses/gpl.txt
+//-------------------------------------------------------------------------------------------------------
+// file:      Concentrator-Mega.ino
+// author:    Alex Shepherd
+// webpage:   http://mrrwa.org/
+// history:   2026-10-19 Initial Version
+//-------------------------------------------------------------------------------------------------------
+// purpose:   Demonstrate how to use the NceCabBusConcentrator class to put a group of throttles and AIUs
+//            on their own Cab Bus, e.g. a long run to a far part of the layout. The concentrator polls
+//            them on that bus and answers the command station for all of their addresses from the
+//            replies it has cached, so the command station never waits on the far bus.
+//
+// additional hardware:
+//            - Two RS485 Interface chips - there are many but the code assumes that the TX & RX Exnable
+//              pins of each are wired together and connected to the Arduino Output Pins defined by
+//              UPSTREAM_TX_ENABLE_PIN and DOWNSTREAM_TX_ENABLE_PIN
+//            - LCD or no LCD throttles and AIUs on the downstream bus, at the addresses added in setup()
+//
+// notes:     This example was developed on an Arduino Mega 2560 which has the four hardware UARTs.
+//            The command station is on Serial1 and the downstream bus on Serial2.
+//
+//            Downstream bytes are written without waiting for them to go out, the TX Enable pin is
+//            released in loop() once the UART is done, so a long LCD update going downstream never
+//            holds up our answer to a command station poll.
+//-------------------------------------------------------------------------------------------------------*/
+
+#include <NceCabBusConcentrator.h>
+
+// Change the #defines below to match the Serial ports you're using for RS485
+#define UpstreamSerial Serial1
+#define DownstreamSerial Serial2
+
+// Change the #defines below to match the RS485 Chip TX Enable pins
+#define UPSTREAM_TX_ENABLE_PIN 2
+#define DOWNSTREAM_TX_ENABLE_PIN 3
+
+NceCabBusConcentrator concentrator;
+
+bool downstreamSending = false;
+
+void sendUpstreamBytes(uint8_t *values, uint8_t length)
+{
+  // Seem to need a short delay to make sure the RS485 Master has disable Tx and is ready for our response
+  delayMicroseconds(200);
+
+  digitalWrite(UPSTREAM_TX_ENABLE_PIN, HIGH);
+  UpstreamSerial.write(values, length);
+  UpstreamSerial.flush();
+  digitalWrite(UPSTREAM_TX_ENABLE_PIN, LOW);
+}
+
+void sendDownstreamBytes(uint8_t *values, uint8_t length)
+{
+  digitalWrite(DOWNSTREAM_TX_ENABLE_PIN, HIGH);
+  DownstreamSerial.write(values, length);
+  downstreamSending = true;
+}
+
+void setup() {
+  pinMode(UPSTREAM_TX_ENABLE_PIN, OUTPUT);
+  digitalWrite(UPSTREAM_TX_ENABLE_PIN, LOW);
+  UpstreamSerial.begin(9600, SERIAL_8N2);
+
+  pinMode(DOWNSTREAM_TX_ENABLE_PIN, OUTPUT);
+  digitalWrite(DOWNSTREAM_TX_ENABLE_PIN, LOW);
+  DownstreamSerial.begin(9600, SERIAL_8N2);
+
+  // Change these to match the cabs on the downstream bus
+  concentrator.addCab(3, CAB_TYPE_LCD);
+  concentrator.addCab(4, CAB_TYPE_NO_LCD);
+  concentrator.addCab(8, CAB_TYPE_AIU);
+
+  concentrator.setUpstreamSendBytesHandler(&sendUpstreamBytes);
+  concentrator.setDownstreamSendBytesHandler(&sendDownstreamBytes);
+}
+
+void loop() {
+  // Read the incoming bytes on the command station bus, polls for our cabs are answered straight away
+  if(UpstreamSerial.available())
+    concentrator.processUpstreamByte(UpstreamSerial.read());
+
+  // Release the downstream bus once the last byte has left the UART, TXC2 is cleared by every write
+  if(downstreamSending && (UCSR2A & _BV(TXC2)))
+  {
+    digitalWrite(DOWNSTREAM_TX_ENABLE_PIN, LOW);
+    downstreamSending = false;
+  }
+
+  // Read the replies from the downstream cabs
+  if(DownstreamSerial.available())
+    concentrator.processDownstreamByte(DownstreamSerial.read());
+
+  concentrator.service();
+}
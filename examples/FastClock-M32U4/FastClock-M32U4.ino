@@ -63,7 +63,7 @@ NceCabBus cabBus;
 
 void FastClockUpdate(uint8_t Hours, uint8_t Minutes, uint8_t Rate, FAST_CLOCK_MODE Mode)
 {
-	DebugMonSerial.print("\nFastClock Update: ");
+	DebugMonSerial.print(F("\nFastClock Update: "));
 
 	if(Hours < 10)
 	  DebugMonSerial.print('0');
@@ -80,17 +80,17 @@ void FastClockUpdate(uint8_t Hours, uint8_t Minutes, uint8_t Rate, FAST_CLOCK_MO
 	switch(Mode)
 	{
 	  case FAST_CLOCK_AM:
-		DebugMonSerial.print("AM");
+		DebugMonSerial.print(F("AM"));
 		break;
     
 	  case FAST_CLOCK_PM:
-		DebugMonSerial.print("PM");
+		DebugMonSerial.print(F("PM"));
 		break;
 	}
 
-	DebugMonSerial.print(" Rate: ");
+	DebugMonSerial.print(F(" Rate: "));
 	DebugMonSerial.print(Rate, DEC);
-	DebugMonSerial.println(":1");
+	DebugMonSerial.println(F(":1"));
 }
 
 #if defined(TCS_FAST_CLOCK_PRIMARY)
@@ -105,7 +105,7 @@ void sendRS485Bytes(uint8_t *values, uint8_t length)
   digitalWrite(RS485_TX_ENABLE_PIN, LOW);
 
 #ifdef DEBUG_RS485_BYTES  
-  DebugMonSerial.print("T:");
+  DebugMonSerial.print(F("T:"));
   for(uint8_t i = 0; i < length; i++)
   {
     uint8_t value = values[i];
@@ -161,10 +161,10 @@ void loop() {
     if((rxByte & 0xC0) == 0x80)
     {
       DebugMonSerial.println();
-      DebugMonSerial.println("Ping");
+      DebugMonSerial.println(F("Ping"));
     }
       
-    DebugMonSerial.print("R:");
+    DebugMonSerial.print(F("R:"));
     if(rxByte < 16)
       DebugMonSerial.print('0');
     
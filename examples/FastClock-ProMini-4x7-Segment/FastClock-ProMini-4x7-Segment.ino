@@ -28,6 +28,11 @@
   //            It uses the SoftSerial UART for the RS485 comms as the Mega328P chip only has 1 hardware UART.
   //            The Adafruit LED Display connects to the Arduin's I2C Port 
   //
+  //            The library builds every device role by default, which is a lot of RAM on a Mega328P.
+  //            To build only the fast clock, put an NceCabBusUserConfig.h containing
+  //              #define NCE_CAB_BUS_PRESET  NCE_CAB_BUS_PRESET_FAST_CLOCK
+  //            in the NceCabBus library's src folder, see "Selecting Device Roles" in the README
+  //
   // required libraries:
   //            Adafruit GFX library which can be installed using the Arduino Library Manager
   //            Adafruit LED Backpack library which can be installed using the Arduino Library Manager
@@ -79,7 +84,7 @@ const long    blinkInterval = 1000;
 void FastClockUpdate(uint8_t Hours, uint8_t Minutes, uint8_t Rate, FAST_CLOCK_MODE Mode)
 {
 #ifdef DEBUG_FAST_CLOCK  
-  DebugMonSerial.print("\nFastClock Update: ");
+  DebugMonSerial.print(F("\nFastClock Update: "));
 
   if (Hours < 10)
     DebugMonSerial.print('0');
@@ -96,17 +101,17 @@ void FastClockUpdate(uint8_t Hours, uint8_t Minutes, uint8_t Rate, FAST_CLOCK_MO
   switch (Mode)
   {
     case FAST_CLOCK_AM:
-      DebugMonSerial.print("AM");
+      DebugMonSerial.print(F("AM"));
       break;
 
     case FAST_CLOCK_PM:
-      DebugMonSerial.print("PM");
+      DebugMonSerial.print(F("PM"));
       break;
   }
 
-  DebugMonSerial.print(" Rate: ");
+  DebugMonSerial.print(F(" Rate: "));
   DebugMonSerial.print(Rate, DEC);
-  DebugMonSerial.println(":1");
+  DebugMonSerial.println(F(":1"));
 #endif
 
   //Added 4 Digit 7 segment display module using I2C
@@ -165,7 +170,7 @@ void loop() {
       DebugMonSerial.println();
     }
 
-    DebugMonSerial.print("R:");
+    DebugMonSerial.print(F("R:"));
     DebugMonSerial.print(rxByte, HEX);
     DebugMonSerial.print(' ');
 #endif
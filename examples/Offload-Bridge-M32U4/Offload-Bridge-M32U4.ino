@@ -0,0 +1,80 @@
+/*-------------------------------------------------------------------------------------------------------
+// Model Railroading with Arduino - NCE Cab Bus Offload Bridge Example
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at: http://www.gnu.org/licenses/gpl.txt
+//-------------------------------------------------------------------------------------------------------
+// file:      Offload-Bridge-M32U4.ino
+// author:    Alex Shepherd
+// webpage:   http://mrrwa.org/
+// history:   2026-10-19 Initial Version
+//-------------------------------------------------------------------------------------------------------
+// purpose:   Demonstrate how to use the NceCabBusBridge class to put a Linux or PC host on the Cab Bus.
+//            The bridge answers our polls from the reply the host last set and forwards every Cab Bus
+//            byte to the host over USB in timestamped batches. The full NceCabBus library runs on the
+//            host, e.g. extras/tcp-server with --offload, so the MCU does not parse the bus at all.
+//
+// additional hardware:
+//            - An RS485 Interface chip - there are many but the code assumes that the TX & RX Exnable pins
+//              are wired together and connected to the Arduino Output Pin defined by RS485_TX_ENABLE_PIN
+//            - A Linux or PC host on the native USB port
+//
+// notes:     This example was developed on an Arduino Pro Micro which has the AVR MEGA32U4 chip.
+//            It uses the native USB port for the host link which leaves the hardware UART for RS485 comms.
+//            The cab address, cab type and poll replies all come from the host.
+//-------------------------------------------------------------------------------------------------------*/
+
+#include <NceCabBusBridge.h>
+
+// Change the #define below to match the Serial port you're using for RS485
+#define RS485Serial Serial1
+
+// Change the #define below to match the Serial port connected to the host
+#define HostSerial Serial
+
+// Change the #define below to match the RS485 Chip TX Enable pin
+#define RS485_TX_ENABLE_PIN 4
+
+NceCabBusBridge bridge;
+
+void sendRS485Bytes(uint8_t *values, uint8_t length)
+{
+  // Seem to need a short delay to make sure the RS485 Master has disable Tx and is ready for our response
+  delayMicroseconds(200);
+
+  digitalWrite(RS485_TX_ENABLE_PIN, HIGH);
+  RS485Serial.write(values, length);
+  RS485Serial.flush();
+  digitalWrite(RS485_TX_ENABLE_PIN, LOW);
+}
+
+void sendHostBytes(uint8_t *values, uint8_t length)
+{
+  // No flush(), a batch is only sent once it is full or old enough
+  HostSerial.write(values, length);
+}
+
+void setup() {
+  pinMode(RS485_TX_ENABLE_PIN, OUTPUT);
+  digitalWrite(RS485_TX_ENABLE_PIN, LOW);
+  RS485Serial.begin(9600, SERIAL_8N2);
+
+  HostSerial.begin(115200);
+
+  bridge.setRS485SendBytesHandler(&sendRS485Bytes);
+  bridge.setUSBSendBytesHandler(&sendHostBytes);
+}
+
+void loop() {
+  // Read the incoming bytes on the RS485 cabbus network, our poll is answered straight away
+  if(RS485Serial.available())
+    bridge.processByte(RS485Serial.read());
+
+  // Read the reply and address updates from the host
+  if(HostSerial.available())
+    bridge.processUSBByte(HostSerial.read());
+
+  bridge.flush();
+}
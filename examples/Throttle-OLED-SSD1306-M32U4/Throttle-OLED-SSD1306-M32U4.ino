@@ -88,7 +88,7 @@ const uint8_t keys[ROWS][COLS] =
   {'E','0','F','D'}
 };
 
-const uint8_t keysToNceFunctionMapping[][2] = 
+const uint8_t keysToNceFunctionMapping[][2] PROGMEM = 
 {
   {BTN_F0,        BTN_NO_KEY_DN}, // 0
   {BTN_F1,        BTN_NO_KEY_DN}, // 1
@@ -127,10 +127,10 @@ uint8_t mapKeysToNceButton(char keysCode, KeyState keyAction)
     return 0;
 
   if( keyAction == PRESSED)
-    return keysToNceFunctionMapping[keyIndex][0];
+    return pgm_read_byte(&keysToNceFunctionMapping[keyIndex][0]);
     
   else if(keyAction == RELEASED)  
-    return keysToNceFunctionMapping[keyIndex][1];
+    return pgm_read_byte(&keysToNceFunctionMapping[keyIndex][1]);
     
   else  
     return 0;
@@ -153,7 +153,7 @@ void sendRS485Bytes(uint8_t *values, uint8_t length)
   digitalWrite(RS485_TX_ENABLE_PIN, LOW);
 
 #ifdef DEBUG_RS485_BYTES  
-  DebugMonSerial.print("T:");
+  DebugMonSerial.print(F("T:"));
   for(uint8_t i = 0; i < length; i++)
   {
     uint8_t value = values[i];
@@ -170,11 +170,11 @@ void sendRS485Bytes(uint8_t *values, uint8_t length)
 void updateLCDHandler(uint8_t Col, uint8_t Row, char *msg, uint8_t len)
 {
 #ifdef DEBUG_LCD
-  DebugMonSerial.print("\nLCD: X:");
+  DebugMonSerial.print(F("\nLCD: X:"));
   DebugMonSerial.print(Col);
-  DebugMonSerial.print(" Y:");
+  DebugMonSerial.print(F(" Y:"));
   DebugMonSerial.print(Row);
-  DebugMonSerial.print(" Msg: ");
+  DebugMonSerial.print(F(" Msg: "));
 #endif
 
   oled.setCursor(Col * (oled.fontWidth() + oled.letterSpacing()) , Row);
@@ -200,9 +200,9 @@ void moveLCDCursorHandler(uint8_t Col, uint8_t Row)
   nextPrintCharCol = Col * (oled.fontWidth() + oled.letterSpacing());
   nextPrintCharRow = Row;
 #ifdef DEBUG_LCD
-  DebugMonSerial.print("\nMove Cursor: Col:");
+  DebugMonSerial.print(F("\nMove Cursor: Col:"));
   DebugMonSerial.print(Col);
-  DebugMonSerial.print(" Row:");
+  DebugMonSerial.print(F(" Row:"));
   DebugMonSerial.println(Row);
 #endif
   oled.setCursor(nextPrintCharCol, nextPrintCharRow);
@@ -211,7 +211,7 @@ void moveLCDCursorHandler(uint8_t Col, uint8_t Row)
 void cursorModeHandler(CURSOR_MODE mode)
 {
 #ifdef DEBUG_LCD
-  DebugMonSerial.print("Cursor Mode: ");
+  DebugMonSerial.print(F("Cursor Mode: "));
   DebugMonSerial.println(mode);
 #endif  
   switch(mode)
@@ -258,9 +258,9 @@ void cursorModeHandler(CURSOR_MODE mode)
 void printLCDCharHandler(char ch, bool advanceCursor)
 {
 #ifdef DEBUG_LCD
-  DebugMonSerial.print("\nPrint Char: ");
+  DebugMonSerial.print(F("\nPrint Char: "));
   DebugMonSerial.print(ch);
-  DebugMonSerial.print(" Adv: ");
+  DebugMonSerial.print(F(" Adv: "));
   DebugMonSerial.println(advanceCursor);
 #endif
 
@@ -299,8 +299,8 @@ void setup()
   oled.setCursor(0,0);
   oled.print(splashMsg);
   oled.setCursor(0,1);
-  oled.println("ABCDEFGHIJKLMOPQ");
-  oled.println("1234567890123456");
+  oled.println(F("ABCDEFGHIJKLMOPQ"));
+  oled.println(F("1234567890123456"));
   
   delay(2000);
   oled.clear();
@@ -357,7 +357,7 @@ void loop() {
     if((rxByte & 0xC0) == 0x80)
       DebugMonSerial.println();
       
-    DebugMonSerial.print("R:");
+    DebugMonSerial.print(F("R:"));
     DebugMonSerial.print(rxByte, HEX);
     DebugMonSerial.print(' ');
 #endif
@@ -381,11 +381,11 @@ void loop() {
         cabBus.setKeyPress(nceBtn);
 
 #ifdef DEBUG_KEYPAD
-        DebugMonSerial.print("\nKeyPressed: ");
+        DebugMonSerial.print(F("\nKeyPressed: "));
         DebugMonSerial.print(kpd.key[i].kchar);
-        DebugMonSerial.print(" State: ");
+        DebugMonSerial.print(F(" State: "));
         DebugMonSerial.print(kpd.key[i].kstate);
-        DebugMonSerial.print(" NCE Button Code: ");
+        DebugMonSerial.print(F(" NCE Button Code: "));
         DebugMonSerial.println(nceBtn, HEX);
 #endif
       }
@@ -68,6 +68,35 @@
 // Create Cab Bus Object
 NceCabBus cabBus;
 
+#ifdef DEBUG_JMRI_INPUT
+// service() reads the JMRI bytes through this Stream, which prints each one as it is read
+class JMRIDebugStream : public Stream
+{
+  public:
+    int available() { return JMRISerial.available(); }
+    int peek() { return JMRISerial.peek(); }
+    size_t write(uint8_t value) { return JMRISerial.write(value); }
+
+    int read()
+    {
+      int jmriByte = JMRISerial.read();
+      if(jmriByte >= 0)
+      {
+        DebugMonSerial.print(F("\nJMRI R:"));
+        if(jmriByte < 16)
+          DebugMonSerial.print('0');
+
+        DebugMonSerial.println(jmriByte, HEX);
+      }
+      return jmriByte;
+    }
+};
+
+JMRIDebugStream JMRIStream;
+#else
+#define JMRIStream JMRISerial
+#endif
+
 void sendUSBBytes(uint8_t *values, uint8_t length)
 {
   // Seem to need a short delay when there are a number of request eg editing a macro
@@ -77,7 +106,7 @@ void sendUSBBytes(uint8_t *values, uint8_t length)
     JMRISerial.flush();
 
 #ifdef DEBUG_JMRI_INPUT
-    DebugMonSerial.print("\nsendUSBBytes: " );
+    DebugMonSerial.print(F("\nsendUSBBytes: "));
     for( uint8_t i = 0; i < length; i++)
     {
       if(values[i] < 16)
@@ -102,7 +131,7 @@ void sendRS485Bytes(uint8_t *values, uint8_t length)
   digitalWrite(RS485_TX_ENABLE_PIN, LOW);
   
   #ifdef DEBUG_RS485_BYTES  
-  DebugMonSerial.print("T:");
+  DebugMonSerial.print(F("T:"));
   for(uint8_t i = 0; i < length; i++)
   {
     uint8_t value = values[i];
@@ -147,54 +176,43 @@ void setup() {
   cabBus.setCabAddress(CAB_BUS_ADDRESS);
   cabBus.setRS485SendBytesHandler(&sendRS485Bytes);
   cabBus.setUSBSendBytesHandler(&sendUSBBytes);
+
+  // Collect the USB responses and send them once per service() call, so pipelined
+  // JMRI commands are answered in a few USB packets rather than one write and flush per response
+  cabBus.setUSBSendBuffering(true);
+
+  // service() reads the RS485 and JMRI bytes itself. When the RS485 bytes are printed for
+  // debugging loop() reads them instead
+#ifdef DEBUG_RS485_BYTES
+  cabBus.setServiceStreams(NULL, &JMRIStream);
+#else
+  cabBus.setServiceStreams(&RS485Serial, &JMRIStream);
+#endif
 }
 
 void loop() {
-
-  
- // Read the incoming bytes on the RS485 cabbus network and processByte
- if(RS485Serial.available())
+#ifdef DEBUG_RS485_BYTES
+  while(RS485Serial.available())
   {
     uint8_t rxByte = RS485Serial.read();
     cabBus.processByte(rxByte);
-    cabBus.processResponseByte(rxByte); 
-   
+    cabBus.processResponseByte(rxByte);
 
-#ifdef DEBUG_RS485_BYTES  
     if((rxByte & 0xC0) == 0x80)
     {
       DebugMonSerial.println();
       DebugMonSerial.println();
     }
-      
-    DebugMonSerial.print("R:");
+
+    DebugMonSerial.print(F("R:"));
     DebugMonSerial.print(rxByte, HEX);
     DebugMonSerial.println(' ');
+  }
 #endif
-    
-    }    
-   
-    
-    // If we've been Polled and are currently executing Commands then skip other loop() processing
-    // so we don't delay any command/response procesing
-    
-  if(cabBus.getCabState() == CAB_STATE_EXEC_MY_CMD)
-    return;
-
- // Read the incoming bytes on the USB network and processByte
 
-  if(JMRISerial.available())
-  {
-    uint8_t jmriByte = JMRISerial.read();
-    cabBus.processUSBByte(jmriByte);  
-
-#ifdef DEBUG_JMRI_INPUT
-    DebugMonSerial.print("\nJMRI R:");
-    if(jmriByte < 16)
-      DebugMonSerial.print('0');
-  
-    DebugMonSerial.println(jmriByte, HEX);
-#endif    
-  } 
+  // Reads every waiting RS485 byte, then whole JMRI commands for as long as the cab can take them,
+  // and sends the buffered USB responses. It skips the USB work while we are being sent a
+  // command so nothing delays our response. There is no other work so no AppTask budget
+  cabBus.service(micros(), 0);
 
 }  // End loop
@@ -0,0 +1,638 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Capture Analyzer
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      CabBusAnalyzer.cpp
+// purpose:   Decode a raw Cab Bus capture, one byte per byte on the wire
+//            as written by a serial sniffer or cabbus-sim --capture, into
+//            a per address summary and optionally a CSV event stream.
+//
+//            The capture is split into chunks at poll bytes, where the
+//            parser state starts afresh, and the chunks are decoded in
+//            parallel, each thread using its own NceCabBus as the parser.
+//            Chunk results are then merged in file order.
+//
+//            A raw capture has no timestamps so the time column is the
+//            byte offset at 9600 baud 8N2. Idle time on the wire is not
+//            in the file, so it runs behind the wall clock.
+//
+// build:     g++ -std=c++17 -O2 -pthread -DARDUINO=10819 -Iextras/host
+//              -Isrc -Iextras/trace extras/analyzer/CabBusAnalyzer.cpp
+//              extras/trace/CabBusTraceFile.cpp extras/host/HostArduino.cpp
+//              src/*.cpp -o cabbus-analyzer
+//
+// usage:     cabbus-analyzer [--threads N] [--events events.csv]
+//              [--trace-file bus.trc] capture.bin
+//
+//------------------------------------------------------------------------
+
+#include <NceCabBus.h>
+
+#include "CabBusTraceFile.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#if !NCE_CAB_BUS_LCD || !NCE_CAB_BUS_FAST_CLOCK
+#error The analyzer needs the LCD and fast clock roles
+#endif
+
+#define ANALYZER_ADDRESSES			64
+#define ANALYZER_MIN_CHUNK			(64 * 1024)
+#define ANALYZER_CHUNKS_PER_THREAD	8
+#define ANALYZER_BYTE_US			(11.0 * 1000000.0 / 9600.0)
+
+typedef enum
+{
+	EVENT_NONE = 0,		// Dropped while merging
+	EVENT_REPLY,		// Cab reply to its poll changed, e.g. a key press or AIU input
+	EVENT_SMART_FRAME,	// Smart cab command frame sent in reply to its poll
+	EVENT_CS_REPLY,		// Command station 0xD8..0xDA reply to a smart cab
+	EVENT_CAB_TYPE,
+	EVENT_LCD,
+	EVENT_MOVE_CURSOR,
+	EVENT_CURSOR_MODE,
+	EVENT_TTY,
+	EVENT_FAST_CLOCK,
+	EVENT_CLOCK_RATE,
+} EVENT_KIND;
+
+typedef struct
+{
+	uint64_t offset;
+	uint8_t kind;
+	uint8_t address;
+	uint8_t param1;		// LCD column, cursor mode, clock hours or rate
+	uint8_t param2;		// LCD row, clock minutes
+	uint8_t length;
+	uint8_t data[9];
+} AnalyzerEvent;
+
+typedef struct
+{
+	uint64_t polls;
+	uint64_t replies;
+	uint64_t replyChanges;
+	uint64_t smartFrames;
+	uint64_t csReplies;
+	uint64_t lcdLines;
+	uint64_t lcdOther;
+	uint8_t cabType;
+} AddressSummary;
+
+typedef struct
+{
+	std::vector<AnalyzerEvent> events;
+	AddressSummary summary[ANALYZER_ADDRESSES];
+
+		// The first reply from each address can only be told to be a change once the
+		// previous chunk is known, so its event is kept here and settled by the merge
+	bool haveReply[ANALYZER_ADDRESSES];
+	uint8_t firstReply[ANALYZER_ADDRESSES][2];
+	size_t firstReplyEvent[ANALYZER_ADDRESSES];
+	uint8_t lastReply[ANALYZER_ADDRESSES][2];
+} ChunkResult;
+
+typedef struct
+{
+	size_t start;
+	size_t end;
+	ChunkResult result;
+} AnalyzerChunk;
+
+	// Next poll byte at or after from, 16 bytes at a time where SSE2 is available
+static size_t findPoll(const uint8_t *data, size_t from, size_t size)
+{
+#ifdef __SSE2__
+	const __m128i typeMask = _mm_set1_epi8((char)CMD_TYPE_MASK);
+	const __m128i typePoll = _mm_set1_epi8((char)CMD_TYPE_POLL);
+
+	for ( ; from + 16 <= size; from += 16)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i *)(data + from));
+		int polls = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(bytes, typeMask), typePoll));
+		if (polls)
+			return from + __builtin_ctz(polls);
+	}
+#endif
+
+	for ( ; from < size; from++)
+		if ((data[from] & CMD_TYPE_MASK) == CMD_TYPE_POLL)
+			return from;
+
+	return size;
+}
+
+class ChunkDecoder : public NceCabBusListener<ChunkDecoder>
+{
+  public:
+	ChunkDecoder()
+	{
+		cab.setCabType(CAB_TYPE_LCD);
+		attachCabBus(cab);
+	}
+
+	void decode(const uint8_t *data, AnalyzerChunk &chunk);
+
+	void lcdUpdate(uint8_t Col, uint8_t Row, char *msg, uint8_t len)
+	{
+		if (!address)	// Fast clock broadcast, reported by fastClock()
+			return;
+
+		AnalyzerEvent &event = addEvent(EVENT_LCD, Col, Row);
+		event.length = (len < sizeof(event.data)) ? len : sizeof(event.data);
+		memcpy(event.data, msg, event.length);
+		pResult->summary[address].lcdLines++;
+	}
+
+	void lcdMoveCursor(uint8_t Col, uint8_t Row)
+	{
+		addEvent(EVENT_MOVE_CURSOR, Col, Row);
+		pResult->summary[address].lcdOther++;
+	}
+
+	void lcdCursorMode(CURSOR_MODE mode)
+	{
+		addEvent(EVENT_CURSOR_MODE, mode, 0);
+		pResult->summary[address].lcdOther++;
+	}
+
+	void lcdPrintChar(char ch, bool advanceCursor)
+	{
+		AnalyzerEvent &event = addEvent(EVENT_TTY, advanceCursor, 0);
+		event.data[0] = ch;
+		event.length = 1;
+		pResult->summary[address].lcdOther++;
+	}
+
+		// The rate is tracked here rather than by the library, see decode()
+	void fastClock(uint8_t Hours, uint8_t Minutes, uint8_t, FAST_CLOCK_MODE Mode)
+	{
+		AnalyzerEvent &event = addEvent(EVENT_FAST_CLOCK, Hours, Minutes);
+		event.data[0] = clockRate;
+		event.data[1] = Mode;
+		event.length = 2;
+	}
+
+  private:
+	NceCabBus cab;
+	ChunkResult *pResult;
+	uint64_t offset;
+	uint8_t address;
+	uint8_t reply[CAB_BUS_COMMAND_LENGTH];
+	uint8_t replyLength;
+	uint64_t replyOffset;
+	uint8_t clockRate;
+
+	AnalyzerEvent &addEvent(EVENT_KIND kind, uint8_t param1, uint8_t param2)
+	{
+		AnalyzerEvent event;
+		memset(&event, 0, sizeof(event));
+		event.offset = offset;
+		event.kind = kind;
+		event.address = address;
+		event.param1 = param1;
+		event.param2 = param2;
+		pResult->events.push_back(event);
+		return pResult->events.back();
+	}
+
+	void finishReply(void);
+};
+
+	// The cab's reply to its poll has ended: a smart cab frame is always an event,
+	// any other reply only when it differs from the last one from that address
+void ChunkDecoder::finishReply(void)
+{
+	if (!replyLength)
+		return;
+
+	AddressSummary &summary = pResult->summary[address];
+	summary.replies++;
+	uint64_t byteOffset = offset;
+	offset = replyOffset;
+
+	if (replyLength == CAB_BUS_COMMAND_LENGTH)
+	{
+		AnalyzerEvent &event = addEvent(EVENT_SMART_FRAME, 0, 0);
+		memcpy(event.data, reply, replyLength);
+		event.length = replyLength;
+		summary.smartFrames++;
+	}
+
+	else if (replyLength == 2)
+	{
+		uint8_t *last = pResult->lastReply[address];
+
+		if (!pResult->haveReply[address])
+		{
+			pResult->haveReply[address] = true;
+			memcpy(pResult->firstReply[address], reply, 2);
+			pResult->firstReplyEvent[address] = pResult->events.size();
+			AnalyzerEvent &event = addEvent(EVENT_REPLY, 0, 0);
+			memcpy(event.data, reply, 2);
+			event.length = 2;
+		}
+		else if ((last[0] != reply[0]) || (last[1] != reply[1]))
+		{
+			AnalyzerEvent &event = addEvent(EVENT_REPLY, 0, 0);
+			memcpy(event.data, reply, 2);
+			event.length = 2;
+			summary.replyChanges++;
+		}
+
+		memcpy(last, reply, 2);
+	}
+
+	offset = byteOffset;
+	replyLength = 0;
+}
+
+	// chunk starts on a poll, so the parser and our reply tracking start afresh.
+	// Bytes after a poll up to the first command byte are the cab's reply, which
+	// a real cab never receives, so they are kept from the parser
+void ChunkDecoder::decode(const uint8_t *data, AnalyzerChunk &chunk)
+{
+	pResult = &chunk.result;
+	memset(pResult->summary, 0, sizeof(pResult->summary));
+	memset(pResult->haveReply, 0, sizeof(pResult->haveReply));
+	address = 0;
+	replyLength = 0;
+	bool replying = false;
+
+		// The clock rate is only broadcast now and then so a chunk may not see it before
+		// a time broadcast. Rate broadcasts are kept from the library, which then reports
+		// every time with the invalid rate set here, and the merge fills in clockRate 0
+	cab.setFastClockCabAddress(0);
+	clockRate = 0;
+
+	for (size_t i = chunk.start; i < chunk.end; i++)
+	{
+		uint8_t inByte = data[i];
+		offset = i;
+
+		if ((inByte & CMD_TYPE_MASK) == CMD_TYPE_POLL)
+		{
+			finishReply();
+			address = inByte & CMD_ASCII_MASK;
+			pResult->summary[address].polls++;
+			cab.setCabAddress(address);
+			cab.processByte(inByte);
+			replying = (address != 0);
+			continue;
+		}
+
+		if (replying)
+		{
+			if ((inByte & CMD_TYPE_MASK) != CMD_TYPE_CMD)
+			{
+				if (!replyLength)
+					replyOffset = i;
+				if (replyLength < sizeof(reply))
+					reply[replyLength++] = inByte;
+				continue;
+			}
+
+			finishReply();
+			replying = false;
+		}
+
+		if ((inByte == FAST_CLOCK_RATE_BCAST) && (i + 1 < chunk.end) && !(data[i + 1] & 0x80))
+		{
+			offset = ++i;
+			if (data[i] != clockRate)
+			{
+				clockRate = data[i];
+				addEvent(EVENT_CLOCK_RATE, clockRate, 0);
+			}
+			continue;
+		}
+
+			// 0xD8..0xDA followed by data is a reply to a smart cab rather than a light command
+		if ((inByte >= 0xD8) && (inByte <= 0xDA) && (i + 1 < chunk.end) && !(data[i + 1] & 0x80))
+		{
+			uint8_t frameLength = (inByte == 0xD8) ? 3 : ((inByte == 0xD9) ? 4 : 7);
+			if (i + frameLength > chunk.end)
+				frameLength = chunk.end - i;
+
+			AnalyzerEvent &event = addEvent(EVENT_CS_REPLY, 0, 0);
+			memcpy(event.data, data + i, frameLength);
+			event.length = frameLength;
+			pResult->summary[address].csReplies++;
+			i += frameLength - 1;
+			continue;
+		}
+
+		cab.processByte(inByte);
+
+			// The cab answers a Cab Type request straight after it
+		if ((inByte == CMD_CAB_TYPE) && (i + 1 < chunk.end) && !(data[i + 1] & 0x80))
+		{
+			offset = ++i;
+			pResult->summary[address].cabType = data[i];
+			addEvent(EVENT_CAB_TYPE, data[i], 0);
+		}
+	}
+
+	finishReply();
+}
+
+	// Settle each chunk's first reply per address and its fast clock rate against
+	// the state the previous chunks left, then add up the summaries
+static void mergeChunks(std::vector<AnalyzerChunk> &chunks, AddressSummary *total)
+{
+	bool haveReply[ANALYZER_ADDRESSES];
+	uint8_t lastReply[ANALYZER_ADDRESSES][2];
+	uint8_t clockRate = 0;	// Not known yet
+
+	memset(haveReply, 0, sizeof(haveReply));
+	memset(total, 0, sizeof(AddressSummary) * ANALYZER_ADDRESSES);
+
+	for (size_t c = 0; c < chunks.size(); c++)
+	{
+		ChunkResult &result = chunks[c].result;
+
+		for (size_t e = 0; e < result.events.size(); e++)
+		{
+			AnalyzerEvent &event = result.events[e];
+
+				// A time before any rate is dropped as the library would, and a chunk's
+				// first rate broadcast is only an event if it changed the rate
+			if (event.kind == EVENT_CLOCK_RATE)
+			{
+				if (event.param1 == clockRate)
+					event.kind = EVENT_NONE;
+				clockRate = event.param1;
+			}
+			else if ((event.kind == EVENT_FAST_CLOCK) && !event.data[0])
+			{
+				if (clockRate)
+					event.data[0] = clockRate;
+				else
+					event.kind = EVENT_NONE;
+			}
+		}
+
+		for (uint8_t a = 0; a < ANALYZER_ADDRESSES; a++)
+		{
+			AddressSummary &from = result.summary[a];
+			AddressSummary &to = total[a];
+
+			if (result.haveReply[a])
+			{
+				if (haveReply[a] && !memcmp(lastReply[a], result.firstReply[a], 2))
+					result.events[result.firstReplyEvent[a]].kind = EVENT_NONE;
+				else if (haveReply[a])
+					to.replyChanges++;
+
+				haveReply[a] = true;
+				memcpy(lastReply[a], result.lastReply[a], 2);
+			}
+
+			to.polls += from.polls;
+			to.replies += from.replies;
+			to.replyChanges += from.replyChanges;
+			to.smartFrames += from.smartFrames;
+			to.csReplies += from.csReplies;
+			to.lcdLines += from.lcdLines;
+			to.lcdOther += from.lcdOther;
+			if (from.cabType)
+				to.cabType = from.cabType;
+		}
+	}
+}
+
+static void writeEvent(FILE *out, const AnalyzerEvent &event)
+{
+	static const char *kindNames[] =
+	{
+		"", "reply", "smart-frame", "cs-reply", "cab-type", "lcd", "move-cursor", "cursor-mode", "tty", "fast-clock", "clock-rate"
+	};
+
+	fprintf(out, "%llu,%.1f,%u,%s,", (unsigned long long)event.offset, event.offset * ANALYZER_BYTE_US / 1000.0,
+		event.address, kindNames[event.kind]);
+
+	switch (event.kind)
+	{
+	case EVENT_LCD:
+		fprintf(out, "col %u row %u \"", event.param1, event.param2);
+		for (uint8_t i = 0; i < event.length; i++)
+			fputc(((event.data[i] >= ' ') && (event.data[i] < 0x7F) && (event.data[i] != '"')) ? event.data[i] : '.', out);
+		fputc('"', out);
+		break;
+
+	case EVENT_MOVE_CURSOR:
+		fprintf(out, "col %u row %u", event.param1, event.param2);
+		break;
+
+	case EVENT_CURSOR_MODE:
+		fprintf(out, "mode %u", event.param1);
+		break;
+
+	case EVENT_TTY:
+		fprintf(out, "'%c'%s", ((event.data[0] >= ' ') && (event.data[0] < 0x7F)) ? event.data[0] : '.', event.param1 ? " advance" : "");
+		break;
+
+	case EVENT_FAST_CLOCK:
+		fprintf(out, "%02u:%02u rate %u mode %u", event.param1, event.param2, event.data[0], event.data[1]);
+		break;
+
+	case EVENT_CLOCK_RATE:
+		fprintf(out, "rate %u", event.param1);
+		break;
+
+	case EVENT_CAB_TYPE:
+		fprintf(out, "'%c'", event.param1);
+		break;
+
+	default:
+		for (uint8_t i = 0; i < event.length; i++)
+			fprintf(out, "%s%02X", i ? " " : "", event.data[i]);
+		break;
+	}
+
+	fputc('\n', out);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: cabbus-analyzer [options] capture.bin\n"
+		"  --threads N          decoder threads (default: all cores)\n"
+		"  --events FILE        write every event as CSV\n"
+		"  --trace-file FILE    write the bus frames to an indexed trace FILE\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned threads = std::thread::hardware_concurrency();
+	const char *eventsPath = NULL;
+	const char *traceFilePath = NULL;
+	const char *capturePath = NULL;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--threads") && (i + 1 < argc))
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--events") && (i + 1 < argc))
+			eventsPath = argv[++i];
+		else if (!strcmp(argv[i], "--trace-file") && (i + 1 < argc))
+			traceFilePath = argv[++i];
+		else if (argv[i][0] == '-')
+			usage();
+		else
+			capturePath = argv[i];
+	}
+
+	if (!capturePath)
+		usage();
+	if (!threads)
+		threads = 1;
+
+	int fd = open(capturePath, O_RDONLY);
+	struct stat st;
+	if ((fd < 0) || (fstat(fd, &st) < 0))
+	{
+		perror(capturePath);
+		return 1;
+	}
+
+	size_t size = st.st_size;
+	const uint8_t *data = NULL;
+	if (size)
+	{
+		data = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED)
+		{
+			perror("mmap");
+			return 1;
+		}
+		madvise((void *)data, size, MADV_SEQUENTIAL);
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		// Cut at the first poll after each even split point, anything before the
+		// first poll of the capture is the end of an unknown exchange and skipped
+	size_t wanted = size / ANALYZER_MIN_CHUNK;
+	if (wanted > (size_t)threads * ANALYZER_CHUNKS_PER_THREAD)
+		wanted = (size_t)threads * ANALYZER_CHUNKS_PER_THREAD;
+	if (wanted < 1)
+		wanted = 1;
+
+	std::vector<AnalyzerChunk> chunks;
+	size_t chunkStart = findPoll(data, 0, size);
+	for (size_t k = 1; (k <= wanted) && (chunkStart < size); k++)
+	{
+		size_t chunkEnd = (k == wanted) ? size : findPoll(data, size / wanted * k, size);
+		if (chunkEnd <= chunkStart)
+			continue;
+
+		chunks.push_back(AnalyzerChunk());
+		chunks.back().start = chunkStart;
+		chunks.back().end = chunkEnd;
+		chunkStart = chunkEnd;
+	}
+
+	std::atomic<size_t> nextChunk(0);
+	std::vector<std::thread> pool;
+	for (unsigned t = 0; t < threads; t++)
+	{
+		pool.push_back(std::thread([&]()
+		{
+			size_t c;
+			while ((c = nextChunk++) < chunks.size())
+			{
+				ChunkDecoder decoder;	// Fresh library state for each chunk
+				decoder.decode(data, chunks[c]);
+			}
+		}));
+	}
+
+	for (size_t t = 0; t < pool.size(); t++)
+		pool[t].join();
+
+	AddressSummary total[ANALYZER_ADDRESSES];
+	mergeChunks(chunks, total);
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (eventsPath)
+	{
+		FILE *out = fopen(eventsPath, "w");
+		if (!out)
+		{
+			perror(eventsPath);
+			return 1;
+		}
+
+		fprintf(out, "offset,time_ms,address,event,detail\n");
+		for (size_t c = 0; c < chunks.size(); c++)
+			for (size_t e = 0; e < chunks[c].result.events.size(); e++)
+				if (chunks[c].result.events[e].kind != EVENT_NONE)
+					writeEvent(out, chunks[c].result.events[e]);
+		fclose(out);
+	}
+
+		// One pass in file order, the times are estimated the same way as the events
+	if (traceFilePath)
+	{
+		CabBusTraceWriter traceFile;
+		if (!traceFile.open(traceFilePath))
+		{
+			perror(traceFilePath);
+			return 1;
+		}
+
+		for (size_t i = 0; i < size; i++)
+			traceFile.addByte((uint64_t)(i * ANALYZER_BYTE_US), data[i]);
+
+		if (!traceFile.close())
+		{
+			fprintf(stderr, "%s: write failed\n", traceFilePath);
+			return 1;
+		}
+	}
+
+	printf("Addr Type     Polls   Replies   Changes  SmartFrm  CSReply   LCDLine  LCDOther\n");
+	for (uint8_t a = 0; a < ANALYZER_ADDRESSES; a++)
+	{
+		AddressSummary &s = total[a];
+		if (!s.polls)
+			continue;
+
+		printf("%4u  %c   %9llu %9llu %9llu %9llu %9llu %9llu %9llu\n", a, s.cabType ? s.cabType : '-',
+			(unsigned long long)s.polls, (unsigned long long)s.replies, (unsigned long long)s.replyChanges,
+			(unsigned long long)s.smartFrames, (unsigned long long)s.csReplies,
+			(unsigned long long)s.lcdLines, (unsigned long long)s.lcdOther);
+	}
+
+	fprintf(stderr, "%.1f MB in %zu chunks on %u threads: %.3f s, %.0f MB/s, about %.1f minutes of bus time\n",
+		size / 1e6, chunks.size(), threads, seconds, seconds > 0 ? size / 1e6 / seconds : 0.0,
+		size * ANALYZER_BYTE_US / 60e6);
+
+	return 0;
+}
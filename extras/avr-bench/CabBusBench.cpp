@@ -0,0 +1,317 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus AVR Cycle Benchmark
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      CabBusBench.cpp
+// purpose:   Count the exact CPU cycles the per-byte library entry points
+//            take on an ATmega32U4 at 16 MHz. Built for AVR and run under
+//            simavr by run-bench.sh, no hardware needed.
+//
+//            Timer1 runs at clk/1 so TCNT1 counts CPU cycles. Each case
+//            resets TCNT1, calls the library and reads TCNT1 back, the cost
+//            of an empty measurement is subtracted. Results are written to
+//            the simavr console (GPIOR0) one JSON object per line.
+//
+//            micros() is the Arduino core's, reading Timer0 at clk/64, so
+//            the counts include what NCE_CAB_BUS_STATS costs on the device.
+//            Interrupts stay off so the Timer0 overflow ISR never lands in
+//            a measurement.
+//
+//            The NCE Cab Bus reply window is about 800us = 12800 cycles
+//            and one byte time at 9600 8N2 is 1146us = 18333 cycles.
+//
+//------------------------------------------------------------------------
+
+#include <NceCabBus.h>
+
+#include <avr/io.h>
+#include <avr/sleep.h>
+
+#include "avr_mcu_section.h"
+
+AVR_MCU(F_CPU, "atmega32u4");
+AVR_MCU_SIMAVR_CONSOLE(&GPIOR0);
+
+#define BENCH_CAB_ADDRESS	3
+#define BENCH_OTHER_ADDRESS	4
+
+// The benchmark is not linked against the Arduino core
+
+	// Same code as micros() in the AVR core's wiring.c so the stats pay
+	// the real price, the overflow count just never moves
+volatile unsigned long timer0_overflow_count = 0;
+
+unsigned long micros(void)
+{
+	unsigned long m;
+	uint8_t oldSREG = SREG, t;
+
+	cli();
+	m = timer0_overflow_count;
+	t = TCNT0;
+	if ((TIFR0 & _BV(TOV0)) && (t < 255))
+		m++;
+	SREG = oldSREG;
+
+	return ((m << 8) + t) * (64 / (F_CPU / 1000000L));
+}
+
+unsigned long millis(void) { return 0; }
+void delayMicroseconds(unsigned int us) { (void)us; }
+extern "C" void __cxa_pure_virtual(void) { while (1); }
+void operator delete(void *ptr) { (void)ptr; }
+void operator delete(void *ptr, size_t size) { (void)ptr; (void)size; }
+
+class ConsolePrint : public Print
+{
+  public:
+	size_t write(uint8_t value)
+	{
+		GPIOR0 = value;
+		return 1;
+	}
+};
+
+ConsolePrint Console;
+NceCabBus cabBus;
+
+volatile uint8_t sinkBytes;
+
+void RS485SendBytesSink(uint8_t *values, uint8_t length)
+{
+	sinkBytes = values[0] + length;
+}
+
+void USBSendBytesSink(uint8_t *values, uint8_t length)
+{
+	sinkBytes = values[0] + length;
+}
+
+void LCDUpdateSink(uint8_t Col, uint8_t Row, char *msg, uint8_t len)
+{
+	sinkBytes = Col + Row + msg[0] + len;
+}
+
+uint16_t benchOverhead;
+bool benchOverflow;
+
+static inline void benchStart(void)
+{
+	TIFR1 = _BV(TOV1);
+	TCNT1 = 0;
+}
+
+static inline uint16_t benchStop(void)
+{
+	uint16_t cycles = TCNT1;
+	if (TIFR1 & _BV(TOV1))
+		benchOverflow = true;
+	return cycles - benchOverhead;
+}
+
+void report(const __FlashStringHelper *name, uint8_t arg, uint16_t cycles, uint8_t bytes)
+{
+	Console.print(F("{\"bench\":\""));
+	Console.print(name);
+	Console.print(F("\",\"arg\":\"0x"));
+	if (arg < 16)
+		Console.print('0');
+	Console.print(arg, HEX);
+	Console.print(F("\",\"bytes\":"));
+	Console.print(bytes);
+	Console.print(F(",\"cycles\":"));
+	Console.print(cycles);
+	Console.print(F(",\"overflow\":"));
+	Console.print(benchOverflow ? F("true") : F("false"));
+	Console.print(F("}\n"));
+
+	benchOverflow = false;
+}
+
+void setupCab(CAB_TYPE type)
+{
+	cabBus.setCabType(type);
+	cabBus.setCabAddress(BENCH_CAB_ADDRESS);
+		// Finish any half received command from the previous case
+	cabBus.processByte(0x80 | BENCH_OTHER_ADDRESS);
+}
+
+uint16_t benchProcessByte(uint8_t inByte)
+{
+	benchStart();
+	cabBus.processByte(inByte);
+	return benchStop();
+}
+
+void benchPolls(void)
+{
+	static const CAB_TYPE cabTypes[] = { CAB_TYPE_LCD, CAB_TYPE_NO_LCD, CAB_TYPE_SMART, CAB_TYPE_AIU };
+
+	setupCab(CAB_TYPE_LCD);
+	report(F("poll_other"), 0x80 | BENCH_OTHER_ADDRESS, benchProcessByte(0x80 | BENCH_OTHER_ADDRESS), 1);
+	report(F("poll_broadcast"), 0x80, benchProcessByte(0x80), 1);
+
+	for (uint8_t i = 0; i < sizeof(cabTypes) / sizeof(cabTypes[0]); i++)
+	{
+		setupCab(cabTypes[i]);
+		report(F("poll_own"), cabTypes[i], benchProcessByte(0x80 | BENCH_CAB_ADDRESS), 1);
+	}
+
+		// A smart cab with a Cab Bus frame waiting to go out
+	setupCab(CAB_TYPE_SMART);
+	static const uint8_t locoCmd[] = { 0xA2, 0xC1, 0x2C, 0x04, 0x40 };
+	for (uint8_t i = 0; i < sizeof(locoCmd); i++)
+		cabBus.processUSBByte(locoCmd[i]);
+	report(F("poll_own_smart_frame"), CAB_TYPE_SMART, benchProcessByte(0x80 | BENCH_CAB_ADDRESS), 1);
+}
+
+void benchLCD(void)
+{
+	static const uint8_t lcdCmd[] = { 0xC0, 'N', 'C', 'E', ' ', 'C', 'A', 'B', ' ' };
+
+	setupCab(CAB_TYPE_LCD);
+	cabBus.processByte(0x80 | BENCH_CAB_ADDRESS);
+
+	uint16_t total = 0;
+	uint16_t worst = 0;
+	for (uint8_t i = 0; i < sizeof(lcdCmd); i++)
+	{
+		uint16_t cycles = benchProcessByte(lcdCmd[i]);
+		total += cycles;
+		if (cycles > worst)
+			worst = cycles;
+	}
+	report(F("lcd_8char_total"), lcdCmd[0], total, sizeof(lcdCmd));
+	report(F("lcd_8char_worst_byte"), lcdCmd[0], worst, 1);
+}
+
+	// Sample arguments for the opcodes that take some, anything not listed is sent as zeros
+typedef struct
+{
+	uint8_t opcode;
+	uint8_t args[5];
+} USBSample;
+
+static const USBSample usbSamples[] PROGMEM = {
+	{ 0x9B, { 0x05 } },
+	{ 0x9C, { 0x01 } },
+	{ 0xA0, { 0x00, 0x1D, 0x06 } },
+	{ 0xA1, { 0x00, 0x1D } },
+	{ 0xA2, { 0xC1, 0x2C, 0x04, 0x40 } },
+	{ 0xA6, { 0x05, 0x03 } },
+	{ 0xA7, { 0x05 } },
+	{ 0xA8, { 0x00, 0x1D, 0x06 } },
+	{ 0xA9, { 0x00, 0x1D } },
+	{ 0xAD, { 0x00, 0x10, 0x03, 0x00 } },
+	{ 0xAE, { 0xC1, 0x2C, 0x00, 0x1D, 0x06 } },
+	{ 0xAF, { 0x00, 0x10, 0x00, 0x01, 0x05 } },
+	{ 0xB3, { 0x00, 0x04 } },
+	{ 0xB4, { 0x41 } },
+	{ 0xB5, { 0x04 } },
+};
+
+void loadUSBSample(uint8_t opcode, uint8_t *args)
+{
+	memset(args, 0, 5);
+	for (uint8_t i = 0; i < sizeof(usbSamples) / sizeof(usbSamples[0]); i++)
+	{
+		if (pgm_read_byte(&usbSamples[i].opcode) == opcode)
+		{
+			memcpy_P(args, usbSamples[i].args, 5);
+			return;
+		}
+	}
+}
+
+extern int8_t getUSBCommandLength(uint8_t Command);
+
+void benchUSB(void)
+{
+	uint8_t args[5];
+
+	for (uint8_t opcode = 0x80; opcode <= 0xB5; opcode++)
+	{
+		uint8_t length = getUSBCommandLength(opcode);
+		loadUSBSample(opcode, args);
+
+		setupCab(CAB_TYPE_SMART);
+			// Drain any frames left by the previous opcode
+		cabBus.processByte(0x80 | BENCH_CAB_ADDRESS);
+		cabBus.processByte(0x80 | BENCH_CAB_ADDRESS);
+
+		uint16_t total = 0;
+		benchStart();
+		cabBus.processUSBByte(opcode);
+		total += benchStop();
+
+		for (uint8_t i = 1; i < length; i++)
+		{
+			benchStart();
+			cabBus.processUSBByte(args[i - 1]);
+			total += benchStop();
+		}
+		report(F("usb_opcode"), opcode, total, length);
+	}
+}
+
+void benchReplies(void)
+{
+	static const uint8_t replyD8[] = { 0xD8, 0x40, 0x46 };
+	static const uint8_t replyD9[] = { 0xD9, 0x40, 0x41, 0x42 };
+	static const uint8_t replyDA[] = { 0xDA, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45 };
+	static const uint8_t *replies[] = { replyD8, replyD9, replyDA };
+	static const uint8_t replyLengths[] = { sizeof(replyD8), sizeof(replyD9), sizeof(replyDA) };
+
+	setupCab(CAB_TYPE_SMART);
+
+	for (uint8_t r = 0; r < 3; r++)
+	{
+		uint16_t total = 0;
+		for (uint8_t i = 0; i < replyLengths[r]; i++)
+		{
+			benchStart();
+			cabBus.processResponseByte(replies[r][i]);
+			total += benchStop();
+		}
+		report(F("reply_decode"), replies[r][0], total, replyLengths[r]);
+	}
+}
+
+int main(void)
+{
+	TCCR1A = 0;
+	TCCR1B = _BV(CS10);		// clk/1, TCNT1 counts CPU cycles
+	TCCR0A = 0;
+	TCCR0B = _BV(CS01) | _BV(CS00);	// clk/64, as the Arduino core sets it
+
+	benchOverhead = 0;
+	benchStart();
+	benchOverhead = benchStop();
+
+	cabBus.setRS485SendBytesHandler(RS485SendBytesSink);
+	cabBus.setUSBSendBytesHandler(USBSendBytesSink);
+	cabBus.setLCDUpdateHandler(LCDUpdateSink);
+
+	Console.print(F("{\"bench\":\"overhead\",\"cycles\":"));
+	Console.print(benchOverhead);
+	Console.print(F("}\n"));
+
+	benchPolls();
+	benchLCD();
+	benchUSB();
+	benchReplies();
+
+		// simavr exits when the CPU sleeps with interrupts disabled
+	cli();
+	sleep_enable();
+	sleep_cpu();
+	return 0;
+}
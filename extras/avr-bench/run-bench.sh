@@ -0,0 +1,50 @@
+#!/bin/sh
+#------------------------------------------------------------------------
+#
+# Model Railroading with Arduino - NCE Cab Bus AVR Cycle Benchmark
+#
+# Builds CabBusBench.cpp and the library for an ATmega32U4 at 16 MHz,
+# runs it under simavr and writes the cycle counts to a JSON file.
+#
+# usage:     extras/avr-bench/run-bench.sh [results.json]
+#
+# needs:     avr-gcc, avr-libc and simavr. Set SIMAVR_INCLUDE if
+#            avr_mcu_section.h is not in /usr/include/simavr/avr
+#
+# The library is built with its default config, NCE_CAB_BUS_STATS on,
+# and the bench carries a copy of the Arduino core's micros(), so the
+# counts include the timestamps processByte() takes for the stats.
+#
+#------------------------------------------------------------------------
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+REPO_DIR=$(cd "$BENCH_DIR/../.." && pwd)
+OUT=${1:-cabbus-avr-bench.json}
+MCU=atmega32u4
+F_CPU=16000000
+SIMAVR_INCLUDE=${SIMAVR_INCLUDE:-/usr/include/simavr/avr}
+BUILD_DIR=$(mktemp -d)
+trap 'rm -rf "$BUILD_DIR"' EXIT
+
+avr-g++ -mmcu=$MCU -DF_CPU=${F_CPU}UL -DARDUINO=10819 -Os -std=gnu++11 \
+	-ffunction-sections -fdata-sections -Wl,--gc-sections \
+	-I"$REPO_DIR/extras/host" -I"$REPO_DIR/src" -I"$SIMAVR_INCLUDE" \
+	"$BENCH_DIR/CabBusBench.cpp" "$REPO_DIR"/src/*.cpp \
+	-o "$BUILD_DIR/CabBusBench.elf"
+
+avr-size "$BUILD_DIR/CabBusBench.elf"
+
+# simavr prefixes console lines, keep just the JSON objects
+simavr -m $MCU -f $F_CPU "$BUILD_DIR/CabBusBench.elf" 2>&1 |
+	sed -n 's/^[^{]*\({"bench".*}\).*$/\1/p' > "$BUILD_DIR/results.txt"
+
+{
+	printf '{"mcu":"%s","f_cpu":%s,"commit":"%s","results":[\n' $MCU $F_CPU \
+		"$(git -C "$REPO_DIR" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+	sed '$!s/$/,/' "$BUILD_DIR/results.txt"
+	printf ']}\n'
+} > "$OUT"
+
+echo "$(wc -l < "$BUILD_DIR/results.txt") results written to $OUT"
@@ -0,0 +1,433 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Async Client
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+
+#include "CabBusClient.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+CabBusTask::~CabBusTask()
+{
+	if (!handle)
+		return;
+
+		// A running task outlives its handle and frees itself when it ends
+	if (handle.done())
+		handle.destroy();
+	else
+		handle.promise().detached = true;
+}
+
+CabBusRequestBase::CabBusRequestBase(CabBusClient *client, const uint8_t *command, uint8_t commandLength, uint8_t responseLength, bool hasStatus)
+{
+	this->client = client;
+	memcpy(this->command, command, commandLength);
+	this->commandLength = commandLength;
+	this->responseLength = responseLength;
+	this->hasStatus = hasStatus;
+	received = 0;
+	status.error = CAB_BUS_CLIENT_OK;
+	status.response = 0;
+}
+
+void CabBusRequestBase::await_suspend(std::coroutine_handle<> h)
+{
+	waiting = h;
+	client->submit(this);
+}
+
+	// Sets the result and resumes the coroutine, which may await its next command
+void CabBusRequestBase::finish(CAB_BUS_CLIENT_ERROR error)
+{
+	status.error = error;
+	status.response = (hasStatus && (received == responseLength)) ? response[received - 1] : 0;
+	waiting.resume();
+}
+
+CabBusClient::CabBusClient()
+{
+	fd = -1;
+	window = CAB_BUS_CLIENT_WINDOW;
+	timeoutMs = CAB_BUS_CLIENT_TIMEOUT_MS;
+	resyncing = false;
+}
+
+CabBusClient::~CabBusClient()
+{
+	close();
+}
+
+bool CabBusClient::connectTCP(const char *host, uint16_t port)
+{
+	close();
+
+	char service[8];
+	snprintf(service, sizeof(service), "%u", port);
+
+	struct addrinfo hints, *addresses;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, service, &hints, &addresses) != 0)
+		return false;
+
+	for (struct addrinfo *a = addresses; a && (fd < 0); a = a->ai_next)
+	{
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if ((fd >= 0) && (connect(fd, a->ai_addr, a->ai_addrlen) != 0))
+		{
+			::close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addresses);
+
+	if (fd < 0)
+		return false;
+
+		// Commands are a few bytes each and the next one should not wait for an ACK
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return true;
+}
+
+	// A NCE USB Interface or a smart cab sketch on its USB port, 9600 8N1
+bool CabBusClient::openSerial(const char *device)
+{
+	close();
+
+	fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+		return false;
+
+	struct termios tty;
+	if (tcgetattr(fd, &tty) != 0)
+	{
+		close();
+		return false;
+	}
+
+	cfmakeraw(&tty);
+	cfsetispeed(&tty, B9600);
+	cfsetospeed(&tty, B9600);
+	tty.c_cflag |= CLOCAL | CREAD;
+	tty.c_cflag &= ~CSTOPB;
+	tcsetattr(fd, TCSANOW, &tty);
+	return true;
+}
+
+void CabBusClient::close(void)
+{
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+	output.clear();
+	resyncing = false;
+}
+
+	// More commands in flight keep the interface busy while responses travel back,
+	// but a command that times out also fails the ones behind it
+void CabBusClient::setWindow(uint8_t commands)
+{
+	window = commands ? commands : 1;
+}
+
+void CabBusClient::setTimeoutMs(uint32_t ms)
+{
+	timeoutMs = ms;
+}
+
+void CabBusClient::submit(CabBusRequestBase *request)
+{
+	queued.push_back(request);
+	fillWindow();
+}
+
+void CabBusClient::fillWindow(void)
+{
+	if (resyncing)
+		return;
+
+	while (!queued.empty() && (inFlight.size() < window))
+	{
+		CabBusRequestBase *request = queued.front();
+		queued.pop_front();
+
+		if (inFlight.empty())
+			frontSince = std::chrono::steady_clock::now();
+		inFlight.push_back(request);
+		output.insert(output.end(), request->command, request->command + request->commandLength);
+	}
+}
+
+	// The interface answers in order, so every byte belongs to the oldest command
+void CabBusClient::receive(const uint8_t *bytes, size_t length)
+{
+	if (resyncing)
+	{
+		lastByteSince = std::chrono::steady_clock::now();
+		return;		// Late bytes for the commands that timed out
+	}
+
+	for (size_t i = 0; i < length; i++)
+	{
+		if (inFlight.empty())
+			continue;	// More bytes than the commands asked for
+
+		CabBusRequestBase *request = inFlight.front();
+		request->response[request->received++] = bytes[i];
+
+		if (request->received == request->responseLength)
+		{
+			bool rejected = request->hasStatus && (bytes[i] != USB_COMMAND_COMPLETED_SUCCESSFULLY);
+			complete(rejected ? CAB_BUS_CLIENT_REJECTED : CAB_BUS_CLIENT_OK);
+		}
+	}
+}
+
+	// Ends the oldest command in flight and starts the timeout of the next
+void CabBusClient::complete(CAB_BUS_CLIENT_ERROR error)
+{
+	CabBusRequestBase *request = inFlight.front();
+	inFlight.pop_front();
+	frontSince = std::chrono::steady_clock::now();
+
+	request->finish(error);
+	fillWindow();
+}
+
+void CabBusClient::failAll(CAB_BUS_CLIENT_ERROR error)
+{
+	while (!inFlight.empty() || !queued.empty())
+	{
+		if (inFlight.empty())
+		{
+			inFlight.push_back(queued.front());
+			queued.pop_front();
+		}
+		complete(error);
+	}
+}
+
+	// The oldest command has not been answered. Any bytes still to come may belong to it or
+	// to the commands behind it, so they all fail and nothing new goes out until the line is quiet
+void CabBusClient::timeout(void)
+{
+	resyncing = true;
+	lastByteSince = std::chrono::steady_clock::now();
+
+	while (!inFlight.empty())
+		complete(CAB_BUS_CLIENT_TIMEOUT);
+}
+
+void CabBusClient::run(void)
+{
+	while (getPending())
+	{
+		if (fd < 0)
+		{
+			failAll(CAB_BUS_CLIENT_DISCONNECTED);
+			break;
+		}
+
+		int waitMs = -1;
+		if (resyncing)
+		{
+			int64_t quietMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - lastByteSince).count();
+			waitMs = (quietMs < CAB_BUS_CLIENT_RESYNC_MS) ? (int)(CAB_BUS_CLIENT_RESYNC_MS - quietMs) : 0;
+		}
+		else if (!inFlight.empty())
+		{
+			int64_t elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - frontSince).count();
+			waitMs = (elapsedMs < (int64_t)timeoutMs) ? (int)(timeoutMs - elapsedMs) : 0;
+		}
+
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN | (output.empty() ? 0 : POLLOUT);
+		pfd.revents = 0;
+
+		if ((poll(&pfd, 1, waitMs) < 0) && (errno != EINTR))
+		{
+			close();
+			continue;
+		}
+
+		if (pfd.revents & POLLOUT)
+		{
+			ssize_t written = write(fd, output.data(), output.size());
+			if (written > 0)
+				output.erase(output.begin(), output.begin() + written);
+			else if ((written < 0) && (errno != EAGAIN) && (errno != EINTR))
+			{
+				close();
+				continue;
+			}
+		}
+
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			uint8_t bytes[256];
+			ssize_t count = read(fd, bytes, sizeof(bytes));
+			if (count > 0)
+				receive(bytes, count);
+			else if ((count == 0) || ((errno != EAGAIN) && (errno != EINTR)))
+			{
+				close();
+				continue;
+			}
+		}
+
+		if (resyncing)
+		{
+			if (std::chrono::steady_clock::now() - lastByteSince >= std::chrono::milliseconds(CAB_BUS_CLIENT_RESYNC_MS))
+			{
+				resyncing = false;
+				fillWindow();
+			}
+		}
+		else if (!inFlight.empty() && (std::chrono::steady_clock::now() - frontSince >= std::chrono::milliseconds(timeoutMs)))
+			timeout();
+	}
+}
+
+static uint32_t decodeBigEndian(const uint8_t *data, uint8_t length)
+{
+	uint32_t value = 0;
+	for (uint8_t i = 0; i < length; i++)
+		value = (value << 8) | data[i];
+	return value;
+}
+
+static uint8_t decodeByte(const uint8_t *data, uint8_t)
+{
+	return data[0];
+}
+
+static uint16_t decodeWord(const uint8_t *data, uint8_t length)
+{
+	if (length < 2)
+		return 0;
+	return (data[0] << 8) | data[1];
+}
+
+	// JMRI style, long addresses are flagged with 0xC000 and the interface keeps the low 12 bits
+static uint16_t locoAddress(uint16_t loco)
+{
+	return (loco > 127) ? (loco | 0xC000) : loco;
+}
+
+CabBusStatusRequest CabBusClient::nop(void)
+{
+	uint8_t command[] = { 0x80 };
+	return CabBusStatusRequest(this, command, sizeof(command));
+}
+
+	// Major << 16 | minor << 8 | revision
+CabBusRequest<uint32_t> CabBusClient::getVersion(void)
+{
+	uint8_t command[] = { 0xAA };
+	return CabBusRequest<uint32_t>(this, command, sizeof(command), 3, false, decodeBigEndian);
+}
+
+CabBusStatusRequest CabBusClient::locoControl(uint16_t loco, uint8_t op, uint8_t data)
+{
+	uint16_t address = locoAddress(loco);
+	uint8_t command[] = { 0xA2, (uint8_t)(address >> 8), (uint8_t)address, op, data };
+	return CabBusStatusRequest(this, command, sizeof(command));
+}
+
+	// 128 speed steps, speed 0..126
+CabBusStatusRequest CabBusClient::setSpeed(uint16_t loco, uint8_t speed, bool forward)
+{
+	return locoControl(loco, forward ? 0x04 : 0x03, speed);
+}
+
+CabBusStatusRequest CabBusClient::emergencyStop(uint16_t loco, bool forward)
+{
+	return locoControl(loco, forward ? 0x06 : 0x05, 0);
+}
+
+CabBusStatusRequest CabBusClient::writeOpsCV(uint16_t loco, uint16_t cv, uint8_t value)
+{
+	uint16_t address = locoAddress(loco);
+	uint8_t command[] = { 0xAE, (uint8_t)(address >> 8), (uint8_t)address, (uint8_t)(cv >> 8), (uint8_t)cv, value };
+	return CabBusStatusRequest(this, command, sizeof(command));
+}
+
+CabBusStatusRequest CabBusClient::setAccessory(uint16_t address, bool reversed)
+{
+	uint8_t command[] = { 0xAD, (uint8_t)(address >> 8), (uint8_t)address, (uint8_t)(reversed ? 0x04 : 0x03), 0 };
+	return CabBusStatusRequest(this, command, sizeof(command));
+}
+
+CabBusStatusRequest CabBusClient::triggerRoute(uint8_t route)
+{
+	uint8_t command[] = { NCE_USB_VENDOR_ROUTE, route };
+	return CabBusStatusRequest(this, command, sizeof(command));
+}
+
+CabBusStatusRequest CabBusClient::enterProgramming(void)
+{
+	uint8_t command[] = { 0x9E };
+	return CabBusStatusRequest(this, command, sizeof(command));
+}
+
+CabBusStatusRequest CabBusClient::exitProgramming(void)
+{
+	uint8_t command[] = { 0x9F };
+	return CabBusStatusRequest(this, command, sizeof(command));
+}
+
+	// Value then status
+CabBusRequest<uint8_t> CabBusClient::readCV(uint16_t cv)
+{
+	uint8_t command[] = { 0xA9, (uint8_t)(cv >> 8), (uint8_t)cv };
+	return CabBusRequest<uint8_t>(this, command, sizeof(command), 2, true, decodeByte);
+}
+
+CabBusStatusRequest CabBusClient::writeCV(uint16_t cv, uint8_t value)
+{
+	uint8_t command[] = { 0xA8, (uint8_t)(cv >> 8), (uint8_t)cv, value };
+	return CabBusStatusRequest(this, command, sizeof(command));
+}
+
+CabBusStatusRequest CabBusClient::setCabMemoryPointer(uint8_t cab, uint8_t offset)
+{
+	uint8_t command[] = { 0xB3, cab, offset };
+	return CabBusStatusRequest(this, command, sizeof(command));
+}
+
+	// 1, 2 or 4 bytes from the pointer on, first byte highest, no status byte
+CabBusRequest<uint32_t> CabBusClient::readCabMemory(uint8_t count)
+{
+	count = (count >= 4) ? 4 : ((count >= 2) ? 2 : 1);
+	uint8_t command[] = { 0xB5, count };
+	return CabBusRequest<uint32_t>(this, command, sizeof(command), count, false, decodeBigEndian);
+}
+
+	// The AIU's 14 inputs, no status byte
+CabBusRequest<uint16_t> CabBusClient::getAiuState(uint8_t cab)
+{
+	uint8_t command[] = { 0x9B, cab };
+	return CabBusRequest<uint16_t>(this, command, sizeof(command), 2, false, decodeWord);
+}
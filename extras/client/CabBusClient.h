@@ -0,0 +1,244 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Async Client
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      CabBusClient.h
+// purpose:   C++20 coroutine client for the NCE USB Interface protocol,
+//            as spoken by a smart cab through extras/tcp-server or a
+//            serial port. Each call returns an awaitable:
+//
+//              CabBusTask throttle(CabBusClient &cab)
+//              {
+//                  CabBusResult<uint8_t> cv29 = co_await cab.readCV(29);
+//                  if (cv29.ok())
+//                      co_await cab.setSpeed(1234, 60);
+//              }
+//
+//            The commands are written as soon as they are awaited, up to
+//            a window of commands in flight, and as the interface answers
+//            in order each response is matched to the oldest command still
+//            waiting. run() is the reactor, one thread drives every
+//            coroutine and the socket.
+//
+//            Failures come back in the result rather than as exceptions:
+//            the interface's error code, a timeout or a lost connection.
+//            A timeout fails every command in flight, as their responses
+//            can no longer be told apart, and late bytes are dropped until
+//            the line has been quiet for CAB_BUS_CLIENT_RESYNC_MS.
+//
+//------------------------------------------------------------------------
+
+#ifndef NCE_CAB_BUS_CLIENT_H
+#define NCE_CAB_BUS_CLIENT_H
+
+#include <NceCabBus.h>
+
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <vector>
+
+#define CAB_BUS_CLIENT_WINDOW		16		// Commands in flight, extras/tcp-server keeps 64 per client
+#define CAB_BUS_CLIENT_TIMEOUT_MS	3000	// Longer than the server's own 2s so it gives up first
+#define CAB_BUS_CLIENT_RESYNC_MS	500		// Quiet time after a timeout before new commands are sent
+
+typedef enum
+{
+	CAB_BUS_CLIENT_OK = 0,
+	CAB_BUS_CLIENT_REJECTED,		// The interface answered with an error, see response
+	CAB_BUS_CLIENT_TIMEOUT,			// No response in time, e.g. no decoder on the programming track
+	CAB_BUS_CLIENT_DISCONNECTED,
+} CAB_BUS_CLIENT_ERROR;
+
+struct CabBusStatus
+{
+	CAB_BUS_CLIENT_ERROR error;
+	uint8_t response;				// USB_RESPONSE_CODES when the command has a status byte
+
+	bool ok(void) const { return error == CAB_BUS_CLIENT_OK; }
+};
+
+template<typename T>
+struct CabBusResult : CabBusStatus
+{
+	T value;
+};
+
+	// Fire and forget coroutine, it starts at once and runs on run(). Another
+	// coroutine can co_await it to wait for it to finish
+class CabBusTask
+{
+  public:
+	struct promise_type
+	{
+		std::coroutine_handle<> continuation;
+		bool detached = false;
+
+		CabBusTask get_return_object(void) { return CabBusTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_never initial_suspend(void) noexcept { return {}; }
+		void return_void(void) {}
+		void unhandled_exception(void) { throw; }
+
+		struct FinalAwaiter
+		{
+			bool await_ready(void) noexcept { return false; }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+			{
+				promise_type &promise = h.promise();
+				std::coroutine_handle<> next = promise.continuation ? promise.continuation : std::noop_coroutine();
+				if (promise.detached)
+					h.destroy();
+				return next;
+			}
+			void await_resume(void) noexcept {}
+		};
+
+		FinalAwaiter final_suspend(void) noexcept { return {}; }
+	};
+
+	CabBusTask(CabBusTask &&other) : handle(other.handle) { other.handle = nullptr; }
+	~CabBusTask();
+
+	bool done(void) const { return !handle || handle.done(); }
+
+	bool await_ready(void) const { return done(); }
+	void await_suspend(std::coroutine_handle<> waiting) { handle.promise().continuation = waiting; }
+	void await_resume(void) {}
+
+  private:
+	explicit CabBusTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+	CabBusTask(const CabBusTask &) = delete;
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+class CabBusClient;
+
+	// One command and where its response goes, lives in the awaiting coroutine's frame
+class CabBusRequestBase
+{
+  public:
+	bool await_ready(void) const { return false; }
+	void await_suspend(std::coroutine_handle<> h);
+
+  protected:
+	friend class CabBusClient;
+
+	CabBusRequestBase(CabBusClient *client, const uint8_t *command, uint8_t commandLength, uint8_t responseLength, bool hasStatus);
+
+	CabBusClient *client;
+	uint8_t command[6];
+	uint8_t commandLength;
+	uint8_t response[32];
+	uint8_t responseLength;
+	uint8_t received;
+	bool hasStatus;					// Last response byte is a USB_RESPONSE_CODES
+	CabBusStatus status;
+	std::coroutine_handle<> waiting;
+
+	void finish(CAB_BUS_CLIENT_ERROR error);
+};
+
+template<typename T>
+class CabBusRequest : public CabBusRequestBase
+{
+  public:
+	typedef T (*Decoder)(const uint8_t *data, uint8_t length);
+
+	CabBusRequest(CabBusClient *client, const uint8_t *command, uint8_t commandLength, uint8_t responseLength, bool hasStatus, Decoder decoder)
+		: CabBusRequestBase(client, command, commandLength, responseLength, hasStatus), decoder(decoder) {}
+
+	CabBusResult<T> await_resume(void)
+	{
+		CabBusResult<T> result;
+		result.error = status.error;
+		result.response = status.response;
+		result.value = (status.error == CAB_BUS_CLIENT_OK) ? decoder(response, responseLength - hasStatus) : T();
+		return result;
+	}
+
+  private:
+	Decoder decoder;
+};
+
+class CabBusStatusRequest : public CabBusRequestBase
+{
+  public:
+	CabBusStatusRequest(CabBusClient *client, const uint8_t *command, uint8_t commandLength)
+		: CabBusRequestBase(client, command, commandLength, 1, true) {}
+
+	CabBusStatus await_resume(void) { return status; }
+};
+
+class CabBusClient
+{
+  public:
+	CabBusClient();
+	~CabBusClient();
+
+	bool connectTCP(const char *host, uint16_t port);
+	bool openSerial(const char *device);
+	void close(void);
+
+	void setWindow(uint8_t commands);
+	void setTimeoutMs(uint32_t ms);
+
+		// Drive the socket and the coroutines until no command is left waiting
+	void run(void);
+	uint32_t getPending(void) const { return queued.size() + inFlight.size(); }
+
+		// Interface, 0x80 and 0xAA
+	CabBusStatusRequest nop(void);
+	CabBusRequest<uint32_t> getVersion(void);
+
+		// Locomotives, 0xA2. Addresses above 127 are sent as long addresses
+	CabBusStatusRequest locoControl(uint16_t loco, uint8_t op, uint8_t data);
+	CabBusStatusRequest setSpeed(uint16_t loco, uint8_t speed, bool forward = true);
+	CabBusStatusRequest emergencyStop(uint16_t loco, bool forward = true);
+	CabBusStatusRequest writeOpsCV(uint16_t loco, uint16_t cv, uint8_t value);
+
+		// Accessories, 0xAD, and routes held by the smart cab, 0xF2
+	CabBusStatusRequest setAccessory(uint16_t address, bool reversed);
+	CabBusStatusRequest triggerRoute(uint8_t route);
+
+		// Programming track, 0x9E/0x9F and direct mode 0xA8/0xA9
+	CabBusStatusRequest enterProgramming(void);
+	CabBusStatusRequest exitProgramming(void);
+	CabBusRequest<uint8_t> readCV(uint16_t cv);
+	CabBusStatusRequest writeCV(uint16_t cv, uint8_t value);
+
+		// Cab memory 0xB3/0xB5 and AIU inputs 0x9B
+	CabBusStatusRequest setCabMemoryPointer(uint8_t cab, uint8_t offset);
+	CabBusRequest<uint32_t> readCabMemory(uint8_t count);
+	CabBusRequest<uint16_t> getAiuState(uint8_t cab);
+
+  private:
+	friend class CabBusRequestBase;
+
+	int fd;
+	uint8_t window;
+	uint32_t timeoutMs;
+	std::deque<CabBusRequestBase *> queued;		// Awaited, not yet written
+	std::deque<CabBusRequestBase *> inFlight;	// Written, oldest answered first
+	std::vector<uint8_t> output;
+	std::chrono::steady_clock::time_point frontSince;
+	bool resyncing;								// After a timeout, until the late bytes stop
+	std::chrono::steady_clock::time_point lastByteSince;
+
+	void submit(CabBusRequestBase *request);
+	void fillWindow(void);
+	void receive(const uint8_t *bytes, size_t length);
+	void complete(CAB_BUS_CLIENT_ERROR error);
+	void failAll(CAB_BUS_CLIENT_ERROR error);
+	void timeout(void);
+};
+
+#endif
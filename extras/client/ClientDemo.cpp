@@ -0,0 +1,227 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Async Client Demo
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      ClientDemo.cpp
+// purpose:   Runs a number of throttle coroutines against a cabbus-server,
+//            each sending speed commands as fast as they are answered,
+//            and a programming coroutine reading CVs alongside them, then
+//            prints the command rate. Compare --window 1 with the default
+//            to see what keeping several commands in flight gains.
+//
+// build:     g++ -std=c++20 -O2 -DARDUINO=10819 -Iextras/host -Isrc
+//              extras/client/ClientDemo.cpp extras/client/CabBusClient.cpp
+//              -o cabbus-client
+//
+// usage:     cabbus-client [--host localhost] [--port 5050] [--throttles 4]
+//              [--commands 50] [--window 16]
+//            cabbus-client --self-test
+//
+//            --self-test needs no server. It runs the client against a
+//            fake interface on loopback that answers one command late,
+//            with several commands in flight, and checks that the late
+//            bytes are not taken as the responses to the commands behind it.
+//
+//------------------------------------------------------------------------
+
+#include "CabBusClient.h"
+
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SELF_TEST_COMMANDS		8
+#define SELF_TEST_LATE_CAB		3		// Its response comes after the client's timeout
+#define SELF_TEST_TIMEOUT_MS	200
+
+static uint32_t completed;
+static uint32_t failed;
+
+static CabBusTask throttle(CabBusClient &cab, uint16_t loco, uint32_t commands)
+{
+	for (uint32_t i = 0; i < commands; i++)
+	{
+		CabBusStatus status = co_await cab.setSpeed(loco, i % 127);
+		if (status.ok())
+			completed++;
+		else
+			failed++;
+	}
+}
+
+static CabBusTask programmer(CabBusClient &cab)
+{
+	static const uint16_t cvs[] = { 1, 29 };
+
+	for (uint8_t i = 0; i < sizeof(cvs) / sizeof(cvs[0]); i++)
+	{
+		CabBusResult<uint8_t> cv = co_await cab.readCV(cvs[i]);
+		if (cv.ok())
+			printf("CV%u = %u\n", cvs[i], cv.value);
+		else
+			printf("CV%u read failed, error %u response '%c'\n", cvs[i], cv.error, cv.response ? cv.response : '-');
+	}
+}
+
+	// Answers each 0x9B AIU status command with the cab number, in order, except that the
+	// answer for SELF_TEST_LATE_CAB comes too late
+static void fakeInterface(int listenFd)
+{
+	int fd = accept(listenFd, NULL, NULL);
+	uint8_t command[2];
+	uint8_t received = 0;
+	uint8_t byte;
+
+	while ((fd >= 0) && (read(fd, &byte, 1) == 1))
+	{
+		command[received++] = byte;
+		if (received < sizeof(command))
+			continue;
+		received = 0;
+
+		if (command[1] == SELF_TEST_LATE_CAB)
+			usleep(SELF_TEST_TIMEOUT_MS * 2 * 1000);
+
+		uint8_t response[2] = { 0, command[1] };
+		if (write(fd, response, sizeof(response)) != sizeof(response))
+			break;
+	}
+	_exit(0);
+}
+
+static CabBusResult<uint16_t> selfTestResults[SELF_TEST_COMMANDS + 1];
+
+static CabBusTask selfTestCommand(CabBusClient &cab, uint8_t aiu)
+{
+	selfTestResults[aiu] = co_await cab.getAiuState(aiu);
+}
+
+	// Commands up to the late one are answered, the late one and those in flight with it time
+	// out, and the ones sent once the late bytes have been dropped get their own responses
+static int selfTest(void)
+{
+	int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	socklen_t addressLength = sizeof(address);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((listenFd < 0) || (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(listenFd, 1) != 0) ||
+		(getsockname(listenFd, (struct sockaddr *)&address, &addressLength) != 0))
+	{
+		fprintf(stderr, "self test: cannot listen on loopback\n");
+		return 1;
+	}
+
+	pid_t child = fork();
+	if (child == 0)
+		fakeInterface(listenFd);
+	close(listenFd);
+
+	CabBusClient cab;
+	if ((child < 0) || !cab.connectTCP("127.0.0.1", ntohs(address.sin_port)))
+	{
+		fprintf(stderr, "self test: cannot start the fake interface\n");
+		return 1;
+	}
+	cab.setWindow(4);
+	cab.setTimeoutMs(SELF_TEST_TIMEOUT_MS);
+
+	for (uint8_t aiu = 1; aiu <= SELF_TEST_COMMANDS; aiu++)
+		selfTestCommand(cab, aiu);
+	cab.run();
+	cab.close();
+
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+
+	int failures = 0;
+	for (uint8_t aiu = 1; aiu <= SELF_TEST_COMMANDS; aiu++)
+	{
+		CabBusResult<uint16_t> &result = selfTestResults[aiu];
+		bool timedOut = (aiu >= SELF_TEST_LATE_CAB) && (aiu < SELF_TEST_LATE_CAB + 4);
+		bool passed = timedOut ? (result.error == CAB_BUS_CLIENT_TIMEOUT) : (result.ok() && (result.value == aiu));
+
+		printf("AIU %u: error %u value %u %s\n", aiu, result.error, result.value, passed ? "ok" : "WRONG");
+		if (!passed)
+			failures++;
+	}
+
+	printf("self test %s\n", failures ? "failed" : "passed");
+	return failures ? 1 : 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: cabbus-client [options]\n"
+		"  --host NAME          cabbus-server host (default localhost)\n"
+		"  --port N             cabbus-server port (default 5050)\n"
+		"  --throttles N        throttle coroutines (default 4)\n"
+		"  --commands N         speed commands per throttle (default 50)\n"
+		"  --window N           commands in flight (default 16)\n"
+		"  --self-test          check the timeout handling against a fake interface\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *host = "localhost";
+	uint16_t port = 5050;
+	uint32_t throttles = 4;
+	uint32_t commands = 50;
+	uint32_t window = CAB_BUS_CLIENT_WINDOW;
+
+	if ((argc == 2) && !strcmp(argv[1], "--self-test"))
+		return selfTest();
+
+	for (int i = 1; i < argc; i++)
+	{
+		if ((i + 1) >= argc)
+			usage();
+
+		if (!strcmp(argv[i], "--host"))				host = argv[++i];
+		else if (!strcmp(argv[i], "--port"))		port = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--throttles"))	throttles = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--commands"))	commands = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--window"))		window = atoi(argv[++i]);
+		else
+			usage();
+	}
+
+	CabBusClient cab;
+	if (!cab.connectTCP(host, port))
+	{
+		fprintf(stderr, "cannot connect to %s:%u\n", host, port);
+		return 1;
+	}
+	cab.setWindow(window);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	programmer(cab);
+	for (uint32_t t = 0; t < throttles; t++)
+		throttle(cab, 1000 + t, commands);
+
+	cab.run();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("%u commands, %u failed, in %.2f s: %.1f commands/s with %u in flight\n",
+		completed, failed, seconds, completed / seconds, window);
+
+	return failed ? 1 : 0;
+}
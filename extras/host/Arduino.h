@@ -0,0 +1,68 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - Host build Arduino.h
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   Just enough of the Arduino core for the NceCabBus library
+//            sources to compile into the host tools in extras/.
+//            Add "-DARDUINO=10819 -Iextras/host" to the compiler flags.
+//
+//------------------------------------------------------------------------
+
+#ifndef NCE_HOST_ARDUINO_H
+#define NCE_HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+#define noInterrupts() cli()
+#define interrupts() sei()
+#else
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_ptr(addr) (*(void * const *)(addr))
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define noInterrupts()
+#define interrupts()
+#endif
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(PSTR(string_literal)))
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define HIGH 0x1
+#define LOW  0x0
+
+// The host clock is a virtual microsecond counter so the simulators
+// stay deterministic, one per thread. A thread that wants wall-clock
+// time calls hostUseRealClock(true), which only affects that thread.
+unsigned long micros(void);
+unsigned long millis(void);
+void delayMicroseconds(unsigned int us);
+void hostSetMicros(unsigned long us);
+void hostUseRealClock(bool enable);
+
+#include "Print.h"
+
+#endif
@@ -0,0 +1,50 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - Host build time functions
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+
+#include "Arduino.h"
+
+#include <chrono>
+
+static thread_local unsigned long virtualMicros = 0;
+static thread_local bool useRealClock = false;
+
+static unsigned long realMicros(void)
+{
+  static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+unsigned long micros(void)
+{
+  return useRealClock ? realMicros() : virtualMicros;
+}
+
+unsigned long millis(void)
+{
+  return micros() / 1000;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  if(!useRealClock)
+    virtualMicros += us;
+}
+
+void hostSetMicros(unsigned long us)
+{
+  virtualMicros = us;
+}
+
+void hostUseRealClock(bool enable)
+{
+  useRealClock = enable;
+}
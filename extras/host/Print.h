@@ -0,0 +1,89 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - Host build Print.h
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   Minimal Arduino compatible Print class. It has no libc
+//            stdio dependency so it also builds with avr-gcc when the
+//            library is compiled outside of the Arduino core.
+//
+//------------------------------------------------------------------------
+
+#ifndef NCE_HOST_PRINT_H
+#define NCE_HOST_PRINT_H
+
+#include "Arduino.h"
+
+class Print
+{
+  public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t value) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size)
+    {
+      size_t n = 0;
+      while(size--)
+        n += write(*buffer++);
+      return n;
+    }
+    size_t write(const char *str)
+    {
+      return str ? write((const uint8_t *)str, strlen(str)) : 0;
+    }
+
+    size_t print(const __FlashStringHelper *ifsh)
+    {
+      const char *p = (const char *)ifsh;
+      size_t n = 0;
+      uint8_t c;
+      while((c = pgm_read_byte(p++)) != 0)
+        n += write(c);
+      return n;
+    }
+    size_t print(const char str[]) { return write(str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char value, int base = DEC) { return printNumber(value, base); }
+    size_t print(int value, int base = DEC) { return print((long)value, base); }
+    size_t print(unsigned int value, int base = DEC) { return printNumber(value, base); }
+    size_t print(long value, int base = DEC)
+    {
+      if((base == DEC) && (value < 0))
+        return write('-') + printNumber(-(unsigned long)value, base);
+      return printNumber((unsigned long)value, base);
+    }
+    size_t print(unsigned long value, int base = DEC) { return printNumber(value, base); }
+
+    size_t println(void) { return write('\r') + write('\n'); }
+    template <typename T> size_t println(T value) { return print(value) + println(); }
+    template <typename T> size_t println(T value, int base) { return print(value, base) + println(); }
+
+  private:
+    size_t printNumber(unsigned long value, uint8_t base)
+    {
+      char buf[8 * sizeof(long) + 1];
+      char *str = &buf[sizeof(buf) - 1];
+
+      if(base < 2)
+        base = 10;
+
+      *str = '\0';
+      do
+      {
+        char c = value % base;
+        value /= base;
+        *--str = c < 10 ? c + '0' : c + 'A' - 10;
+      } while(value);
+
+      return write(str);
+    }
+};
+
+#endif
@@ -0,0 +1,31 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - Host build Stream.h
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   Minimal Arduino compatible Stream class, the byte source
+//            NceCabBus::service() reads from.
+//
+//------------------------------------------------------------------------
+
+#ifndef NCE_HOST_STREAM_H
+#define NCE_HOST_STREAM_H
+
+#include "Print.h"
+
+class Stream : public Print
+{
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+#endif
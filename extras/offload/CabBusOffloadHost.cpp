@@ -0,0 +1,180 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Offload Host
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      CabBusOffloadHost.cpp
+// purpose:   Decode the NceCabBusBridge batches into a NceCabBus and keep
+//            the bridge's poll reply up to date.
+//
+//------------------------------------------------------------------------
+
+#include "CabBusOffloadHost.h"
+
+#include <string.h>
+
+CabBusOffloadHost::CabBusOffloadHost(NceCabBus &cab, std::function<void(const uint8_t *bytes, size_t length)> toBridge)
+	: cab(cab), toBridge(toBridge)
+{
+	memset(replies, 0, sizeof(replies));
+	generation = 0;
+	oneShot = false;
+	used = false;
+	started = false;
+
+	headerCount = 0;
+	recordCount = 0;
+	recordsLeft = 0;
+	lastMicros = 0;
+	busMicros = 0;
+
+	memset(&stats, 0, sizeof(stats));
+}
+
+void CabBusOffloadHost::begin(uint64_t addressMask)
+{
+	uint8_t cabType[2] = { BRIDGE_SET_CAB_TYPE, (uint8_t)cab.getCabType() };
+	toBridge(cabType, sizeof(cabType));
+
+	publish(true);
+
+		// Last, so the bridge has a reply before it answers any poll
+	uint8_t addresses[9] = { BRIDGE_SET_ADDRESSES };
+	for (uint8_t i = 0; i < 8; i++)
+		addresses[1 + i] = addressMask >> (i * 8);
+	toBridge(addresses, sizeof(addresses));
+}
+
+void CabBusOffloadHost::update(void)
+{
+	publish(false);
+}
+
+void CabBusOffloadHost::receive(const uint8_t *bytes, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		uint8_t value = bytes[i];
+
+		if (headerCount < BRIDGE_BATCH_HEADER)
+		{
+			if (!headerCount && (value != BRIDGE_BATCH_START))
+			{
+				stats.badBatches++;
+				continue;
+			}
+
+			header[headerCount++] = value;
+			if (headerCount < BRIDGE_BATCH_HEADER)
+				continue;
+
+			uint32_t batchMicros = header[2] | (header[3] << 8) | (header[4] << 16) | ((uint32_t)header[5] << 24);
+			busMicros += started ? (uint32_t)(batchMicros - lastMicros) : batchMicros;
+			lastMicros = batchMicros;
+			started = true;
+
+			stats.batches++;
+			recordsLeft = header[1];
+			recordCount = 0;
+			if (!recordsLeft)
+				headerCount = 0;
+			continue;
+		}
+
+		record[recordCount++] = value;
+		if (recordCount < 3)
+			continue;
+
+		uint16_t delta = record[1] | (record[2] << 8);
+		bool ownPoll = delta & BRIDGE_DELTA_OWN_POLL;
+		if (ownPoll && (recordCount < 4))
+			continue;
+
+		delta &= BRIDGE_DELTA_MAX;
+		lastMicros += delta;
+		busMicros += delta;
+
+		busByte(record[0], ownPoll, record[3]);
+
+		recordCount = 0;
+		if (!--recordsLeft)
+			headerCount = 0;
+	}
+}
+
+void CabBusOffloadHost::busByte(uint8_t value, bool ownPoll, uint8_t status)
+{
+	stats.busBytes++;
+
+	if (ownPoll)
+	{
+		const Reply &reply = replies[status & 0x7F];
+
+		stats.ownPolls++;
+		if (status & BRIDGE_POLL_REPLY_SENT)
+		{
+			stats.repliesSent++;
+			cab.processForwardedByte(value, reply.data, reply.length);
+		}
+		else
+			cab.processForwardedByte(value, reply.idle, 2);
+
+		if ((status & 0x7F) == generation)
+			used = true;
+	}
+	else
+		cab.processForwardedByte(value, NULL, 0);
+
+	cab.processQueuedBytes();
+
+#if NCE_CAB_BUS_SMART_CAB
+	if (cab.getCabType() == CAB_TYPE_SMART)
+		cab.processResponseByte(value);
+#endif
+
+	publish(false);
+}
+
+void CabBusOffloadHost::publish(bool force)
+{
+	Reply next;
+	memset(&next, 0, sizeof(next));
+	next.length = cab.getPollReply(next.data, next.idle);
+
+	if (!force)
+	{
+			// A key press or frame has to go out, or be seen not to, before anything replaces it
+		if (oneShot && !used)
+			return;
+
+		const Reply &current = replies[generation];
+		if (!memcmp(&next, &current, sizeof(next)) && !(oneShot && used))
+			return;
+	}
+
+	generation = (generation + 1) & 0x7F;
+	replies[generation] = next;
+	oneShot = (next.length != 2) || memcmp(next.data, next.idle, 2);
+	used = false;
+
+	uint8_t command[BRIDGE_COMMAND_MAX];
+	uint8_t length = 0;
+
+	command[length++] = BRIDGE_SET_REPLY;
+	command[length++] = generation;
+	command[length++] = next.length;
+	for (uint8_t i = 0; i < next.length; i++)
+		command[length++] = next.data[i];
+	command[length++] = next.idle[0];
+	command[length++] = next.idle[1];
+
+	toBridge(command, length);
+	stats.repliesSet++;
+}
@@ -0,0 +1,98 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Offload Host
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      CabBusOffloadHost.h
+// purpose:   PC side of an NceCabBusBridge. The batches from the bridge
+//            are fed into a NceCabBus on the PC, which does all of the
+//            parsing, queueing and reply decoding, and each time the
+//            reply to our poll changes it is sent to the bridge.
+//
+//            A reply that carries a key press or a smart cab frame is
+//            only replaced once the bridge has reported the poll that
+//            used it, so the library is always told which reply went out.
+//
+//            Needs NCE_CAB_BUS_ISR_RECEIVE set to 1 in the build flags.
+//
+//------------------------------------------------------------------------
+
+#ifndef NCE_CAB_BUS_OFFLOAD_HOST_H
+#define NCE_CAB_BUS_OFFLOAD_HOST_H
+
+#include <NceCabBus.h>
+#include <NceCabBusBridge.h>
+
+#if !NCE_CAB_BUS_ISR_RECEIVE
+#error The offload host needs NCE_CAB_BUS_ISR_RECEIVE
+#endif
+
+#include <functional>
+
+typedef struct
+{
+	uint64_t batches;
+	uint64_t busBytes;
+	uint64_t ownPolls;
+	uint64_t repliesSent;		// Polls the bridge answered with a reply we set rather than its idle reply
+	uint64_t repliesSet;		// BRIDGE_SET_REPLY commands sent
+	uint64_t badBatches;		// Bytes skipped looking for BRIDGE_BATCH_START
+} CabBusOffloadStats;
+
+class CabBusOffloadHost
+{
+  public:
+		// cab must be set up first: cab type, addresses and handlers. toBridge writes to the bridge
+	CabBusOffloadHost(NceCabBus &cab, std::function<void(const uint8_t *bytes, size_t length)> toBridge);
+
+		// Send the cab type, the first reply and then the addresses, bit n = address n
+	void begin(uint64_t addressMask);
+
+		// Bytes read from the bridge
+	void receive(const uint8_t *bytes, size_t length);
+
+		// Call after changing the cab's state outside receive(), e.g. processUSBByte()
+	void update(void);
+
+	uint64_t getBusMicros(void) const { return busMicros; }
+	const CabBusOffloadStats &getStats(void) const { return stats; }
+
+  private:
+	typedef struct
+	{
+		uint8_t length;
+		uint8_t data[CAB_BUS_COMMAND_LENGTH];
+		uint8_t idle[2];
+	} Reply;
+
+	NceCabBus &cab;
+	std::function<void(const uint8_t *bytes, size_t length)> toBridge;
+
+	Reply replies[128];				// By generation, the bridge reports which one it sent
+	uint8_t generation;
+	bool oneShot;					// The current reply differs from its idle reply
+	bool used;						// The bridge has reported a poll answered since it was set
+	bool started;
+
+	uint8_t header[BRIDGE_BATCH_HEADER];
+	uint8_t record[4];
+	uint8_t headerCount;
+	uint8_t recordCount;
+	uint8_t recordsLeft;
+	uint32_t lastMicros;			// Bridge micros() of the last record
+	uint64_t busMicros;
+
+	CabBusOffloadStats stats;
+
+	void busByte(uint8_t value, bool ownPoll, uint8_t status);
+	void publish(bool force);
+};
+
+#endif
@@ -0,0 +1,579 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Simulator
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      CabBusSim.cpp
+// purpose:   Attach any number of NceCabBus throttles, AIUs, fast clocks
+//            and smart cabs to the simulated bus, drive them with
+//            scripted inputs and report bus throughput and latency.
+//
+// build:     g++ -std=c++17 -O2 -pthread -DARDUINO=10819 -Iextras/host -Isrc
+//              -Iextras/trace extras/simulator/*.cpp
+//              extras/trace/CabBusTraceFile.cpp extras/host/HostArduino.cpp
+//              src/*.cpp -o cabbus-sim
+//
+//------------------------------------------------------------------------
+
+#include "SimBus.h"
+#include "CabBusTraceFile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+typedef struct
+{
+	uint32_t throttles;
+	uint32_t aius;
+	uint32_t clocks;
+	uint32_t smartCabs;
+	uint32_t smartAddresses;	// Cab addresses each smart cab answers on
+	double   seconds;
+	uint64_t seed;
+
+	double   keyRate;		// Key presses per second per throttle
+	double   knobRate;		// Speed knob changes per second per throttle
+	double   aiuRate;		// Input changes per second per AIU
+	double   usbRate;		// JMRI commands per second per smart cab
+	uint32_t jmriWindow;	// Commands JMRI keeps in flight
+
+	bool     loopWork;		// Model the sketch loop() work that delays RS485 processing
+	uint32_t throttleWorkUs;	// loop() work per 20ms in a throttle, e.g. OLED updates
+	bool     isrReceive;	// Devices use processByteFromISR() / processQueuedBytes()
+	uint32_t turnaroundUs;
+
+	SimBusConfig bus;
+
+	const char *jsonPath;
+	FILE *capture;			// Raw bytes from the wire, for extras/analyzer
+	CabBusTraceWriter *traceFile;	// Indexed frames, for extras/trace/TraceQuery
+	uint32_t sweepFrom, sweepTo, sweepStep;
+	uint32_t scalingBuses;	// Time 1..N independent buses run on as many threads
+} SimOptions;
+
+typedef struct
+{
+	SimDevice *device;
+	std::deque<SimTime> backlog;	// Commands JMRI has generated but not yet sent
+} SmartCabScript;
+
+static const uint8_t scriptKeys[] =
+{
+	BTN_F0, BTN_F1, BTN_F2, BTN_F3, BTN_F4, BTN_F5, BTN_FAS, BTN_SLO, BTN_DIR, BTN_HORN_DN, BTN_HORN_UP
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: cabbus-sim [options]\n"
+		"  --throttles N        LCD throttles (default 10)\n"
+		"  --aius N             AIUs (default 4)\n"
+		"  --clocks N           passive fast clocks (default 1)\n"
+		"  --smart N            USB smart cabs (default 1)\n"
+		"  --smart-addresses N  cab addresses per smart cab (default 1), needs\n"
+		"                       -DNCE_CAB_BUS_SMART_CAB_ADDRESSES=N or more\n"
+		"  --seconds S          simulated time (default 60)\n"
+		"  --seed N             random seed (default 1)\n"
+		"  --key-rate R         key presses/sec per throttle (default 0.5)\n"
+		"  --knob-rate R        speed knob changes/sec per throttle (default 1)\n"
+		"  --aiu-rate R         input changes/sec per AIU (default 0.2)\n"
+		"  --usb-rate R         JMRI commands/sec per smart cab (default 5)\n"
+		"  --jmri-window N      JMRI commands in flight (default 1)\n"
+		"  --reply-window-us N  command station reply window (default 800)\n"
+		"  --gap-us N           command station gap between slots (default 100)\n"
+		"  --turnaround-us N    device delay before replying (default 200)\n"
+		"  --fast-clock-rate N  fast clock ratio, 0 = off (default 4)\n"
+		"  --prog-read-ms N     programming track CV read time (default 250)\n"
+		"  --usb-timeout-ms N   JMRI command timeout (default 2000)\n"
+		"  --no-probe           do not poll unused addresses\n"
+		"  --no-loop-work       devices process bytes as soon as they arrive\n"
+		"  --throttle-work-us N throttle loop() work every 20ms (default 600)\n"
+		"  --isr                devices answer polls from the UART RX interrupt\n"
+		"  --sweep-throttles A:B:S  repeat the run for A..B throttles in steps of S\n"
+		"  --scaling N          run 1..N independent buses at once, one per thread,\n"
+		"                       and report the wall time of each\n"
+		"  --json FILE          write the results as JSON\n"
+		"  --capture FILE       write every byte on the wire to FILE\n"
+		"  --trace-file FILE    write the bus frames to an indexed trace FILE\n");
+	exit(1);
+}
+
+static void scheduleKeys(SimBus &, SimDevice &device, SimRandom &rnd, const SimOptions &opt, SimTime end)
+{
+	for (SimTime t = rnd.interval(opt.keyRate); t < end; t += rnd.interval(opt.keyRate))
+		device.pressKey(t, scriptKeys[rnd.range(0, sizeof(scriptKeys) - 1)]);
+
+	for (SimTime t = rnd.interval(opt.knobRate); t < end; t += rnd.interval(opt.knobRate))
+		device.setSpeedKnob(t, rnd.range(0, 126));
+}
+
+static void scheduleAiu(SimBus &, SimDevice &device, SimRandom &rnd, const SimOptions &opt, SimTime end)
+{
+	for (SimTime t = rnd.interval(opt.aiuRate); t < end; t += rnd.interval(opt.aiuRate))
+		device.setAiuBit(t, rnd.range(0, AIU_NUM_IOS - 1), rnd.range(0, 1));
+}
+
+	// A JMRI like command mix: mostly throttle speed, some turnouts and the odd CV read
+static void submitJmriCommand(SmartCabScript &script, SimRandom &rnd, SimTime queuedSince)
+{
+	uint8_t cmd[6];
+	uint8_t length, responseLength = 1;
+	uint32_t pick = rnd.range(0, 99);
+
+	if (pick < 70)
+	{
+			// JMRI flags long addresses with 0xC000, the bridge keeps the low 12 bits
+		uint16_t loco = rnd.range(3, 4095);
+		if (loco > 127)
+			loco |= 0xC000;
+		cmd[0] = 0xA2; cmd[1] = loco >> 8; cmd[2] = loco & 0xFF; cmd[3] = 0x04; cmd[4] = rnd.range(0, 126);
+		length = 5;
+	}
+	else if (pick < 90)
+	{
+		uint16_t accy = rnd.range(1, 2044);
+		cmd[0] = 0xAD; cmd[1] = accy >> 8; cmd[2] = accy & 0xFF; cmd[3] = rnd.range(3, 4); cmd[4] = 0;
+		length = 5;
+	}
+	else if (pick < 96)
+	{
+		uint16_t cv = rnd.range(1, 255);
+		cmd[0] = 0xA8; cmd[1] = cv >> 8; cmd[2] = cv & 0xFF; cmd[3] = rnd.range(0, 255);
+		length = 4;
+	}
+	else
+	{
+		uint16_t cv = rnd.range(1, 255);
+		cmd[0] = 0xA9; cmd[1] = cv >> 8; cmd[2] = cv & 0xFF;
+		length = 3;
+		responseLength = 2;
+	}
+
+	script.device->submitUSB(queuedSince, cmd, length, responseLength);
+}
+
+static void pumpJmri(SmartCabScript &script, SimRandom &rnd, const SimOptions &opt)
+{
+	while (!script.backlog.empty() && (script.device->usbOutstanding() < opt.jmriWindow))
+	{
+		SimTime queuedSince = script.backlog.front();
+		script.backlog.pop_front();
+		submitJmriCommand(script, rnd, queuedSince);
+	}
+}
+
+static void scheduleJmriFrom(SimBus &bus, SmartCabScript &script, SimRandom &rnd, const SimOptions &opt, SimTime from, SimTime end)
+{
+	SimTime t = from + rnd.interval(opt.usbRate);
+	if (t >= end)
+		return;
+
+	bus.schedule(t, [&bus, &script, &rnd, &opt, t, end]()
+	{
+		script.backlog.push_back(t);
+		pumpJmri(script, rnd, opt);
+		scheduleJmriFrom(bus, script, rnd, opt, t, end);
+	});
+}
+
+static const char *kindName(SIM_DEVICE_KIND kind)
+{
+	switch (kind)
+	{
+	case SIM_THROTTLE:		return "throttle";
+	case SIM_AIU:			return "aiu";
+	case SIM_FAST_CLOCK:	return "clock";
+	case SIM_SMART_CAB:		return "smart";
+	}
+	return "?";
+}
+
+typedef struct
+{
+	uint32_t devices;
+	double pollsPerSec;
+	uint32_t rotationP50Us, rotationP99Us, rotationMaxUs;
+	uint32_t replyP99Us, replyMaxUs;
+	uint32_t lateReplies;
+	uint32_t keysPressed, keysReceived;
+	uint32_t usbSubmitted, usbCompleted, usbLost, usbTimedOut;
+	uint32_t usbP50Us, usbP99Us, usbMaxUs;
+} SimSummary;
+
+static SimSummary runSimulation(const SimOptions &opt, bool report, FILE *json)
+{
+	SimBus bus(opt.bus);
+	SimRandom rnd(opt.seed);
+	SimTime end = (SimTime)(opt.seconds * 1e9);
+	uint8_t address = 2;
+	std::vector<std::unique_ptr<SmartCabScript> > smartScripts;
+
+	if (opt.throttles + opt.aius + (opt.smartCabs * opt.smartAddresses) > 62)
+	{
+		fprintf(stderr, "cabbus-sim: at most 62 addressed devices fit on the bus\n");
+		exit(1);
+	}
+
+	for (uint32_t i = 0; i < opt.throttles; i++)
+	{
+		SimDeviceConfig cfg = { SIM_THROTTLE, address++, opt.turnaroundUs, 20000, opt.loopWork ? opt.throttleWorkUs : 0u, opt.isrReceive, 0 };
+		scheduleKeys(bus, bus.addDevice(cfg, rnd.range(0, 19999)), rnd, opt, end);
+	}
+
+	for (uint32_t i = 0; i < opt.aius; i++)
+	{
+		SimDeviceConfig cfg = { SIM_AIU, address++, opt.turnaroundUs, 1000, opt.loopWork ? 50u : 0u, opt.isrReceive, 0 };
+		scheduleAiu(bus, bus.addDevice(cfg, rnd.range(0, 999)), rnd, opt, end);
+	}
+
+	for (uint32_t i = 0; i < opt.smartCabs; i++)
+	{
+		SimDeviceConfig cfg = { SIM_SMART_CAB, address, opt.turnaroundUs, 5000, opt.loopWork ? 100u : 0u, opt.isrReceive, (uint8_t)(opt.smartAddresses - 1) };
+		address += opt.smartAddresses;
+		SmartCabScript *script = new SmartCabScript();
+		script->device = &bus.addDevice(cfg, rnd.range(0, 4999));
+		script->device->onUSBComplete = [script, &rnd, &opt](SimDevice &, SimTime)
+		{
+			pumpJmri(*script, rnd, opt);
+		};
+		smartScripts.push_back(std::unique_ptr<SmartCabScript>(script));
+		scheduleJmriFrom(bus, *script, rnd, opt, 0, end);
+	}
+
+	for (uint32_t i = 0; i < opt.clocks; i++)
+	{
+		SimDeviceConfig cfg = { SIM_FAST_CLOCK, 0, opt.turnaroundUs, 1000, opt.loopWork ? 400u : 0u, opt.isrReceive, 0 };
+		bus.addDevice(cfg, rnd.range(0, 999));
+	}
+
+	if (opt.capture || opt.traceFile)
+	{
+		FILE *capture = opt.capture;
+		CabBusTraceWriter *traceFile = opt.traceFile;
+		bus.onWireByte = [capture, traceFile](SimTime start, uint8_t value)
+		{
+			if (capture)
+				fputc(value, capture);
+			if (traceFile)
+				traceFile->addByte(start / 1000, value);
+		};
+	}
+
+	bus.runUntil(end);
+
+	SimSummary summary = SimSummary();
+	SimLatency allReplies, allUsb;
+	double seconds = (double)bus.now() / 1e9;
+
+	summary.devices = bus.getDevices().size();
+	summary.pollsPerSec = bus.stats.polls / seconds;
+	summary.rotationP50Us = bus.stats.rotationUs.percentile(50);
+	summary.rotationP99Us = bus.stats.rotationUs.percentile(99);
+	summary.rotationMaxUs = bus.stats.rotationUs.max();
+
+	if (report)
+	{
+		printf("NCE Cab Bus Simulator: %u throttles, %u AIUs, %u clocks, %u smart cabs, %.1f s simulated, seed %llu\n",
+			opt.throttles, opt.aius, opt.clocks, opt.smartCabs, seconds, (unsigned long long)opt.seed);
+		printf("Bus: %llu polls (%.1f polls/sec), %llu rotations, rotation p50 %.1f ms p99 %.1f ms max %.1f ms\n",
+			(unsigned long long)bus.stats.polls, summary.pollsPerSec, (unsigned long long)bus.stats.rotations,
+			summary.rotationP50Us / 1000.0, summary.rotationP99Us / 1000.0, summary.rotationMaxUs / 1000.0);
+		printf("     %llu smart cab frames, %llu bad checksums, %llu reply frames, %llu LCD commands\n\n",
+			(unsigned long long)bus.stats.framesReceived, (unsigned long long)bus.stats.badChecksums,
+			(unsigned long long)bus.stats.repliesSent, (unsigned long long)bus.stats.lcdCommandsSent);
+		printf("Addr Type      Polls Replies  Late  p50us  p90us  p99us  maxus  Keys(pressed/seen)  USB(sent/done/lost)  USB p50ms  p99ms\n");
+	}
+
+	if (json)
+		fprintf(json, "{\"seconds\":%.3f,\"polls\":%llu,\"pollsPerSec\":%.2f,\"rotationP50Us\":%u,\"rotationP99Us\":%u,\"rotationMaxUs\":%u,\"devices\":[",
+			seconds, (unsigned long long)bus.stats.polls, summary.pollsPerSec,
+			summary.rotationP50Us, summary.rotationP99Us, summary.rotationMaxUs);
+
+	for (size_t i = 0; i < bus.getDevices().size(); i++)
+	{
+		SimDevice &d = *bus.getDevices()[i];
+		SimDeviceStats &s = d.stats;
+
+		summary.lateReplies += s.lateReplies;
+		summary.keysPressed += s.keysPressed;
+		summary.keysReceived += s.keysReceived;
+		summary.usbSubmitted += s.usbSubmitted;
+		summary.usbCompleted += s.usbCompleted;
+		summary.usbLost += s.usbLost;
+		summary.usbTimedOut += s.usbTimedOut;
+		summary.replyP99Us = std::max(summary.replyP99Us, s.replyLatencyUs.percentile(99));
+		summary.replyMaxUs = std::max(summary.replyMaxUs, s.replyLatencyUs.max());
+		summary.usbP50Us = std::max(summary.usbP50Us, s.usbLatencyUs.percentile(50));
+		summary.usbP99Us = std::max(summary.usbP99Us, s.usbLatencyUs.percentile(99));
+		summary.usbMaxUs = std::max(summary.usbMaxUs, s.usbLatencyUs.max());
+
+		if (report)
+		{
+			printf("%4u %-8s %6u %7u %5u %6u %6u %6u %6u  %8u/%-8u  %6u/%-6u/%-5u  %9.1f %6.1f\n",
+				d.config.address, kindName(d.config.kind), s.polls, s.replies, s.lateReplies,
+				s.replyLatencyUs.percentile(50), s.replyLatencyUs.percentile(90),
+				s.replyLatencyUs.percentile(99), s.replyLatencyUs.max(),
+				s.keysPressed, s.keysReceived, s.usbSubmitted, s.usbCompleted, s.usbLost,
+				s.usbLatencyUs.percentile(50) / 1000.0, s.usbLatencyUs.percentile(99) / 1000.0);
+		}
+
+		if (json)
+			fprintf(json, "%s{\"address\":%u,\"type\":\"%s\",\"polls\":%u,\"replies\":%u,\"late\":%u,"
+				"\"replyP50Us\":%u,\"replyP90Us\":%u,\"replyP99Us\":%u,\"replyMaxUs\":%u,"
+				"\"keysPressed\":%u,\"keysSeen\":%u,\"lcdUpdates\":%u,\"fastClockUpdates\":%u,"
+				"\"usbSubmitted\":%u,\"usbCompleted\":%u,\"usbLost\":%u,\"usbTimedOut\":%u,\"usbP50Us\":%u,\"usbP99Us\":%u,\"usbMaxUs\":%u}",
+				i ? "," : "", d.config.address, kindName(d.config.kind), s.polls, s.replies, s.lateReplies,
+				s.replyLatencyUs.percentile(50), s.replyLatencyUs.percentile(90),
+				s.replyLatencyUs.percentile(99), s.replyLatencyUs.max(),
+				s.keysPressed, s.keysReceived, s.lcdUpdates, s.fastClockUpdates,
+				s.usbSubmitted, s.usbCompleted, s.usbLost, s.usbTimedOut,
+				s.usbLatencyUs.percentile(50), s.usbLatencyUs.percentile(99), s.usbLatencyUs.max());
+	}
+
+	if (json)
+		fprintf(json, "]}");
+
+	if (report)
+	{
+		printf("\nTotals: %u late replies, %u of %u key presses seen by the command station, "
+			"%u JMRI commands lost on the wire, %u never answered\n",
+			summary.lateReplies, summary.keysReceived, summary.keysPressed, summary.usbLost, summary.usbTimedOut);
+	}
+
+	return summary;
+}
+
+	// Each bus is a separate SimBus with its own NceCabBus objects and virtual clock, nothing is
+	// shared between the threads, so the simulated seconds per wall second should grow with the
+	// number of buses until the cores run out
+static void runScaling(const SimOptions &opt)
+{
+	double singleRate = 0;
+
+	printf("NCE Cab Bus Simulator scaling: %u devices per bus, %.1f s simulated per bus, %u hardware threads\n",
+		opt.throttles + opt.aius + opt.clocks + opt.smartCabs, opt.seconds, std::thread::hardware_concurrency());
+	printf("Buses  Wall s  Bus s/wall s  Speedup  Efficiency  Polls/s per bus\n");
+
+	for (uint32_t buses = 1; buses <= opt.scalingBuses; buses++)
+	{
+		std::vector<SimSummary> results(buses);
+		std::vector<std::thread> threads;
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (uint32_t i = 0; i < buses; i++)
+		{
+			threads.push_back(std::thread([&opt, &results, i]()
+			{
+				SimOptions run = opt;
+				run.seed = opt.seed + i;
+				results[i] = runSimulation(run, false, NULL);
+			}));
+		}
+
+		for (size_t i = 0; i < threads.size(); i++)
+			threads[i].join();
+
+		double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double rate = buses * opt.seconds / wall;
+		if (buses == 1)
+			singleRate = rate;
+
+		double pollsPerSec = 0;
+		for (uint32_t i = 0; i < buses; i++)
+			pollsPerSec += results[i].pollsPerSec / buses;
+
+		printf("%5u %7.3f %13.1f %8.2f %10.0f%% %16.1f\n",
+			buses, wall, rate, rate / singleRate, 100.0 * rate / singleRate / buses, pollsPerSec);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	SimOptions opt;
+
+	opt.throttles = 10;
+	opt.aius = 4;
+	opt.clocks = 1;
+	opt.smartCabs = 1;
+	opt.smartAddresses = 1;
+	opt.seconds = 60;
+	opt.seed = 1;
+	opt.keyRate = 0.5;
+	opt.knobRate = 1;
+	opt.aiuRate = 0.2;
+	opt.usbRate = 5;
+	opt.jmriWindow = 1;
+	opt.loopWork = true;
+	opt.throttleWorkUs = 600;
+	opt.isrReceive = false;
+	opt.turnaroundUs = 200;
+	opt.bus.replyWindowUs = 800;
+	opt.bus.interPollGapUs = 100;
+	opt.bus.fastClockRate = 4;
+	opt.bus.progReadUs = 250000;
+	opt.bus.usbTimeoutUs = 2000000;
+	opt.bus.probeInactive = true;
+	opt.jsonPath = NULL;
+	opt.capture = NULL;
+	opt.traceFile = NULL;
+	opt.sweepFrom = opt.sweepTo = opt.sweepStep = 0;
+	opt.scalingBuses = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = (i + 1) < argc;
+		const char *value = hasValue ? argv[i + 1] : NULL;
+
+		if (arg == "--no-probe")
+			opt.bus.probeInactive = false;
+		else if (arg == "--no-loop-work")
+			opt.loopWork = false;
+		else if (arg == "--isr")
+			opt.isrReceive = true;
+		else if (!hasValue)
+			usage();
+		else
+		{
+			i++;
+			if (arg == "--throttles")				opt.throttles = atoi(value);
+			else if (arg == "--aius")				opt.aius = atoi(value);
+			else if (arg == "--clocks")				opt.clocks = atoi(value);
+			else if (arg == "--smart")				opt.smartCabs = atoi(value);
+			else if (arg == "--smart-addresses")	opt.smartAddresses = atoi(value);
+			else if (arg == "--seconds")			opt.seconds = atof(value);
+			else if (arg == "--seed")				opt.seed = strtoull(value, NULL, 0);
+			else if (arg == "--key-rate")			opt.keyRate = atof(value);
+			else if (arg == "--knob-rate")			opt.knobRate = atof(value);
+			else if (arg == "--aiu-rate")			opt.aiuRate = atof(value);
+			else if (arg == "--usb-rate")			opt.usbRate = atof(value);
+			else if (arg == "--jmri-window")		opt.jmriWindow = atoi(value);
+			else if (arg == "--reply-window-us")	opt.bus.replyWindowUs = atoi(value);
+			else if (arg == "--gap-us")				opt.bus.interPollGapUs = atoi(value);
+			else if (arg == "--turnaround-us")		opt.turnaroundUs = atoi(value);
+			else if (arg == "--throttle-work-us")	opt.throttleWorkUs = atoi(value);
+			else if (arg == "--fast-clock-rate")	opt.bus.fastClockRate = atoi(value);
+			else if (arg == "--prog-read-ms")		opt.bus.progReadUs = atoi(value) * 1000;
+			else if (arg == "--usb-timeout-ms")		opt.bus.usbTimeoutUs = atoi(value) * 1000;
+			else if (arg == "--json")				opt.jsonPath = value;
+			else if (arg == "--scaling")			opt.scalingBuses = atoi(value);
+			else if (arg == "--capture")
+			{
+				opt.capture = fopen(value, "wb");
+				if (!opt.capture)
+				{
+					perror(value);
+					return 1;
+				}
+			}
+			else if (arg == "--trace-file")
+			{
+				opt.traceFile = new CabBusTraceWriter();
+				if (!opt.traceFile->open(value))
+				{
+					perror(value);
+					return 1;
+				}
+			}
+			else if (arg == "--sweep-throttles")
+			{
+				if (sscanf(value, "%u:%u:%u", &opt.sweepFrom, &opt.sweepTo, &opt.sweepStep) != 3 || !opt.sweepStep)
+					usage();
+			}
+			else
+				usage();
+		}
+	}
+
+	if (opt.jmriWindow == 0)
+		opt.jmriWindow = 1;
+
+	if (opt.smartAddresses == 0)
+		opt.smartAddresses = 1;
+
+	if (opt.traceFile && opt.sweepStep)
+	{
+		fprintf(stderr, "cabbus-sim: --trace-file needs a single run, not --sweep-throttles\n");
+		return 1;
+	}
+
+	if (opt.scalingBuses)
+	{
+		if (opt.jsonPath || opt.capture || opt.traceFile || opt.sweepStep)
+		{
+			fprintf(stderr, "cabbus-sim: --scaling only reports times, no --json, --capture, --trace-file or --sweep-throttles\n");
+			return 1;
+		}
+
+		runScaling(opt);
+		return 0;
+	}
+
+	FILE *json = NULL;
+	if (opt.jsonPath)
+	{
+		json = fopen(opt.jsonPath, "w");
+		if (!json)
+		{
+			perror(opt.jsonPath);
+			return 1;
+		}
+	}
+
+	if (!opt.sweepStep)
+		runSimulation(opt, true, json);
+	else
+	{
+		printf("Throttles Devices  Polls/s  Rot p50ms  Rot p99ms  Reply p99us  Late  Keys seen    USB p50ms  USB p99ms  USB lost/timeout\n");
+		if (json)
+			fprintf(json, "[");
+
+		for (uint32_t n = opt.sweepFrom; n <= opt.sweepTo; n += opt.sweepStep)
+		{
+			SimOptions run = opt;
+			run.throttles = n;
+
+			if (json && (n != opt.sweepFrom))
+				fprintf(json, ",");
+
+			SimSummary s = runSimulation(run, false, json);
+
+			printf("%9u %7u %8.1f %10.1f %10.1f %12u %5u %5u/%-5u %10.1f %10.1f %9u/%u\n",
+				n, s.devices, s.pollsPerSec, s.rotationP50Us / 1000.0, s.rotationP99Us / 1000.0,
+				s.replyP99Us, s.lateReplies, s.keysReceived, s.keysPressed,
+				s.usbP50Us / 1000.0, s.usbP99Us / 1000.0, s.usbLost, s.usbTimedOut);
+		}
+
+		if (json)
+			fprintf(json, "]");
+	}
+
+	if (json)
+	{
+		fprintf(json, "\n");
+		fclose(json);
+	}
+
+	if (opt.capture)
+		fclose(opt.capture);
+
+	if (opt.traceFile)
+	{
+		if (!opt.traceFile->close())
+			fprintf(stderr, "failed to write the trace file\n");
+		delete opt.traceFile;
+	}
+
+	return 0;
+}
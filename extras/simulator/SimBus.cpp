@@ -0,0 +1,642 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Simulator
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+
+#include "SimBus.h"
+
+#include <algorithm>
+#include <math.h>
+
+#if !NCE_CAB_BUS_ISR_RECEIVE
+#error The simulator needs NCE_CAB_BUS_ISR_RECEIVE for its --isr devices
+#endif
+
+SimTime SimRandom::interval(double ratePerSec)
+{
+	if (ratePerSec <= 0)
+		return SIM_SEC(1000000);
+
+	double u = (double)((next() >> 11) + 1) / (double)(1ULL << 53);
+	return (SimTime)(-log(u) / ratePerSec * 1e9);
+}
+
+uint32_t SimLatency::percentile(double p)
+{
+	if (samples.empty())
+		return 0;
+
+	if (!sorted)
+	{
+		std::sort(samples.begin(), samples.end());
+		sorted = true;
+	}
+
+	size_t rank = (size_t)ceil(p / 100.0 * samples.size());
+	if (rank)
+		rank--;
+	return samples[std::min(rank, samples.size() - 1)];
+}
+
+uint32_t SimLatency::max(void)
+{
+	return percentile(100.0);
+}
+
+SimDevice::SimDevice(SimBus &bus, const SimDeviceConfig &config, uint32_t phaseUs)
+	: config(config), stats(), txStart(0), bus(bus), phaseUs(phaseUs), inLibrary(false), libraryTime(0),
+	  usbInFlight(0), usbNextId(0), usbBytesThisCall(0)
+{
+	attachCabBus(cab);
+
+	switch (config.kind)
+	{
+	case SIM_THROTTLE:
+		cab.setCabType(CAB_TYPE_LCD);
+		cab.setCabAddress(config.address);
+		break;
+
+	case SIM_AIU:
+		cab.setCabType(CAB_TYPE_AIU);
+		cab.setCabAddress(config.address);
+		break;
+
+	case SIM_FAST_CLOCK:
+		break;
+
+	case SIM_SMART_CAB:
+		cab.setCabType(CAB_TYPE_SMART);
+		cab.setCabAddress(config.address);
+#if NCE_CAB_BUS_MULTI_ADDRESS
+		for (uint8_t i = 1; i <= config.extraAddresses; i++)
+			cab.addCabAddress(config.address + i);
+#endif
+		break;
+	}
+}
+
+SimTime SimDevice::readyTime(SimTime arrival) const
+{
+	if (!config.loopPeriodUs || !config.loopWorkUs)
+		return arrival;
+
+	SimTime period = SIM_US(config.loopPeriodUs);
+	SimTime work = SIM_US(config.loopWorkUs);
+	SimTime pos = (arrival + period - (SIM_US(phaseUs) % period)) % period;
+
+	return (pos < work) ? arrival + (work - pos) : arrival;
+}
+
+void SimDevice::pressKey(SimTime when, uint8_t key)
+{
+	stats.keysPressed++;
+	bus.schedule(readyTime(when), [this, key]() { cab.setKeyPress(key); });
+}
+
+void SimDevice::setSpeedKnob(SimTime when, uint8_t speed)
+{
+	bus.schedule(readyTime(when), [this, speed]() { cab.setSpeedKnob(speed); });
+}
+
+void SimDevice::setAiuBit(SimTime when, uint8_t ioNum, bool state)
+{
+	bus.schedule(readyTime(when), [this, ioNum, state]() { cab.setAuiIoBitState(ioNum, state); });
+}
+
+void SimDevice::submitUSB(SimTime when, const uint8_t *cmd, uint8_t length, uint8_t responseLength)
+{
+	std::vector<uint8_t> bytes(cmd, cmd + length);
+	uint32_t id = usbNextId++;
+
+	stats.usbSubmitted++;
+	usbInFlight++;
+
+	bus.schedule(readyTime(bus.now() > when ? bus.now() : when), [this, bytes, id, when, responseLength]()
+	{
+		UsbRequest request = { id, when, responseLength, 0 };
+		usbQueue.push_back(request);
+
+		enterLibrary(bus.now());
+		for (size_t i = 0; i < bytes.size(); i++)
+			cab.processUSBByte(bytes[i]);
+		leaveLibrary();
+
+		settleUSB(bus.now(), false);
+	});
+
+		// The JMRI timeout starts when the command is actually sent, not when it was queued
+	bus.schedule(std::max(bus.now(), when) + SIM_US(bus.config.usbTimeoutUs), [this, id]()
+	{
+		for (size_t i = 0; i < usbQueue.size(); i++)
+		{
+			if (usbQueue[i].id == id)
+			{
+				usbQueue.erase(usbQueue.begin() + i);
+				usbInFlight--;
+				stats.usbTimedOut++;
+
+				if (onUSBComplete)
+					onUSBComplete(*this, bus.now());
+				break;
+			}
+		}
+	});
+}
+
+void SimDevice::injectUSB(const uint8_t *bytes, uint8_t length)
+{
+	enterLibrary(bus.now());
+	for (uint8_t i = 0; i < length; i++)
+		cab.processUSBByte(bytes[i]);
+	leaveLibrary();
+}
+
+void SimDevice::sendRS485Bytes(uint8_t *values, uint8_t length)
+{
+	if (!inLibrary)
+		return;
+
+	txBytes.assign(values, values + length);
+	txStart = libraryTime + SIM_US(config.turnaroundUs);
+}
+
+void SimDevice::sendUSBBytes(uint8_t *values, uint8_t length)
+{
+	if (!inLibrary || (config.kind != SIM_SMART_CAB))
+		return;
+
+	if (onUSBBytes)
+		onUSBBytes(*this, values, length);
+
+	for (uint8_t i = 0; i < length; i++)
+	{
+		for (size_t j = 0; j < usbQueue.size(); j++)
+		{
+			if (usbQueue[j].received < usbQueue[j].responseLength)
+			{
+				usbQueue[j].received++;
+				break;
+			}
+		}
+	}
+	usbBytesThisCall += length;
+}
+
+void SimDevice::fastClock(uint8_t, uint8_t, uint8_t, FAST_CLOCK_MODE)
+{
+	if (inLibrary && (config.kind == SIM_FAST_CLOCK))
+		stats.fastClockUpdates++;
+}
+
+void SimDevice::lcdUpdate(uint8_t, uint8_t, char *, uint8_t)
+{
+	if (inLibrary && (config.kind == SIM_THROTTLE))
+		stats.lcdUpdates++;
+}
+
+void SimDevice::lcdPrintChar(char, bool)
+{
+	if (inLibrary && (config.kind == SIM_THROTTLE))
+		stats.lcdUpdates++;
+}
+
+void SimDevice::settleUSB(SimTime when, bool lost)
+{
+	usbBytesThisCall = 0;
+
+	while (!usbQueue.empty() && (usbQueue.front().received >= usbQueue.front().responseLength))
+	{
+		UsbRequest request = usbQueue.front();
+		usbQueue.pop_front();
+		usbInFlight--;
+
+		stats.usbCompleted++;
+		if (lost)
+			stats.usbLost++;
+		stats.usbLatencyUs.add((uint32_t)((when - request.submitted) / 1000));
+
+		if (onUSBComplete)
+			onUSBComplete(*this, when);
+	}
+}
+
+SimBus::SimBus(const SimBusConfig &config)
+	: config(config), stats(), eventSeq(0), clock(0), rotationIndex(0), probeAddress(0),
+	  rotationStart(0), lastFastMinute(-1), fastClockRateSent(false), memCab(0), memOffset(0)
+{
+	memset(active, 0, sizeof(active));
+	memset(cabMemory, 0, sizeof(cabMemory));
+	memset(lastOpsFrame, 0, sizeof(lastOpsFrame));
+}
+
+SimBus::~SimBus()
+{
+}
+
+SimDevice &SimBus::addDevice(const SimDeviceConfig &config, uint32_t phaseUs)
+{
+	devices.push_back(std::unique_ptr<SimDevice>(new SimDevice(*this, config, phaseUs)));
+
+		// Start from a bus the command station has already discovered so a run
+		// measures steady state rather than the one probe per rotation start-up
+	if ((config.kind != SIM_FAST_CLOCK) && config.address)
+		for (uint8_t address = config.address; (address <= config.address + config.extraAddresses) && (address < 64); address++)
+			active[address] = true;
+
+	return *devices.back();
+}
+
+void SimBus::schedule(SimTime when, std::function<void()> action)
+{
+	Event event = { when, eventSeq++, action };
+	events.push(event);
+}
+
+void SimBus::runEvents(SimTime upTo)
+{
+	while (!events.empty() && (events.top().when <= upTo))
+	{
+		Event event = events.top();
+		events.pop();
+
+		SimTime saved = clock;
+		clock = std::max(clock, event.when);
+		hostSetMicros(clock / 1000);
+		event.action();
+		clock = std::max(saved, clock);
+	}
+}
+
+void SimBus::runUntil(SimTime end)
+{
+	while (clock < end)
+		runSlot();
+
+	runEvents(end);
+}
+
+SimDevice *SimBus::findDevice(uint8_t address)
+{
+	if (address == 0)
+		return NULL;
+
+	for (size_t i = 0; i < devices.size(); i++)
+		if ((devices[i]->config.kind != SIM_FAST_CLOCK) && (address >= devices[i]->config.address) &&
+			(address <= devices[i]->config.address + devices[i]->config.extraAddresses))
+			return devices[i].get();
+
+	return NULL;
+}
+
+void SimBus::buildRotation(void)
+{
+	if (stats.polls)
+	{
+		stats.rotations++;
+		stats.rotationUs.add((uint32_t)((clock - rotationStart) / 1000));
+	}
+	rotationStart = clock;
+
+	rotation.clear();
+	rotation.push_back(0);	// Broadcast slot first
+
+	for (uint8_t address = 1; address < 64; address++)
+		if (active[address])
+			rotation.push_back(address);
+
+	if (config.probeInactive || (rotation.size() == 1))
+	{
+		for (uint8_t i = 0; i < 63; i++)
+		{
+			probeAddress = (probeAddress % 63) + 1;
+			if (!active[probeAddress])
+			{
+				rotation.push_back(probeAddress);
+				break;
+			}
+		}
+	}
+
+	rotationIndex = 0;
+}
+
+void SimBus::deliver(SimDevice &device, uint8_t value, SimTime arrival)
+{
+	SimTime t = device.readyTime(arrival);
+
+	if (device.config.isrReceive)
+	{
+		device.enterLibrary(arrival);
+		hostSetMicros(arrival / 1000);
+		device.cab.processByteFromISR(value);
+	}
+
+	device.enterLibrary(t);
+	hostSetMicros(t / 1000);
+
+	if (device.config.isrReceive)
+		device.cab.processQueuedBytes();
+	else
+		device.cab.processByte(value);
+	if (device.config.kind == SIM_SMART_CAB)
+		device.cab.processResponseByte(value);
+
+	device.leaveLibrary();
+
+		// A device that just queued a poll reply is settled by runSlot() once
+		// it is known whether the reply made it onto the wire
+	if (device.txBytes.empty())
+		device.settleUSB(t, false);
+}
+
+SimTime SimBus::transmit(SimTime start, const uint8_t *bytes, uint8_t length, SimDevice *sender)
+{
+	SimTime t = start;
+
+	for (uint8_t i = 0; i < length; i++)
+	{
+		t += SIM_BYTE_TIME;
+		runEvents(t);
+
+		if (onWireByte)
+			onWireByte(t - SIM_BYTE_TIME, bytes[i]);
+
+			// /RE is tied to TE so the sender does not hear its own bytes
+		for (size_t d = 0; d < devices.size(); d++)
+			if (devices[d].get() != sender)
+				deliver(*devices[d], bytes[i], t);
+	}
+
+	return t;
+}
+
+void SimBus::runSlot(void)
+{
+	if (rotationIndex >= rotation.size())
+		buildRotation();
+
+	uint8_t address = rotation[rotationIndex++];
+	uint8_t poll = 0x80 | address;
+	SimDevice *polled = findDevice(address);
+
+	runEvents(clock);
+
+	for (size_t d = 0; d < devices.size(); d++)
+		devices[d]->txBytes.clear();
+
+	stats.polls++;
+	SimTime pollEnd = transmit(clock, &poll, 1, NULL);
+	SimTime t = pollEnd;
+
+	if (address == 0)
+	{
+		stats.broadcasts++;
+		t = sendFastClock(t);
+	}
+	else
+	{
+		bool replied = false;
+
+		if (polled)
+		{
+			polled->stats.polls++;
+
+			if (!polled->txBytes.empty())
+			{
+				uint32_t latencyUs = (uint32_t)((polled->txStart - pollEnd) / 1000);
+				polled->stats.replyLatencyUs.add(latencyUs);
+
+				if (latencyUs <= config.replyWindowUs)
+				{
+					std::vector<uint8_t> reply = polled->txBytes;
+					polled->txBytes.clear();
+					polled->stats.replies++;
+					active[address] = true;
+					replied = true;
+
+					t = transmit(polled->txStart, reply.data(), reply.size(), polled);
+					polled->settleUSB(t, false);
+					handleReply(polled, address, reply, t);
+				}
+				else
+				{
+						// Too late, the command station has moved on and the reply collides
+					polled->stats.lateReplies++;
+					polled->txBytes.clear();
+					polled->settleUSB(polled->txStart, true);
+				}
+			}
+		}
+
+		if (!replied)
+			t = pollEnd + SIM_US(config.replyWindowUs);
+
+		if (!pendingReplies[address].empty() && (pendingReplies[address].front().ready <= t))
+		{
+			PendingReply reply = pendingReplies[address].front();
+			pendingReplies[address].pop_front();
+			stats.repliesSent++;
+			t = transmit(t, reply.bytes.data(), reply.bytes.size(), NULL);
+		}
+	}
+
+	clock = t + SIM_US(config.interPollGapUs);
+}
+
+SimTime SimBus::sendLCDLine(uint8_t cmd, const char *text, SimTime t)
+{
+	uint8_t bytes[9];
+
+	bytes[0] = cmd;
+	for (uint8_t i = 0; i < 8; i++)
+		bytes[i + 1] = text[i] ? text[i] : ' ';
+
+	stats.lcdCommandsSent++;
+	return transmit(t, bytes, 9, NULL);
+}
+
+void SimBus::handleReply(SimDevice *device, uint8_t address, std::vector<uint8_t> &reply, SimTime &t)
+{
+	switch (device->config.kind)
+	{
+	case SIM_THROTTLE:
+		if (reply.size() >= 1)
+		{
+			uint8_t key = reply[0];
+
+			if (key == BTN_REP_LAST_LCD)
+			{
+				t = sendLCDLine(CMD_PR_1ST_LEFT, "NCE SIM ", t);
+				t = sendLCDLine(CMD_PR_1ST_RIGHT, " 12:00  ", t);
+				t = sendLCDLine(CMD_PR_2ND_LEFT, "L:0003  ", t);
+				t = sendLCDLine(CMD_PR_2ND_RIGHT, "SPD:000 ", t);
+			}
+			else if (key != BTN_NO_KEY_DN)
+			{
+				device->stats.keysReceived++;
+				t = sendLCDLine(CMD_PR_2ND_LEFT, "KEY     ", t);
+				t = sendLCDLine(CMD_PR_2ND_RIGHT, "ACCEPTED", t);
+			}
+		}
+		break;
+
+	case SIM_SMART_CAB:
+		if (reply.size() == 5)
+		{
+			stats.framesReceived++;
+			executeFrame(address, reply.data(), t);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+void SimBus::queueReply(uint8_t address, SimTime ready, const uint8_t *data, uint8_t count, uint8_t status)
+{
+	PendingReply reply;
+	reply.ready = ready;
+
+	if (count == 1)
+	{
+		reply.bytes.push_back(0xD8);
+		reply.bytes.push_back((status << 4) | (data[0] >> 6));
+		reply.bytes.push_back(data[0] & 0x3F);
+	}
+	else
+	{
+		reply.bytes.push_back(count == 2 ? 0xD9 : 0xDA);
+		for (uint8_t i = 0; i < count; i += 2)
+		{
+			reply.bytes.push_back(((i == 0) ? (status << 4) : 0) | (data[i] >> 4));
+			reply.bytes.push_back((data[i] & 0x0F) | ((data[i + 1] >> 6) << 4));
+			reply.bytes.push_back(data[i + 1] & 0x3F);
+		}
+	}
+
+	pendingReplies[address].push_back(reply);
+}
+
+void SimBus::executeFrame(uint8_t address, const uint8_t *frame, SimTime t)
+{
+	if ((frame[0] ^ frame[1] ^ frame[2] ^ frame[3]) != frame[4])
+	{
+		stats.badChecksums++;
+		return;
+	}
+
+	if (frame[0] != 0x4E)
+	{
+			// Loco, accessory and macro commands go straight to the track.
+			// Remember an ops mode address for the second frame that follows.
+		if ((frame[2] == 0) && (frame[3] == 0))
+			memcpy(lastOpsFrame, frame, sizeof(lastOpsFrame));
+		return;
+	}
+
+	uint8_t sub = frame[1];
+	uint16_t cv = ((sub & 0x0F) << 6) | (frame[2] >> 1);
+	uint8_t value = ((frame[2] & 0x01) << 7) | frame[3];
+
+	switch (sub & 0xF0)
+	{
+	case 0x20:	// Paged read
+	case 0x30:	// Direct read
+		{
+			std::map<uint16_t, uint8_t>::iterator it = progTrackCVs.find(cv);
+			uint8_t data = (it != progTrackCVs.end()) ? it->second : (cv == 1 ? 3 : 0);
+			queueReply(address, t + SIM_US(config.progReadUs), &data, 1, 0);
+		}
+		break;
+
+	case 0x40:	// Paged write
+	case 0x50:	// Direct write
+		progTrackCVs[cv] = value;
+		break;
+
+	case 0x60:	// Ops mode loco / accessory programming second frame
+	case 0x70:
+		break;
+
+	case 0x10:
+		switch (sub)
+		{
+		case 0x18:	// Set cab memory pointer
+			memCab = (frame[2] >> 1) & 0x3F;
+			memOffset = ((frame[2] & 0x01) << 7) | frame[3];
+			break;
+
+		case 0x19:
+			if (frame[2] <= 0x01)	// Write one byte
+				cabMemory[memCab][memOffset++] = ((frame[2] & 0x01) << 7) | frame[3];
+
+			else if (frame[2] == 0x02)	// Read 1, 2 or 4 bytes
+			{
+				uint8_t count = (frame[3] == 4) ? 4 : ((frame[3] == 2) ? 2 : 1);
+				uint8_t data[4];
+				for (uint8_t i = 0; i < count; i++)
+					data[i] = cabMemory[memCab][memOffset++];
+				queueReply(address, t, data, count, 0);
+			}
+			else if (frame[2] == 0x03)	// AIU status
+			{
+				SimDevice *aiu = findDevice(frame[3] & 0x3F);
+				uint16_t state = aiu ? aiu->cab.getAuiIoState() : 0;
+				uint8_t data[2] = { (uint8_t)(state >> 8), (uint8_t)(state & 0xFF) };
+				queueReply(address, t, data, 2, 0);
+			}
+			break;
+
+		case 0x1E:	// Register read
+			{
+				uint8_t data = 0;
+				queueReply(address, t + SIM_US(config.progReadUs), &data, 1, 0);
+			}
+			break;
+
+		default:	// Enter/exit programming track, register write
+			break;
+		}
+		break;
+	}
+}
+
+SimTime SimBus::sendFastClock(SimTime t)
+{
+	if (!config.fastClockRate)
+		return t;
+
+	if (!fastClockRateSent)
+	{
+		uint8_t bytes[2] = { FAST_CLOCK_RATE_BCAST, config.fastClockRate };
+		fastClockRateSent = true;
+		t = transmit(t, bytes, 2, NULL);
+	}
+
+		// Fast time starts at 06:00 in 24 hour mode
+	uint32_t fastMinutes = (uint32_t)(t / SIM_SEC(1) * config.fastClockRate / 60) + (6 * 60);
+	if ((int32_t)fastMinutes != lastFastMinute)
+	{
+		uint8_t hours = (fastMinutes / 60) % 24;
+		uint8_t minutes = fastMinutes % 60;
+		uint8_t bytes[9] =
+		{
+			FAST_CLOCK_BCAST, ' ',
+			(uint8_t)('0' + hours / 10), (uint8_t)('0' + hours % 10), ':',
+			(uint8_t)('0' + minutes / 10), (uint8_t)('0' + minutes % 10), ' ', ' '
+		};
+
+		lastFastMinute = fastMinutes;
+		t = transmit(t, bytes, 9, NULL);
+	}
+
+	return t;
+}
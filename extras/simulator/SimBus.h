@@ -0,0 +1,285 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Simulator
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      SimBus.h
+// purpose:   Deterministic discrete-event model of a NCE Cab Bus.
+//
+//            The RS485 wire runs at 9600 baud 8N2 so every byte takes
+//            11 bit times. A command station model polls the attached
+//            NceCabBus instances, enforces the reply window, executes
+//            smart cab commands against virtual decoders and answers
+//            CV / memory reads with 0xD8-0xDA reply frames.
+//
+//            All times are virtual nanoseconds, nothing depends on the
+//            host clock so a run with the same seed is repeatable.
+//
+//------------------------------------------------------------------------
+
+#ifndef NCE_SIM_BUS_H
+#define NCE_SIM_BUS_H
+
+#include <NceCabBus.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <vector>
+
+typedef uint64_t SimTime;	// Virtual time in nanoseconds
+
+#define SIM_US(us)		((SimTime)(us) * 1000)
+#define SIM_MS(ms)		((SimTime)(ms) * 1000000)
+#define SIM_SEC(s)		((SimTime)(s) * 1000000000)
+
+// 1 Start + 8 Data + 2 Stop bits at 9600 baud
+#define SIM_BYTE_TIME	((SimTime)11 * 1000000000 / 9600)
+
+typedef enum
+{
+	SIM_THROTTLE = 0,
+	SIM_AIU,
+	SIM_FAST_CLOCK,
+	SIM_SMART_CAB,
+} SIM_DEVICE_KIND;
+
+class SimRandom
+{
+  public:
+	SimRandom(uint64_t seed) : state(seed ? seed : 0x9E3779B97F4A7C15ULL) {}
+
+	uint64_t next(void)
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 0x2545F4914F6CDD1DULL;
+	}
+
+	uint32_t range(uint32_t lo, uint32_t hi)	// inclusive
+	{
+		return lo + (uint32_t)(next() % ((uint64_t)hi - lo + 1));
+	}
+
+	// Exponentially distributed interval for a Poisson process of rate events/sec
+	SimTime interval(double ratePerSec);
+
+  private:
+	uint64_t state;
+};
+
+class SimLatency
+{
+  public:
+	void add(uint32_t us) { samples.push_back(us); }
+	size_t count(void) const { return samples.size(); }
+	uint32_t percentile(double p);
+	uint32_t max(void);
+
+  private:
+	std::vector<uint32_t> samples;
+	bool sorted = false;
+};
+
+typedef struct
+{
+	SIM_DEVICE_KIND kind;
+	uint8_t address;
+	uint32_t turnaroundUs;	// delayMicroseconds() in the sketch RS485 send handler
+	uint32_t loopPeriodUs;	// The sketch spends loopWorkUs doing other work every loopPeriodUs,
+	uint32_t loopWorkUs;	// bytes that arrive meanwhile wait in the UART buffer
+	bool     isrReceive;	// Answer polls from the RX interrupt, only the queued bytes wait for loop()
+	uint8_t  extraAddresses;	// Smart cab also answers the next n addresses, needs NCE_CAB_BUS_SMART_CAB_ADDRESSES > n
+} SimDeviceConfig;
+
+typedef struct
+{
+	uint32_t polls;
+	uint32_t replies;
+	uint32_t lateReplies;	// Started after the reply window closed and collided
+	SimLatency replyLatencyUs;
+
+	uint32_t keysPressed;
+	uint32_t keysReceived;	// Seen by the command station
+	uint32_t lcdUpdates;
+	uint32_t fastClockUpdates;
+
+	uint32_t usbSubmitted;
+	uint32_t usbCompleted;
+	uint32_t usbLost;		// Acknowledged to JMRI but the frame never reached the command station
+	uint32_t usbTimedOut;	// Never answered, JMRI gave up waiting
+	SimLatency usbLatencyUs;	// JMRI command to track (or to reply for reads)
+} SimDeviceStats;
+
+class SimBus;
+
+class SimDevice : public NceCabBusListener<SimDevice>
+{
+  public:
+	SimDevice(SimBus &bus, const SimDeviceConfig &config, uint32_t phaseUs);
+
+	NceCabBus cab;
+	SimDeviceConfig config;
+	SimDeviceStats stats;
+
+	void pressKey(SimTime when, uint8_t key);
+	void setSpeedKnob(SimTime when, uint8_t speed);
+	void setAiuBit(SimTime when, uint8_t ioNum, bool state);
+	void submitUSB(SimTime when, const uint8_t *cmd, uint8_t length, uint8_t responseLength);
+	void injectUSB(const uint8_t *bytes, uint8_t length);	// Raw USB bytes from an outside client, processed now
+
+	uint32_t usbOutstanding(void) const { return usbInFlight; }
+
+		// Called when a USB command has received its complete response or timed out
+	std::function<void(SimDevice &device, SimTime when)> onUSBComplete;
+
+		// Called with every USB response byte the library sends
+	std::function<void(SimDevice &device, const uint8_t *values, uint8_t length)> onUSBBytes;
+
+		// Library handlers, bound to this device with attachCabBus()
+	void sendRS485Bytes(uint8_t *values, uint8_t length);
+	void sendUSBBytes(uint8_t *values, uint8_t length);
+	void fastClock(uint8_t Hours, uint8_t Minutes, uint8_t Rate, FAST_CLOCK_MODE Mode);
+	void lcdUpdate(uint8_t Col, uint8_t Row, char *msg, uint8_t len);
+	void lcdPrintChar(char ch, bool advanceCursor);
+
+	std::vector<uint8_t> txBytes;	// Reply captured from the RS485 send handler
+	SimTime txStart;
+
+  private:
+	friend class SimBus;
+
+	typedef struct
+	{
+		uint32_t id;
+		SimTime submitted;
+		uint8_t responseLength;
+		uint8_t received;
+	} UsbRequest;
+
+	SimBus &bus;
+	uint32_t phaseUs;
+	bool inLibrary;			// Library code is running for this device, its handlers are live
+	SimTime libraryTime;	// Virtual time of that call
+
+	std::deque<UsbRequest> usbQueue;
+	uint32_t usbInFlight;
+	uint32_t usbNextId;
+	uint8_t usbBytesThisCall;
+
+	SimTime readyTime(SimTime arrival) const;
+	void enterLibrary(SimTime when) { inLibrary = true; libraryTime = when; }
+	void leaveLibrary(void) { inLibrary = false; }
+	void settleUSB(SimTime when, bool lost);
+};
+
+typedef struct
+{
+	uint32_t replyWindowUs;		// Time the command station waits for the first reply byte
+	uint32_t interPollGapUs;	// Command station turnaround between slots
+	uint8_t  fastClockRate;		// n:1, 0 disables the fast clock broadcasts
+	uint32_t progReadUs;		// Programming track CV read time
+	uint32_t usbTimeoutUs;		// JMRI gives up on a command after this long
+	bool     probeInactive;		// Poll one unused address per rotation like a real command station
+} SimBusConfig;
+
+typedef struct
+{
+	uint64_t polls;
+	uint64_t rotations;
+	uint64_t framesReceived;
+	uint64_t badChecksums;
+	uint64_t repliesSent;
+	uint64_t lcdCommandsSent;
+	uint64_t broadcasts;
+	SimLatency rotationUs;
+} SimBusStats;
+
+class SimBus
+{
+  public:
+	SimBus(const SimBusConfig &config);
+	~SimBus();
+
+	SimDevice &addDevice(const SimDeviceConfig &config, uint32_t phaseUs);
+	std::vector<std::unique_ptr<SimDevice> > &getDevices(void) { return devices; }
+
+	void schedule(SimTime when, std::function<void()> action);
+	void runUntil(SimTime end);
+	SimTime now(void) const { return clock; }
+
+	SimBusConfig config;
+	SimBusStats stats;
+
+		// Called with every byte put on the wire and the time it started, e.g. to write a capture
+	std::function<void(SimTime start, uint8_t value)> onWireByte;
+
+  private:
+	friend class SimDevice;
+
+	typedef struct
+	{
+		SimTime when;
+		uint64_t seq;
+		std::function<void()> action;
+	} Event;
+
+	struct EventLater
+	{
+		bool operator()(const Event &a, const Event &b) const
+		{
+			return (a.when > b.when) || ((a.when == b.when) && (a.seq > b.seq));
+		}
+	};
+
+	typedef struct
+	{
+		SimTime ready;
+		std::vector<uint8_t> bytes;
+	} PendingReply;
+
+	std::vector<std::unique_ptr<SimDevice> > devices;
+	std::priority_queue<Event, std::vector<Event>, EventLater> events;
+	uint64_t eventSeq;
+	SimTime clock;
+
+		// Command station state
+	bool active[64];
+	uint8_t rotationIndex;
+	uint8_t probeAddress;
+	std::vector<uint8_t> rotation;
+	SimTime rotationStart;
+	int32_t lastFastMinute;
+	bool fastClockRateSent;
+	std::deque<PendingReply> pendingReplies[64];
+	std::map<uint16_t, uint8_t> progTrackCVs;
+	uint8_t cabMemory[64][256];
+	uint8_t memCab;
+	uint8_t memOffset;
+	uint8_t lastOpsFrame[5];
+
+	void runEvents(SimTime upTo);
+	void runSlot(void);
+	void buildRotation(void);
+	SimTime transmit(SimTime start, const uint8_t *bytes, uint8_t length, SimDevice *sender);
+	void deliver(SimDevice &device, uint8_t value, SimTime arrival);
+	SimDevice *findDevice(uint8_t address);
+
+	void handleReply(SimDevice *device, uint8_t address, std::vector<uint8_t> &reply, SimTime &t);
+	void executeFrame(uint8_t address, const uint8_t *frame, SimTime t);
+	void queueReply(uint8_t address, SimTime ready, const uint8_t *data, uint8_t count, uint8_t status);
+	SimTime sendLCDLine(uint8_t cmd, const char *text, SimTime t);
+	SimTime sendFastClock(SimTime t);
+};
+
+#endif
@@ -0,0 +1,55 @@
+#!/bin/sh
+#------------------------------------------------------------------------
+#
+# Model Railroading with Arduino - NceCabBus example build size report
+#
+# Compiles every example with arduino-cli for the board it was developed
+# on, once as shipped and once with the library debug logger enabled
+# (-DDEBUG_LIBRARY), and reports the Flash and SRAM (global variables)
+# each build uses. The results are also written to a CSV file so they
+# can be compared between commits.
+#
+# usage:     extras/size-report/size-report.sh [size-report.csv]
+#
+# needs:     arduino-cli with the arduino:avr core and the libraries the
+#            examples use (Bounce2, Keypad, SSD1306Ascii, Adafruit GFX and
+#            LED Backpack) installed.
+#
+#------------------------------------------------------------------------
+
+REPO_DIR=$(cd "$(dirname "$0")/../.." && pwd)
+OUT=${1:-size-report.csv}
+
+board_for()
+{
+	case "$1" in
+		*ProMini*)		echo arduino:avr:pro:cpu=16MHzatmega328 ;;
+		*Mega-Dual*)	echo arduino:avr:mega ;;
+		*)				echo arduino:avr:leonardo ;;	# Pro Micro, ATmega32U4
+	esac
+}
+
+# Print "flash sram" for one build, or "- -" if it failed
+build_size()
+{
+	arduino-cli compile --fqbn "$1" --library "$REPO_DIR" \
+		--build-property "compiler.cpp.extra_flags=$3" "$2" 2>&1 |
+	awk '
+		/Sketch uses/		{ flash = $3 }
+		/Global variables use/	{ sram = $4 }
+		END { if (flash == "" || sram == "") print "- -"; else print flash, sram }'
+}
+
+echo "example,board,flash,sram,flash_debug,sram_debug" > "$OUT"
+printf '%-32s %-24s %8s %8s %12s %12s\n' Example Board Flash SRAM "Flash debug" "SRAM debug"
+
+for sketch in "$REPO_DIR"/examples/*/; do
+	name=$(basename "$sketch")
+	fqbn=$(board_for "$name")
+	set -- $(build_size "$fqbn" "$sketch" "") $(build_size "$fqbn" "$sketch" "-DDEBUG_LIBRARY")
+
+	printf '%-32s %-24s %8s %8s %12s %12s\n' "$name" "$fqbn" "$1" "$2" "$3" "$4"
+	echo "$name,$fqbn,$1,$2,$3,$4" >> "$OUT"
+done
+
+echo "Results written to $OUT"
@@ -0,0 +1,650 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus TCP Server
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      CabBusServer.cpp
+// purpose:   Share one smart cab between several programs. Each TCP client
+//            speaks the same binary protocol as the NCE USB Interface, e.g.
+//            JMRI set to "NCE Network" pointed at this port. Complete
+//            commands are taken from the clients in turn, one at a time,
+//            and the response bytes go back to the client that sent the
+//            command.
+//
+//            The smart cab runs on the PC and talks to the Cab Bus through
+//            an RS485 adapter given with --serial, or with --sim to the
+//            simulated command station from extras/simulator in real
+//            time, which is enough to try clients out on loopback.
+//
+//            With --offload the Cab Bus is reached through a USB attached
+//            MCU running NceCabBusBridge (examples/Offload-Bridge-M32U4),
+//            which answers our polls itself so USB latency does not count
+//            against the reply window.
+//
+//            Several buses can be served from one process, each with its
+//            own smart cab, clients and port, and each on its own thread:
+//            give --sim, --serial or --offload once per bus, followed by
+//            its --address and --port. A later bus takes the next port.
+//
+//            A USB serial adapter has to answer a poll within 800us, so
+//            set its latency timer to 1ms, e.g. for FTDI:
+//              echo 1 > /sys/bus/usb-serial/devices/ttyUSB0/latency_timer
+//
+// build:     g++ -std=c++17 -O2 -DARDUINO=10819 -Iextras/host -Isrc
+//              -Iextras/simulator -Iextras/offload
+//              -pthread extras/tcp-server/CabBusServer.cpp extras/simulator/SimBus.cpp
+//              extras/offload/CabBusOffloadHost.cpp extras/host/HostArduino.cpp
+//              src/*.cpp -o cabbus-server
+//
+// usage:     cabbus-server --sim [--port 5050]
+//            cabbus-server --serial /dev/ttyUSB0 --address 2 [--port 5050]
+//            cabbus-server --offload /dev/ttyACM0 --address 2 [--port 5050]
+//            cabbus-server --offload /dev/ttyACM0 --offload /dev/ttyACM1
+//              --offload /dev/ttyACM2 --port 5052
+//
+//------------------------------------------------------------------------
+
+#include "SimBus.h"
+#include "CabBusOffloadHost.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#define SERVER_COMMAND_TIMEOUT_MS	2000	// Same as JMRI, a command station that never replies
+#define SERVER_CLIENT_BACKLOG		64		// Commands a client may queue before it is throttled
+
+typedef struct
+{
+	int fd;
+	uint32_t id;
+	std::vector<uint8_t> partial;					// Bytes of a command still arriving
+	std::deque<std::vector<uint8_t> > commands;		// Complete commands waiting their turn
+	uint32_t sent;
+	uint32_t timedOut;
+} ServerClient;
+
+typedef struct
+{
+	uint16_t port;
+	const char *serialPath;
+	bool offload;					// serialPath is an NceCabBusBridge
+	bool sim;
+	uint8_t cabAddress;
+} ServerBusOptions;
+
+typedef struct
+{
+	bool anyAddress;
+	bool verbose;
+	std::vector<ServerBusOptions> buses;
+} ServerOptions;
+
+static uint64_t elapsedUs(std::chrono::steady_clock::time_point since)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+static int openSerial(const char *path)
+{
+	int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (fd < 0)
+	{
+		perror(path);
+		return -1;
+	}
+
+	struct termios tio;
+	memset(&tio, 0, sizeof(tio));
+	tio.c_cflag = CS8 | CSTOPB | CREAD | CLOCAL;	// Cab Bus is 9600 8N2
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, B9600);
+	cfsetospeed(&tio, B9600);
+
+	if (tcsetattr(fd, TCSANOW, &tio) < 0)
+	{
+		perror("tcsetattr");
+		close(fd);
+		return -1;
+	}
+
+	tcflush(fd, TCIOFLUSH);
+	return fd;
+}
+
+static int openListener(uint16_t port, bool anyAddress)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		perror("socket");
+		return -1;
+	}
+
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(anyAddress ? INADDR_ANY : INADDR_LOOPBACK);
+
+	if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) || (listen(fd, 8) < 0))
+	{
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+	// Split the client's byte stream into whole commands using the USB command lengths
+static void addClientBytes(ServerClient &client, const uint8_t *bytes, size_t length)
+{
+	for (size_t i = 0; i < length; i++)
+	{
+		client.partial.push_back(bytes[i]);
+
+		int8_t commandLength = getUSBCommandLength(client.partial[0]);
+		if (commandLength < 1)
+			commandLength = 1;	// The smart cab answers unknown opcodes with Not Supported
+
+		if (client.partial.size() >= (size_t)commandLength)
+		{
+			client.commands.push_back(client.partial);
+			client.partial.clear();
+		}
+	}
+}
+
+class ServerBus
+{
+  public:
+	virtual ~ServerBus() {}
+	virtual NceCabBus &cab(void) = 0;
+	virtual void sendUSB(const uint8_t *bytes, uint8_t length) = 0;
+	virtual int pollFd(void) { return -1; }
+	virtual int pollTimeoutMs(void) { return 10; }
+	virtual void run(void) = 0;
+};
+
+	// One bus with its TCP port and clients, everything a server thread touches
+class ServerSession
+{
+  public:
+	ServerSession(const ServerBusOptions &options, bool anyAddress, bool verbose);
+
+	bool open(void);
+	void run(void);
+
+		// A response byte from the smart cab, goes to the client whose command is in flight
+	void routeUSBBytes(const uint8_t *values, uint8_t length);
+
+  private:
+	ServerBusOptions options;
+	bool anyAddress;
+	bool verbose;
+
+	std::unique_ptr<ServerBus> bus;
+	int listenFd;
+
+	std::vector<std::unique_ptr<ServerClient> > clients;
+	uint32_t nextClientId;
+	size_t nextClient;				// Round robin position
+
+	bool inFlight;					// A command has been given to the smart cab
+	uint32_t ownerId;				// Client that sent it, 0 once it has gone
+	std::chrono::steady_clock::time_point inFlightSince;
+	uint32_t orphanBytes;			// Response bytes with nobody to send them to
+
+	ServerClient *findClient(uint32_t id);
+	void acceptClient(void);
+	void removeClient(size_t index);
+	void serviceCommands(void);
+};
+
+	// Library on the PC, Cab Bus through an RS485 adapter
+class SerialServerBus : public ServerBus, public NceCabBusListener<SerialServerBus>
+{
+  public:
+	SerialServerBus(ServerSession &session, int fd, uint8_t address) : session(session), serialFd(fd)
+	{
+		smartCab.setCabType(CAB_TYPE_SMART);
+		smartCab.setCabAddress(address);
+		attachCabBus(smartCab);
+	}
+
+	~SerialServerBus() { close(serialFd); }
+
+	NceCabBus &cab(void) { return smartCab; }
+	int pollFd(void) { return serialFd; }
+
+	void sendUSB(const uint8_t *bytes, uint8_t length)
+	{
+		for (uint8_t i = 0; i < length; i++)
+			smartCab.processUSBByte(bytes[i]);
+	}
+
+	void run(void)
+	{
+		uint8_t buffer[64];
+		ssize_t count;
+
+		while ((count = read(serialFd, buffer, sizeof(buffer))) > 0)
+		{
+			for (ssize_t i = 0; i < count; i++)
+			{
+				smartCab.processByte(buffer[i]);
+				smartCab.processResponseByte(buffer[i]);
+			}
+		}
+	}
+
+	void sendRS485Bytes(uint8_t *values, uint8_t length)
+	{
+		if (write(serialFd, values, length) != length)
+			perror("serial write");
+	}
+
+	void sendUSBBytes(uint8_t *values, uint8_t length)
+	{
+		session.routeUSBBytes(values, length);
+	}
+
+  private:
+	ServerSession &session;
+	int serialFd;
+	NceCabBus smartCab;
+};
+
+	// Library on the PC, Cab Bus through an NceCabBusBridge that answers our polls
+class OffloadServerBus : public ServerBus, public NceCabBusListener<OffloadServerBus>
+{
+  public:
+	OffloadServerBus(ServerSession &session, int fd, uint8_t address)
+		: session(session), serialFd(fd), host(smartCab, [fd](const uint8_t *bytes, size_t length)
+		{
+			if (write(fd, bytes, length) != (ssize_t)length)
+				perror("bridge write");
+		})
+	{
+		smartCab.setCabType(CAB_TYPE_SMART);
+		smartCab.setCabAddress(address);
+		attachCabBus(smartCab);
+		host.begin(1ULL << address);
+	}
+
+	~OffloadServerBus() { close(serialFd); }
+
+	NceCabBus &cab(void) { return smartCab; }
+	int pollFd(void) { return serialFd; }
+
+	void sendUSB(const uint8_t *bytes, uint8_t length)
+	{
+		for (uint8_t i = 0; i < length; i++)
+			smartCab.processUSBByte(bytes[i]);
+
+		host.update();
+	}
+
+	void run(void)
+	{
+		uint8_t buffer[256];
+		ssize_t count;
+
+		while ((count = read(serialFd, buffer, sizeof(buffer))) > 0)
+			host.receive(buffer, count);
+	}
+
+	void sendUSBBytes(uint8_t *values, uint8_t length)
+	{
+		session.routeUSBBytes(values, length);
+	}
+
+  private:
+	ServerSession &session;
+	int serialFd;
+	NceCabBus smartCab;
+	CabBusOffloadHost host;
+};
+
+	// Simulated command station from extras/simulator kept in step with the wall clock
+class SimServerBus : public ServerBus
+{
+  public:
+	SimServerBus(ServerSession &session, uint8_t address) : bus(simConfig())
+	{
+		SimDeviceConfig config;
+		memset(&config, 0, sizeof(config));
+		config.kind = SIM_SMART_CAB;
+		config.address = address;
+		config.turnaroundUs = 200;
+
+		device = &bus.addDevice(config, 0);
+		device->onUSBBytes = [&session](SimDevice &, const uint8_t *values, uint8_t length) { session.routeUSBBytes(values, length); };
+		start = std::chrono::steady_clock::now();
+	}
+
+	NceCabBus &cab(void) { return device->cab; }
+	int pollTimeoutMs(void) { return 1; }
+
+	void sendUSB(const uint8_t *bytes, uint8_t length)
+	{
+		device->injectUSB(bytes, length);
+	}
+
+	void run(void)
+	{
+		bus.runUntil(SIM_US(elapsedUs(start)));
+	}
+
+  private:
+	SimBus bus;
+	SimDevice *device;
+	std::chrono::steady_clock::time_point start;
+
+	static SimBusConfig simConfig(void)
+	{
+		SimBusConfig config;
+		config.replyWindowUs = 800;
+		config.interPollGapUs = 100;
+		config.fastClockRate = 0;
+		config.progReadUs = 250000;
+		config.usbTimeoutUs = SERVER_COMMAND_TIMEOUT_MS * 1000;
+		config.probeInactive = true;
+		return config;
+	}
+};
+
+ServerSession::ServerSession(const ServerBusOptions &options, bool anyAddress, bool verbose)
+	: options(options), anyAddress(anyAddress), verbose(verbose), listenFd(-1), nextClientId(1), nextClient(0),
+	  inFlight(false), ownerId(0), orphanBytes(0)
+{
+}
+
+bool ServerSession::open(void)
+{
+	if (options.sim)
+		bus.reset(new SimServerBus(*this, options.cabAddress));
+	else
+	{
+		int fd = openSerial(options.serialPath);
+		if (fd < 0)
+			return false;
+		if (options.offload)
+			bus.reset(new OffloadServerBus(*this, fd, options.cabAddress));
+		else
+			bus.reset(new SerialServerBus(*this, fd, options.cabAddress));
+	}
+
+	listenFd = openListener(options.port, anyAddress);
+	if (listenFd < 0)
+		return false;
+
+	fprintf(stderr, "listening on port %u for %s\n", options.port, options.sim ? "the simulated bus" : options.serialPath);
+	return true;
+}
+
+ServerClient *ServerSession::findClient(uint32_t id)
+{
+	for (size_t i = 0; i < clients.size(); i++)
+		if (clients[i]->id == id)
+			return clients[i].get();
+
+	return NULL;
+}
+
+void ServerSession::routeUSBBytes(const uint8_t *values, uint8_t length)
+{
+	ServerClient *client = inFlight ? findClient(ownerId) : NULL;
+
+	if (!client)
+	{
+		orphanBytes += length;
+		return;
+	}
+
+	if (send(client->fd, values, length, MSG_NOSIGNAL) < 0)
+		perror("send");
+}
+
+void ServerSession::acceptClient(void)
+{
+	int fd = accept(listenFd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+		// Responses are a byte or two, send them straight away
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	std::unique_ptr<ServerClient> client(new ServerClient());
+	client->fd = fd;
+	client->id = nextClientId++;
+	client->sent = 0;
+	client->timedOut = 0;
+
+	if (verbose)
+		fprintf(stderr, "port %u: client %u connected\n", options.port, client->id);
+
+	clients.push_back(std::move(client));
+}
+
+void ServerSession::removeClient(size_t index)
+{
+	ServerClient &client = *clients[index];
+
+	if (verbose)
+		fprintf(stderr, "port %u: client %u closed, %u commands sent, %u timed out\n", options.port, client.id, client.sent, client.timedOut);
+
+	close(client.fd);
+	clients.erase(clients.begin() + index);
+
+	if (nextClient > index)
+		nextClient--;
+}
+
+	// Finish the command in flight once the smart cab has sent its whole response, then
+	// start the next one from the client after the last one served
+void ServerSession::serviceCommands(void)
+{
+	for (;;)
+	{
+		if (inFlight)
+		{
+			if (bus->cab().isUSBCommandPending())
+			{
+				if (elapsedUs(inFlightSince) < (uint64_t)SERVER_COMMAND_TIMEOUT_MS * 1000)
+					return;
+
+					// The client gets no response, as from a real interface, and the
+					// next command starts a new one in the smart cab
+				ServerClient *owner = findClient(ownerId);
+				if (owner)
+					owner->timedOut++;
+				if (verbose)
+					fprintf(stderr, "port %u: client %u command timed out\n", options.port, ownerId);
+			}
+			inFlight = false;
+		}
+
+		ServerClient *client = NULL;
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+			size_t index = (nextClient + i) % clients.size();
+			if (!clients[index]->commands.empty())
+			{
+				client = clients[index].get();
+				nextClient = index + 1;
+				break;
+			}
+		}
+
+		if (!client)
+			return;
+
+		std::vector<uint8_t> command = client->commands.front();
+		client->commands.pop_front();
+		client->sent++;
+
+		inFlight = true;
+		ownerId = client->id;
+		inFlightSince = std::chrono::steady_clock::now();
+		bus->sendUSB(command.data(), command.size());
+	}
+}
+
+void ServerSession::run(void)
+{
+		// A real bus runs on the wall clock, a simulated one keeps its virtual time. The
+		// setting is per thread so one does not change the other
+	if (!options.sim)
+		hostUseRealClock(true);
+
+	std::vector<struct pollfd> fds;
+	for (;;)
+	{
+		fds.clear();
+		fds.push_back({ listenFd, POLLIN, 0 });
+		if (bus->pollFd() >= 0)
+			fds.push_back({ bus->pollFd(), POLLIN, 0 });
+
+		size_t firstClient = fds.size();
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+				// Stop reading a client that is far ahead of the bus, TCP then holds it back
+			short events = (clients[i]->commands.size() < SERVER_CLIENT_BACKLOG) ? POLLIN : 0;
+			fds.push_back({ clients[i]->fd, events, 0 });
+		}
+
+		if ((poll(fds.data(), fds.size(), bus->pollTimeoutMs()) < 0) && (errno != EINTR))
+		{
+			perror("poll");
+			return;
+		}
+
+		bus->run();
+		serviceCommands();
+
+		for (size_t i = clients.size(); i-- > 0; )
+		{
+			struct pollfd &pfd = fds[firstClient + i];
+			if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			uint8_t buffer[256];
+			ssize_t count = recv(pfd.fd, buffer, sizeof(buffer), 0);
+			if (count <= 0)
+				removeClient(i);
+			else
+				addClientBytes(*clients[i], buffer, count);
+		}
+
+		if (fds[0].revents & POLLIN)
+			acceptClient();
+
+		serviceCommands();
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: cabbus-server (--sim | --serial DEVICE | --offload DEVICE) [options] ...\n"
+		"  --sim                run against the simulated command station\n"
+		"  --serial DEVICE      RS485 adapter on the Cab Bus\n"
+		"  --offload DEVICE     NceCabBusBridge on the Cab Bus\n"
+		"  --address N          smart cab address (default 2)\n"
+		"  --port N             TCP port (default 5050, a later bus the next port)\n"
+		"  --any                accept clients from other hosts, not just loopback\n"
+		"  --verbose            log clients and timeouts\n"
+		"Give --sim, --serial or --offload once for each bus, --address and --port\n"
+		"apply to the bus before them, or to the first bus if given before it.\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	ServerOptions opt;
+	opt.anyAddress = false;
+	opt.verbose = false;
+
+	ServerBusOptions bus = { 5050, NULL, false, false, 2 };
+	bool busGiven = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		bool newBus = !strcmp(argv[i], "--sim") ||
+			((!strcmp(argv[i], "--serial") || !strcmp(argv[i], "--offload")) && (i + 1 < argc));
+
+		if (newBus)
+		{
+			if (busGiven)
+			{
+				opt.buses.push_back(bus);
+				bus.port++;
+			}
+			busGiven = true;
+			bus.sim = !strcmp(argv[i], "--sim");
+			bus.offload = !strcmp(argv[i], "--offload");
+			bus.serialPath = bus.sim ? NULL : argv[++i];
+		}
+		else if (!strcmp(argv[i], "--address") && (i + 1 < argc))
+			bus.cabAddress = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--port") && (i + 1 < argc))
+			bus.port = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--any"))
+			opt.anyAddress = true;
+		else if (!strcmp(argv[i], "--verbose"))
+			opt.verbose = true;
+		else
+			usage();
+	}
+
+	if (!busGiven)
+		usage();
+	opt.buses.push_back(bus);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	std::vector<std::unique_ptr<ServerSession> > sessions;
+	for (size_t i = 0; i < opt.buses.size(); i++)
+	{
+		sessions.push_back(std::unique_ptr<ServerSession>(new ServerSession(opt.buses[i], opt.anyAddress, opt.verbose)));
+		if (!sessions.back()->open())
+			return 1;
+	}
+
+		// Nothing is shared between the buses, each runs on its own thread
+	for (size_t i = 1; i < sessions.size(); i++)
+		std::thread(&ServerSession::run, sessions[i].get()).detach();
+
+	sessions[0]->run();
+	return 1;
+}
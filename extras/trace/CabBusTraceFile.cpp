@@ -0,0 +1,322 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Trace File
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+
+#include "CabBusTraceFile.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Same framing as the Cab Bus itself, see NceCabBus.h
+#define TRACE_TYPE_MASK		0xC0
+#define TRACE_TYPE_POLL		0x80
+#define TRACE_TYPE_CMD		0xC0
+#define TRACE_ADDRESS_MASK	0x3F
+
+static_assert(sizeof(CabBusTraceRecord) == 32, "records must stay 32 bytes");
+static_assert(sizeof(CabBusTraceHeader) <= CAB_BUS_TRACE_HEADER_SIZE, "header does not fit");
+
+CabBusTraceWriter::CabBusTraceWriter()
+{
+	file = NULL;
+	frame.length = 0;
+	nextKind = TRACE_FRAME_COMMAND;
+	polledAddress = 0;
+	recordCount = 0;
+}
+
+CabBusTraceWriter::~CabBusTraceWriter()
+{
+	if (file)
+		close();
+}
+
+bool CabBusTraceWriter::open(const char *path)
+{
+	file = fopen(path, "wb");
+	if (!file)
+		return false;
+
+	uint8_t header[CAB_BUS_TRACE_HEADER_SIZE];
+	memset(header, 0, sizeof(header));
+	fwrite(header, sizeof(header), 1, file);	// Filled in by close()
+
+	frame.length = 0;
+	nextKind = TRACE_FRAME_COMMAND;
+	polledAddress = 0;
+	recordCount = 0;
+	block.clear();
+	blockTimes.clear();
+	for (uint8_t a = 0; a < CAB_BUS_TRACE_ADDRESSES; a++)
+		postings[a].clear();
+
+	return true;
+}
+
+	// A poll starts a frame of its own, the bytes after it up to the next command
+	// byte are the cab's reply and a command byte runs up to the next poll or command
+void CabBusTraceWriter::addByte(uint64_t timeUs, uint8_t value)
+{
+	if (!file)
+		return;
+
+	if ((value & TRACE_TYPE_MASK) == TRACE_TYPE_POLL)
+	{
+		polledAddress = value & TRACE_ADDRESS_MASK;
+		startFrame(timeUs, TRACE_FRAME_POLL);
+		frame.data[frame.length++] = value;
+		endFrame();
+		nextKind = TRACE_FRAME_REPLY;
+		return;
+	}
+
+	if ((value & TRACE_TYPE_MASK) == TRACE_TYPE_CMD)
+	{
+		startFrame(timeUs, TRACE_FRAME_COMMAND);
+		nextKind = TRACE_FRAME_COMMAND;
+	}
+	else if (!frame.length || (frame.length == CAB_BUS_TRACE_FRAME_MAX))
+		startFrame(timeUs, (TRACE_FRAME_KIND)nextKind);
+
+	frame.data[frame.length++] = value;
+}
+
+void CabBusTraceWriter::startFrame(uint64_t timeUs, TRACE_FRAME_KIND kind)
+{
+	endFrame();
+
+	memset(&frame, 0, sizeof(frame));
+	frame.timeUs = timeUs;
+	frame.address = polledAddress;
+	frame.kind = kind;
+}
+
+void CabBusTraceWriter::endFrame(void)
+{
+	if (!frame.length)
+		return;
+
+	if (block.empty())
+		blockTimes.push_back(frame.timeUs);
+
+	std::vector<uint32_t> &blocks = postings[frame.address];
+	uint32_t blockNumber = blockTimes.size() - 1;
+	if (blocks.empty() || (blocks.back() != blockNumber))
+		blocks.push_back(blockNumber);
+
+	block.push_back(frame);
+	recordCount++;
+	frame.length = 0;
+
+	if (block.size() == CAB_BUS_TRACE_BLOCK_RECORDS)
+		writeBlock();
+}
+
+void CabBusTraceWriter::writeBlock(void)
+{
+	if (!block.empty())
+		fwrite(&block[0], sizeof(CabBusTraceRecord), block.size(), file);
+	block.clear();
+}
+
+	// Writes the indexes and the header, returns false if anything failed to write
+bool CabBusTraceWriter::close(void)
+{
+	if (!file)
+		return false;
+
+	endFrame();
+	writeBlock();
+
+	CabBusTraceHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CAB_BUS_TRACE_MAGIC, sizeof(CAB_BUS_TRACE_MAGIC));
+	header.version = CAB_BUS_TRACE_VERSION;
+	header.recordSize = sizeof(CabBusTraceRecord);
+	header.blockRecords = CAB_BUS_TRACE_BLOCK_RECORDS;
+	header.addressCount = CAB_BUS_TRACE_ADDRESSES;
+	header.recordCount = recordCount;
+	header.blockCount = blockTimes.size();
+	header.timeIndexOffset = CAB_BUS_TRACE_HEADER_SIZE + (recordCount * sizeof(CabBusTraceRecord));
+	header.postingOffset = header.timeIndexOffset + (blockTimes.size() * sizeof(uint64_t));
+
+	if (!blockTimes.empty())
+		fwrite(&blockTimes[0], sizeof(uint64_t), blockTimes.size(), file);
+
+	for (uint8_t a = 0; a < CAB_BUS_TRACE_ADDRESSES; a++)
+	{
+		header.postingStart[a + 1] = header.postingStart[a] + postings[a].size();
+		if (!postings[a].empty())
+			fwrite(&postings[a][0], sizeof(uint32_t), postings[a].size(), file);
+	}
+
+	bool ok = (fseek(file, 0, SEEK_SET) == 0) && (fwrite(&header, sizeof(header), 1, file) == 1);
+	ok = !ferror(file) && ok;
+	ok = (fclose(file) == 0) && ok;
+	file = NULL;
+
+	return ok;
+}
+
+CabBusTraceFile::CabBusTraceFile()
+{
+	map = NULL;
+	mapSize = 0;
+	header = NULL;
+	records = NULL;
+	blockTimes = NULL;
+	postings = NULL;
+}
+
+CabBusTraceFile::~CabBusTraceFile()
+{
+	close();
+}
+
+	// Maps path and checks every offset in the header lies inside the file
+bool CabBusTraceFile::open(const char *path)
+{
+	close();
+
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if ((fstat(fd, &st) < 0) || ((size_t)st.st_size < CAB_BUS_TRACE_HEADER_SIZE))
+	{
+		::close(fd);
+		return false;
+	}
+
+	mapSize = st.st_size;
+	void *mapped = mmap(NULL, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED)
+		return false;
+
+	map = (const uint8_t *)mapped;
+	header = (const CabBusTraceHeader *)map;
+
+	const CabBusTraceHeader &h = *header;
+	bool valid = !memcmp(h.magic, CAB_BUS_TRACE_MAGIC, sizeof(CAB_BUS_TRACE_MAGIC)) &&
+		(h.version == CAB_BUS_TRACE_VERSION) &&
+		(h.recordSize == sizeof(CabBusTraceRecord)) &&
+		(h.blockRecords == CAB_BUS_TRACE_BLOCK_RECORDS) &&
+		(h.addressCount == CAB_BUS_TRACE_ADDRESSES) &&
+		(h.blockCount == (h.recordCount + CAB_BUS_TRACE_BLOCK_RECORDS - 1) / CAB_BUS_TRACE_BLOCK_RECORDS) &&
+		(h.timeIndexOffset == CAB_BUS_TRACE_HEADER_SIZE + (h.recordCount * sizeof(CabBusTraceRecord))) &&
+		(h.postingOffset == h.timeIndexOffset + (h.blockCount * sizeof(uint64_t))) &&
+		(h.postingOffset + (h.postingStart[CAB_BUS_TRACE_ADDRESSES] * sizeof(uint32_t)) <= mapSize);
+
+	for (uint8_t a = 0; valid && (a < CAB_BUS_TRACE_ADDRESSES); a++)
+		valid = (h.postingStart[a] <= h.postingStart[a + 1]);
+
+	if (!valid)
+	{
+		close();
+		return false;
+	}
+
+	records = (const CabBusTraceRecord *)(map + CAB_BUS_TRACE_HEADER_SIZE);
+	blockTimes = (const uint64_t *)(map + h.timeIndexOffset);
+	postings = (const uint32_t *)(map + h.postingOffset);
+	madvise((void *)map, mapSize, MADV_RANDOM);
+
+	return true;
+}
+
+void CabBusTraceFile::close(void)
+{
+	if (map)
+		munmap((void *)map, mapSize);
+
+	map = NULL;
+	mapSize = 0;
+	header = NULL;
+	records = NULL;
+	blockTimes = NULL;
+	postings = NULL;
+}
+
+uint64_t CabBusTraceFile::getFirstTime(void) const
+{
+	return getRecordCount() ? records[0].timeUs : 0;
+}
+
+uint64_t CabBusTraceFile::getLastTime(void) const
+{
+	return getRecordCount() ? records[header->recordCount - 1].timeUs : 0;
+}
+
+	// Last block starting before timeUs, as its records may run up to it and past
+uint64_t CabBusTraceFile::firstBlock(uint64_t timeUs) const
+{
+	const uint64_t *end = blockTimes + header->blockCount;
+	const uint64_t *from = std::lower_bound(blockTimes, end, timeUs);
+
+	return (from == blockTimes) ? 0 : (from - blockTimes) - 1;
+}
+
+uint64_t CabBusTraceFile::query(uint64_t addressMask, uint64_t fromUs, uint64_t toUs,
+	std::function<void(const CabBusTraceRecord &record)> found) const
+{
+	if (!header || !header->blockCount || (fromUs >= toUs))
+		return 0;
+
+	uint64_t fromBlock = firstBlock(fromUs);
+	uint64_t toBlock = std::lower_bound(blockTimes, blockTimes + header->blockCount, toUs) - blockTimes;
+
+		// Blocks holding any of the addresses, from the posting lists, or every block
+	std::vector<uint64_t> blocks;
+	if (addressMask == CAB_BUS_TRACE_ALL_ADDRESSES)
+	{
+		for (uint64_t b = fromBlock; b < toBlock; b++)
+			blocks.push_back(b);
+	}
+	else
+	{
+		for (uint8_t a = 0; a < CAB_BUS_TRACE_ADDRESSES; a++)
+		{
+			if (!(addressMask & (1ULL << a)))
+				continue;
+
+			const uint32_t *list = postings + header->postingStart[a];
+			const uint32_t *listEnd = postings + header->postingStart[a + 1];
+			for (const uint32_t *p = std::lower_bound(list, listEnd, fromBlock); (p < listEnd) && (*p < toBlock); p++)
+				blocks.push_back(*p);
+		}
+
+		std::sort(blocks.begin(), blocks.end());
+		blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+	}
+
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		uint64_t first = blocks[i] * CAB_BUS_TRACE_BLOCK_RECORDS;
+		uint64_t last = std::min(first + CAB_BUS_TRACE_BLOCK_RECORDS, header->recordCount);
+
+		for (uint64_t r = first; r < last; r++)
+		{
+			const CabBusTraceRecord &record = records[r];
+			if ((record.timeUs >= fromUs) && (record.timeUs < toUs) &&
+				(record.address < CAB_BUS_TRACE_ADDRESSES) && (addressMask & (1ULL << record.address)))
+				found(record);
+		}
+	}
+
+	return blocks.size();
+}
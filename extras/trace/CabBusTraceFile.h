@@ -0,0 +1,141 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Trace File
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      CabBusTraceFile.h
+// purpose:   Indexed trace container written by the host tools, so the
+//            traffic of one cab over a few minutes can be found in a
+//            long session without decoding the file from the start.
+//
+//            The wire bytes are cut into frames, a poll, the cab's reply
+//            or a command, and each frame is a fixed size record tagged
+//            with its time and the cab address polled when it was sent.
+//            Records are grouped in blocks, and the file ends with the
+//            first time of every block and, for each address, the list
+//            of blocks holding its frames. A reader maps the file and
+//            only looks at the blocks a query needs.
+//
+//            Layout, little endian as written by the host:
+//              0       CabBusTraceHeader, padded to CAB_BUS_TRACE_HEADER_SIZE
+//              4096    records, CAB_BUS_TRACE_BLOCK_RECORDS to a block
+//              ...     uint64_t first time of each block
+//              ...     uint32_t block numbers, ascending, address 0 first,
+//                      postingStart[a] .. postingStart[a + 1] for address a
+//
+//------------------------------------------------------------------------
+
+#ifndef NCE_CAB_BUS_TRACE_FILE_H
+#define NCE_CAB_BUS_TRACE_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <functional>
+#include <vector>
+
+#define CAB_BUS_TRACE_MAGIC			"NCETRC1"
+#define CAB_BUS_TRACE_VERSION		1
+#define CAB_BUS_TRACE_HEADER_SIZE	4096
+#define CAB_BUS_TRACE_BLOCK_RECORDS	128
+#define CAB_BUS_TRACE_ADDRESSES		64
+#define CAB_BUS_TRACE_FRAME_MAX		21
+#define CAB_BUS_TRACE_ALL_ADDRESSES	0xFFFFFFFFFFFFFFFFULL
+
+typedef enum
+{
+	TRACE_FRAME_POLL = 0,	// Poll byte from the command station
+	TRACE_FRAME_REPLY,		// Bytes the polled cab sent back
+	TRACE_FRAME_COMMAND,	// A command byte and its data, to the polled cab or broadcast
+} TRACE_FRAME_KIND;
+
+typedef struct
+{
+	uint64_t timeUs;		// Start of the first byte
+	uint8_t  address;		// Cab polled at the time, 0 for broadcasts
+	uint8_t  kind;			// TRACE_FRAME_KIND
+	uint8_t  length;
+	uint8_t  data[CAB_BUS_TRACE_FRAME_MAX];	// Longer frames carry on in the next record
+} CabBusTraceRecord;
+
+typedef struct
+{
+	char     magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	uint32_t blockRecords;
+	uint32_t addressCount;
+	uint64_t recordCount;
+	uint64_t blockCount;
+	uint64_t timeIndexOffset;
+	uint64_t postingOffset;
+	uint64_t postingStart[CAB_BUS_TRACE_ADDRESSES + 1];
+} CabBusTraceHeader;
+
+	// Builds a trace file from the bytes on the wire in the order they were sent
+class CabBusTraceWriter
+{
+  public:
+	CabBusTraceWriter();
+	~CabBusTraceWriter();
+
+	bool open(const char *path);
+	void addByte(uint64_t timeUs, uint8_t value);
+	bool close(void);
+
+  private:
+	FILE *file;
+	CabBusTraceRecord frame;
+	uint8_t nextKind;		// For bytes that do not start a frame themselves
+	uint8_t polledAddress;
+	std::vector<CabBusTraceRecord> block;
+	std::vector<uint64_t> blockTimes;
+	std::vector<uint32_t> postings[CAB_BUS_TRACE_ADDRESSES];
+	uint64_t recordCount;
+
+	void startFrame(uint64_t timeUs, TRACE_FRAME_KIND kind);
+	void endFrame(void);
+	void writeBlock(void);
+};
+
+	// Read only view of a trace file mapped into memory
+class CabBusTraceFile
+{
+  public:
+	CabBusTraceFile();
+	~CabBusTraceFile();
+
+	bool open(const char *path);
+	void close(void);
+
+	uint64_t getRecordCount(void) const { return header ? header->recordCount : 0; }
+	uint64_t getBlockCount(void) const { return header ? header->blockCount : 0; }
+	uint64_t getFirstTime(void) const;
+	uint64_t getLastTime(void) const;
+	const CabBusTraceRecord &getRecord(uint64_t index) const { return records[index]; }
+
+		// Calls found for each record of an address in addressMask, bit a for address a,
+		// with fromUs <= timeUs < toUs, in file order. Returns the number of blocks read
+	uint64_t query(uint64_t addressMask, uint64_t fromUs, uint64_t toUs,
+		std::function<void(const CabBusTraceRecord &record)> found) const;
+
+  private:
+	const uint8_t *map;
+	size_t mapSize;
+	const CabBusTraceHeader *header;
+	const CabBusTraceRecord *records;
+	const uint64_t *blockTimes;
+	const uint32_t *postings;
+
+	uint64_t firstBlock(uint64_t timeUs) const;
+};
+
+#endif
@@ -0,0 +1,157 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Trace Decoder
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      TraceDecode.cpp
+// purpose:   Read a binary trace written by NceCabBus::dumpTrace() or
+//            readTrace() and print one line per byte with its time, channel
+//            and value as CSV.
+//
+//            With --replay the received RS485 and USB bytes are also fed
+//            into a host NceCabBus of the given type and address, and the
+//            bytes it sends are printed as "replay" lines next to the
+//            traced ones so a fault can be reproduced on the PC.
+//
+// build:     g++ -std=c++17 -O2 -DARDUINO=10819 -DNCE_CAB_BUS_TRACE=1
+//              -Iextras/host -Isrc extras/trace/TraceDecode.cpp
+//              extras/host/HostArduino.cpp src/*.cpp -o cabbus-trace
+//
+// usage:     cabbus-trace trace.bin
+//            cabbus-trace --replay lcd 3 trace.bin
+//
+//------------------------------------------------------------------------
+
+#include <NceCabBus.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t traceTimeUs;
+
+static const char *channelName(uint8_t channel)
+{
+	switch (channel)
+	{
+	case NCE_CAB_BUS_TRACE_RS485_RX:	return "rs485-rx";
+	case NCE_CAB_BUS_TRACE_RS485_TX:	return "rs485-tx";
+	case NCE_CAB_BUS_TRACE_USB_RX:		return "usb-rx";
+	default:							return "usb-tx";
+	}
+}
+
+static void replayRS485SendBytes(uint8_t *values, uint8_t length)
+{
+	for (uint8_t i = 0; i < length; i++)
+		printf("%llu,replay-rs485-tx,0x%02X\n", (unsigned long long)traceTimeUs, values[i]);
+}
+
+static void replayUSBSendBytes(uint8_t *values, uint8_t length)
+{
+	for (uint8_t i = 0; i < length; i++)
+		printf("%llu,replay-usb-tx,0x%02X\n", (unsigned long long)traceTimeUs, values[i]);
+}
+
+static bool parseCabType(const char *name, CAB_TYPE *pType)
+{
+	if (!strcmp(name, "lcd"))			*pType = CAB_TYPE_LCD;
+	else if (!strcmp(name, "nolcd"))	*pType = CAB_TYPE_NO_LCD;
+	else if (!strcmp(name, "smart"))	*pType = CAB_TYPE_SMART;
+	else if (!strcmp(name, "aiu"))		*pType = CAB_TYPE_AIU;
+	else
+		return false;
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	NceCabBus replayCab;
+	bool replay = false;
+	const char *fileName = NULL;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--replay") && (i + 2 < argc))
+		{
+			CAB_TYPE cabType;
+			if (!parseCabType(argv[i + 1], &cabType))
+			{
+				fprintf(stderr, "unknown cab type %s, use lcd, nolcd, smart or aiu\n", argv[i + 1]);
+				return 1;
+			}
+			replayCab.setCabType(cabType);
+			replayCab.setCabAddress(atoi(argv[i + 2]));
+			replayCab.setRS485SendBytesHandler(replayRS485SendBytes);
+			replayCab.setUSBSendBytesHandler(replayUSBSendBytes);
+			replay = true;
+			i += 2;
+		}
+		else
+			fileName = argv[i];
+	}
+
+	FILE *in = fileName ? fopen(fileName, "rb") : stdin;
+	if (!in)
+	{
+		perror(fileName);
+		return 1;
+	}
+
+	printf("time_us,channel,byte\n");
+
+	int tag;
+	while ((tag = fgetc(in)) != EOF)
+	{
+		int value = fgetc(in);
+		if (value == EOF)
+		{
+			fprintf(stderr, "trace ends inside a record\n");
+			break;
+		}
+
+		uint64_t delta = tag & 0x1F;
+		if (tag & NCE_CAB_BUS_TRACE_MORE)
+		{
+			int shift = 5;
+			int deltaByte;
+			do
+			{
+				deltaByte = fgetc(in);
+				if (deltaByte == EOF)
+					break;
+				delta |= (uint64_t)(deltaByte & 0x7F) << shift;
+				shift += 7;
+			} while (deltaByte & 0x80);
+		}
+
+		traceTimeUs += delta;
+		uint8_t channel = tag & 0xC0;
+		printf("%llu,%s,0x%02X\n", (unsigned long long)traceTimeUs, channelName(channel), value);
+
+		if (replay)
+		{
+			if (channel == NCE_CAB_BUS_TRACE_RS485_RX)
+			{
+				replayCab.processByte(value);
+				if (replayCab.getCabType() == CAB_TYPE_SMART)
+					replayCab.processResponseByte(value);
+			}
+			else if (channel == NCE_CAB_BUS_TRACE_USB_RX)
+				replayCab.processUSBByte(value);
+		}
+	}
+
+	if (in != stdin)
+		fclose(in);
+
+	return 0;
+}
@@ -0,0 +1,211 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NCE Cab Bus Trace Query
+//
+// Copyright (c) 2026 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      TraceQuery.cpp
+// purpose:   Print the frames of an indexed trace file, as written by
+//            cabbus-sim --trace-file or cabbus-analyzer --trace-file, for
+//            some cab addresses over a time window. Only the blocks that
+//            hold those addresses in that window are read.
+//
+//            With --replay the command station side of the frames, plus
+//            the broadcasts, is fed into a host NceCabBus of the given
+//            type at the one queried address, and the bytes it sends are
+//            printed as "replay" lines.
+//
+// build:     g++ -std=c++17 -O2 -DARDUINO=10819 -Iextras/host -Isrc
+//              extras/trace/TraceQuery.cpp extras/trace/CabBusTraceFile.cpp
+//              extras/host/HostArduino.cpp src/*.cpp -o cabbus-trace-query
+//
+// usage:     cabbus-trace-query --address 5 --from 21:10 --to 21:12 bus.trc
+//            cabbus-trace-query --address 5 --replay lcd bus.trc
+//
+//------------------------------------------------------------------------
+
+#include <NceCabBus.h>
+
+#include "CabBusTraceFile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t replayTimeUs;
+
+static const char *kindName(uint8_t kind)
+{
+	switch (kind)
+	{
+	case TRACE_FRAME_POLL:	return "poll";
+	case TRACE_FRAME_REPLY:	return "reply";
+	default:				return "command";
+	}
+}
+
+static void replayRS485SendBytes(uint8_t *values, uint8_t length)
+{
+	printf("%llu,replay,", (unsigned long long)replayTimeUs);
+	for (uint8_t i = 0; i < length; i++)
+		printf("%s%02X", i ? " " : "", values[i]);
+	printf("\n");
+}
+
+static bool parseCabType(const char *name, CAB_TYPE *pType)
+{
+	if (!strcmp(name, "lcd"))			*pType = CAB_TYPE_LCD;
+	else if (!strcmp(name, "nolcd"))	*pType = CAB_TYPE_NO_LCD;
+	else if (!strcmp(name, "smart"))	*pType = CAB_TYPE_SMART;
+	else if (!strcmp(name, "aiu"))		*pType = CAB_TYPE_AIU;
+	else
+		return false;
+
+	return true;
+}
+
+	// Seconds, minutes:seconds or hours:minutes:seconds from the start of the trace
+static bool parseTime(const char *text, uint64_t *pTimeUs)
+{
+	double parts[3];
+	int count = 0;
+	const char *p = text;
+
+	while (count < 3)
+	{
+		char *end;
+		parts[count++] = strtod(p, &end);
+		if (end == p)
+			return false;
+		if (*end != ':')
+		{
+			if (*end)
+				return false;
+			break;
+		}
+		p = end + 1;
+	}
+
+	double seconds = 0;
+	for (int i = 0; i < count; i++)
+		seconds = (seconds * 60) + parts[i];
+
+	*pTimeUs = (uint64_t)(seconds * 1e6);
+	return seconds >= 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: cabbus-trace-query [options] trace-file\n"
+		"  --address N          cab address to show, may be repeated (default all)\n"
+		"  --from T             start time as S, M:S or H:M:S (default start)\n"
+		"  --to T               end time, not included (default end)\n"
+		"  --replay TYPE        feed the one address to a lcd, nolcd, smart or aiu cab\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t addressMask = 0;
+	uint8_t lastAddress = 0;
+	uint64_t fromUs = 0, toUs = UINT64_MAX;
+	const char *fileName = NULL;
+	NceCabBus replayCab;
+	bool replay = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		bool hasValue = (i + 1) < argc;
+
+		if (!strcmp(argv[i], "--address") && hasValue)
+		{
+			int address = atoi(argv[++i]);
+			if ((address < 0) || (address >= CAB_BUS_TRACE_ADDRESSES))
+				usage();
+			addressMask |= 1ULL << address;
+			lastAddress = address;
+		}
+		else if (!strcmp(argv[i], "--from") && hasValue)
+		{
+			if (!parseTime(argv[++i], &fromUs))
+				usage();
+		}
+		else if (!strcmp(argv[i], "--to") && hasValue)
+		{
+			if (!parseTime(argv[++i], &toUs))
+				usage();
+		}
+		else if (!strcmp(argv[i], "--replay") && hasValue)
+		{
+			CAB_TYPE cabType;
+			if (!parseCabType(argv[++i], &cabType))
+			{
+				fprintf(stderr, "unknown cab type %s, use lcd, nolcd, smart or aiu\n", argv[i]);
+				return 1;
+			}
+			replayCab.setCabType(cabType);
+			replayCab.setRS485SendBytesHandler(replayRS485SendBytes);
+			replay = true;
+		}
+		else if (argv[i][0] == '-')
+			usage();
+		else
+			fileName = argv[i];
+	}
+
+	if (!fileName)
+		usage();
+
+	if (replay)
+	{
+		if (!addressMask || (addressMask & (addressMask - 1)))
+		{
+			fprintf(stderr, "--replay needs exactly one --address\n");
+			return 1;
+		}
+		replayCab.setCabAddress(lastAddress);
+		addressMask |= 1;	// Broadcasts, e.g. the fast clock
+	}
+
+	if (!addressMask)
+		addressMask = CAB_BUS_TRACE_ALL_ADDRESSES;
+
+	CabBusTraceFile trace;
+	if (!trace.open(fileName))
+	{
+		fprintf(stderr, "%s: not a trace file\n", fileName);
+		return 1;
+	}
+
+	uint64_t found = 0;
+
+	printf("time_us,address,frame,bytes\n");
+
+	uint64_t blocksRead = trace.query(addressMask, fromUs, toUs, [&](const CabBusTraceRecord &record)
+	{
+		printf("%llu,%u,%s,", (unsigned long long)record.timeUs, record.address, kindName(record.kind));
+		for (uint8_t i = 0; i < record.length; i++)
+			printf("%s%02X", i ? " " : "", record.data[i]);
+		printf("\n");
+		found++;
+
+		if (replay && (record.kind != TRACE_FRAME_REPLY))
+		{
+			replayTimeUs = record.timeUs;
+			for (uint8_t i = 0; i < record.length; i++)
+				replayCab.processByte(record.data[i]);
+		}
+	});
+
+	fprintf(stderr, "%llu frames from %llu of %llu blocks\n", (unsigned long long)found,
+		(unsigned long long)blocksRead, (unsigned long long)trace.getBlockCount());
+
+	return 0;
+}
@@ -1,108 +1,5 @@
 #include "NceCabBus.h"
 
-#define MAX_USB_COMMAND_LENGTH	11
-typedef struct
-{
-	uint8_t expectedLength;
-	uint8_t count;
-	uint8_t data[MAX_USB_COMMAND_LENGTH];
-} USBCommand;
-
-#define CAB_BUS_COMMAND_LENGTH	5
-typedef struct
-{
-	uint8_t count;
-	uint8_t data[CAB_BUS_COMMAND_LENGTH];
-} CabBusCommand;
-
-typedef struct
-{
-	uint8_t count;
-	uint8_t data[MAX_USB_COMMAND_LENGTH];
-} USBResponse;
-
-#define CAB_BUS_REPLY_LENGTH	7
-typedef struct
-{
-	uint8_t count;
-	uint8_t ReplySize;
-	bool Receive_Reply;
-	uint8_t data[CAB_BUS_REPLY_LENGTH];
-} CabBusCommandReply;
-
-USBCommand USBCommandBuffer;
-USBResponse USBResponseBuffer;
-CabBusCommand CabBusCommandBuffer;
-CabBusCommand CabBusCommandBuffer1;
-CabBusCommandReply CabBusReplyBuffer;
-
-const uint8_t USBCommandLengths[] = {
-	1, // 0x80
-	1, // 0x81	Only Available with RS232 Interface
-	1, // 0x82	Only Available with RS232 Interface
-	1, // 0x83	Only Available with RS232 Interface
-	1, // 0x84	Only Available with RS232 Interface
-	1, // 0x85	Only Available with RS232 Interface
-	1, // 0x86	Only Available with RS232 Interface
-	1, // 0x87	Only Available with RS232 Interface
-	1, // 0x88	Only Available with RS232 Interface
-	1, // 0x89	Only Available with RS232 Interface
-	1, // 0x8A	Only Available with RS232 Interface
-	1, // 0x8B	Only Available with RS232 Interface
-	1, // 0x8C
-	1, // 0x8D	Only Available with RS232 Interface
-	1, // 0x8E	Only Available with RS232 Interface
-	1, // 0x8F	Only Available with RS232 Interface
-	1, // 0x90	Only Available with RS232 Interface
-	1, // 0x91	Only Available with RS232 Interface
-	1, // 0x92	Only Available with RS232 Interface
-	1, // 0x93	Only Available with RS232 Interface
-	1, // 0x94	Only Available with RS232 Interface
-	1, // 0x95	Only Available with RS232 Interface
-	1, // 0x96	Only Available with RS232 Interface
-	1, // 0x97	Only Available with RS232 Interface
-	1, // 0x98	Only Available with RS232 Interface
-	1, // 0x99	Only Available with RS232 Interface
-	1, // 0x9A	Only Available with RS232 Interface
-	2, // 0x9B
-	2, // 0x9C
-	1, // 0x9D	Only Available with RS232 Interface
-	1, // 0x9E 
-	1, // 0x9F
-	4, // 0xA0
-	3, // 0xA1
-	5, // 0xA2
-	1, // 0xA3	Only Available with RS232 Interface
-	1, // 0xA4	Only Available with RS232 Interface
-	1, // 0xA5	Only Available with RS232 Interface
-	3, // 0xA6
-	2, // 0xA7
-	4, // 0xA8
-	3, // 0xA9
-	1, // 0xAA
-	1, // 0xAB	Only Available with RS232 Interface
-	1, // 0xAC	Only Available with RS232 Interface
-	5, // 0xAD
-	6, // 0xAE
-	6, // 0xAF
-	5, // 0xB0	Reserved for future use
-	1, // 0xB1
-	1, // 0xB2	Only Available with RS232 Interface
-	3, // 0xB3
-	2, // 0xB4
-	2  // 0xB5
-};
-
-int8_t getUSBCommandLength(uint8_t Command)
-{
-	if( (Command < 0x80) && (Command > 0xB5))
-		return -1;
-		
-	uint8_t commandOffset = Command - 0x80;
-	return USBCommandLengths[commandOffset];
-}
-
-
 uint8_t adjustCabBusASCII(uint8_t chr)
 {
 	if(chr & 0x20)
@@ -111,415 +8,6 @@ uint8_t adjustCabBusASCII(uint8_t chr)
 		return(chr & 0x7F);  // Clear only bit 7
 }
 
-uint8_t NceCabBus::calcChecksum(uint8_t *Buffer, uint8_t Length)
- {
-    uint8_t checkSum = 0;
-    for(uint8_t i = 0; i < Length; i++)
-    	checkSum ^= Buffer[i];
-
-    return checkSum;
-}
-
-void NceCabBus::processUSBByte(uint8_t inByte)
-{
-	if (USBCommandBuffer.expectedLength)
-	{
-		if (USBCommandBuffer.count < USBCommandBuffer.expectedLength)
-		{
-			USBCommandBuffer.data[USBCommandBuffer.count] = inByte;
-			if (pLogger)
-			{
-				pLogger->print("\nUSB Add Byte: ");
-				if (USBCommandBuffer.count < 16)
-					pLogger->print('0');
-				pLogger->println(USBCommandBuffer.data[USBCommandBuffer.count], HEX);
-			}
-
-			USBCommandBuffer.count++;
-		}
-	}
-	else
-	{
-		USBCommandBuffer.expectedLength = getUSBCommandLength(inByte);
-		USBCommandBuffer.data[0] = inByte;
-		USBCommandBuffer.count = 1;
-
-		if (pLogger)
-		{
-			pLogger->print("\nUSB New Command: ");
-			pLogger->print(USBCommandBuffer.data[0], HEX);
-			pLogger->print("  Expected Length: ");
-			pLogger->println(USBCommandBuffer.expectedLength);
-		}
-	}
-
-	if (USBCommandBuffer.count >= USBCommandBuffer.expectedLength)
-	{
-		if (pLogger)
-		{
-			pLogger->print("\nProcess USB Command: Count: ");
-			pLogger->print(USBCommandBuffer.count);
-			pLogger->print("  Data: ");
-			for (uint8_t i = 0; i < USBCommandBuffer.count; i++)
-			{
-				if (USBCommandBuffer.data[i] < 16)
-					pLogger->print('0');
-				pLogger->print(USBCommandBuffer.data[i], HEX);
-			}
-			pLogger->println();
-		}
-
-		switch (USBCommandBuffer.data[0])
-		{
-		case 0x80:	// NOP, dummy instruction Returns !
-		{
-			USBResponseBuffer.data[0] = (USB_COMMAND_COMPLETED_SUCCESSFULLY);
-			USBResponseBuffer.count = 1;
-			if (func_USBSendBytes)
-			{
-				func_USBSendBytes(USBResponseBuffer.data, USBResponseBuffer.count);
-				USBResponseBuffer.count = 0;
-			}
-			break;
-		}
-
-		case 0x8C:	// NOP, dummy instruction Returns ! followed by CR/LF
-		{
-			USBResponseBuffer.data[0] = (USB_COMMAND_COMPLETED_SUCCESSFULLY);
-			USBResponseBuffer.data[1] = '\r';
-			USBResponseBuffer.data[2] = '\n';
-			USBResponseBuffer.count = 3;
-			if (func_USBSendBytes)
-			{
-				func_USBSendBytes(USBResponseBuffer.data, USBResponseBuffer.count);
-				USBResponseBuffer.count = 0;
-			}
-			break;
-		}
-
-		case 0x9B: // 0x9B yy Return Status of AIU yy
-		{
-			
-			CabBusCommandBuffer.data[0] = 0x4E;
-			CabBusCommandBuffer.data[1] = 0x19;
-			CabBusCommandBuffer.data[2] = 0x03;
-			CabBusCommandBuffer.data[3] = USBCommandBuffer.data[1];
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-		
-
-		case 0x9C: // 0x9C xx Execute Macro number xx
-		{
-			if ((USBCommandBuffer.data[1] < 0) || (USBCommandBuffer.data[1] > 255))
-			{
-				sendUSBResponse(USB_ADDRESS_OUT_OF_RANGE);
-				return;
-			}
-
-			CabBusCommandBuffer.data[0] = 0x50;
-			CabBusCommandBuffer.data[1] = 0x00;
-			CabBusCommandBuffer.data[2] = 0x01;
-			CabBusCommandBuffer.data[3] = USBCommandBuffer.data[1];
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-
-		case 0x9E:	// Enter programming Track mode
-		{			
-						
-			CabBusCommandBuffer.data[0] = 0x4E;
-			CabBusCommandBuffer.data[1] = 0x1B;
-			CabBusCommandBuffer.data[2] = 0x00;
-			CabBusCommandBuffer.data[3] = 0x00;
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-
-		}
-
-
-		case 0x9F:	// Exit programming Track mode
-		{
-			
-			CabBusCommandBuffer.data[0] = 0x4E;
-			CabBusCommandBuffer.data[1] = 0x1A;
-			CabBusCommandBuffer.data[2] = 0x00;
-			CabBusCommandBuffer.data[3] = 0x00;
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-		case 0xA0:	// 0xA0 aaaa xx program CV aaaa with data xx in direct mode  
-		{
-			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
-			uint16_t datavalue = USBCommandBuffer.data[3];
-
-			CabBusCommandBuffer.data[0] = 0x4E;
-			CabBusCommandBuffer.data[1] = 0x40 + (CVaddress >> 6);
-			CabBusCommandBuffer.data[2] = (0x007F & (CVaddress << 1)) + (datavalue >> 7);
-			CabBusCommandBuffer.data[3] = 0x007F & datavalue;
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-		case 0xA1:	// 0xA1 aaaa Read CV aaaa in paged mode  
-		{
-			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
-
-			CabBusCommandBuffer.data[0] = 0x4E;
-			CabBusCommandBuffer.data[1] = 0x20 + (CVaddress >> 6);
-			CabBusCommandBuffer.data[2] = (0x007F & (CVaddress << 1));
-			CabBusCommandBuffer.data[3] = 0x00;
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-
-		case 0xA2: // Locomotive Control Command 0xA2 <addr_h> <addr_l> <op_1> <data_1>
-		{
-			uint16_t address = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
-			if ((address < 3) || (address > 9999))
-			{
-				sendUSBResponse(USB_ADDRESS_OUT_OF_RANGE);
-				return;
-			}
-			if (address > 127)
-			{
-			CabBusCommandBuffer.data[0] = 0x00FF & (address >> 7);				// addr_h 
-			}
-			else
-			{
-			CabBusCommandBuffer.data[0] = 0x4F;									// short addr_h
-			}
-			CabBusCommandBuffer.data[1] = 0x007F & address;							// addr_l
-			CabBusCommandBuffer.data[2] = USBCommandBuffer.data[3];					// op_1
-			CabBusCommandBuffer.data[3] = USBCommandBuffer.data[4];					//data_1
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-		case 0xA6:	// 0xA6 rr xx program register rr with data xx in register mode 
-		{
-
-			uint16_t datavalue = USBCommandBuffer.data[2];
-
-			CabBusCommandBuffer.data[0] = 0x4E;
-			CabBusCommandBuffer.data[1] = 0x1F;
-			CabBusCommandBuffer.data[2] = (USBCommandBuffer.data[2] >> 1);
-			CabBusCommandBuffer.data[3] = 0x007F & datavalue;
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-		case 0xA7:	// 0xA7 rr read register rr in register mode 
-		{
-
-
-			CabBusCommandBuffer.data[0] = 0x4E;
-			CabBusCommandBuffer.data[1] = 0x1E;
-			CabBusCommandBuffer.data[2] = (USBCommandBuffer.data[2] >> 1);
-			CabBusCommandBuffer.data[3] = 0x00;
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-		case 0xA8:	// 0xA8 aaaa xx program CV aaaa with data xx in direct mode 
-		{
-
-			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
-			uint16_t datavalue = USBCommandBuffer.data[3];
-
-			CabBusCommandBuffer.data[0] = 0x4E; 
-			CabBusCommandBuffer.data[1] = 0x50 + (CVaddress >> 6);
-			CabBusCommandBuffer.data[2] = (0x007F & (CVaddress << 1)) + (datavalue >> 7);
-			CabBusCommandBuffer.data[3] = 0x007F & datavalue;
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-		case 0xA9:	// 0xA9 aaaa Read CV aaaa in direct mode 
-		{
-			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
-
-			CabBusCommandBuffer.data[0] = 0x4E;
-			CabBusCommandBuffer.data[1] = 0x30 + (CVaddress >> 6);
-			CabBusCommandBuffer.data[2] = (0x007F & (CVaddress << 1));
-			CabBusCommandBuffer.data[3] = 0x00;
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-		case 0xAA:	// Return USB Interface firmware Version
-		{
-			USBResponseBuffer.data[0] = 7;
-			USBResponseBuffer.data[1] = 3;
-			USBResponseBuffer.data[2] = 3;
-			USBResponseBuffer.count = 3;
-			if (func_USBSendBytes)
-			{
-				func_USBSendBytes(USBResponseBuffer.data, USBResponseBuffer.count);
-				USBResponseBuffer.count = 0;
-			}
-			break;
-		}
-
-		case 0xAD: // Accy/Signal and macro commands  0xAD <addr_h> <addr_l> <op_1> <data_1>
-		{
-			uint16_t address = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
-			if (address > 2044)
-			{
-				sendUSBResponse(USB_ADDRESS_OUT_OF_RANGE);
-				return;
-			}
-			CabBusCommandBuffer.data[0] = 0x0050 + (address >> 7);					// addr_h 
-			CabBusCommandBuffer.data[1] = 0x007F & address;							// addr_l
-			CabBusCommandBuffer.data[2] = USBCommandBuffer.data[3];					// op_1
-			CabBusCommandBuffer.data[3] = USBCommandBuffer.data[4];					//data_1
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-
-		case 0xAE: // OP's Program loco CV 0xAE <addr_h> <addr_l> <cv_h> <cv_l> <data_1> 
-		{
-			uint16_t address = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
-			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[3] << 8) + USBCommandBuffer.data[4]);
-			uint16_t datavalue = USBCommandBuffer.data[5];
-
-			
-			if ((address < 0) || (address > 9999))
-			{
-				sendUSBResponse(USB_ADDRESS_OUT_OF_RANGE);
-				return;
-			}
-			
-
-			CabBusCommandBuffer.data[0] = 0x00FF & (address >> 7);
-			CabBusCommandBuffer.data[1] = 0x007F & address;
-			CabBusCommandBuffer.data[2] = 0x00;
-			CabBusCommandBuffer.data[3] = 0x00;
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-
-			CabBusCommandBuffer1.data[0] = 0x4E;
-			CabBusCommandBuffer1.data[1] = 0x60 + (CVaddress >> 6);
-			CabBusCommandBuffer1.data[2] = ((0x007F & (CVaddress << 1)) - 2) + (datavalue >> 7);
-			CabBusCommandBuffer1.data[3] = 0x007F & datavalue;
-			CabBusCommandBuffer1.data[4] = calcChecksum(CabBusCommandBuffer1.data, 4);
-			CabBusCommandBuffer1.count = 5;
-			break;
-		}
-
-		case 0xAF: // OP's Program accessory/signal 0xAF <addr_h> <addr_l> <cv_h> <cv_l> <data_1> 
-		{
-			uint16_t address = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
-			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[3] << 8) + USBCommandBuffer.data[4]);
-			uint16_t datavalue = USBCommandBuffer.data[5];
-			
-			
-			if ((address < 0) || (address > 2044))
-				{
-					sendUSBResponse(USB_ADDRESS_OUT_OF_RANGE);
-					return;
-				}
-				
-
-			CabBusCommandBuffer.data[0] = 0x00FF & (address >> 7);
-			CabBusCommandBuffer.data[1] = 0x007F & address;
-			CabBusCommandBuffer.data[2] = 0x00;
-			CabBusCommandBuffer.data[3] = 0x00;
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-
-			CabBusCommandBuffer1.data[0] = 0x4E;
-			CabBusCommandBuffer1.data[1] = 0x70 + (CVaddress >> 6);
-			CabBusCommandBuffer1.data[2] = ((0x007F & (CVaddress << 1)) - 2) + (datavalue >> 7);
-			CabBusCommandBuffer1.data[3] = 0x007F & datavalue;
-			CabBusCommandBuffer1.data[4] = calcChecksum(CabBusCommandBuffer1.data, 4);
-			CabBusCommandBuffer1.count = 5;
-			break;
-		}
-
-		case 0xB3: // 0xB3 yy xx Set the CAB context page memory read/write pointer to cab address yy  memory location xx
-				   // yy in the range of 0-255 and cabbus address ranging from 0-63	
-		{
-			
-			uint16_t memaddress = (USBCommandBuffer.data[1]);
-		/*
-			if ((USBCommandBuffer.data[1] < 0) || (USBCommandBuffer.data[1] > 255) ||
-				(USBCommandBuffer.data[2] < 0) || (USBCommandBuffer.data[2] > 63))
-			{
-				sendUSBResponse(USB_CV_ADDRESS_OR_DATA_OUT_OF_RANGE);
-				return;
-			}
-			*/
-
-			CabBusCommandBuffer.data[0] = 0x4E;
-			CabBusCommandBuffer.data[1] = 0x18;
-			CabBusCommandBuffer.data[2] = (memaddress << 1) + (USBCommandBuffer.data[2] >> 7);
-			CabBusCommandBuffer.data[3] = 0x07F & USBCommandBuffer.data[2];
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-		case 0xB4: // 0xB4 xx write 1 byte to cab bus memory at memory pointer location the pointer will increment after the write
-
-		{
-
-			uint16_t datavalue = (USBCommandBuffer.data[1]);
-
-			CabBusCommandBuffer.data[0] = 0x4E;
-			CabBusCommandBuffer.data[1] = 0x19;
-			CabBusCommandBuffer.data[2] = 0x00 + (datavalue >> 7);
-			CabBusCommandBuffer.data[3] = 0x07F & (datavalue);
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-
-			break;
-		}
-
-		case 0xB5: // 0xB5 xx return 1,2,4  bytes (indicated by xx = 1,2, or 4) from cab memory at memory pointer location the pointer will increment after the read
-
-		{
-
-			CabBusCommandBuffer.data[0] = 0x4E;
-			CabBusCommandBuffer.data[1] = 0x19;
-			CabBusCommandBuffer.data[2] = 0x02;
-			CabBusCommandBuffer.data[3] = USBCommandBuffer.data[1];
-			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
-			CabBusCommandBuffer.count = 5;
-			break;
-		}
-
-		default:	// Function which are Not Supported added to prevent code locking up
-		{
-
-			sendUSBResponse(USB_COMMAND_NOT_SUPPORTED);
-			break;
-		}
-		}
-
-		USBCommandBuffer.expectedLength = 0;
-		USBCommandBuffer.count = 0;
-	}
-}
-
-
-
 uint8_t NceCabBus::getCmdDataLen(uint8_t cmd, uint8_t Broadcast)
 {
 	uint8_t cmdLen = 0;
@@ -586,17 +74,151 @@ uint8_t NceCabBus::getCmdDataLen(uint8_t cmd, uint8_t Broadcast)
 
 NceCabBus::NceCabBus()
 {
-	aiuState = 0;
 	cabAddress = 0;
 	
-	speedKnob = 127; 	// 127 = knob not used
-	keyCode = BTN_REP_LAST_LCD;
-	
+#if NCE_CAB_BUS_MULTI_ADDRESS
+	extraCabAddressCount = 0;
+	ownPolledAddress = 0;
+	replyAddress = 0;
+	responsePolledAddress = 0;
+	frameQueueTail = 0;
+	frameQueueCount = 0;
+#endif
+
 	cabType = CAB_TYPE_UNKNOWN;
 	cabState = CAB_STATE_UNKNOWN;
 	
+	cmdBufferIndex = 0;
+	cmdBufferExpectedLength = 0;
+
+	func_RS485SendBytes = NULL;
+	listenerContext = NULL;
+	pListenerTable = NULL;
+	pLogger = NULL;
+
+#if NCE_CAB_BUS_STATS
+	clearStats();
+#endif
+
+#if NCE_CAB_BUS_DEFERRED_LOG
+	logHead = 0;
+	logCount = 0;
+	logDropped = 0;
+	logDroppedReported = 0;
+#endif
+
+#if NCE_CAB_BUS_TRACE
+	traceHead = 0;
+	traceCount = 0;
+	traceTail = 0;
+	traceDropped = 0;
+	traceLastMicros = 0;
+	traceEnabled = false;
+#endif
+
+#if NCE_CAB_BUS_KEYPAD
+	speedKnob = 127; 	// 127 = knob not used
+	keyQueue[0] = BTN_REP_LAST_LCD;
+	keyQueueTail = 0;
+	keyQueueCount = 1;
+	keyQueueOverflows = 0;
+	mergeKeyReleases = true;
+#endif
+
+#if NCE_CAB_BUS_AIU
+	aiuState = 0;
+#endif
+
+#if NCE_CAB_BUS_FAST_CLOCK
+	FastClockHours = 0;
+	FastClockMinutes = 0;
 	FastClockRate = 0;
 	FastClockMode = FAST_CLOCK_NOT_SET;
+	func_FastClockHandler = NULL;
+#endif
+
+#if NCE_CAB_BUS_SERVICE
+	pRS485Stream = NULL;
+	pUSBStream = NULL;
+	func_AppTaskHandler = NULL;
+#endif
+
+#if NCE_CAB_BUS_USE_TIMETABLE
+	timetable = NULL;
+	timetableCount = 0;
+	timetableNext = 0;
+	timetableTime = TIMETABLE_TIME_UNKNOWN;
+	func_TimetableHandler = NULL;
+#if NCE_CAB_BUS_SMART_CAB
+	timetableQueueTail = 0;
+	timetableQueueCount = 0;
+	timetableOverflows = 0;
+	timetableFrame.count = 0;
+#endif
+#endif
+
+#if NCE_CAB_BUS_LCD
+	func_LCDUpdateHandler = NULL;
+	func_LCDMoveCursorHandler = NULL;
+	func_LCDCursorModeHandler = NULL;
+	func_LCDPrintCharHandler = NULL;
+#if NCE_CAB_BUS_SNAPSHOT
+	memset(lcdShadow, ' ', sizeof(lcdShadow));
+	lcdShadowCol = 0;
+	lcdShadowRow = 0;
+#endif
+#endif
+
+#if NCE_CAB_BUS_SMART_CAB
+	USBCommandBuffer.expectedLength = 0;
+	USBCommandBuffer.count = 0;
+	USBCommandBuffer.data[0] = 0;
+	USBResponseBuffer.count = 0;
+	CabBusCommandBuffer.count = 0;
+	CabBusCommandBuffer1.count = 0;
+	CabBusReplyBuffer.count = 0;
+	CabBusReplyBuffer.ReplySize = 0;
+	func_USBSendBytes = NULL;
+	usbCommandPending = false;
+#if NCE_CAB_BUS_USB_TX_BUFFER_SIZE
+	usbTxCount = 0;
+	usbTxBuffering = false;
+	usbTxHold = false;
+#endif
+#if NCE_CAB_BUS_ROUTES
+	routeTable = NULL;
+	routeEEPROMAddress = 0;
+	routeInEEPROM = false;
+	routeCount = 0;
+	routeQueueTail = 0;
+	routeQueueCount = 0;
+	routeIndex = 0;
+	routeFrame.count = 0;
+	routeFrameEntry = 0;
+	clearAccessoryCache();
+#endif
+#endif
+
+	updatePollReply();
+
+#if NCE_CAB_BUS_ISR_RECEIVE
+	isrReceive = false;
+	isrOwnPoll = false;
+	rxQueueHead = 0;
+	rxQueueTail = 0;
+	rxQueueOverflows = 0;
+#if NCE_CAB_BUS_SMART_CAB
+	isrReplyCommand = NULL;
+	isrSentCommand = NULL;
+	isrCommandsSent = 0;
+	isrCommandsHandled = 0;
+#if NCE_CAB_BUS_MULTI_ADDRESS
+	isrPolledAddress = 0;
+	isrSentAddress = 0;
+#endif
+#endif
+	updateISRReply();
+#endif
 };
 
 void NceCabBus::setLogger(Print *pLogger)
@@ -609,16 +231,21 @@ void NceCabBus::setRS485SendBytesHandler(RS485SendBytes funcPtr)
 	func_RS485SendBytes = funcPtr;
 }
 
-void NceCabBus::setUSBSendBytesHandler(USBSendBytes funcPtr)
+	// Replaces the func_ handlers with the context handlers in table, pass NULL to go back to them
+void NceCabBus::setListener(void *context, const NceCabBusListenerTable *table)
 {
-	func_USBSendBytes = funcPtr;
+	listenerContext = context;
+	pListenerTable = table;
 }
 
+#if NCE_CAB_BUS_FAST_CLOCK
 void NceCabBus::setFastClockHandler(FastClockHandler funcPtr)
 {
 	func_FastClockHandler = funcPtr;
 }
+#endif
 
+#if NCE_CAB_BUS_LCD
 void NceCabBus::setLCDUpdateHandler(LCDUpdateHandler funcPtr)
 {
 	func_LCDUpdateHandler = funcPtr;
@@ -638,6 +265,7 @@ void NceCabBus::setLCDPrintCharHandler(LCDPrintCharHandler funcPtr)
 {
 	func_LCDPrintCharHandler = funcPtr;
 }
+#endif
 
 CAB_TYPE NceCabBus::getCabType(void)
 {
@@ -646,7 +274,9 @@ CAB_TYPE NceCabBus::getCabType(void)
 
 void NceCabBus::setCabType(CAB_TYPE newtype)
 {
+	BEGIN_REPLY_UPDATE();
 	cabType = newtype;
+	END_REPLY_UPDATE();
 }
 
 uint8_t NceCabBus::getCabAddress(void)
@@ -654,22 +284,69 @@ uint8_t NceCabBus::getCabAddress(void)
 	return cabAddress; 
 }
 
+	// Sets the only address we answer polls on, any added by addCabAddress() are removed
 void NceCabBus::setCabAddress(uint8_t addr)
 {
+	BEGIN_REPLY_UPDATE();
 	cabAddress = addr;
+#if NCE_CAB_BUS_MULTI_ADDRESS
+	extraCabAddressCount = 0;
+#endif
+	END_REPLY_UPDATE();
+}
+
+#if NCE_CAB_BUS_MULTI_ADDRESS
+	// Answer polls on addr as well as the cab address, so a smart cab sends one queued
+	// frame per poll of any of them. Returns false when NCE_CAB_BUS_SMART_CAB_ADDRESSES are in use
+bool NceCabBus::addCabAddress(uint8_t addr)
+{
+	if (isOwnAddress(addr))
+		return true;
+
+	if (extraCabAddressCount >= (NCE_CAB_BUS_SMART_CAB_ADDRESSES - 1))
+		return false;
+
+	BEGIN_REPLY_UPDATE();
+	extraCabAddresses[extraCabAddressCount++] = addr;
+	END_REPLY_UPDATE();
+	return true;
 }
+#endif
 
+bool NceCabBus::isOwnAddress(uint8_t address)
+{
+	if (address == cabAddress)
+		return true;
+
+#if NCE_CAB_BUS_MULTI_ADDRESS
+	for (uint8_t i = 0; i < extraCabAddressCount; i++)
+		if (address == extraCabAddresses[i])
+			return true;
+#endif
+
+	return false;
+}
+
+#if NCE_CAB_BUS_FAST_CLOCK
 void NceCabBus::setFastClockCabAddress(uint8_t addr)
 {
+	BEGIN_REPLY_UPDATE();
 	cabAddress = addr;
 	cabType = CAB_TYPE_LCD;
+	END_REPLY_UPDATE();
 	FastClockRate = 255;	// Set the Rate to Maximum to signal invalid Ratio to enable the call-back to still trigger. 
 }
+#endif
 
+#if NCE_CAB_BUS_KEYPAD
 void NceCabBus::setSpeedKnob(uint8_t speed)
 {
 	if(speed <= 127)
+	{
+		BEGIN_REPLY_UPDATE();
 		speedKnob = speed;
+		END_REPLY_UPDATE();
+	}
 }
 
 uint8_t NceCabBus::getSpeedKnob(void)
@@ -677,122 +354,172 @@ uint8_t NceCabBus::getSpeedKnob(void)
 	return speedKnob;
 }
 
+	// Queue a key code to be sent on a following poll, one per poll in the order they were set
 void NceCabBus::setKeyPress(uint8_t keyCode)
 {
-	this->keyCode = keyCode;
+		// A key release is already reported as BTN_NO_KEY_DN once the queue is empty
+	if (mergeKeyReleases && (keyCode == BTN_NO_KEY_DN))
+		return;
+
+	BEGIN_REPLY_UPDATE();
+	if (keyQueueCount < NCE_CAB_BUS_KEY_QUEUE_SIZE)
+	{
+		keyQueue[(keyQueueTail + keyQueueCount) & (NCE_CAB_BUS_KEY_QUEUE_SIZE - 1)] = keyCode;
+		keyQueueCount++;
+	}
+	else if (keyQueueOverflows < 255)
+		keyQueueOverflows++;
+	END_REPLY_UPDATE();
 }
 
+	// When true (the default) BTN_NO_KEY_DN passed to setKeyPress() is dropped so a press and its
+	// release only use one poll. Set false to queue every key code as given
+void NceCabBus::setMergeKeyReleases(bool merge)
+{
+	mergeKeyReleases = merge;
+}
+
+uint8_t NceCabBus::getKeyQueueOverflows(void)
+{
+	return keyQueueOverflows;
+}
+
+uint8_t NceCabBus::peekKeyCode(void)
+{
+	return keyQueueCount ? keyQueue[keyQueueTail] : BTN_NO_KEY_DN;
+}
+
+	// Drop the key code returned by peekKeyCode() once it has been sent
+void NceCabBus::keyCodeSent(void)
+{
+	if (keyQueueCount)
+	{
+		keyQueueTail = (keyQueueTail + 1) & (NCE_CAB_BUS_KEY_QUEUE_SIZE - 1);
+		keyQueueCount--;
+	}
+
+	pollReply[0] = peekKeyCode();
+}
+#endif
+
 CAB_STATE NceCabBus::getCabState()
 {
 	return cabState;
 }
 
+#if NCE_CAB_BUS_STATS
+void NceCabBus::getStats(NceCabBusStats *pStats)
+{
+	noInterrupts();		// repliesSent may be updated by processByteFromISR()
+	*pStats = stats;
+	interrupts();
+}
+
+void NceCabBus::clearStats(void)
+{
+	noInterrupts();
+	memset(&stats, 0, sizeof(stats));
+	interrupts();
+}
+
+void NceCabBus::countCommand(uint8_t Command, bool Broadcast)
+{
+	CAB_BUS_CMD_CLASS cmdClass;
+
+	if (Broadcast)
+		cmdClass = CAB_BUS_CMD_CLASS_BROADCAST;
+	else if (Command <= CMD_PR_4TH_RIGHT)
+		cmdClass = CAB_BUS_CMD_CLASS_LCD_TEXT;
+	else if (Command <= CMD_HOME)
+		cmdClass = CAB_BUS_CMD_CLASS_LCD_CONTROL;
+	else if (Command <= CMD_CAB_SETUP)
+		cmdClass = CAB_BUS_CMD_CLASS_CAB_SETUP;
+	else if ((Command == CMD_RETURN_LOCO_ADDR) || (Command == CMD_RETURN_LOCO_INFO))
+		cmdClass = CAB_BUS_CMD_CLASS_LOCO;
+	else
+		cmdClass = CAB_BUS_CMD_CLASS_INDICATOR;
+
+	stats.commands[cmdClass]++;
+}
+#endif
+
 void NceCabBus::processByte(uint8_t inByte)
 {
+#if NCE_CAB_BUS_TRACE
+#if NCE_CAB_BUS_ISR_RECEIVE
+	if (!isrReceive)	// Otherwise traced on arrival by processByteFromISR()
+#endif
+	traceByte(NCE_CAB_BUS_TRACE_RS485_RX, inByte);
+#endif
+
+#if NCE_CAB_BUS_STATS
+	uint16_t startMicros = micros();
+
+	parseByte(inByte);
+
+	uint16_t elapsedMicros = (uint16_t)micros() - startMicros;
+	if (elapsedMicros > stats.maxProcessByteMicros)
+		stats.maxProcessByteMicros = elapsedMicros;
+#else
+	parseByte(inByte);
+#endif
+}
+
+void NceCabBus::parseByte(uint8_t inByte)
+{
+	NCE_CAB_BUS_STAT_INC(bytesParsed);
+
 	if ((inByte & CMD_TYPE_MASK) == CMD_TYPE_POLL)
 	{
 		uint8_t polledAddress = inByte & CMD_ASCII_MASK;
 
 		cmdBufferIndex = 0;
+		NCE_CAB_BUS_STAT_INC(pollsSeen);
 
 		if (polledAddress == 0)
 			cabState = CAB_STATE_EXEC_BROADCAST_CMD;
 
-		else if (polledAddress != cabAddress)
+		else if (!isOwnAddress(polledAddress))
 			cabState = CAB_STATE_PING_OTHER;
 
 		else
 		{
 			cabState = CAB_STATE_EXEC_MY_CMD;	// Listen for a Command
+			NCE_CAB_BUS_STAT_INC(pollsForUs);
+#if NCE_CAB_BUS_MULTI_ADDRESS
+			ownPolledAddress = polledAddress;
+#endif
+
+#if NCE_CAB_BUS_ISR_RECEIVE
+			if (isrReceive)		// processByteFromISR() has already sent our reply
+				return;
+#endif
 
 			switch (cabType)
 			{
 			case CAB_TYPE_LCD:
-				send2BytesResponse(keyCode, speedKnob);
-				keyCode = BTN_NO_KEY_DN;
-				break;
 			case CAB_TYPE_NO_LCD:
-				send2BytesResponse(keyCode, speedKnob);
-				keyCode = BTN_NO_KEY_DN;
+				callRS485SendBytes((uint8_t *)pollReply, 2);
+#if NCE_CAB_BUS_KEYPAD
+				keyCodeSent();
+#endif
 				break;
-			case CAB_TYPE_SMART:
-
-				if (CabBusCommandBuffer.count)
-				{
-					if (func_RS485SendBytes)
-						func_RS485SendBytes(CabBusCommandBuffer.data, CabBusCommandBuffer.count);
-
-					if (pLogger)
-					{
-						pLogger->print("\nSend RS485: ");
-						for (uint8_t i = 0; i < CabBusCommandBuffer.count; i++)
-						{
-							if (CabBusCommandBuffer.data[i] < 16)
-								pLogger->print('0');
-							pLogger->print(CabBusCommandBuffer.data[i], HEX);
-							pLogger->print(' ');
-						}
-						pLogger->println();
-					}
-
-					CabBusCommandBuffer.count = 0;
-					if (CabBusCommandBuffer1.count == 0)
-					// if not a read function send the reply here or not a two pass function prog on main or Accy
-					
-					if ((USBCommandBuffer.data[0] == 0x96) || (USBCommandBuffer.data[0] == 0x9E) ||
-						(USBCommandBuffer.data[0] == 0x9F) || (USBCommandBuffer.data[0] == 0xA0) ||
-						(USBCommandBuffer.data[0] == 0xA2) || (USBCommandBuffer.data[0] == 0xA6) ||
-						(USBCommandBuffer.data[0] == 0xA8) || (USBCommandBuffer.data[0] == 0xAd) ||
-						(USBCommandBuffer.data[0] == 0xAE) || (USBCommandBuffer.data[0] == 0xAF) ||
-						(USBCommandBuffer.data[0] == 0xB3) || (USBCommandBuffer.data[0] == 0xB4))
-
-					{
-						sendUSBResponse(USB_COMMAND_COMPLETED_SUCCESSFULLY);
-					}
-					break;
-				}
-				
-				if (CabBusCommandBuffer1.count)
-				{
-					if (func_RS485SendBytes)
-						func_RS485SendBytes(CabBusCommandBuffer1.data, CabBusCommandBuffer1.count);
-
-					if (pLogger)
-					{
-						pLogger->print("\nSend RS485: ");
-						for (uint8_t i = 0; i < CabBusCommandBuffer1.count; i++)
-						{
-							if (CabBusCommandBuffer1.data[i] < 16)
-								pLogger->print('0');
-							pLogger->print(CabBusCommandBuffer1.data[i], HEX);
-							pLogger->print(' ');
-						}
-						pLogger->println();
-					}
-
-					CabBusCommandBuffer1.count = 0;
 
-					// Send the Acknowledge here if its a two pass function prog on main or Accy
-
-					if ((USBCommandBuffer.data[0] == 0x96) || (USBCommandBuffer.data[0] == 0x9E) ||
-						(USBCommandBuffer.data[0] == 0x9F) || (USBCommandBuffer.data[0] == 0xA0) ||
-						(USBCommandBuffer.data[0] == 0xA2) || (USBCommandBuffer.data[0] == 0xA6) ||
-						(USBCommandBuffer.data[0] == 0xA8) || (USBCommandBuffer.data[0] == 0xAd) ||
-						(USBCommandBuffer.data[0] == 0xAE) || (USBCommandBuffer.data[0] == 0xAF) ||
-						(USBCommandBuffer.data[0] == 0xB3) || (USBCommandBuffer.data[0] == 0xB4))
-
-					{
-						sendUSBResponse(USB_COMMAND_COMPLETED_SUCCESSFULLY);
-					}
+#if NCE_CAB_BUS_SMART_CAB
+			case CAB_TYPE_SMART:
+				if (sendSmartCabCommand())
 					break;
-				}
-				
-				
 
+				// Nothing waiting to go out so send the same reply as an idle AIU
+				callRS485SendBytes((uint8_t *)pollReply, 2);
+				break;
+#endif
 
+#if NCE_CAB_BUS_AIU
 			case CAB_TYPE_AIU:
-				send2BytesResponse(aiuState & 0x7F, (aiuState >> 7) & 0x7F);
+				callRS485SendBytes((uint8_t *)pollReply, 2);
 				break;
+#endif
 
 			case CAB_TYPE_UNKNOWN:
 			case CAB_TYPE_RESERVED:
@@ -807,7 +534,15 @@ void NceCabBus::processByte(uint8_t inByte)
 	else if (cabState >= CAB_STATE_EXEC_MY_CMD)
 	{
 		if (cmdBufferIndex == 0)
+		{
 			cmdBufferExpectedLength = getCmdDataLen(inByte, cabState == CAB_STATE_EXEC_BROADCAST_CMD);
+			if (cmdBufferExpectedLength == 0)
+				NCE_CAB_BUS_STAT_INC(unknownCommands);
+		}
+
+			// Ignore the rest of an unknown command rather than overrun cmdBuffer
+		if (cmdBufferIndex >= CMD_LEN_MAX)
+			return;
 
 		if (cmdBufferIndex && (cmdBufferExpectedLength > 2))
 			cmdBuffer[cmdBufferIndex++] = adjustCabBusASCII(inByte);
@@ -816,55 +551,44 @@ void NceCabBus::processByte(uint8_t inByte)
 
 		if (cmdBufferIndex == cmdBufferExpectedLength)
 		{
-			if (pLogger)
-			{
-				pLogger->print("\nCmd: ");
-				for (uint8_t i = 0; i < cmdBufferExpectedLength; i++)
-				{
-					if (cmdBuffer[i] < 16)
-						pLogger->print('0');
-					pLogger->print(cmdBuffer[i], HEX);
-					pLogger->print('-');
-					char asciiValue = (char)(cmdBuffer[i] & CMD_ASCII_MASK);
-					pLogger->print(asciiValue);
-					pLogger->print(' ');
-				}
-			}
+			logBytes(LOG_EVENT_COMMAND, cmdBuffer, cmdBufferExpectedLength);
 
 			uint8_t Command = cmdBuffer[0];
 
+#if NCE_CAB_BUS_STATS
+			countCommand(Command, cabState == CAB_STATE_EXEC_BROADCAST_CMD);
+#endif
+
 			if (cabState == CAB_STATE_EXEC_MY_CMD)
 			{
 				switch (Command)
 				{
 				case CMD_CAB_TYPE:
+#if NCE_CAB_BUS_ISR_RECEIVE
+					if (!isrReceive)	// Otherwise already sent by processByteFromISR()
+#endif
 					send1ByteResponse(cabType);
 					break;
 
-
+#if NCE_CAB_BUS_FAST_CLOCK
 				case FAST_CLOCK_RATE_BCAST:	// Broadcast Fast Clock Rate
 					if (FastClockRate != cmdBuffer[1])
 					{
 						FastClockRate = cmdBuffer[1];
-						if (func_FastClockHandler && (FastClockMode > FAST_CLOCK_NOT_SET) && (FastClockRate > 0))
-							func_FastClockHandler(FastClockHours, FastClockMinutes, FastClockRate, FastClockMode);
+						callFastClockHandler();
 					}
 					break;
+#endif
 
 // 				case CMD_PR_1ST_RIGHT:  // Actually the same value as FAST_CLOCK_BCAST
 				case FAST_CLOCK_BCAST:	// Broadcast Fast Clock Time
-					FastClockHours = ((cmdBuffer[2] - '0') * 10) + (cmdBuffer[3] - '0');
-					FastClockMinutes = ((cmdBuffer[5] - '0') * 10) + (cmdBuffer[6] - '0');
-					if (cmdBuffer[7] == 'A')
-						FastClockMode = FAST_CLOCK_AM;
-					else if (cmdBuffer[7] == 'P')
-						FastClockMode = FAST_CLOCK_PM;
-					else
-						FastClockMode = FAST_CLOCK_24;
-
- 					if (func_FastClockHandler && (FastClockMode > FAST_CLOCK_NOT_SET) && (FastClockRate > 0))
-						func_FastClockHandler(FastClockHours, FastClockMinutes, FastClockRate, FastClockMode);
+#if NCE_CAB_BUS_FAST_CLOCK
+					fastClockTimeReceived();
+#endif
 
+#if !NCE_CAB_BUS_LCD
+					break;
+#else
 					// Let code fall-through to next case statements to continue
 					
 				case CMD_PR_1ST_LEFT:
@@ -874,52 +598,42 @@ void NceCabBus::processByte(uint8_t inByte)
 				case CMD_PR_3RD_RIGHT:
 				case CMD_PR_4TH_LEFT:
 				case CMD_PR_4TH_RIGHT:
-					if (func_LCDUpdateHandler)
 					{
 						uint8_t Row = (Command & 0x03) >> 1;
 						uint8_t Col = (Command & 0x01) * 8;
 
-						func_LCDUpdateHandler(Col, Row, (char*)cmdBuffer + 1, 8);
+						callLCDUpdateHandler(Col, Row, (char*)cmdBuffer + 1, 8);
 					}
 					break;
 
 				case CMD_MOVE_CURSOR:
-					if (func_LCDMoveCursorHandler)
-					{
-						if ((cmdBuffer[1] >= 0x80) && (cmdBuffer[1] <= 0x8F))
-							func_LCDMoveCursorHandler(cmdBuffer[1] - 0x80, 0);
+					if ((cmdBuffer[1] >= 0x80) && (cmdBuffer[1] <= 0x8F))
+						callLCDMoveCursorHandler(cmdBuffer[1] - 0x80, 0);
 
-						else if ((cmdBuffer[1] >= 0xC0) && (cmdBuffer[1] <= 0xCF))
-							func_LCDMoveCursorHandler(cmdBuffer[1] - 0xC0, 1);
-					}
+					else if ((cmdBuffer[1] >= 0xC0) && (cmdBuffer[1] <= 0xCF))
+						callLCDMoveCursorHandler(cmdBuffer[1] - 0xC0, 1);
 					break;
 
 				case CMD_PR_TTY:
 				case CMD_PR_TTY_NEXT:
-					if (func_LCDPrintCharHandler)
-						func_LCDPrintCharHandler((char)(cmdBuffer[1] & CMD_ASCII_MASK), Command == CMD_PR_TTY_NEXT);
+					callLCDPrintCharHandler((char)(cmdBuffer[1] & CMD_ASCII_MASK), Command == CMD_PR_TTY_NEXT);
 					break;
 
 				case CMD_HOME:
-					if (func_LCDCursorModeHandler)
-						func_LCDCursorModeHandler(CURSOR_HOME);
+					callLCDCursorModeHandler(CURSOR_HOME);
 
 				case CMD_CLEAR_HOME:
-					if (func_LCDCursorModeHandler)
-						func_LCDCursorModeHandler(CURSOR_CLEAR_HOME);
+					callLCDCursorModeHandler(CURSOR_CLEAR_HOME);
 
 				case CMD_CURSOR_OFF:
-					if (func_LCDCursorModeHandler)
-						func_LCDCursorModeHandler(CURSOR_OFF);
+					callLCDCursorModeHandler(CURSOR_OFF);
 
 				case CMD_CURSOR_ON:
-					if (func_LCDCursorModeHandler)
-						func_LCDCursorModeHandler(CURSOR_ON);
+					callLCDCursorModeHandler(CURSOR_ON);
 
 				case CMD_DISP_RIGHT:
-					if (func_LCDCursorModeHandler)
-						func_LCDCursorModeHandler(DISPLAY_SHIFT_RIGHT);
-
+					callLCDCursorModeHandler(DISPLAY_SHIFT_RIGHT);
+#endif
 				}
 			}
 
@@ -928,35 +642,30 @@ void NceCabBus::processByte(uint8_t inByte)
 				switch (Command)
 				{
 				case FAST_CLOCK_BCAST:	// Broadcast Fast Clock Time
-					FastClockHours = ((cmdBuffer[2] - '0') * 10) + (cmdBuffer[3] - '0');
-					FastClockMinutes = ((cmdBuffer[5] - '0') * 10) + (cmdBuffer[6] - '0');
-					if (cmdBuffer[7] == 'A')
-						FastClockMode = FAST_CLOCK_AM;
-					else if (cmdBuffer[7] == 'P')
-						FastClockMode = FAST_CLOCK_PM;
-					else
-						FastClockMode = FAST_CLOCK_24;
-
-					if (func_FastClockHandler && (FastClockMode > FAST_CLOCK_NOT_SET) && (FastClockRate > 0))
-						func_FastClockHandler(FastClockHours, FastClockMinutes, FastClockRate, FastClockMode);
-
-					if (cabType == CAB_TYPE_LCD && func_LCDUpdateHandler)
+#if NCE_CAB_BUS_FAST_CLOCK
+					fastClockTimeReceived();
+#endif
+
+#if NCE_CAB_BUS_LCD
+					if (cabType == CAB_TYPE_LCD)
 					{
 						uint8_t yPos = (Command & 0x03) >> 1;
 						uint8_t xPos = (Command & 0x01) * 8;
 
-						func_LCDUpdateHandler(xPos, yPos, (char*)cmdBuffer + 1, 8);
+						callLCDUpdateHandler(xPos, yPos, (char*)cmdBuffer + 1, 8);
 					}
+#endif
 					break;
 
+#if NCE_CAB_BUS_FAST_CLOCK
 				case FAST_CLOCK_RATE_BCAST:	// Broadcast Fast Clock Rate
 					if (FastClockRate != cmdBuffer[1])
 					{
 						FastClockRate = cmdBuffer[1];
-						if (func_FastClockHandler && (FastClockMode > FAST_CLOCK_NOT_SET) && (FastClockRate > 0))
-							func_FastClockHandler(FastClockHours, FastClockMinutes, FastClockRate, FastClockMode);
+						callFastClockHandler();
 					}
 					break;
+#endif
 				}
 			}
 			cmdBufferIndex = 0;
@@ -964,246 +673,66 @@ void NceCabBus::processByte(uint8_t inByte)
 	}
 }
 
-void NceCabBus::processResponseByte(uint8_t inByte)
+#if NCE_CAB_BUS_FAST_CLOCK
+	// The fast clock time, sent as a broadcast or to the fast clock cab address
+void NceCabBus::fastClockTimeReceived(void)
 {
-	if ((inByte == 0xD8) || (inByte == 0xD9) || (inByte == 0xDA))
-	{
-		CabBusReplyBuffer.count = 0;
-		CabBusReplyBuffer.Receive_Reply = true;
-		CabBusReplyBuffer.ReplySize;
-
-		switch (inByte)
-		{
-			case 0xD8:
-			{
-				CabBusReplyBuffer.ReplySize = 3;
-			break;
-			}
-			case 0xD9:
-			{
-				CabBusReplyBuffer.ReplySize = 4;
-			break;
-			}
-			case 0xDA:
-			{
-				CabBusReplyBuffer.ReplySize = 7;
-			break;
-			}
-		}
-	}
-
-		if (CabBusReplyBuffer.Receive_Reply == true) //Store the Reply
-		{
-			CabBusReplyBuffer.data[CabBusReplyBuffer.count] = inByte;
-			
-		if (pLogger)
-		{
-			pLogger->print("\nReply Buffer Size: ");
-			pLogger->println(CabBusReplyBuffer.ReplySize);
-			pLogger->print("Active State: ");
-			pLogger->println(CabBusReplyBuffer.Receive_Reply);
-			pLogger->print("Byte Count: ");
-			pLogger->println(CabBusReplyBuffer.count);
-			pLogger->print("T:");
-			pLogger->println();
-			pLogger->println();
-		}
-		
-		CabBusReplyBuffer.count++;
-		}
-	
-
-	if (CabBusReplyBuffer.ReplySize > 0)
-	{
-		if (CabBusReplyBuffer.count == CabBusReplyBuffer.ReplySize)
-		{
-
-			CabBusReplyBuffer.count = 0;
-			CabBusReplyBuffer.ReplySize = 0;
-			CabBusReplyBuffer.Receive_Reply = false;
-			if (pLogger)
-			{
-				pLogger->print("Active State: ");
-				pLogger->println(CabBusReplyBuffer.Receive_Reply);
-			}
-
-
-			switch (CabBusReplyBuffer.data[0])
-			{
-			case 0xD8:
-			{
-				USBResponseBuffer.data[0] = ((CabBusReplyBuffer.data[1] & 0x03) << 6) + (CabBusReplyBuffer.data[2] & 0x3F);
-
-				switch ((CabBusReplyBuffer.data[1] & 0x30))
-				{
-				case 0x00:
-					{
-						USBResponseBuffer.data[1] = (USB_COMMAND_COMPLETED_SUCCESSFULLY);
-						break;
-					}
-					case 0x01:
-					{
-						USBResponseBuffer.data[1] = (USB_ADDRESS_OUT_OF_RANGE);
-						break;
-					}
-					case 0x02:
-					{
-						USBResponseBuffer.data[1] = (USB_CAB_ADDRESS_OR_OPCODE_OUT_OF_RANGE);
-						break;
-					}
-					case 0x03:
-					{
-						USBResponseBuffer.data[1] = (USB_CV_ADDRESS_OR_DATA_OUT_OF_RANGE);
-						break;
-					}
-					case 0x04:
-					{
-						USBResponseBuffer.data[1] = (USB_BYTE_COUNT_OUT_OF_RANGE);
-						break;
-					}
-
-				}
-				if (USBCommandBuffer.data[0] == 0xB5)
-				USBResponseBuffer.count = 1;
-				else
-				USBResponseBuffer.count = 2;
-				break;
-			}
-			case 0xD9:
-			{
-				USBResponseBuffer.data[0] = ((CabBusReplyBuffer.data[1] & 0x0F) << 4) + (CabBusReplyBuffer.data[2] & 0x0F);
-				USBResponseBuffer.data[1] = ((CabBusReplyBuffer.data[2] & 0x30) << 2) + (CabBusReplyBuffer.data[3] & 0x3F);
-
-				switch ((CabBusReplyBuffer.data[1] & 0x30))
-				{
-					case 0x00:
-					{
-						USBResponseBuffer.data[2] = (USB_COMMAND_COMPLETED_SUCCESSFULLY);
-						break;
-					}
-					case 0x01:
-					{
-						USBResponseBuffer.data[2] = (USB_ADDRESS_OUT_OF_RANGE);
-						break;
-					}
-					case 0x02:
-					{
-						USBResponseBuffer.data[2] = (USB_CAB_ADDRESS_OR_OPCODE_OUT_OF_RANGE);
-						break;
-					}
-					case 0x03:
-					{
-						USBResponseBuffer.data[2] = (USB_CV_ADDRESS_OR_DATA_OUT_OF_RANGE);
-						break;
-					}
-					case 0x04:
-					{
-						USBResponseBuffer.data[2] = (USB_BYTE_COUNT_OUT_OF_RANGE);
-						break;
-					}
-
-				}
-				if ((USBCommandBuffer.data[0] == 0xB5) || (USBCommandBuffer.data[0] == 0x9B))
-					USBResponseBuffer.count = 2;
-				else
-					USBResponseBuffer.count = 3;
-				break;
-			}
-			case 0xDA:
-			{
-				USBResponseBuffer.data[0] = ((CabBusReplyBuffer.data[1] & 0x0F) << 4) + (CabBusReplyBuffer.data[2] & 0x0F);
-				USBResponseBuffer.data[1] = ((CabBusReplyBuffer.data[2] & 0x30) << 2) + (CabBusReplyBuffer.data[3] & 0x3F);
-				USBResponseBuffer.data[2] = ((CabBusReplyBuffer.data[4] & 0x0F) << 4) + (CabBusReplyBuffer.data[5] & 0x0F);
-				USBResponseBuffer.data[3] = ((CabBusReplyBuffer.data[5] & 0x30) << 2) + (CabBusReplyBuffer.data[6] & 0x3F);
-				
-
-				switch ((CabBusReplyBuffer.data[1] & 0x30))
-				{
-					case 0x00:
-					{
-						USBResponseBuffer.data[4] = (USB_COMMAND_COMPLETED_SUCCESSFULLY);
-						break;
-					}
-					case 0x01:
-					{
-						USBResponseBuffer.data[4] = (USB_ADDRESS_OUT_OF_RANGE);
-						break;
-					}
-					case 0x02:
-					{
-						USBResponseBuffer.data[4] = (USB_CAB_ADDRESS_OR_OPCODE_OUT_OF_RANGE);
-						break;
-					}
-					case 0x03:
-					{
-						USBResponseBuffer.data[4] = (USB_CV_ADDRESS_OR_DATA_OUT_OF_RANGE);
-						break;
-					}
-					case 0x04:
-					{
-						USBResponseBuffer.data[4] = (USB_BYTE_COUNT_OUT_OF_RANGE);
-						break;
-					}
-
-				}
-				if (USBCommandBuffer.data[0] == 0xB5) // This function has no status reply
-					USBResponseBuffer.count = 4;
-				else
-				USBResponseBuffer.count = 5;
-				break;
-			}
-			}
-
-			if (func_USBSendBytes)
-			{
-				func_USBSendBytes(USBResponseBuffer.data, USBResponseBuffer.count);
-				USBResponseBuffer.count = 0;
-			}
-
-			
-		}
-
-	}
-
-
-	
-}
-
+	FastClockHours = ((cmdBuffer[2] - '0') * 10) + (cmdBuffer[3] - '0');
+	FastClockMinutes = ((cmdBuffer[5] - '0') * 10) + (cmdBuffer[6] - '0');
+	if (cmdBuffer[7] == 'A')
+		FastClockMode = FAST_CLOCK_AM;
+	else if (cmdBuffer[7] == 'P')
+		FastClockMode = FAST_CLOCK_PM;
+	else
+		FastClockMode = FAST_CLOCK_24;
 
-void NceCabBus::sendUSBResponse(USB_RESPONSE_CODES response)
-{
-	if(func_USBSendBytes)
-	{
-		uint8_t responseBuffer = (response);
-		func_USBSendBytes(&responseBuffer, 1);
-	}
+	callFastClockHandler();
+#if NCE_CAB_BUS_USE_TIMETABLE
+	runTimetable();
+#endif
 }
-
-
-
+#endif
 
 void NceCabBus::send1ByteResponse(uint8_t byte0)
 {
-	if(func_RS485SendBytes)
-		func_RS485SendBytes(&byte0, 1);
+	callRS485SendBytes(&byte0, 1);
 }
 
-void NceCabBus::send2BytesResponse(uint8_t byte0, uint8_t byte1)
+	// Rebuild the 2 byte reply to our poll in wire format, called after anything it depends on
+	// changes. A smart cab sends it when it has no frame waiting
+void NceCabBus::updatePollReply(void)
 {
-	uint8_t bytes[2];
-	
-	if(func_RS485SendBytes)
+	switch (cabType)
 	{
-		bytes[0] = byte0;
-		bytes[1] = byte1;
-		
-		func_RS485SendBytes(bytes, 2);
+	case CAB_TYPE_LCD:
+	case CAB_TYPE_NO_LCD:
+#if NCE_CAB_BUS_KEYPAD
+		pollReply[0] = peekKeyCode();
+		pollReply[1] = speedKnob;
+#else
+		pollReply[0] = BTN_NO_KEY_DN;
+		pollReply[1] = 127;	// No keypad and knob not used
+#endif
+		break;
+
+	default:
+#if NCE_CAB_BUS_AIU
+		pollReply[0] = aiuState & 0x7F;
+		pollReply[1] = (aiuState >> 7) & 0x7F;
+#else
+		pollReply[0] = 0;
+		pollReply[1] = 0;
+#endif
+		break;
 	}
 }
 
+#if NCE_CAB_BUS_AIU
 void NceCabBus::setAuiIoState(uint16_t state)
 {
+	BEGIN_REPLY_UPDATE();
 	aiuState = state & ((1 << AIU_NUM_IOS) - 1);
+	END_REPLY_UPDATE();
 }
  
 uint16_t NceCabBus::getAuiIoState(void)
@@ -1215,10 +744,12 @@ void NceCabBus::setAuiIoBitState(uint8_t IoNum, bool bitState)
 {
 	if(IoNum < AIU_NUM_IOS)
 	{
+		BEGIN_REPLY_UPDATE();
 		if(bitState)
 			aiuState |= 1 << IoNum;
 		else
 			aiuState &= ~(1 << IoNum);
+		END_REPLY_UPDATE();
 	}
 }
 
@@ -1230,4 +761,4 @@ bool NceCabBus::getAuiIoBitState(uint8_t IoNum)
 
 	return false;
 }
-    
+#endif
@@ -16,12 +16,18 @@
 // history:   2019-04-28 Initial Version
 // history:   2021-05-30 Added functions under the smart device for usb interface
 //                       and added processResponseByte   
+// history:   2026-10-19 Split into roles selected in NceCabBusConfig.h, moved the
+//                       smart cab buffers into the object and the USB
+//                       translator into NceCabBusUSB.cpp
 //------------------------------------------------------------------------
 //
 // purpose:   Provide a simplified interface to the NCE Cab Bus
 //
 //------------------------------------------------------------------------
 
+#ifndef NCE_CAB_BUS_H
+#define NCE_CAB_BUS_H
+
 #if defined(ARDUINO) && ARDUINO >= 100
 #include "Arduino.h"
 #else
@@ -30,11 +36,70 @@
 
 #include "Print.h"
 #include "keycodes.h"
+#include "NceCabBusConfig.h"
+
+#if NCE_CAB_BUS_SERVICE
+#include "Stream.h"
+#endif
 
 #define AIU_NUM_IOS 14
 
 #define CMD_LEN_MAX 9
 
+#define CAB_BUS_COMMAND_LENGTH	5	// Longest reply we send to a poll: a smart cab command frame
+
+	// Several smart cab addresses sharing one frame queue
+#define NCE_CAB_BUS_MULTI_ADDRESS	(NCE_CAB_BUS_SMART_CAB && (NCE_CAB_BUS_SMART_CAB_ADDRESSES > 1))
+
+#if NCE_CAB_BUS_SNAPSHOT
+#define NCE_CAB_BUS_SNAPSHOT_VERSION	1
+
+	// Largest snapshot saveSnapshot() writes with the roles built in: a 6 byte header, each
+	// section with a tag and length byte, and the CRC
+#define SNAPSHOT_LCD_SIZE		((NCE_CAB_BUS_LCD) ? (2 + 2 + (NCE_CAB_BUS_LCD_COLS * NCE_CAB_BUS_LCD_ROWS)) : 0)
+#define SNAPSHOT_FAST_CLOCK_SIZE	((NCE_CAB_BUS_FAST_CLOCK) ? (2 + 4) : 0)
+#define SNAPSHOT_AIU_SIZE		((NCE_CAB_BUS_AIU) ? (2 + 2) : 0)
+#if NCE_CAB_BUS_MULTI_ADDRESS
+	// Frames in the queue past what fits in one 255 byte section are not saved
+#define SNAPSHOT_FRAMES_SIZE	((NCE_CAB_BUS_SMART_CAB_QUEUE_SIZE * (1 + CAB_BUS_COMMAND_LENGTH)) < 255 ? (NCE_CAB_BUS_SMART_CAB_QUEUE_SIZE * (1 + CAB_BUS_COMMAND_LENGTH)) : 255)
+#define SNAPSHOT_SMART_CAB_SIZE	((2 + NCE_CAB_BUS_SMART_CAB_ADDRESSES - 1) + (2 + SNAPSHOT_FRAMES_SIZE))
+#else
+#define SNAPSHOT_SMART_CAB_SIZE	0
+#endif
+#define NCE_CAB_BUS_SNAPSHOT_SIZE	(6 + SNAPSHOT_LCD_SIZE + SNAPSHOT_FAST_CLOCK_SIZE + SNAPSHOT_AIU_SIZE + SNAPSHOT_SMART_CAB_SIZE + 2)
+#endif
+
+#if NCE_CAB_BUS_SMART_CAB
+#define MAX_USB_COMMAND_LENGTH	11
+typedef struct
+{
+	uint8_t expectedLength;
+	uint8_t count;
+	uint8_t data[MAX_USB_COMMAND_LENGTH];
+} USBCommand;
+
+typedef struct
+{
+	uint8_t count;
+	uint8_t data[CAB_BUS_COMMAND_LENGTH];
+} CabBusCommand;
+
+typedef struct
+{
+	uint8_t count;
+	uint8_t data[MAX_USB_COMMAND_LENGTH];
+} USBResponse;
+
+typedef struct
+{
+	uint8_t count;			// Reply bytes received including the 0xD8..0xDA opcode
+	uint8_t ReplySize;		// Reply frame length, 0 when not receiving a reply
+	uint8_t opcode;
+	uint8_t lastByte;		// Previous reply byte, holds the first half of the byte being decoded
+	uint8_t status;			// USB status byte from the first reply byte
+} CabBusCommandReply;
+#endif
+
 typedef enum
 {
   CAB_TYPE_UNKNOWN = 0,
@@ -83,14 +148,150 @@ typedef enum
 	USB_COMMAND_COMPLETED_SUCCESSFULLY = '!',
 } USB_RESPONSE_CODES;
 
+	// Vendor USB opcodes answered by the library itself
+#define NCE_USB_VENDOR_GET_STATS	0xF0	// Returns the NceCabBusStats block
+#define NCE_USB_VENDOR_CLEAR_STATS	0xF1	// Returns !
+#define NCE_USB_VENDOR_ROUTE		0xF2	// 0xF2 <route>, returns ! when queued, 1 no such route, 4 route queue full
+
+#if NCE_CAB_BUS_SMART_CAB && NCE_CAB_BUS_ROUTES
+	// Route table entries, an accessory address 1..2044 and the state to set it to
+#define NCE_ROUTE_NORMAL(address)	((uint16_t)(address))
+#define NCE_ROUTE_REVERSE(address)	((uint16_t)(0x8000 | (address)))
+#define NCE_ROUTE_END				0
+
+	// Or with the route number to send every accessory even if already set
+#define NCE_ROUTE_FORCE				0x80
+#endif
+
+	// Fast clock timetable, only built with the fast clock
+#define NCE_CAB_BUS_USE_TIMETABLE	(NCE_CAB_BUS_FAST_CLOCK && NCE_CAB_BUS_TIMETABLE)
+
+#if NCE_CAB_BUS_USE_TIMETABLE
+	// Timetable entry times, minutes from midnight on the 24 hour fast clock
+#define NCE_TIME(hours, minutes)	((uint16_t)(((hours) * 60) + (minutes)))
+#define TIMETABLE_TIME_UNKNOWN		0xFFFF
+
+	// Timetable actions: an id 0..4095 passed to the TimetableHandler, a macro 0..255, an
+	// accessory address 1..2044 and the state to set it to, or a route 0..127 with NCE_ROUTE_FORCE
+	// or'ed in to send every accessory. A route value above 0xFF is never run
+#define NCE_TIMETABLE_CALLBACK(id)			((uint16_t)(id))
+#if NCE_CAB_BUS_SMART_CAB
+#define NCE_TIMETABLE_MACRO(macro)			((uint16_t)(0x1000 | (macro)))
+#define NCE_TIMETABLE_NORMAL(address)		((uint16_t)(0x2000 | (address)))
+#define NCE_TIMETABLE_REVERSE(address)		((uint16_t)(0x3000 | (address)))
+#if NCE_CAB_BUS_ROUTES
+#define NCE_TIMETABLE_ROUTE(route)			((uint16_t)(0x4000 | (route)))
+#endif
+#endif
+
+	// In PROGMEM, sorted by time with no two entries for the same minute and action
+typedef struct
+{
+	uint16_t time;
+	uint16_t action;
+} NceTimetableEntry;
+#endif
+
+#if NCE_CAB_BUS_STATS
+typedef enum
+{
+	CAB_BUS_CMD_CLASS_LCD_TEXT = 0,		// 0xC0-0xC7 Print 8 characters
+	CAB_BUS_CMD_CLASS_LCD_CONTROL,		// 0xC8-0xD1 Cursor, single character and display control
+	CAB_BUS_CMD_CLASS_CAB_SETUP,		// 0xD2-0xD3 Cab type and setup
+	CAB_BUS_CMD_CLASS_INDICATOR,		// 0xD4-0xD9, 0xDC Lights and buzzer
+	CAB_BUS_CMD_CLASS_LOCO,				// 0xDA-0xDB Loco address and info
+	CAB_BUS_CMD_CLASS_BROADCAST,		// Fast clock time and rate
+	CAB_BUS_CMD_CLASS_COUNT
+} CAB_BUS_CMD_CLASS;
+
+	// Fixed layout, also sent as is (little endian) in reply to USB opcode 0xF0
+typedef struct
+{
+	uint32_t bytesParsed;			// Bytes passed to processByte()
+	uint32_t pollsSeen;
+	uint32_t pollsForUs;
+	uint32_t repliesSent;			// Replies sent on the RS485 bus
+	uint16_t commands[CAB_BUS_CMD_CLASS_COUNT];	// Commands decoded by CAB_BUS_CMD_CLASS
+	uint16_t unknownCommands;		// Commands with an unknown opcode or no length
+	uint16_t usbCommandsAccepted;
+	uint16_t usbCommandsRejected;	// Answered with an error or Not Supported
+	uint16_t usbCommandsOverflowed;	// Arrived while a Cab Bus frame was still waiting to be sent
+	uint16_t repliesDecoded;		// 0xD8-0xDA replies passed to processResponseByte()
+	uint16_t repliesOrphaned;		// Replies cut short by the start of another
+	uint16_t maxProcessByteMicros;
+	uint16_t reserved;
+} NceCabBusStats;
+
+#define NCE_CAB_BUS_STAT_INC(counter)	stats.counter++
+#else
+#define NCE_CAB_BUS_STAT_INC(counter)	do {} while (0)
+#endif
+
+#if NCE_CAB_BUS_TRACE
+	// Trace record: <tag> <byte> [<delta>...]
+	// tag bits 7-6 channel, bit 5 set if more delta bytes follow, bits 4-0 low 5 bits of the
+	// microseconds since the previous record. Each following delta byte holds the next 7 bits,
+	// bit 7 set if another follows
+#define NCE_CAB_BUS_TRACE_RS485_RX	0x00
+#define NCE_CAB_BUS_TRACE_RS485_TX	0x40
+#define NCE_CAB_BUS_TRACE_USB_RX	0x80
+#define NCE_CAB_BUS_TRACE_USB_TX	0xC0
+#define NCE_CAB_BUS_TRACE_MORE		0x20
+
+#define NCE_CAB_BUS_TRACE_BYTE(channel, value)	traceByte(channel, value)
+#else
+#define NCE_CAB_BUS_TRACE_BYTE(channel, value)
+#endif
+
+	// setLogger() messages, also the record ids of the deferred log ring. A record is a
+	// header byte, id << 3 | argument count, and up to 4 argument bytes. Byte dumps are
+	// a record holding the count and the first 3 bytes then LOG_EVENT_DATA records
+typedef enum
+{
+	LOG_EVENT_COMMAND = 0,		// Cab Bus command for us or broadcast: bytes
+	LOG_EVENT_USB_ADD_BYTE,		// value
+	LOG_EVENT_USB_NEW_COMMAND,	// opcode, expected length
+	LOG_EVENT_USB_PROCESS,		// bytes
+	LOG_EVENT_REPLY,			// opcode, size
+	LOG_EVENT_SEND_RS485,		// bytes
+	LOG_EVENT_ROUTE_QUEUED,		// route
+	LOG_EVENT_ROUTE_DONE,		// route
+	LOG_EVENT_TIMETABLE,		// hours, minutes of the entries run
+	LOG_EVENT_DATA,				// Next bytes of the dump before
+} LOG_EVENT;
+
 typedef void (*RS485SendByte)(uint8_t value);
 typedef void (*RS485SendBytes)(uint8_t *values, uint8_t length);
 typedef void (*USBSendBytes)(uint8_t *values, uint8_t length);
+
+#if NCE_CAB_BUS_SMART_CAB
+	// Bytes in the USB command starting with opcode Command, -1 if not a known opcode
+int8_t getUSBCommandLength(uint8_t Command);
+#endif
 typedef void (*FastClockHandler)(uint8_t Hours, uint8_t Minutes, uint8_t Rate, FAST_CLOCK_MODE Mode);
 typedef void (*LCDUpdateHandler)(uint8_t Col, uint8_t Row, char *msg, uint8_t len);
 typedef void (*LCDMoveCursorHandler)(uint8_t Col, uint8_t Row);
 typedef void (*LCDCursorModeHandler)(CURSOR_MODE mode);
 typedef void (*LCDPrintCharHandler)(char ch, bool advanceCursor);
+#if NCE_CAB_BUS_SERVICE
+	// Runs some sketch work within budgetUs, returns true when it has more to do
+typedef bool (*AppTaskHandler)(uint32_t budgetUs);
+#endif
+#if NCE_CAB_BUS_USE_TIMETABLE
+typedef void (*TimetableHandler)(uint16_t id, uint8_t Hours, uint8_t Minutes);
+#endif
+
+	// The same handlers with a context pointer, see NceCabBusListener.h
+typedef struct
+{
+	void (*sendRS485Bytes)(void *context, uint8_t *values, uint8_t length);
+	void (*sendUSBBytes)(void *context, uint8_t *values, uint8_t length);
+	void (*fastClock)(void *context, uint8_t Hours, uint8_t Minutes, uint8_t Rate, FAST_CLOCK_MODE Mode);
+	void (*lcdUpdate)(void *context, uint8_t Col, uint8_t Row, char *msg, uint8_t len);
+	void (*lcdMoveCursor)(void *context, uint8_t Col, uint8_t Row);
+	void (*lcdCursorMode)(void *context, CURSOR_MODE mode);
+	void (*lcdPrintChar)(void *context, char ch, bool advanceCursor);
+} NceCabBusListenerTable;
 
 class NceCabBus
 {
@@ -104,31 +305,116 @@ class NceCabBus
     uint8_t getCabAddress(void);
     void setCabAddress(uint8_t addr);
     void setFastClockCabAddress(uint8_t addr);    
+#if NCE_CAB_BUS_MULTI_ADDRESS
+    bool addCabAddress(uint8_t addr);
+#endif
     
     CAB_STATE getCabState();
     
     void processByte(uint8_t inByte);
+    void setRS485SendBytesHandler(RS485SendBytes funcPtr);
+    void setListener(void *context, const NceCabBusListenerTable *table);
+
+#if NCE_CAB_BUS_SERVICE
+    void setServiceStreams(Stream *rs485, Stream *usb);
+    void setAppTaskHandler(AppTaskHandler funcPtr);
+    uint32_t service(uint32_t now, uint32_t budgetUs);
+#endif
+
+#if NCE_CAB_BUS_STATS
+    void getStats(NceCabBusStats *pStats);
+    void clearStats(void);
+#endif
+
+#if NCE_CAB_BUS_DEFERRED_LOG
+    void flushLog(void);
+    uint16_t getLogDropped(void);
+#endif
+
+#if NCE_CAB_BUS_SNAPSHOT
+    uint16_t saveSnapshot(uint8_t *buffer, uint16_t size);
+    bool restoreSnapshot(const uint8_t *buffer, uint16_t length);
+#ifdef __AVR__
+    uint16_t saveSnapshotEEPROM(uint16_t eepromAddress);
+    bool restoreSnapshotEEPROM(uint16_t eepromAddress);
+#endif
+#if NCE_CAB_BUS_LCD
+    char getLCDChar(uint8_t Col, uint8_t Row);
+#endif
+#endif
+
+#if NCE_CAB_BUS_TRACE
+    void setTraceEnabled(bool enabled);
+    uint16_t readTrace(uint8_t *buffer, uint16_t size);
+    void dumpTrace(Print *pOut);
+    uint16_t getTraceDropped(void);
+#endif
+
+#if NCE_CAB_BUS_ISR_RECEIVE
+    void processByteFromISR(uint8_t inByte);
+    void processQueuedBytes(void);
+    uint8_t getRxQueueOverflows(void);
+
+		// Host side of an offload bridge, see NceCabBusBridge.h
+    void processForwardedByte(uint8_t inByte, const uint8_t *sentReply, uint8_t sentLength);
+    uint8_t getPollReply(uint8_t *reply, uint8_t *idleReply);
+#endif
+
+#if NCE_CAB_BUS_SMART_CAB
     void processUSBByte(uint8_t inByte);
     void processResponseByte(uint8_t inByte);
-    
-    void setRS485SendBytesHandler(RS485SendBytes funcPtr);
     void setUSBSendBytesHandler(USBSendBytes funcPtr);
+    bool isUSBCommandPending(void);
+#if NCE_CAB_BUS_USB_TX_BUFFER_SIZE
+    void setUSBSendBuffering(bool enabled);
+    void flushUSB(void);
+#endif
+
+#if NCE_CAB_BUS_ROUTES
+    void setRouteTable(const uint16_t *table, uint8_t routeCount);
+#ifdef __AVR__
+    void setRouteTableEEPROM(uint16_t eepromAddress, uint8_t routeCount);
+#endif
+    bool triggerRoute(uint8_t route);
+    uint8_t getRoutesPending(void);
+    void clearAccessoryCache(void);
+#endif
+#endif
+
+#if NCE_CAB_BUS_LCD
     void setLCDUpdateHandler(LCDUpdateHandler funcPtr);
     void setLCDMoveCursorHandler(LCDMoveCursorHandler funcPtr);
     void setLCDCursorModeHandler(LCDCursorModeHandler funcPtr);
     void setLCDPrintCharHandler(LCDPrintCharHandler funcPtr);
+#endif
 
+#if NCE_CAB_BUS_FAST_CLOCK
     void setFastClockHandler(FastClockHandler funcPtr);
+#if NCE_CAB_BUS_USE_TIMETABLE
+    void setTimetable(const NceTimetableEntry *table, uint16_t count);
+    void setTimetableHandler(TimetableHandler funcPtr);
+#if NCE_CAB_BUS_SMART_CAB
+    uint8_t getTimetablePending(void);
+    uint8_t getTimetableOverflows(void);
+#endif
+#endif
+#endif
     
+#if NCE_CAB_BUS_AIU
     void setAuiIoState(uint16_t state); 
     uint16_t getAuiIoState(void);
     
     void setAuiIoBitState(uint8_t IoNum, bool bitState); 
     bool getAuiIoBitState(uint8_t IoNum);
+#endif
     
+#if NCE_CAB_BUS_KEYPAD
     void setSpeedKnob(uint8_t speed);
     uint8_t getSpeedKnob(void);
     void setKeyPress(uint8_t keyCode);
+    void setMergeKeyReleases(bool merge);
+    uint8_t getKeyQueueOverflows(void);
+#endif
 
 
   private:
@@ -136,33 +422,382 @@ class NceCabBus
   	CAB_STATE	cabState;
   	uint8_t 	cabAddress;
   	
+  	bool		isOwnAddress(uint8_t address);
+
+#if NCE_CAB_BUS_MULTI_ADDRESS
+  	uint8_t		extraCabAddresses[NCE_CAB_BUS_SMART_CAB_ADDRESSES - 1];
+  	uint8_t		extraCabAddressCount;
+  	uint8_t		ownPolledAddress;		// Our address whose poll the last frame was sent on
+  	uint8_t		replyAddress;			// Address that sent the last frame, its reply follows that poll
+  	uint8_t		responsePolledAddress;	// Last poll seen by processResponseByte()
+
+  	CabBusCommand	frameQueue[NCE_CAB_BUS_SMART_CAB_QUEUE_SIZE];
+  	uint8_t		frameQueueTail;
+  	uint8_t		frameQueueCount;
+
+  	void		queueSmartCabFrames(void);
+#endif
+
+#if NCE_CAB_BUS_AIU
   	uint16_t	aiuState;
+#endif
 	
+#if NCE_CAB_BUS_FAST_CLOCK
   	uint8_t		FastClockHours;
   	uint8_t		FastClockMinutes;
   	uint8_t		FastClockRate; // As a Ratio of n:1
   	FAST_CLOCK_MODE	FastClockMode;
+  	FastClockHandler 			func_FastClockHandler;
+
+  	void		fastClockTimeReceived(void);
+#endif
+
+#if NCE_CAB_BUS_USE_TIMETABLE
+  	const NceTimetableEntry	*timetable;
+  	uint16_t	timetableCount;
+  	uint16_t	timetableNext;		// First entry after timetableTime
+  	uint16_t	timetableTime;		// Last fast time run, TIMETABLE_TIME_UNKNOWN until the clock is seen
+  	TimetableHandler	func_TimetableHandler;
+#if NCE_CAB_BUS_SMART_CAB
+  	uint16_t	timetableQueue[NCE_CAB_BUS_TIMETABLE_QUEUE_SIZE];	// Macro and accessory actions waiting for our polls
+  	uint8_t		timetableQueueTail;
+  	uint8_t		timetableQueueCount;
+  	uint8_t		timetableOverflows;
+  	CabBusCommand	timetableFrame;
+
+  	CabBusCommand	*nextTimetableFrame(void);
+  	void		timetableFrameSent(void);
+#endif
+
+  	void		runTimetable(void);
+  	void		syncTimetable(uint16_t now);
+  	void		runTimetableAction(uint16_t action);
+#endif
   	
+#if NCE_CAB_BUS_KEYPAD
   	uint8_t		speedKnob; // Range 0-126, 127 = knob not used
-  	uint8_t		keyCode; // Range 0-126, 127 = knob not used
+  	volatile uint8_t	keyQueue[NCE_CAB_BUS_KEY_QUEUE_SIZE];	// Key presses not yet reported to the Command Station
+  	volatile uint8_t	keyQueueTail;
+  	volatile uint8_t	keyQueueCount;
+  	uint8_t		keyQueueOverflows;
+  	bool		mergeKeyReleases;
+
+  	uint8_t		peekKeyCode(void);
+  	void		keyCodeSent(void);
+#endif
 	
+#if NCE_CAB_BUS_STATS
+  	NceCabBusStats	stats;
+  	void		countCommand(uint8_t Command, bool Broadcast);
+#endif
+
+  	void		parseByte(uint8_t inByte);
+
+#if NCE_CAB_BUS_SERVICE
+  	Stream		*pRS485Stream;
+  	Stream		*pUSBStream;
+  	AppTaskHandler	func_AppTaskHandler;
+
+  	void		serviceRS485(void);
+#if NCE_CAB_BUS_SMART_CAB
+  	void		serviceUSB(void);
+#endif
+#endif
+
+#if NCE_CAB_BUS_TRACE
+  	volatile uint8_t	traceRing[NCE_CAB_BUS_TRACE_SIZE];
+  	volatile uint16_t	traceHead;
+  	volatile uint16_t	traceCount;
+  	uint16_t		traceTail;
+  	uint16_t		traceDropped;
+  	uint32_t		traceLastMicros;
+  	bool			traceEnabled;
+
+  	void		traceByte(uint8_t channel, uint8_t value);
+#endif
+
   	uint8_t		cmdBufferIndex;
   	uint8_t		cmdBufferExpectedLength;
   	uint8_t		cmdBuffer[CMD_LEN_MAX];
   	
+  	volatile uint8_t	pollReply[2];	// Key code and knob, or AIU inputs, ready to send when we are polled
+
   	void		send1ByteResponse(uint8_t byte0);
-  	void		send2BytesResponse(uint8_t byte0, uint8_t byte1);
-  	uint8_t		calcChecksum(uint8_t *Buffer, uint8_t Length);
-	void		sendUSBResponse(USB_RESPONSE_CODES response);
+  	void		updatePollReply(void);
   	
   	RS485SendBytes				func_RS485SendBytes;
-  	USBSendBytes				func_USBSendBytes;
-  	FastClockHandler 			func_FastClockHandler;
+
+  	void							*listenerContext;
+  	const NceCabBusListenerTable	*pListenerTable;	// Used instead of the func_ handlers when set
+
+  	inline void	callRS485SendBytes(uint8_t *values, uint8_t length);
+#if NCE_CAB_BUS_SMART_CAB
+  	inline void	callUSBSendBytes(uint8_t *values, uint8_t length);
+  	inline void	deliverUSBBytes(uint8_t *values, uint8_t length);
+#endif
+#if NCE_CAB_BUS_FAST_CLOCK
+  	inline void	callFastClockHandler(void);
+#endif
+#if NCE_CAB_BUS_LCD
+  	inline void	callLCDUpdateHandler(uint8_t Col, uint8_t Row, char *msg, uint8_t len);
+  	inline void	callLCDMoveCursorHandler(uint8_t Col, uint8_t Row);
+  	inline void	callLCDCursorModeHandler(CURSOR_MODE mode);
+  	inline void	callLCDPrintCharHandler(char ch, bool advanceCursor);
+#endif
+
+#if NCE_CAB_BUS_SNAPSHOT && NCE_CAB_BUS_LCD
+  	char		lcdShadow[NCE_CAB_BUS_LCD_ROWS][NCE_CAB_BUS_LCD_COLS];	// What the LCD handlers have been told to show
+  	uint8_t		lcdShadowCol;
+  	uint8_t		lcdShadowRow;
+
+  	void		shadowLCDText(uint8_t Col, uint8_t Row, const char *msg, uint8_t len);
+  	void		shadowLCDChar(char ch, bool advanceCursor);
+  	void		shadowLCDCursorMode(CURSOR_MODE mode);
+#endif
+
+#if NCE_CAB_BUS_LCD
   	LCDUpdateHandler			func_LCDUpdateHandler;
   	LCDMoveCursorHandler 	func_LCDMoveCursorHandler;
   	LCDCursorModeHandler	func_LCDCursorModeHandler;
   	LCDPrintCharHandler 	func_LCDPrintCharHandler;
+#endif
+
+#if NCE_CAB_BUS_SMART_CAB
+  	USBCommand			USBCommandBuffer;
+  	USBResponse			USBResponseBuffer;
+  	CabBusCommand		CabBusCommandBuffer;
+  	CabBusCommand		CabBusCommandBuffer1;	// Second frame of the two pass ops programming commands
+  	CabBusCommandReply	CabBusReplyBuffer;
+  	USBSendBytes		func_USBSendBytes;
+  	bool				usbCommandPending;	// From the first byte of a USB command until its response is sent
+#if NCE_CAB_BUS_USB_TX_BUFFER_SIZE
+  	uint8_t				usbTxBuffer[NCE_CAB_BUS_USB_TX_BUFFER_SIZE];
+  	uint8_t				usbTxCount;
+  	bool				usbTxBuffering;
+  	bool				usbTxHold;		// Set while service() reads USB commands, it flushes once after them
+#endif
+
+  	uint8_t		calcChecksum(uint8_t *Buffer, uint8_t Length);
+	void		sendUSBResponse(USB_RESPONSE_CODES response);
+	void		sendUSBByte(uint8_t value);
+	void		endUSBReply(uint8_t status);
+	void		usbResponseSent(void);
+	void		closeOrphanedReply(void);
+#if NCE_CAB_BUS_USB_TX_BUFFER_SIZE
+	void		queueUSBBytes(uint8_t *values, uint8_t length);
+#endif
+	bool		sendSmartCabCommand(void);
+	CabBusCommand	*nextSmartCabCommand(void);
+	void		smartCabCommandSent(CabBusCommand *pCommand);
+	bool		needsUSBAcknowledge(uint8_t Command);
+
+#if NCE_CAB_BUS_ROUTES
+  	const uint16_t	*routeTable;		// PROGMEM, routeCount x NCE_CAB_BUS_ROUTE_LENGTH entries
+  	uint16_t	routeEEPROMAddress;
+  	bool		routeInEEPROM;
+  	uint8_t		routeCount;
+  	uint8_t		routeQueue[NCE_CAB_BUS_ROUTE_QUEUE_SIZE];
+  	uint8_t		routeQueueTail;
+  	uint8_t		routeQueueCount;
+  	uint8_t		routeIndex;			// Next entry of the route at routeQueueTail
+  	CabBusCommand	routeFrame;
+  	uint16_t	routeFrameEntry;	// Entry routeFrame was built from
+  	uint8_t		accessoryKnown[(NCE_CAB_BUS_ROUTE_CACHE_SIZE + 7) / 8];
+  	uint8_t		accessoryReversed[(NCE_CAB_BUS_ROUTE_CACHE_SIZE + 7) / 8];
+
+  	uint16_t	readRouteEntry(uint8_t route, uint8_t index);
+  	CabBusCommand	*nextRouteFrame(void);
+  	void		routeFrameSent(void);
+  	void		cancelRoutes(void);
+  	void		setAccessoryState(uint16_t address, bool reversed);
+  	bool		isAccessoryState(uint16_t address, bool reversed);
+#endif
+#endif
+  	
+#if NCE_CAB_BUS_ISR_RECEIVE
+  	bool			isrReceive;		// Set once processByteFromISR() is in use
+  	volatile bool		isrOwnPoll;		// The last byte seen by the ISR was our poll
+  	volatile uint8_t	rxQueue[NCE_CAB_BUS_RX_QUEUE_SIZE];
+  	volatile uint8_t	rxQueueHead;	// Only written by processByteFromISR()
+  	volatile uint8_t	rxQueueTail;	// Only written by processQueuedBytes()
+  	volatile uint8_t	rxQueueOverflows;
+  	volatile uint8_t	isrReply[CAB_BUS_COMMAND_LENGTH];	// Pre-built reply to our poll
+  	volatile uint8_t	isrReplyLength;
+#if NCE_CAB_BUS_SMART_CAB
+  	CabBusCommand * volatile	isrReplyCommand;	// Frame in isrReply or NULL
+  	CabBusCommand * volatile	isrSentCommand;		// Last frame sent by the interrupt
+  	volatile uint8_t	isrCommandsSent;
+#if NCE_CAB_BUS_MULTI_ADDRESS
+  	volatile uint8_t	isrPolledAddress;	// Our address the ISR is answering
+  	volatile uint8_t	isrSentAddress;		// Address isrSentCommand went out on
+#endif
+  	uint8_t				isrCommandsHandled;
+#endif
+
+  	void		updateISRReply(void);
+  	void		setISRIdleReply(void);
+  	void		sendISRReply(void);
+  	void		isrReplySent(void);
+  	bool		isISRReply(const uint8_t *reply, uint8_t length);
+  	void		queueRxByte(uint8_t inByte);
+  	void		processRxQueue(bool responses);
+#if NCE_CAB_BUS_SMART_CAB
+  	void		finishISRCommands(void);
+#endif
+#endif
   	
   	uint8_t getCmdDataLen(uint8_t cmd, uint8_t Broadcast);
   	Print *pLogger;
+
+#if NCE_CAB_BUS_DEFERRED_LOG
+  	uint8_t		logRing[NCE_CAB_BUS_LOG_SIZE];
+  	uint16_t	logHead;
+  	uint16_t	logCount;
+  	uint16_t	logDropped;
+  	uint16_t	logDroppedReported;
+
+  	void		logRecord(uint8_t event, const uint8_t *args, uint8_t argCount);
+  	uint8_t		readLogByte(void);
+#endif
+
+  	inline void	logEvent(uint8_t event, uint8_t arg0, uint8_t arg1);
+  	void		logBytes(uint8_t event, const uint8_t *bytes, uint8_t count);
+  	void		printLogRecord(uint8_t event, const uint8_t *args, uint8_t count);
 };
+
+#if NCE_CAB_BUS_ISR_RECEIVE
+	// The poll reply state is shared with processByteFromISR() so change it with
+	// interrupts off and rebuild the pre-built reply before enabling them again
+#define BEGIN_REPLY_UPDATE()	noInterrupts()
+#define END_REPLY_UPDATE()		do { updatePollReply(); updateISRReply(); interrupts(); } while(0)
+#else
+	// Keep the poll reply ready so answering a poll is only a call to the RS485 send handler
+#define BEGIN_REPLY_UPDATE()
+#define END_REPLY_UPDATE()		updatePollReply()
+#endif
+
+	// Handler dispatch, defined here so the compiler can inline it into processByte(). The
+	// handlers themselves are called through the listener table or the func_ pointers
+inline void NceCabBus::callRS485SendBytes(uint8_t *values, uint8_t length)
+{
+	NCE_CAB_BUS_STAT_INC(repliesSent);
+#if NCE_CAB_BUS_TRACE
+	for (uint8_t i = 0; i < length; i++)
+		traceByte(NCE_CAB_BUS_TRACE_RS485_TX, values[i]);
+#endif
+
+	if (pListenerTable)
+		pListenerTable->sendRS485Bytes(listenerContext, values, length);
+	else if (func_RS485SendBytes)
+		func_RS485SendBytes(values, length);
+}
+
+#if NCE_CAB_BUS_SMART_CAB
+inline void NceCabBus::callUSBSendBytes(uint8_t *values, uint8_t length)
+{
+#if NCE_CAB_BUS_TRACE
+	for (uint8_t i = 0; i < length; i++)
+		traceByte(NCE_CAB_BUS_TRACE_USB_TX, values[i]);
+#endif
+
+#if NCE_CAB_BUS_USB_TX_BUFFER_SIZE
+	if (usbTxBuffering)
+	{
+		queueUSBBytes(values, length);
+		return;
+	}
+#endif
+
+	deliverUSBBytes(values, length);
+}
+
+inline void NceCabBus::deliverUSBBytes(uint8_t *values, uint8_t length)
+{
+	if (pListenerTable)
+		pListenerTable->sendUSBBytes(listenerContext, values, length);
+	else if (func_USBSendBytes)
+		func_USBSendBytes(values, length);
+}
+#endif
+
+#if NCE_CAB_BUS_FAST_CLOCK
+inline void NceCabBus::callFastClockHandler(void)
+{
+	if ((FastClockMode == FAST_CLOCK_NOT_SET) || (FastClockRate == 0))
+		return;
+
+	if (pListenerTable)
+		pListenerTable->fastClock(listenerContext, FastClockHours, FastClockMinutes, FastClockRate, FastClockMode);
+	else if (func_FastClockHandler)
+		func_FastClockHandler(FastClockHours, FastClockMinutes, FastClockRate, FastClockMode);
+}
+#endif
+
+#if NCE_CAB_BUS_LCD
+inline void NceCabBus::callLCDUpdateHandler(uint8_t Col, uint8_t Row, char *msg, uint8_t len)
+{
+#if NCE_CAB_BUS_SNAPSHOT
+	shadowLCDText(Col, Row, msg, len);
+#endif
+
+	if (pListenerTable)
+		pListenerTable->lcdUpdate(listenerContext, Col, Row, msg, len);
+	else if (func_LCDUpdateHandler)
+		func_LCDUpdateHandler(Col, Row, msg, len);
+}
+
+inline void NceCabBus::callLCDMoveCursorHandler(uint8_t Col, uint8_t Row)
+{
+#if NCE_CAB_BUS_SNAPSHOT
+	lcdShadowCol = Col;
+	lcdShadowRow = Row;
+#endif
+
+	if (pListenerTable)
+		pListenerTable->lcdMoveCursor(listenerContext, Col, Row);
+	else if (func_LCDMoveCursorHandler)
+		func_LCDMoveCursorHandler(Col, Row);
+}
+
+inline void NceCabBus::callLCDCursorModeHandler(CURSOR_MODE mode)
+{
+#if NCE_CAB_BUS_SNAPSHOT
+	shadowLCDCursorMode(mode);
+#endif
+
+	if (pListenerTable)
+		pListenerTable->lcdCursorMode(listenerContext, mode);
+	else if (func_LCDCursorModeHandler)
+		func_LCDCursorModeHandler(mode);
+}
+
+inline void NceCabBus::callLCDPrintCharHandler(char ch, bool advanceCursor)
+{
+#if NCE_CAB_BUS_SNAPSHOT
+	shadowLCDChar(ch, advanceCursor);
+#endif
+
+	if (pListenerTable)
+		pListenerTable->lcdPrintChar(listenerContext, ch, advanceCursor);
+	else if (func_LCDPrintCharHandler)
+		func_LCDPrintCharHandler(ch, advanceCursor);
+}
+#endif
+
+	// Nothing is logged, or queued, without a logger
+inline void NceCabBus::logEvent(uint8_t event, uint8_t arg0, uint8_t arg1)
+{
+	if (!pLogger)
+		return;
+
+	uint8_t args[2] = { arg0, arg1 };
+#if NCE_CAB_BUS_DEFERRED_LOG
+	logRecord(event, args, 2);
+#else
+	printLogRecord(event, args, 2);
+#endif
+}
+
+#include "NceCabBusListener.h"
+
+#endif
@@ -0,0 +1,222 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusBridge.cpp
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   Offload bridge, answers our polls from the reply set by the
+//            host and forwards the bus to it. See NceCabBusBridge.h for
+//            the protocol.
+//
+//------------------------------------------------------------------------
+
+#include "NceCabBusBridge.h"
+
+NceCabBusBridge::NceCabBusBridge()
+{
+	func_RS485SendBytes = NULL;
+	func_USBSendBytes = NULL;
+
+	for (uint8_t i = 0; i < sizeof(addressMask); i++)
+		addressMask[i] = 0;
+
+	cabType = CAB_TYPE_UNKNOWN;
+	replyLength = 0;
+	idleReply[0] = 0;
+	idleReply[1] = 0;
+	replyGeneration = 0;
+	replyUsed = true;
+	ownPoll = false;
+
+	batchLength = 0;
+	batchCount = 0;
+	batchStartMicros = 0;
+	lastMicros = 0;
+	batchesSent = 0;
+
+	commandCount = 0;
+}
+
+void NceCabBusBridge::setRS485SendBytesHandler(RS485SendBytes funcPtr)
+{
+	func_RS485SendBytes = funcPtr;
+}
+
+void NceCabBusBridge::setUSBSendBytesHandler(USBSendBytes funcPtr)
+{
+	func_USBSendBytes = funcPtr;
+}
+
+bool NceCabBusBridge::isOwnAddress(uint8_t address)
+{
+	return address && (addressMask[address >> 3] & (1 << (address & 0x07)));
+}
+
+void NceCabBusBridge::processByte(uint8_t inByte)
+{
+	uint32_t now = micros();
+	bool ownPollRecord = false;
+	uint8_t status = 0;
+
+	if ((inByte & CMD_TYPE_MASK) == CMD_TYPE_POLL)
+	{
+		ownPoll = isOwnAddress(inByte & CMD_ASCII_MASK);
+		if (ownPoll)
+		{
+				// Answer first, the batch can wait
+			ownPollRecord = true;
+			status = replyGeneration;
+
+			if (!replyUsed)
+			{
+				if (replyLength && func_RS485SendBytes)
+					func_RS485SendBytes(reply, replyLength);
+
+				status |= BRIDGE_POLL_REPLY_SENT;
+				replyUsed = true;
+			}
+			else if (func_RS485SendBytes)
+				func_RS485SendBytes(idleReply, 2);
+		}
+	}
+
+	else if (ownPoll)
+	{
+		ownPoll = false;
+
+			// The Cab Type request must be answered inside the reply window too
+		if ((inByte == CMD_CAB_TYPE) && func_RS485SendBytes)
+			func_RS485SendBytes(&cabType, 1);
+	}
+
+	addRecord(inByte, now, ownPollRecord, status);
+}
+
+void NceCabBusBridge::addRecord(uint8_t inByte, uint32_t now, bool ownPollRecord, uint8_t status)
+{
+	uint32_t delta = now - lastMicros;
+
+		// A gap too long for the 15 bit delta starts a new batch with its own time
+	if (batchCount && (delta > BRIDGE_DELTA_MAX))
+		sendBatch();
+
+	if (!batchCount)
+	{
+		batch[0] = BRIDGE_BATCH_START;
+		batch[2] = now;
+		batch[3] = now >> 8;
+		batch[4] = now >> 16;
+		batch[5] = now >> 24;
+		batchLength = BRIDGE_BATCH_HEADER;
+		batchStartMicros = now;
+		delta = 0;
+	}
+
+	if (ownPollRecord)
+		delta |= BRIDGE_DELTA_OWN_POLL;
+
+	batch[batchLength++] = inByte;
+	batch[batchLength++] = delta;
+	batch[batchLength++] = delta >> 8;
+	if (ownPollRecord)
+		batch[batchLength++] = status;
+
+	lastMicros = now;
+
+	if (++batchCount == NCE_CAB_BUS_BRIDGE_BATCH_SIZE)
+		sendBatch();
+}
+
+void NceCabBusBridge::sendBatch(void)
+{
+	batch[1] = batchCount;
+
+	if (func_USBSendBytes)
+		func_USBSendBytes(batch, batchLength);
+
+	batchCount = 0;
+	batchesSent++;
+}
+
+void NceCabBusBridge::flush(void)
+{
+	if (batchCount && ((uint32_t)(micros() - batchStartMicros) >= NCE_CAB_BUS_BRIDGE_BATCH_US))
+		sendBatch();
+}
+
+uint16_t NceCabBusBridge::getBatchesSent(void)
+{
+	return batchesSent;
+}
+
+	// Total length of the command being received, so far as the bytes received tell
+uint8_t NceCabBusBridge::commandLength(void)
+{
+	switch (command[0])
+	{
+	case BRIDGE_SET_ADDRESSES:
+		return 1 + sizeof(addressMask);
+
+	case BRIDGE_SET_CAB_TYPE:
+		return 2;
+
+	case BRIDGE_SET_REPLY:
+		if (commandCount < 3)
+			return 3;
+		return 3 + command[2] + 2;
+
+	default:
+		return 1;
+	}
+}
+
+void NceCabBusBridge::processUSBByte(uint8_t inByte)
+{
+	command[commandCount++] = inByte;
+
+	if ((command[0] == BRIDGE_SET_REPLY) && (commandCount == 3) && (command[2] > CAB_BUS_COMMAND_LENGTH))
+	{
+		commandCount = 0;	// Not a reply we can send, drop it
+		return;
+	}
+
+	if (commandCount < commandLength())
+		return;
+
+	runCommand();
+	commandCount = 0;
+}
+
+void NceCabBusBridge::runCommand(void)
+{
+	switch (command[0])
+	{
+	case BRIDGE_SET_ADDRESSES:
+		for (uint8_t i = 0; i < sizeof(addressMask); i++)
+			addressMask[i] = command[1 + i];
+		break;
+
+	case BRIDGE_SET_CAB_TYPE:
+		cabType = command[1];
+		break;
+
+	case BRIDGE_SET_REPLY:
+		replyGeneration = command[1] & 0x7F;
+		replyLength = command[2];
+		for (uint8_t i = 0; i < replyLength; i++)
+			reply[i] = command[3 + i];
+		idleReply[0] = command[3 + replyLength];
+		idleReply[1] = command[4 + replyLength];
+		replyUsed = false;
+		break;
+
+	default:
+		break;
+	}
+}
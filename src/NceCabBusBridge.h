@@ -0,0 +1,111 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusBridge.h
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      NceCabBusBridge.h
+// purpose:   Thin offload bridge for a USB attached MCU. It answers our
+//            polls from a reply the host sets and forwards every Cab Bus
+//            byte to the host in timestamped batches. The host runs a
+//            full NceCabBus on them with processForwardedByte(), so the
+//            MCU no longer parses traffic that is not ours.
+//
+//            Bridge to host, one batch at a time:
+//
+//              BRIDGE_BATCH_START, count, micros() of the first byte
+//              (4 bytes, little endian), then count records of
+//              byte, delta (2 bytes, little endian) [, status]
+//
+//            delta is the microseconds since the previous record, 0 for
+//            the first. When the record is our poll bit 15 is set and a
+//            status byte follows: the generation of the reply set by the
+//            host, with BRIDGE_POLL_REPLY_SENT when that reply was sent
+//            rather than the idle reply.
+//
+//            Host to bridge, each a command byte and its data:
+//
+//              BRIDGE_SET_ADDRESSES  8 byte mask, bit n answers address n
+//              BRIDGE_SET_CAB_TYPE   the answer to the Cab Type request
+//              BRIDGE_SET_REPLY      generation, length, reply bytes and
+//                                    the 2 byte idle reply
+//
+//            A reply is sent to one poll only, later polls get the idle
+//            reply until the host sets the next one, so a slow host can
+//            delay a key press or a smart cab frame but never repeat it.
+//
+//------------------------------------------------------------------------
+
+#ifndef NCE_CAB_BUS_BRIDGE_H
+#define NCE_CAB_BUS_BRIDGE_H
+
+#include "NceCabBus.h"
+
+#define BRIDGE_BATCH_START		0xA5
+#define BRIDGE_BATCH_HEADER		6		// Start, count and the 32 bit time
+#define BRIDGE_DELTA_MAX		0x7FFF
+#define BRIDGE_DELTA_OWN_POLL	0x8000	// Record is our poll, a status byte follows
+#define BRIDGE_POLL_REPLY_SENT	0x80	// Status: the reply of generation (status & 0x7F) was sent
+
+#define BRIDGE_SET_ADDRESSES	0x01
+#define BRIDGE_SET_CAB_TYPE		0x02
+#define BRIDGE_SET_REPLY		0x03
+
+#define BRIDGE_COMMAND_MAX		(3 + CAB_BUS_COMMAND_LENGTH + 2)	// BRIDGE_SET_REPLY with the longest reply
+
+class NceCabBusBridge
+{
+  public:
+	NceCabBusBridge();
+
+	void setRS485SendBytesHandler(RS485SendBytes funcPtr);
+	void setUSBSendBytesHandler(USBSendBytes funcPtr);
+
+		// Every byte received on the Cab Bus, called from loop()
+	void processByte(uint8_t inByte);
+
+		// Every byte received from the host
+	void processUSBByte(uint8_t inByte);
+
+		// Call from loop(), sends the batch once it is NCE_CAB_BUS_BRIDGE_BATCH_US old
+	void flush(void);
+
+	uint16_t getBatchesSent(void);
+
+  private:
+	RS485SendBytes	func_RS485SendBytes;
+	USBSendBytes	func_USBSendBytes;
+
+	uint8_t		addressMask[8];
+	uint8_t		cabType;
+	uint8_t		reply[CAB_BUS_COMMAND_LENGTH];
+	uint8_t		replyLength;
+	uint8_t		idleReply[2];
+	uint8_t		replyGeneration;
+	bool		replyUsed;			// Sent to a poll, later polls get idleReply
+	bool		ownPoll;			// The last byte was our poll
+
+	uint8_t		batch[BRIDGE_BATCH_HEADER + (NCE_CAB_BUS_BRIDGE_BATCH_SIZE * 4)];
+	uint8_t		batchLength;
+	uint8_t		batchCount;
+	uint32_t	batchStartMicros;
+	uint32_t	lastMicros;
+	uint16_t	batchesSent;
+
+	uint8_t		command[BRIDGE_COMMAND_MAX];
+	uint8_t		commandCount;
+
+	bool		isOwnAddress(uint8_t address);
+	void		addRecord(uint8_t inByte, uint32_t now, bool ownPollRecord, uint8_t status);
+	void		sendBatch(void);
+	uint8_t		commandLength(void);
+	void		runCommand(void);
+};
+
+#endif
@@ -0,0 +1,335 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusConcentrator.cpp
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   Downstream bus master and upstream stand in for its cabs.
+//            See NceCabBusConcentrator.h.
+//
+//------------------------------------------------------------------------
+
+#include "NceCabBusConcentrator.h"
+
+static void clearQueue(ConcentratorQueue *queue)
+{
+	queue->tail = 0;
+	queue->count = 0;
+	queue->pending = 0;
+}
+
+NceCabBusConcentrator::NceCabBusConcentrator()
+{
+	func_UpstreamSendBytes = NULL;
+	func_DownstreamSendBytes = NULL;
+
+	cabCount = 0;
+	clearQueue(&broadcasts);
+
+	slotQueue = NULL;
+	slotOverflow = false;
+	upstreamCab = NULL;
+	queueOverflows = 0;
+
+	state = CONCENTRATOR_IDLE;
+	pollIndex = 0;
+	busyUntil = 0;
+	replyCount = 0;
+	rotations = 0;
+}
+
+bool NceCabBusConcentrator::addCab(uint8_t address, CAB_TYPE type)
+{
+	if ((cabCount >= NCE_CAB_BUS_CONCENTRATOR_CABS) || !address || (address > CMD_ASCII_MASK) || findCab(address))
+		return false;
+
+	if ((type != CAB_TYPE_LCD) && (type != CAB_TYPE_NO_LCD) && (type != CAB_TYPE_AIU))
+		return false;
+
+	ConcentratorCab *cab = &cabs[cabCount++];
+	cab->address = address;
+	cab->cabType = type;
+	cab->reply[0] = (type == CAB_TYPE_AIU) ? 0 : BTN_NO_KEY_DN;
+	cab->reply[1] = (type == CAB_TYPE_AIU) ? 0 : 127;	// Knob not used
+	cab->keyTail = 0;
+	cab->keyCount = 0;
+	cab->misses = NCE_CAB_BUS_CONCENTRATOR_MISSES;		// Offline until it has replied
+	clearQueue(&cab->commands);
+	return true;
+}
+
+void NceCabBusConcentrator::setUpstreamSendBytesHandler(RS485SendBytes funcPtr)
+{
+	func_UpstreamSendBytes = funcPtr;
+}
+
+void NceCabBusConcentrator::setDownstreamSendBytesHandler(RS485SendBytes funcPtr)
+{
+	func_DownstreamSendBytes = funcPtr;
+}
+
+ConcentratorCab *NceCabBusConcentrator::findCab(uint8_t address)
+{
+	for (uint8_t i = 0; i < cabCount; i++)
+		if (cabs[i].address == address)
+			return &cabs[i];
+
+	return NULL;
+}
+
+bool NceCabBusConcentrator::isCabOnline(uint8_t address)
+{
+	ConcentratorCab *cab = findCab(address);
+	return cab && (cab->misses < NCE_CAB_BUS_CONCENTRATOR_MISSES);
+}
+
+	// Command station slots dropped because a cab's command queue was full
+uint16_t NceCabBusConcentrator::getQueueOverflows(void)
+{
+	return queueOverflows;
+}
+
+uint32_t NceCabBusConcentrator::getRotations(void)
+{
+	return rotations;
+}
+
+//------------------------------------------------------------------------
+// Upstream, towards the command station
+//------------------------------------------------------------------------
+
+void NceCabBusConcentrator::processUpstreamByte(uint8_t inByte)
+{
+	if ((inByte & CMD_TYPE_MASK) == CMD_TYPE_POLL)
+	{
+		endSlot();
+		upstreamCab = NULL;
+
+		uint8_t polledAddress = inByte & CMD_ASCII_MASK;
+		if (!polledAddress)
+		{
+			slotQueue = &broadcasts;
+			return;
+		}
+
+		ConcentratorCab *cab = findCab(polledAddress);
+		if (cab && (cab->misses < NCE_CAB_BUS_CONCENTRATOR_MISSES))
+		{
+			sendUpstreamReply(cab);
+			upstreamCab = cab;
+			slotQueue = &cab->commands;
+		}
+		return;
+	}
+
+	if (upstreamCab)
+	{
+		ConcentratorCab *cab = upstreamCab;
+		upstreamCab = NULL;
+
+			// Answered here, the downstream cab never sees it
+		if (inByte == CMD_CAB_TYPE)
+		{
+			if (func_UpstreamSendBytes)
+				func_UpstreamSendBytes(&cab->cabType, 1);
+			return;
+		}
+	}
+
+	if (slotQueue)
+		queueByte(slotQueue, inByte);
+}
+
+void NceCabBusConcentrator::sendUpstreamReply(ConcentratorCab *cab)
+{
+	uint8_t bytes[2];
+
+	bytes[0] = cab->reply[0];
+	bytes[1] = cab->reply[1];
+
+	if (cab->keyCount)
+	{
+		bytes[0] = cab->keys[cab->keyTail];
+		cab->keyTail = (cab->keyTail + 1) & (NCE_CAB_BUS_CONCENTRATOR_KEYS - 1);
+		cab->keyCount--;
+	}
+
+	if (func_UpstreamSendBytes)
+		func_UpstreamSendBytes(bytes, 2);
+}
+
+void NceCabBusConcentrator::queueByte(ConcentratorQueue *queue, uint8_t value)
+{
+	if (slotOverflow)
+		return;
+
+	if ((queue->count + queue->pending) >= NCE_CAB_BUS_CONCENTRATOR_QUEUE_SIZE)
+	{
+		slotOverflow = true;
+		return;
+	}
+
+	queue->data[(queue->tail + queue->count + queue->pending) & (NCE_CAB_BUS_CONCENTRATOR_QUEUE_SIZE - 1)] = value;
+	queue->pending++;
+}
+
+	// The command station has moved on, so the commands of the last slot are complete and can
+	// go downstream. A slot that did not fit is dropped whole rather than sent cut short
+void NceCabBusConcentrator::endSlot(void)
+{
+	if (!slotQueue)
+		return;
+
+	if (slotOverflow)
+	{
+		slotQueue->pending = 0;
+		if (queueOverflows < 0xFFFF)
+			queueOverflows++;
+	}
+	else
+	{
+		slotQueue->count += slotQueue->pending;
+		slotQueue->pending = 0;
+	}
+
+	slotQueue = NULL;
+	slotOverflow = false;
+}
+
+//------------------------------------------------------------------------
+// Downstream, where we are the master
+//------------------------------------------------------------------------
+
+	// The handler may return before the bytes are sent, e.g. buffered by HardwareSerial, so
+	// count their time on the wire before polling again or timing out a reply
+void NceCabBusConcentrator::sendDownstream(uint8_t *values, uint8_t length)
+{
+	if (func_DownstreamSendBytes)
+		func_DownstreamSendBytes(values, length);
+
+	busyUntil = micros() + ((uint32_t)length * CONCENTRATOR_BYTE_US);
+}
+
+	// Copy out the ready bytes of a queue, any of a slot still in progress stay
+uint8_t NceCabBusConcentrator::takeQueued(ConcentratorQueue *queue, uint8_t *buffer)
+{
+	uint8_t count = queue->count;
+
+	for (uint8_t i = 0; i < count; i++)
+		buffer[i] = queue->data[(queue->tail + i) & (NCE_CAB_BUS_CONCENTRATOR_QUEUE_SIZE - 1)];
+
+	queue->tail = (queue->tail + count) & (NCE_CAB_BUS_CONCENTRATOR_QUEUE_SIZE - 1);
+	queue->count = 0;
+	return count;
+}
+
+void NceCabBusConcentrator::service(void)
+{
+	if (!cabCount)
+		return;
+
+	int32_t sinceSent = micros() - busyUntil;	// Negative while our bytes are still going out
+
+	if (state == CONCENTRATOR_WAIT_REPLY)
+	{
+		if (sinceSent < NCE_CAB_BUS_CONCENTRATOR_REPLY_US)
+			return;
+
+		if (cabs[pollIndex].misses < NCE_CAB_BUS_CONCENTRATOR_MISSES)
+			cabs[pollIndex].misses++;
+
+		pollIndex++;
+		state = CONCENTRATOR_IDLE;
+	}
+	else if (sinceSent < 0)
+		return;
+
+	else if (state == CONCENTRATOR_SENDING)
+	{
+		pollIndex++;
+		state = CONCENTRATOR_IDLE;
+	}
+
+	pollNextCab();
+}
+
+void NceCabBusConcentrator::pollNextCab(void)
+{
+	if (pollIndex >= cabCount)
+	{
+		pollIndex = 0;
+		rotations++;
+
+		uint8_t buffer[NCE_CAB_BUS_CONCENTRATOR_QUEUE_SIZE + 1];
+		buffer[0] = CMD_TYPE_POLL;	// Broadcast
+		uint8_t count = takeQueued(&broadcasts, buffer + 1);
+		if (count)
+		{
+			sendDownstream(buffer, count + 1);
+			return;
+		}
+	}
+
+	uint8_t poll = CMD_TYPE_POLL | cabs[pollIndex].address;
+	replyCount = 0;
+	state = CONCENTRATOR_WAIT_REPLY;
+	sendDownstream(&poll, 1);
+}
+
+void NceCabBusConcentrator::processDownstreamByte(uint8_t inByte)
+{
+	if (state != CONCENTRATOR_WAIT_REPLY)
+		return;
+
+	reply[replyCount++] = inByte;
+	if (replyCount < 2)
+		return;
+
+	replyReceived(&cabs[pollIndex]);
+}
+
+void NceCabBusConcentrator::replyReceived(ConcentratorCab *cab)
+{
+	cab->misses = 0;
+
+	if (cab->cabType == CAB_TYPE_AIU)
+	{
+		cab->reply[0] = reply[0];
+		cab->reply[1] = reply[1];
+	}
+	else
+	{
+		cab->reply[1] = reply[1];	// Knob
+
+		if (reply[0] != BTN_NO_KEY_DN)
+		{
+			if (cab->keyCount < NCE_CAB_BUS_CONCENTRATOR_KEYS)
+			{
+				cab->keys[(cab->keyTail + cab->keyCount) & (NCE_CAB_BUS_CONCENTRATOR_KEYS - 1)] = reply[0];
+				cab->keyCount++;
+			}
+			else if (queueOverflows < 0xFFFF)
+				queueOverflows++;
+		}
+	}
+
+		// The cab is now listening for its commands
+	uint8_t buffer[NCE_CAB_BUS_CONCENTRATOR_QUEUE_SIZE];
+	uint8_t count = takeQueued(&cab->commands, buffer);
+	if (count)
+	{
+		sendDownstream(buffer, count);
+		state = CONCENTRATOR_SENDING;
+	}
+	else
+	{
+		pollIndex++;
+		state = CONCENTRATOR_IDLE;
+	}
+}
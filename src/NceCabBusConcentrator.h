@@ -0,0 +1,121 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusConcentrator.h
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      NceCabBusConcentrator.h
+// purpose:   Stand in for a group of throttles and AIUs on a second,
+//            downstream, Cab Bus. On the downstream bus the concentrator
+//            is the master and polls each cab in turn. Upstream it
+//            answers the command station's polls for all of their
+//            addresses from the last reply each cab gave, so the command
+//            station never waits on a long run and its rotation is short.
+//
+//            Key presses are queued and each one goes upstream once. The
+//            command bytes the command station sends after polling one of
+//            our cabs, e.g. LCD text, are held until the end of its slot
+//            and then sent to that cab after its next downstream poll.
+//            Broadcasts, such as the fast clock, are sent downstream once
+//            per rotation.
+//
+//            A cab that misses NCE_CAB_BUS_CONCENTRATOR_MISSES polls in a
+//            row is not answered for upstream until it replies again.
+//
+//------------------------------------------------------------------------
+
+#ifndef NCE_CAB_BUS_CONCENTRATOR_H
+#define NCE_CAB_BUS_CONCENTRATOR_H
+
+#include "NceCabBus.h"
+
+#define CONCENTRATOR_BYTE_US	1146	// 11 bits at 9600 baud
+
+typedef struct
+{
+	uint8_t data[NCE_CAB_BUS_CONCENTRATOR_QUEUE_SIZE];
+	uint8_t tail;
+	uint8_t count;			// Bytes ready to send downstream
+	uint8_t pending;		// Bytes after them from a command station slot still in progress
+} ConcentratorQueue;
+
+typedef struct
+{
+	uint8_t address;
+	uint8_t cabType;
+	uint8_t reply[2];		// Upstream reply when no key is waiting: no key and the knob, or the AIU inputs
+	uint8_t keys[NCE_CAB_BUS_CONCENTRATOR_KEYS];
+	uint8_t keyTail;
+	uint8_t keyCount;
+	uint8_t misses;			// Downstream polls missed in a row
+	ConcentratorQueue commands;
+} ConcentratorCab;
+
+typedef enum
+{
+	CONCENTRATOR_IDLE = 0,
+	CONCENTRATOR_WAIT_REPLY,
+	CONCENTRATOR_SENDING,
+} CONCENTRATOR_STATE;
+
+class NceCabBusConcentrator
+{
+  public:
+	NceCabBusConcentrator();
+
+		// Answer for a LCD / no LCD throttle or an AIU on the downstream bus, false when full
+	bool addCab(uint8_t address, CAB_TYPE type);
+
+	void setUpstreamSendBytesHandler(RS485SendBytes funcPtr);
+	void setDownstreamSendBytesHandler(RS485SendBytes funcPtr);
+
+		// Every byte from the command station bus, and from the downstream bus
+	void processUpstreamByte(uint8_t inByte);
+	void processDownstreamByte(uint8_t inByte);
+
+		// Call from loop(), runs the downstream poll rotation
+	void service(void);
+
+	bool isCabOnline(uint8_t address);
+	uint16_t getQueueOverflows(void);
+	uint32_t getRotations(void);
+
+  private:
+	RS485SendBytes		func_UpstreamSendBytes;
+	RS485SendBytes		func_DownstreamSendBytes;
+
+	ConcentratorCab		cabs[NCE_CAB_BUS_CONCENTRATOR_CABS];
+	uint8_t				cabCount;
+	ConcentratorQueue	broadcasts;
+
+		// Upstream
+	ConcentratorQueue	*slotQueue;		// Where the command station's bytes in this slot go
+	bool				slotOverflow;
+	ConcentratorCab		*upstreamCab;	// Our cab just polled, until the next byte
+	uint16_t			queueOverflows;
+
+		// Downstream
+	CONCENTRATOR_STATE	state;
+	uint8_t				pollIndex;
+	uint32_t			busyUntil;		// micros() when the bytes already sent are off the wire
+	uint8_t				reply[2];
+	uint8_t				replyCount;
+	uint32_t			rotations;
+
+	ConcentratorCab		*findCab(uint8_t address);
+	void		sendUpstreamReply(ConcentratorCab *cab);
+	void		queueByte(ConcentratorQueue *queue, uint8_t value);
+	void		endSlot(void);
+	void		sendDownstream(uint8_t *values, uint8_t length);
+	uint8_t		takeQueued(ConcentratorQueue *queue, uint8_t *buffer);
+	void		pollNextCab(void);
+	void		replyReceived(ConcentratorCab *cab);
+};
+
+#endif
@@ -0,0 +1,256 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusConfig.h
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      NceCabBusConfig.h
+// purpose:   Select which Cab Bus device roles are built into the library.
+//
+//            The Arduino IDE compiles the library separately from the
+//            sketch, so a #define in the sketch does not reach it. The
+//            settings are taken from -D options in the build flags (e.g.
+//            PlatformIO build_flags = -DNCE_CAB_BUS_SMART_CAB=0), then from
+//            NceCabBusUserConfig.h when the compiler finds one, then from
+//            the defaults below.
+//
+//            NceCabBusUserConfig.h is looked for next to this file and on
+//            the include path, so with the Arduino IDE it goes in the
+//            library's src folder and with PlatformIO in a folder given
+//            with -I in build_flags. It can pick one of the presets below
+//            and set any other option, e.g.
+//
+//              #define NCE_CAB_BUS_PRESET  NCE_CAB_BUS_PRESET_AIU
+//
+//            The defaults build every role. A role set to 0 removes its
+//            code, its state in the NceCabBus object and its handler
+//            setters, so only a build with the unused roles turned off,
+//            e.g. with a preset, leaves out the USB smart cab buffers.
+//
+//------------------------------------------------------------------------
+
+#ifndef NCE_CAB_BUS_CONFIG_H
+#define NCE_CAB_BUS_CONFIG_H
+
+#if defined(__has_include)
+#if __has_include("NceCabBusUserConfig.h")
+#include "NceCabBusUserConfig.h"
+#endif
+#endif
+
+	// Presets for NCE_CAB_BUS_PRESET, each builds only the roles its device uses
+#define NCE_CAB_BUS_PRESET_AIU			1	// AIU
+#define NCE_CAB_BUS_PRESET_FAST_CLOCK	2	// Fast clock
+#define NCE_CAB_BUS_PRESET_THROTTLE		3	// LCD and keypad
+#define NCE_CAB_BUS_PRESET_USB			4	// USB smart cab, stats and service()
+
+	// A role set on its own as well overrides the preset
+#ifdef NCE_CAB_BUS_PRESET
+#ifndef NCE_CAB_BUS_LCD
+#define NCE_CAB_BUS_LCD				(NCE_CAB_BUS_PRESET == NCE_CAB_BUS_PRESET_THROTTLE)
+#endif
+#ifndef NCE_CAB_BUS_KEYPAD
+#define NCE_CAB_BUS_KEYPAD			(NCE_CAB_BUS_PRESET == NCE_CAB_BUS_PRESET_THROTTLE)
+#endif
+#ifndef NCE_CAB_BUS_AIU
+#define NCE_CAB_BUS_AIU				(NCE_CAB_BUS_PRESET == NCE_CAB_BUS_PRESET_AIU)
+#endif
+#ifndef NCE_CAB_BUS_FAST_CLOCK
+#define NCE_CAB_BUS_FAST_CLOCK		(NCE_CAB_BUS_PRESET == NCE_CAB_BUS_PRESET_FAST_CLOCK)
+#endif
+#ifndef NCE_CAB_BUS_SMART_CAB
+#define NCE_CAB_BUS_SMART_CAB		(NCE_CAB_BUS_PRESET == NCE_CAB_BUS_PRESET_USB)
+#endif
+#ifndef NCE_CAB_BUS_STATS
+#define NCE_CAB_BUS_STATS			(NCE_CAB_BUS_PRESET == NCE_CAB_BUS_PRESET_USB)
+#endif
+#ifndef NCE_CAB_BUS_SERVICE
+#define NCE_CAB_BUS_SERVICE			(NCE_CAB_BUS_PRESET == NCE_CAB_BUS_PRESET_USB)
+#endif
+#endif
+
+	// LCD display commands: setLCDUpdateHandler(), setLCDMoveCursorHandler(), ...
+#ifndef NCE_CAB_BUS_LCD
+#define NCE_CAB_BUS_LCD				1
+#endif
+
+	// Keypad and speed knob: setKeyPress(), setSpeedKnob(), getSpeedKnob()
+#ifndef NCE_CAB_BUS_KEYPAD
+#define NCE_CAB_BUS_KEYPAD			1
+#endif
+
+	// Key presses waiting to be reported, one per poll, must be a power of 2
+#ifndef NCE_CAB_BUS_KEY_QUEUE_SIZE
+#define NCE_CAB_BUS_KEY_QUEUE_SIZE	8
+#endif
+
+	// Auxiliary Input Unit: setAuiIoState(), setAuiIoBitState(), ...
+#ifndef NCE_CAB_BUS_AIU
+#define NCE_CAB_BUS_AIU				1
+#endif
+
+	// Fast clock broadcasts: setFastClockHandler(), setFastClockCabAddress()
+#ifndef NCE_CAB_BUS_FAST_CLOCK
+#define NCE_CAB_BUS_FAST_CLOCK		1
+#endif
+
+	// USB Interface smart cab: processUSBByte(), processResponseByte(), setUSBSendBytesHandler()
+#ifndef NCE_CAB_BUS_SMART_CAB
+#define NCE_CAB_BUS_SMART_CAB		1
+#endif
+
+	// Smart cab route tables: setRouteTable(), triggerRoute() and USB vendor opcode 0xF2
+#ifndef NCE_CAB_BUS_ROUTES
+#define NCE_CAB_BUS_ROUTES			0
+#endif
+
+	// Accessories in each route, a route with fewer ends with a 0 entry
+#ifndef NCE_CAB_BUS_ROUTE_LENGTH
+#define NCE_CAB_BUS_ROUTE_LENGTH	16
+#endif
+
+	// Accessory addresses 1..n whose last state is remembered so routes skip them when already set
+#ifndef NCE_CAB_BUS_ROUTE_CACHE_SIZE
+#define NCE_CAB_BUS_ROUTE_CACHE_SIZE	256
+#endif
+
+	// Routes that can wait to run after the current one, must be a power of 2
+#ifndef NCE_CAB_BUS_ROUTE_QUEUE_SIZE
+#define NCE_CAB_BUS_ROUTE_QUEUE_SIZE	4
+#endif
+
+	// Cab addresses a smart cab answers polls on. More than 1 adds addCabAddress() and a shared
+	// frame queue, so JMRI commands go out on whichever of our addresses is polled next
+#ifndef NCE_CAB_BUS_SMART_CAB_ADDRESSES
+#define NCE_CAB_BUS_SMART_CAB_ADDRESSES	1
+#endif
+
+	// Cab Bus frames acknowledged to JMRI and waiting for one of our polls, must be a power of 2
+#ifndef NCE_CAB_BUS_SMART_CAB_QUEUE_SIZE
+#define NCE_CAB_BUS_SMART_CAB_QUEUE_SIZE	8
+#endif
+
+	// USB response bytes collected after setUSBSendBuffering(true) and handed to the USBSendBytes
+	// handler in one call once the response is complete or the buffer full, at most 255. 0 leaves buffering out
+#ifndef NCE_CAB_BUS_USB_TX_BUFFER_SIZE
+#define NCE_CAB_BUS_USB_TX_BUFFER_SIZE	16
+#endif
+
+	// Receive from the UART RX interrupt: processByteFromISR(), processQueuedBytes(). Off unless
+	// the sketch drives the UART itself, see the Throttle-OLED-SSD1306-M32U4-ISR example
+#ifndef NCE_CAB_BUS_ISR_RECEIVE
+#define NCE_CAB_BUS_ISR_RECEIVE		0
+#endif
+
+	// Bytes buffered between processByteFromISR() and processQueuedBytes(), must be a power of 2.
+	// Each byte is 1.15ms on the wire so 32 bytes lets loop() be busy for about 36ms
+#ifndef NCE_CAB_BUS_RX_QUEUE_SIZE
+#define NCE_CAB_BUS_RX_QUEUE_SIZE	32
+#endif
+
+	// Always on counters: getStats(), clearStats() and USB vendor opcodes 0xF0 / 0xF1
+#ifndef NCE_CAB_BUS_STATS
+#define NCE_CAB_BUS_STATS			1
+#endif
+
+	// service(): reads the RS485 and USB Streams, sends the buffered USB responses and runs the
+	// AppTask handler in what is left of a microsecond budget. Each loop() becomes one call
+#ifndef NCE_CAB_BUS_SERVICE
+#define NCE_CAB_BUS_SERVICE			1
+#endif
+
+	// Binary trace of every RS485 and USB byte into a RAM ring: setTraceEnabled(), readTrace(), dumpTrace()
+#ifndef NCE_CAB_BUS_TRACE
+#define NCE_CAB_BUS_TRACE			0
+#endif
+
+	// Trace ring size in bytes, must be a power of 2. Each byte traced takes 2-3 bytes
+#ifndef NCE_CAB_BUS_TRACE_SIZE
+#define NCE_CAB_BUS_TRACE_SIZE		256
+#endif
+
+	// setLogger() output goes to a RAM ring of binary records and is only printed by flushLog(),
+	// so debug output never delays a reply. Off prints straight away as before
+#ifndef NCE_CAB_BUS_DEFERRED_LOG
+#define NCE_CAB_BUS_DEFERRED_LOG	0
+#endif
+
+	// Log ring size in bytes, must be a power of 2. A record is 1 byte plus up to 4 argument bytes
+#ifndef NCE_CAB_BUS_LOG_SIZE
+#define NCE_CAB_BUS_LOG_SIZE		128
+#endif
+
+	// Fast clock timetable: setTimetable(), setTimetableHandler(). Needs NCE_CAB_BUS_FAST_CLOCK,
+	// macro and accessory actions need NCE_CAB_BUS_SMART_CAB and route actions NCE_CAB_BUS_ROUTES
+#ifndef NCE_CAB_BUS_TIMETABLE
+#define NCE_CAB_BUS_TIMETABLE		0
+#endif
+
+	// Timetable macro and accessory actions waiting for our polls, must be a power of 2
+#ifndef NCE_CAB_BUS_TIMETABLE_QUEUE_SIZE
+#define NCE_CAB_BUS_TIMETABLE_QUEUE_SIZE	8
+#endif
+
+	// Fast minutes the clock can move on between broadcasts with the entries in between still run.
+	// A bigger step, or the clock set back, only moves the timetable to the new time
+#ifndef NCE_CAB_BUS_TIMETABLE_CATCH_UP
+#define NCE_CAB_BUS_TIMETABLE_CATCH_UP	5
+#endif
+
+	// saveSnapshot() / restoreSnapshot() of the role state for a warm start after a reset.
+	// An LCD build also keeps a copy of the display, NCE_CAB_BUS_LCD_COLS x NCE_CAB_BUS_LCD_ROWS bytes
+#ifndef NCE_CAB_BUS_SNAPSHOT
+#define NCE_CAB_BUS_SNAPSHOT		0
+#endif
+
+	// Size of the LCD copy kept for the snapshot, NCE_CAB_BUS_LCD_COLS a multiple of 8 and at most 253 characters
+#ifndef NCE_CAB_BUS_LCD_COLS
+#define NCE_CAB_BUS_LCD_COLS		16
+#endif
+
+#ifndef NCE_CAB_BUS_LCD_ROWS
+#define NCE_CAB_BUS_LCD_ROWS		2
+#endif
+
+	// NceCabBusBridge: bus bytes forwarded to the host in one batch, at most 62
+#ifndef NCE_CAB_BUS_BRIDGE_BATCH_SIZE
+#define NCE_CAB_BUS_BRIDGE_BATCH_SIZE	16
+#endif
+
+	// NceCabBusBridge: flush() sends a batch that is not full once its first byte is this old
+#ifndef NCE_CAB_BUS_BRIDGE_BATCH_US
+#define NCE_CAB_BUS_BRIDGE_BATCH_US		4000
+#endif
+
+	// NceCabBusConcentrator: downstream throttles and AIUs it can answer for
+#ifndef NCE_CAB_BUS_CONCENTRATOR_CABS
+#define NCE_CAB_BUS_CONCENTRATOR_CABS	8
+#endif
+
+	// NceCabBusConcentrator: command bytes held for each cab and for broadcasts, a power of 2 up to 128
+#ifndef NCE_CAB_BUS_CONCENTRATOR_QUEUE_SIZE
+#define NCE_CAB_BUS_CONCENTRATOR_QUEUE_SIZE	32
+#endif
+
+	// NceCabBusConcentrator: key presses held for each throttle, a power of 2
+#ifndef NCE_CAB_BUS_CONCENTRATOR_KEYS
+#define NCE_CAB_BUS_CONCENTRATOR_KEYS	4
+#endif
+
+	// NceCabBusConcentrator: time for a downstream reply once our poll is sent
+#ifndef NCE_CAB_BUS_CONCENTRATOR_REPLY_US
+#define NCE_CAB_BUS_CONCENTRATOR_REPLY_US	4000
+#endif
+
+	// NceCabBusConcentrator: downstream polls missed in a row before a cab is no longer answered for
+#ifndef NCE_CAB_BUS_CONCENTRATOR_MISSES
+#define NCE_CAB_BUS_CONCENTRATOR_MISSES	3
+#endif
+
+#endif
@@ -0,0 +1,279 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusISR.cpp
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   Interrupt driven receive. The UART RX interrupt passes each
+//            byte to processByteFromISR() which answers our poll straight
+//            away with a reply that was built earlier in loop() context,
+//            then queues the byte in a single producer / single consumer
+//            ring. loop() calls processQueuedBytes() to handle the rest,
+//            so slow loop() work no longer delays the poll reply.
+//
+//            Only built when NCE_CAB_BUS_ISR_RECEIVE is enabled.
+//
+//------------------------------------------------------------------------
+
+#include "NceCabBus.h"
+
+#if NCE_CAB_BUS_ISR_RECEIVE
+
+	// Call from the UART RX interrupt handler. The RS485 send handler is
+	// then also called from the interrupt so it must not rely on interrupts
+void NceCabBus::processByteFromISR(uint8_t inByte)
+{
+	isrReceive = true;
+	NCE_CAB_BUS_TRACE_BYTE(NCE_CAB_BUS_TRACE_RS485_RX, inByte);
+
+	if ((inByte & CMD_TYPE_MASK) == CMD_TYPE_POLL)
+	{
+		uint8_t polledAddress = inByte & CMD_ASCII_MASK;
+
+		isrOwnPoll = polledAddress && isOwnAddress(polledAddress);
+		if (isrOwnPoll)
+		{
+#if NCE_CAB_BUS_MULTI_ADDRESS
+			isrPolledAddress = polledAddress;
+#endif
+			sendISRReply();
+		}
+	}
+
+	else if (isrOwnPoll)
+	{
+		isrOwnPoll = false;
+
+			// The Cab Type request must be answered inside the reply window too
+		if (inByte == CMD_CAB_TYPE)
+			send1ByteResponse(cabType);
+	}
+
+	queueRxByte(inByte);
+}
+
+	// Call with each byte forwarded by an offload bridge, then processQueuedBytes(). The bridge has
+	// already answered our poll itself, with one of the replies read by getPollReply() or its idle
+	// reply, pass those bytes with our poll and NULL otherwise
+void NceCabBus::processForwardedByte(uint8_t inByte, const uint8_t *sentReply, uint8_t sentLength)
+{
+	isrReceive = true;
+	NCE_CAB_BUS_TRACE_BYTE(NCE_CAB_BUS_TRACE_RS485_RX, inByte);
+
+	if ((inByte & CMD_TYPE_MASK) == CMD_TYPE_POLL)
+	{
+		uint8_t polledAddress = inByte & CMD_ASCII_MASK;
+
+		if (sentReply && polledAddress && isOwnAddress(polledAddress) && isISRReply(sentReply, sentLength))
+		{
+#if NCE_CAB_BUS_MULTI_ADDRESS
+			isrPolledAddress = polledAddress;
+#endif
+			isrReplySent();
+		}
+	}
+
+	queueRxByte(inByte);
+}
+
+	// Whether a reply sent by an offload bridge is the one our poll would get now, it may be from
+	// before the last update. A throttle only has to match the key code, the knob can have moved
+bool NceCabBus::isISRReply(const uint8_t *reply, uint8_t length)
+{
+	if (length != isrReplyLength)
+		return false;
+
+#if NCE_CAB_BUS_KEYPAD
+	if ((cabType == CAB_TYPE_LCD) || (cabType == CAB_TYPE_NO_LCD))
+		return reply[0] == isrReply[0];
+#endif
+
+	for (uint8_t i = 0; i < length; i++)
+		if (reply[i] != isrReply[i])
+			return false;
+
+	return true;
+}
+
+	// The reply our next poll gets, for an offload bridge to send, and the 2 byte reply it falls
+	// back to once that has gone out: no key pressed, or no smart cab frame waiting. Returns the
+	// reply length
+uint8_t NceCabBus::getPollReply(uint8_t *reply, uint8_t *idleReply)
+{
+	noInterrupts();
+	uint8_t length = isrReplyLength;
+	for (uint8_t i = 0; i < length; i++)
+		reply[i] = isrReply[i];
+
+#if NCE_CAB_BUS_KEYPAD
+	idleReply[0] = ((cabType == CAB_TYPE_LCD) || (cabType == CAB_TYPE_NO_LCD)) ? BTN_NO_KEY_DN : pollReply[0];
+#else
+	idleReply[0] = pollReply[0];
+#endif
+	idleReply[1] = pollReply[1];
+	interrupts();
+
+	return length;
+}
+
+void NceCabBus::queueRxByte(uint8_t inByte)
+{
+	uint8_t nextHead = (rxQueueHead + 1) & (NCE_CAB_BUS_RX_QUEUE_SIZE - 1);
+	if (nextHead == rxQueueTail)
+	{
+		if (rxQueueOverflows < 255)
+			rxQueueOverflows++;
+		return;
+	}
+
+	rxQueue[rxQueueHead] = inByte;
+	rxQueueHead = nextHead;
+}
+
+	// Call from loop() to process the bytes queued by processByteFromISR()
+void NceCabBus::processQueuedBytes(void)
+{
+	processRxQueue(false);
+}
+
+	// With responses, a smart cab also passes each byte to processResponseByte(), for service()
+void NceCabBus::processRxQueue(bool responses)
+{
+#if NCE_CAB_BUS_SMART_CAB
+	finishISRCommands();
+#else
+	(void)responses;
+#endif
+
+	while (rxQueueTail != rxQueueHead)
+	{
+		uint8_t inByte = rxQueue[rxQueueTail];
+		rxQueueTail = (rxQueueTail + 1) & (NCE_CAB_BUS_RX_QUEUE_SIZE - 1);
+		processByte(inByte);
+#if NCE_CAB_BUS_SMART_CAB
+		if (responses && (cabType == CAB_TYPE_SMART))
+			processResponseByte(inByte);
+#endif
+	}
+}
+
+#if NCE_CAB_BUS_SMART_CAB
+	// Finish off any command frames the interrupt has sent and publish the next one. Also called
+	// by processUSBByte() so a new USB command never replaces a frame that has gone out
+void NceCabBus::finishISRCommands(void)
+{
+	while (isrCommandsHandled != isrCommandsSent)
+	{
+		isrCommandsHandled++;
+#if NCE_CAB_BUS_MULTI_ADDRESS
+		ownPolledAddress = isrSentAddress;
+#endif
+		smartCabCommandSent(isrSentCommand);
+
+		noInterrupts();
+		updateISRReply();
+		interrupts();
+	}
+}
+#endif
+
+uint8_t NceCabBus::getRxQueueOverflows(void)
+{
+	return rxQueueOverflows;
+}
+
+	// Rebuild the reply to our poll, called with interrupts disabled
+void NceCabBus::updateISRReply(void)
+{
+	switch (cabType)
+	{
+	case CAB_TYPE_LCD:
+	case CAB_TYPE_NO_LCD:
+		isrReply[0] = pollReply[0];
+		isrReply[1] = pollReply[1];
+		isrReplyLength = 2;
+		break;
+
+#if NCE_CAB_BUS_SMART_CAB
+	case CAB_TYPE_SMART:
+	{
+		CabBusCommand *pCommand = nextSmartCabCommand();
+
+			// Don't publish a frame again that the interrupt has sent but loop() has not finished off
+		if (pCommand && (isrCommandsHandled == isrCommandsSent))
+		{
+			for (uint8_t i = 0; i < pCommand->count; i++)
+				isrReply[i] = pCommand->data[i];
+
+			isrReplyLength = pCommand->count;
+			isrReplyCommand = pCommand;
+		}
+		else
+			setISRIdleReply();
+		break;
+	}
+#endif
+
+#if NCE_CAB_BUS_AIU
+	case CAB_TYPE_AIU:
+		setISRIdleReply();
+		break;
+#endif
+
+	default:
+		isrReplyLength = 0;
+		break;
+	}
+}
+
+	// AIU input state reply, also sent by an idle smart cab
+void NceCabBus::setISRIdleReply(void)
+{
+	isrReply[0] = pollReply[0];
+	isrReply[1] = pollReply[1];
+	isrReplyLength = 2;
+
+#if NCE_CAB_BUS_SMART_CAB
+	isrReplyCommand = NULL;
+#endif
+}
+
+void NceCabBus::sendISRReply(void)
+{
+	if (isrReplyLength)
+		callRS485SendBytes((uint8_t *)isrReply, isrReplyLength);
+
+	isrReplySent();
+}
+
+	// Move on from the reply that has just gone out to our poll
+void NceCabBus::isrReplySent(void)
+{
+#if NCE_CAB_BUS_KEYPAD
+	if ((cabType == CAB_TYPE_LCD) || (cabType == CAB_TYPE_NO_LCD))
+	{
+		keyCodeSent();
+		isrReply[0] = pollReply[0];
+	}
+#endif
+
+#if NCE_CAB_BUS_SMART_CAB
+	if (isrReplyCommand)
+	{
+		isrSentCommand = isrReplyCommand;
+#if NCE_CAB_BUS_MULTI_ADDRESS
+		isrSentAddress = isrPolledAddress;
+#endif
+		isrCommandsSent++;
+		setISRIdleReply();
+	}
+#endif
+}
+
+#endif
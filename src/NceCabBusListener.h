@@ -0,0 +1,106 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusListener.h
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// file:      NceCabBusListener.h
+// purpose:   Handlers as member functions of a sketch class instead of
+//            global functions, so each NceCabBus can have its own object
+//            holding its state. Derive the class from
+//            NceCabBusListener<YourClass> and define the handlers it needs:
+//
+//              class AiuNode : public NceCabBusListener<AiuNode>
+//              {
+//                public:
+//                  void sendRS485Bytes(uint8_t *values, uint8_t length);
+//              };
+//
+//              aiuNode.attachCabBus(cabBus);
+//
+//            attachCabBus() gives the library a table of small functions,
+//            one per handler, that call the members of the object. Each
+//            handler call is still an indirect call through that table, as
+//            with the global functions, and the ones not defined by the
+//            class do nothing.
+//
+//------------------------------------------------------------------------
+
+#ifndef NCE_CAB_BUS_LISTENER_H
+#define NCE_CAB_BUS_LISTENER_H
+
+template <class Derived>
+class NceCabBusListener
+{
+  public:
+    void attachCabBus(NceCabBus &cabBus)
+    {
+      cabBus.setListener(static_cast<Derived *>(this), &listenerTable);
+    }
+
+    void sendRS485Bytes(uint8_t *, uint8_t) {}
+    void sendUSBBytes(uint8_t *, uint8_t) {}
+    void fastClock(uint8_t, uint8_t, uint8_t, FAST_CLOCK_MODE) {}
+    void lcdUpdate(uint8_t, uint8_t, char *, uint8_t) {}
+    void lcdMoveCursor(uint8_t, uint8_t) {}
+    void lcdCursorMode(CURSOR_MODE) {}
+    void lcdPrintChar(char, bool) {}
+
+  private:
+    static void callSendRS485Bytes(void *context, uint8_t *values, uint8_t length)
+    {
+      static_cast<Derived *>(context)->sendRS485Bytes(values, length);
+    }
+
+    static void callSendUSBBytes(void *context, uint8_t *values, uint8_t length)
+    {
+      static_cast<Derived *>(context)->sendUSBBytes(values, length);
+    }
+
+    static void callFastClock(void *context, uint8_t Hours, uint8_t Minutes, uint8_t Rate, FAST_CLOCK_MODE Mode)
+    {
+      static_cast<Derived *>(context)->fastClock(Hours, Minutes, Rate, Mode);
+    }
+
+    static void callLCDUpdate(void *context, uint8_t Col, uint8_t Row, char *msg, uint8_t len)
+    {
+      static_cast<Derived *>(context)->lcdUpdate(Col, Row, msg, len);
+    }
+
+    static void callLCDMoveCursor(void *context, uint8_t Col, uint8_t Row)
+    {
+      static_cast<Derived *>(context)->lcdMoveCursor(Col, Row);
+    }
+
+    static void callLCDCursorMode(void *context, CURSOR_MODE mode)
+    {
+      static_cast<Derived *>(context)->lcdCursorMode(mode);
+    }
+
+    static void callLCDPrintChar(void *context, char ch, bool advanceCursor)
+    {
+      static_cast<Derived *>(context)->lcdPrintChar(ch, advanceCursor);
+    }
+
+    static const NceCabBusListenerTable listenerTable;
+};
+
+template <class Derived>
+const NceCabBusListenerTable NceCabBusListener<Derived>::listenerTable =
+{
+  &NceCabBusListener<Derived>::callSendRS485Bytes,
+  &NceCabBusListener<Derived>::callSendUSBBytes,
+  &NceCabBusListener<Derived>::callFastClock,
+  &NceCabBusListener<Derived>::callLCDUpdate,
+  &NceCabBusListener<Derived>::callLCDMoveCursor,
+  &NceCabBusListener<Derived>::callLCDCursorMode,
+  &NceCabBusListener<Derived>::callLCDPrintChar,
+};
+
+#endif
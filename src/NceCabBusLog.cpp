@@ -0,0 +1,228 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusLog.cpp
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   setLogger() debug output. Every message is a LOG_EVENT id
+//            and a few bytes, printed straight away, or with
+//            NCE_CAB_BUS_DEFERRED_LOG written to a RAM ring and printed
+//            by flushLog() when the sketch has time, so a slow Print
+//            target can not make the cab miss its reply window.
+//
+//------------------------------------------------------------------------
+
+#include "NceCabBus.h"
+
+#define LOG_MAX_ARGS		4
+#define LOG_DUMP_FIRST		(LOG_MAX_ARGS - 1)	// Bytes in the first record of a dump, after the count
+
+static void printHexByte(Print *pOut, uint8_t value)
+{
+	if (value < 16)
+		pOut->print('0');
+	pOut->print(value, HEX);
+}
+
+	// Same text as was printed before the log was deferred
+void NceCabBus::printLogRecord(uint8_t event, const uint8_t *args, uint8_t count)
+{
+	switch (event)
+	{
+	case LOG_EVENT_COMMAND:
+		pLogger->print(F("\nCmd: "));
+		for (uint8_t i = 0; i < count; i++)
+		{
+			printHexByte(pLogger, args[i]);
+			pLogger->print('-');
+			pLogger->print((char)(args[i] & CMD_ASCII_MASK));
+			pLogger->print(' ');
+		}
+		break;
+
+	case LOG_EVENT_USB_ADD_BYTE:
+		pLogger->print(F("\nUSB Add Byte: "));
+		printHexByte(pLogger, args[0]);
+		pLogger->println();
+		break;
+
+	case LOG_EVENT_USB_NEW_COMMAND:
+		pLogger->print(F("\nUSB New Command: "));
+		pLogger->print(args[0], HEX);
+		pLogger->print(F("  Expected Length: "));
+		pLogger->println(args[1]);
+		break;
+
+	case LOG_EVENT_USB_PROCESS:
+		pLogger->print(F("\nProcess USB Command: Count: "));
+		pLogger->print(count);
+		pLogger->print(F("  Data: "));
+		for (uint8_t i = 0; i < count; i++)
+			printHexByte(pLogger, args[i]);
+		pLogger->println();
+		break;
+
+	case LOG_EVENT_REPLY:
+		pLogger->print(F("\nReply: "));
+		pLogger->print(args[0], HEX);
+		pLogger->print(F(" Size: "));
+		pLogger->println(args[1]);
+		break;
+
+	case LOG_EVENT_SEND_RS485:
+		pLogger->print(F("\nSend RS485: "));
+		for (uint8_t i = 0; i < count; i++)
+		{
+			printHexByte(pLogger, args[i]);
+			pLogger->print(' ');
+		}
+		pLogger->println();
+		break;
+
+	case LOG_EVENT_ROUTE_QUEUED:
+		pLogger->print(F("\nRoute Queued: "));
+		pLogger->println(args[0]);
+		break;
+
+	case LOG_EVENT_ROUTE_DONE:
+		pLogger->print(F("\nRoute Done: "));
+		pLogger->println(args[0]);
+		break;
+
+	case LOG_EVENT_TIMETABLE:
+		pLogger->print(F("\nTimetable: "));
+		pLogger->print(args[0]);
+		pLogger->print(':');
+		if (args[1] < 10)
+			pLogger->print('0');
+		pLogger->println(args[1]);
+		break;
+	}
+}
+
+void NceCabBus::logBytes(uint8_t event, const uint8_t *bytes, uint8_t count)
+{
+	if (!pLogger)
+		return;
+
+#if !NCE_CAB_BUS_DEFERRED_LOG
+	printLogRecord(event, bytes, count);
+#else
+		// All of the dump or none of it, so flushLog() never sees half of one
+	uint8_t first = (count < LOG_DUMP_FIRST) ? count : LOG_DUMP_FIRST;
+	uint8_t rest = count - first;
+	uint16_t size = (2 + first) + rest + ((rest + LOG_MAX_ARGS - 1) / LOG_MAX_ARGS);
+
+	if (logCount + size > NCE_CAB_BUS_LOG_SIZE)
+	{
+		if (logDropped < 0xFFFF)
+			logDropped++;
+		return;
+	}
+
+	uint8_t args[LOG_MAX_ARGS];
+	args[0] = count;
+	for (uint8_t i = 0; i < first; i++)
+		args[i + 1] = bytes[i];
+	logRecord(event, args, first + 1);
+
+	for (uint8_t i = first; i < count; i += LOG_MAX_ARGS)
+		logRecord(LOG_EVENT_DATA, bytes + i, ((count - i) < LOG_MAX_ARGS) ? (count - i) : LOG_MAX_ARGS);
+#endif
+}
+
+#if NCE_CAB_BUS_DEFERRED_LOG
+
+static bool isLogDump(uint8_t event)
+{
+	return (event == LOG_EVENT_COMMAND) || (event == LOG_EVENT_USB_PROCESS) || (event == LOG_EVENT_SEND_RS485);
+}
+
+	// Called from the same loop() code as processByte(), so no interrupt locking
+void NceCabBus::logRecord(uint8_t event, const uint8_t *args, uint8_t argCount)
+{
+	if (logCount + 1 + argCount > NCE_CAB_BUS_LOG_SIZE)
+	{
+		if (logDropped < 0xFFFF)
+			logDropped++;
+		return;
+	}
+
+	logRing[logHead] = (event << 3) | argCount;
+	logHead = (logHead + 1) & (NCE_CAB_BUS_LOG_SIZE - 1);
+
+	for (uint8_t i = 0; i < argCount; i++)
+	{
+		logRing[logHead] = args[i];
+		logHead = (logHead + 1) & (NCE_CAB_BUS_LOG_SIZE - 1);
+	}
+
+	logCount += 1 + argCount;
+}
+
+uint8_t NceCabBus::readLogByte(void)
+{
+	uint8_t value = logRing[(logHead - logCount) & (NCE_CAB_BUS_LOG_SIZE - 1)];
+	logCount--;
+	return value;
+}
+
+	// Print and free every record logged so far. Call it from loop() when there is time,
+	// e.g. straight after our poll has been answered
+void NceCabBus::flushLog(void)
+{
+	while (logCount)
+	{
+		uint8_t header = readLogByte();
+		uint8_t event = header >> 3;
+		uint8_t count = header & 0x07;
+		uint8_t args[CMD_LEN_MAX + LOG_MAX_ARGS];
+
+		for (uint8_t i = 0; i < count; i++)
+			args[i] = readLogByte();
+
+		if (isLogDump(event) && count)
+		{
+				// Move the bytes down over the count and gather the LOG_EVENT_DATA records
+			uint8_t dumpLength = args[0];
+			count--;
+			for (uint8_t i = 0; i < count; i++)
+				args[i] = args[i + 1];
+
+			while ((count < dumpLength) && logCount)
+			{
+				uint8_t more = readLogByte() & 0x07;
+				for (uint8_t i = 0; i < more; i++)
+				{
+					uint8_t value = readLogByte();
+					if (count < CMD_LEN_MAX)
+						args[count++] = value;
+				}
+			}
+		}
+
+		if (pLogger)
+			printLogRecord(event, args, count);
+	}
+
+	if (pLogger && (logDropped != logDroppedReported))
+	{
+		pLogger->print(F("\nLog Dropped: "));
+		pLogger->println((uint16_t)(logDropped - logDroppedReported));
+		logDroppedReported = logDropped;
+	}
+}
+
+	// Records, or whole dumps, thrown away because the ring was full
+uint16_t NceCabBus::getLogDropped(void)
+{
+	return logDropped;
+}
+
+#endif
@@ -0,0 +1,202 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusRoutes.cpp
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   Smart cab route tables. A route is a fixed length list of
+//            accessory address/state entries held in flash, or EEPROM on
+//            AVR. Triggering one, from triggerRoute() or the vendor USB
+//            opcode 0xF2, queues it and its entries are sent as 0xAD style
+//            accessory frames on our polls whenever no USB command is
+//            waiting, one per poll. Accessories already in the wanted state
+//            are skipped, the state is remembered from every accessory frame
+//            this cab has sent.
+//
+//            Only built when NCE_CAB_BUS_SMART_CAB and NCE_CAB_BUS_ROUTES
+//            are enabled.
+//
+//------------------------------------------------------------------------
+
+#include "NceCabBus.h"
+
+#if NCE_CAB_BUS_SMART_CAB && NCE_CAB_BUS_ROUTES
+
+#ifdef __AVR__
+#include <avr/eeprom.h>
+#endif
+
+#define ROUTE_ADDRESS_MASK	0x0FFF
+#define ROUTE_REVERSE_BIT	0x8000
+#define ROUTE_ADDRESS_MAX	2044
+
+	// table is routeCount routes of NCE_CAB_BUS_ROUTE_LENGTH entries in PROGMEM
+void NceCabBus::setRouteTable(const uint16_t *table, uint8_t routeCount)
+{
+	cancelRoutes();
+	routeTable = table;
+	routeInEEPROM = false;
+	this->routeCount = routeCount;
+}
+
+#ifdef __AVR__
+	// As setRouteTable() but the table starts at eepromAddress
+void NceCabBus::setRouteTableEEPROM(uint16_t eepromAddress, uint8_t routeCount)
+{
+	cancelRoutes();
+	routeEEPROMAddress = eepromAddress;
+	routeInEEPROM = true;
+	this->routeCount = routeCount;
+}
+#endif
+
+	// Drop the queued routes and the frame built for the one in progress, so nothing from the
+	// old table goes out once it is replaced. A frame the interrupt has sent is finished off first
+void NceCabBus::cancelRoutes(void)
+{
+#if NCE_CAB_BUS_ISR_RECEIVE
+	finishISRCommands();
+#endif
+
+	BEGIN_REPLY_UPDATE();
+	routeQueueCount = 0;
+	routeIndex = 0;
+	routeFrame.count = 0;
+	END_REPLY_UPDATE();
+}
+
+	// Queue route to run after any already queued, or route with NCE_ROUTE_FORCE to send
+	// every accessory in it. Returns false if there is no such route or the queue is full
+bool NceCabBus::triggerRoute(uint8_t route)
+{
+	if (((route & ~NCE_ROUTE_FORCE) >= routeCount) || (routeQueueCount >= NCE_CAB_BUS_ROUTE_QUEUE_SIZE))
+		return false;
+
+	routeQueue[(routeQueueTail + routeQueueCount) & (NCE_CAB_BUS_ROUTE_QUEUE_SIZE - 1)] = route;
+	routeQueueCount++;
+
+	logEvent(LOG_EVENT_ROUTE_QUEUED, route & ~NCE_ROUTE_FORCE, 0);
+
+#if NCE_CAB_BUS_ISR_RECEIVE
+	noInterrupts();
+	updateISRReply();
+	interrupts();
+#endif
+	return true;
+}
+
+	// Routes queued or still being sent
+uint8_t NceCabBus::getRoutesPending(void)
+{
+	return routeQueueCount;
+}
+
+	// Forget every accessory state, e.g. after the layout was powered off
+void NceCabBus::clearAccessoryCache(void)
+{
+	memset(accessoryKnown, 0, sizeof(accessoryKnown));
+	memset(accessoryReversed, 0, sizeof(accessoryReversed));
+}
+
+uint16_t NceCabBus::readRouteEntry(uint8_t route, uint8_t index)
+{
+	uint16_t offset = ((uint16_t)route * NCE_CAB_BUS_ROUTE_LENGTH) + index;
+
+#ifdef __AVR__
+	if (routeInEEPROM)
+		return eeprom_read_word((const uint16_t *)(routeEEPROMAddress + (offset * 2)));
+#endif
+
+	return pgm_read_word(&routeTable[offset]);
+}
+
+	// Returns the frame for the next accessory of the current route that needs
+	// sending, or NULL when no routes are left. Calling it again before the frame
+	// is sent builds the same frame
+CabBusCommand *NceCabBus::nextRouteFrame(void)
+{
+	while (routeQueueCount)
+	{
+		uint8_t route = routeQueue[routeQueueTail];
+
+		for ( ; routeIndex < NCE_CAB_BUS_ROUTE_LENGTH; routeIndex++)
+		{
+			uint16_t entry = readRouteEntry(route & ~NCE_ROUTE_FORCE, routeIndex);
+			if (entry == NCE_ROUTE_END)
+				break;
+
+			uint16_t address = entry & ROUTE_ADDRESS_MASK;
+			bool reversed = entry & ROUTE_REVERSE_BIT;
+
+			if ((address > ROUTE_ADDRESS_MAX) ||
+				(!(route & NCE_ROUTE_FORCE) && isAccessoryState(address, reversed)))
+				continue;
+
+			routeFrame.data[0] = 0x50 + (address >> 7);
+			routeFrame.data[1] = address & 0x7F;
+			routeFrame.data[2] = reversed ? 0x04 : 0x03;
+			routeFrame.data[3] = 0x00;
+			routeFrame.data[4] = calcChecksum(routeFrame.data, 4);
+			routeFrame.count = 5;
+			routeFrameEntry = entry;
+			return &routeFrame;
+		}
+
+		logEvent(LOG_EVENT_ROUTE_DONE, route & ~NCE_ROUTE_FORCE, 0);
+
+		routeQueueTail = (routeQueueTail + 1) & (NCE_CAB_BUS_ROUTE_QUEUE_SIZE - 1);
+		routeQueueCount--;
+		routeIndex = 0;
+	}
+
+	return NULL;
+}
+
+	// routeFrame has gone out, remember the state and move to the next entry. Nothing to do if
+	// the routes were cancelled since it was built
+void NceCabBus::routeFrameSent(void)
+{
+	if (!routeFrame.count)
+		return;
+
+	setAccessoryState(routeFrameEntry & ROUTE_ADDRESS_MASK, routeFrameEntry & ROUTE_REVERSE_BIT);
+	routeFrame.count = 0;
+	routeIndex++;
+}
+
+void NceCabBus::setAccessoryState(uint16_t address, bool reversed)
+{
+	if ((address == 0) || (address > NCE_CAB_BUS_ROUTE_CACHE_SIZE))
+		return;
+
+	uint16_t bit = address - 1;
+	uint8_t mask = 1 << (bit & 7);
+
+	accessoryKnown[bit >> 3] |= mask;
+	if (reversed)
+		accessoryReversed[bit >> 3] |= mask;
+	else
+		accessoryReversed[bit >> 3] &= ~mask;
+}
+
+bool NceCabBus::isAccessoryState(uint16_t address, bool reversed)
+{
+	if ((address == 0) || (address > NCE_CAB_BUS_ROUTE_CACHE_SIZE))
+		return false;
+
+	uint16_t bit = address - 1;
+	uint8_t mask = 1 << (bit & 7);
+
+	if (!(accessoryKnown[bit >> 3] & mask))
+		return false;
+
+	return ((accessoryReversed[bit >> 3] & mask) != 0) == reversed;
+}
+
+#endif
@@ -0,0 +1,132 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusService.cpp
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   One call run loop. service() reads every RS485 byte waiting,
+//            then the USB bytes for as long as the smart cab can take
+//            them, sends the buffered USB responses and prints the
+//            deferred log, and then calls the sketch's AppTask handler
+//            while time is left of the budget for this loop() pass. New
+//            RS485 bytes are read between AppTask calls, and nothing but
+//            RS485 is done while the command station is sending a command
+//            to us, so the latency of a node no longer depends on how its
+//            loop() was written.
+//
+//            Only built when NCE_CAB_BUS_SERVICE is enabled.
+//
+//------------------------------------------------------------------------
+
+#include "NceCabBus.h"
+
+#if NCE_CAB_BUS_SERVICE
+
+static uint32_t budgetLeft(uint32_t now, uint32_t budgetUs)
+{
+	uint32_t used = micros() - now;
+	return (used < budgetUs) ? budgetUs - used : 0;
+}
+
+	// Where service() reads the bytes from, either may be NULL. The replies still go out through
+	// the RS485SendBytes and USBSendBytes handlers. With NCE_CAB_BUS_ISR_RECEIVE the bytes queued
+	// by processByteFromISR() are used instead of rs485 once it has been called
+void NceCabBus::setServiceStreams(Stream *rs485, Stream *usb)
+{
+	pRS485Stream = rs485;
+	pUSBStream = usb;
+}
+
+void NceCabBus::setAppTaskHandler(AppTaskHandler funcPtr)
+{
+	func_AppTaskHandler = funcPtr;
+}
+
+	// Call once per loop() with now = micros() at its start. budgetUs is how long the whole
+	// pass may take, the AppTask handler gets what the bus work leaves of it. Returns the
+	// microseconds of the budget left unused, 0 when the pass ran over
+uint32_t NceCabBus::service(uint32_t now, uint32_t budgetUs)
+{
+	serviceRS485();
+
+		// The command station is talking to us, leave everything else for the next pass
+	if (cabState == CAB_STATE_EXEC_MY_CMD)
+		return budgetLeft(now, budgetUs);
+
+#if NCE_CAB_BUS_SMART_CAB
+	serviceUSB();
+#endif
+
+#if NCE_CAB_BUS_DEFERRED_LOG
+	flushLog();
+#endif
+
+	while (func_AppTaskHandler)
+	{
+		uint32_t left = budgetLeft(now, budgetUs);
+		if (!left || !func_AppTaskHandler(left))
+			break;
+
+		serviceRS485();
+		if (cabState == CAB_STATE_EXEC_MY_CMD)
+			break;
+	}
+
+	return budgetLeft(now, budgetUs);
+}
+
+void NceCabBus::serviceRS485(void)
+{
+#if NCE_CAB_BUS_ISR_RECEIVE
+	if (isrReceive)
+	{
+		processRxQueue(true);
+		return;
+	}
+#endif
+
+	if (!pRS485Stream)
+		return;
+
+	while (pRS485Stream->available() > 0)
+	{
+		uint8_t inByte = pRS485Stream->read();
+		processByte(inByte);
+#if NCE_CAB_BUS_SMART_CAB
+		if (cabType == CAB_TYPE_SMART)
+			processResponseByte(inByte);
+#endif
+	}
+}
+
+#if NCE_CAB_BUS_SMART_CAB
+	// Reads the rest of a USB command, or a new one once the last has been answered. Until
+	// then the bytes wait in the Stream, so a JMRI that sends ahead can't overwrite a command
+	// whose frames have not gone out yet
+void NceCabBus::serviceUSB(void)
+{
+	if (pUSBStream)
+	{
+#if NCE_CAB_BUS_USB_TX_BUFFER_SIZE
+		usbTxHold = true;
+#endif
+		while ((!usbCommandPending || (USBCommandBuffer.count < USBCommandBuffer.expectedLength)) && (pUSBStream->available() > 0))
+			processUSBByte(pUSBStream->read());
+#if NCE_CAB_BUS_USB_TX_BUFFER_SIZE
+		usbTxHold = false;
+#endif
+	}
+
+#if NCE_CAB_BUS_USB_TX_BUFFER_SIZE
+	flushUSB();
+#endif
+}
+#endif
+
+#endif
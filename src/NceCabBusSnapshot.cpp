@@ -0,0 +1,334 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusSnapshot.cpp
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   Warm start snapshot of the role state: cab type and address,
+//            LCD contents and cursor, fast clock, AIU inputs and the smart
+//            cab addresses and acknowledged frames. saveSnapshot() writes
+//            it to RAM, e.g. a .noinit buffer, or to EEPROM on AVR, and
+//            restoreSnapshot() puts it back after a reset so the throttle
+//            shows its last screen and an AIU reports its inputs without
+//            waiting for the command station to send everything again.
+//
+//            Layout, multi byte values little endian:
+//              'N', version, total length (2), cab type, cab address
+//              sections of tag, data length, data
+//              CRC-16/CCITT-FALSE (2) of everything before it
+//
+//            Sections for roles that are not built in are skipped on
+//            restore, as are unknown tags. Only built when
+//            NCE_CAB_BUS_SNAPSHOT is enabled.
+//
+//------------------------------------------------------------------------
+
+#include "NceCabBus.h"
+
+#if NCE_CAB_BUS_SNAPSHOT
+
+#ifdef __AVR__
+#include <avr/eeprom.h>
+#endif
+
+#define SNAPSHOT_MAGIC			'N'
+#define SNAPSHOT_HEADER_SIZE	6
+#define SNAPSHOT_CRC_SIZE		2
+
+#define SNAPSHOT_TAG_LCD		0x01	// Cursor col, row, then the display row by row
+#define SNAPSHOT_TAG_FAST_CLOCK	0x02	// Hours, minutes, rate, mode
+#define SNAPSHOT_TAG_AIU		0x03	// Input state
+#define SNAPSHOT_TAG_ADDRESSES	0x04	// Cab addresses added by addCabAddress()
+#define SNAPSHOT_TAG_FRAMES		0x05	// Queued frames, each a count and its bytes
+
+static uint16_t snapshotCRC(const uint8_t *data, uint16_t length)
+{
+	uint16_t crc = 0xFFFF;
+
+	while (length--)
+	{
+		crc ^= (uint16_t)(*data++) << 8;
+		for (uint8_t i = 0; i < 8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+	// Writes the snapshot to buffer and returns its length, or 0 if size is less
+	// than NCE_CAB_BUS_SNAPSHOT_SIZE
+uint16_t NceCabBus::saveSnapshot(uint8_t *buffer, uint16_t size)
+{
+	if (size < NCE_CAB_BUS_SNAPSHOT_SIZE)
+		return 0;
+
+	uint16_t length = SNAPSHOT_HEADER_SIZE;
+
+	buffer[0] = SNAPSHOT_MAGIC;
+	buffer[1] = NCE_CAB_BUS_SNAPSHOT_VERSION;
+	buffer[4] = cabType;
+	buffer[5] = cabAddress;
+
+#if NCE_CAB_BUS_LCD
+	buffer[length++] = SNAPSHOT_TAG_LCD;
+	buffer[length++] = 2 + sizeof(lcdShadow);
+	buffer[length++] = lcdShadowCol;
+	buffer[length++] = lcdShadowRow;
+	memcpy(buffer + length, lcdShadow, sizeof(lcdShadow));
+	length += sizeof(lcdShadow);
+#endif
+
+#if NCE_CAB_BUS_FAST_CLOCK
+	buffer[length++] = SNAPSHOT_TAG_FAST_CLOCK;
+	buffer[length++] = 4;
+	buffer[length++] = FastClockHours;
+	buffer[length++] = FastClockMinutes;
+	buffer[length++] = FastClockRate;
+	buffer[length++] = FastClockMode;
+#endif
+
+#if NCE_CAB_BUS_AIU
+	buffer[length++] = SNAPSHOT_TAG_AIU;
+	buffer[length++] = 2;
+	buffer[length++] = aiuState & 0xFF;
+	buffer[length++] = aiuState >> 8;
+#endif
+
+#if NCE_CAB_BUS_MULTI_ADDRESS
+	buffer[length++] = SNAPSHOT_TAG_ADDRESSES;
+	buffer[length++] = extraCabAddressCount;
+	memcpy(buffer + length, extraCabAddresses, extraCabAddressCount);
+	length += extraCabAddressCount;
+
+		// Frames already acknowledged to JMRI, so nobody would send them again. A frame that
+		// is still being received or waiting to be acknowledged is left for JMRI to retry
+	buffer[length++] = SNAPSHOT_TAG_FRAMES;
+	uint16_t sizeIndex = length++;
+
+#if NCE_CAB_BUS_ISR_RECEIVE
+	noInterrupts();
+#endif
+	for (uint8_t i = 0; i < frameQueueCount; i++)
+	{
+		CabBusCommand *frame = &frameQueue[(frameQueueTail + i) & (NCE_CAB_BUS_SMART_CAB_QUEUE_SIZE - 1)];
+		if ((length - sizeIndex - 1) + 1 + frame->count > SNAPSHOT_FRAMES_SIZE)
+			break;
+
+		buffer[length++] = frame->count;
+		memcpy(buffer + length, frame->data, frame->count);
+		length += frame->count;
+	}
+#if NCE_CAB_BUS_ISR_RECEIVE
+	interrupts();
+#endif
+	buffer[sizeIndex] = length - sizeIndex - 1;
+#endif
+
+	length += SNAPSHOT_CRC_SIZE;
+	buffer[2] = length & 0xFF;
+	buffer[3] = length >> 8;
+
+	uint16_t crc = snapshotCRC(buffer, length - SNAPSHOT_CRC_SIZE);
+	buffer[length - 2] = crc & 0xFF;
+	buffer[length - 1] = crc >> 8;
+
+	return length;
+}
+
+	// Puts back the state from a snapshot written by saveSnapshot() and repaints the LCD.
+	// Returns false, changing nothing, when it is not a valid snapshot of this version
+bool NceCabBus::restoreSnapshot(const uint8_t *buffer, uint16_t length)
+{
+	if ((length < SNAPSHOT_HEADER_SIZE + SNAPSHOT_CRC_SIZE) || (buffer[0] != SNAPSHOT_MAGIC) || (buffer[1] != NCE_CAB_BUS_SNAPSHOT_VERSION))
+		return false;
+
+	uint16_t total = buffer[2] | ((uint16_t)buffer[3] << 8);
+	if ((total < SNAPSHOT_HEADER_SIZE + SNAPSHOT_CRC_SIZE) || (total > length))
+		return false;
+
+	uint16_t end = total - SNAPSHOT_CRC_SIZE;
+	if (snapshotCRC(buffer, end) != (buffer[end] | ((uint16_t)buffer[end + 1] << 8)))
+		return false;
+
+		// Check every section fits before changing anything
+	for (uint16_t index = SNAPSHOT_HEADER_SIZE; index < end; index += 2 + buffer[index + 1])
+		if ((index + 2 > end) || (index + 2 + buffer[index + 1] > end))
+			return false;
+
+	setCabType((CAB_TYPE)buffer[4]);
+	setCabAddress(buffer[5]);
+
+	for (uint16_t index = SNAPSHOT_HEADER_SIZE; index < end; index += 2 + buffer[index + 1])
+	{
+		uint8_t tag = buffer[index];
+#if NCE_CAB_BUS_LCD || NCE_CAB_BUS_FAST_CLOCK || NCE_CAB_BUS_AIU || NCE_CAB_BUS_MULTI_ADDRESS
+		uint8_t size = buffer[index + 1];
+		const uint8_t *data = buffer + index + 2;
+#endif
+
+		switch (tag)
+		{
+#if NCE_CAB_BUS_LCD
+		case SNAPSHOT_TAG_LCD:
+			if (size == 2 + sizeof(lcdShadow))
+			{
+				memcpy(lcdShadow, data + 2, sizeof(lcdShadow));
+
+				if (cabType == CAB_TYPE_LCD)
+				{
+					for (uint8_t Row = 0; Row < NCE_CAB_BUS_LCD_ROWS; Row++)
+						for (uint8_t Col = 0; Col < NCE_CAB_BUS_LCD_COLS; Col += 8)
+						{
+							char text[8];
+							memcpy(text, &lcdShadow[Row][Col], sizeof(text));
+							callLCDUpdateHandler(Col, Row, text, sizeof(text));
+						}
+
+					callLCDMoveCursorHandler(data[0], data[1]);
+				}
+				else
+				{
+					lcdShadowCol = data[0];
+					lcdShadowRow = data[1];
+				}
+			}
+			break;
+#endif
+
+#if NCE_CAB_BUS_FAST_CLOCK
+		case SNAPSHOT_TAG_FAST_CLOCK:
+			if (size == 4)
+			{
+				FastClockHours = data[0];
+				FastClockMinutes = data[1];
+				FastClockRate = data[2];
+				FastClockMode = (FAST_CLOCK_MODE)data[3];
+				callFastClockHandler();
+			}
+			break;
+#endif
+
+#if NCE_CAB_BUS_AIU
+		case SNAPSHOT_TAG_AIU:
+			if (size == 2)
+				setAuiIoState(data[0] | ((uint16_t)data[1] << 8));
+			break;
+#endif
+
+#if NCE_CAB_BUS_MULTI_ADDRESS
+		case SNAPSHOT_TAG_ADDRESSES:
+			for (uint8_t i = 0; i < size; i++)
+				addCabAddress(data[i]);
+			break;
+
+		case SNAPSHOT_TAG_FRAMES:
+			{
+#if NCE_CAB_BUS_ISR_RECEIVE
+				noInterrupts();
+#endif
+				frameQueueTail = 0;
+				frameQueueCount = 0;
+
+				for (uint8_t i = 0; (i < size) && (frameQueueCount < NCE_CAB_BUS_SMART_CAB_QUEUE_SIZE); )
+				{
+					uint8_t count = data[i++];
+					if ((count == 0) || (count > CAB_BUS_COMMAND_LENGTH) || (i + count > size))
+						break;
+
+					CabBusCommand *frame = &frameQueue[frameQueueCount++];
+					frame->count = count;
+					memcpy(frame->data, data + i, count);
+					i += count;
+				}
+
+#if NCE_CAB_BUS_ISR_RECEIVE
+				updateISRReply();
+				interrupts();
+#endif
+			}
+			break;
+#endif
+
+		default:	// A role not built in or a later addition
+			break;
+		}
+	}
+
+	return true;
+}
+
+#ifdef __AVR__
+	// As saveSnapshot() but to EEPROM at eepromAddress, only the bytes that changed are written
+uint16_t NceCabBus::saveSnapshotEEPROM(uint16_t eepromAddress)
+{
+	uint8_t buffer[NCE_CAB_BUS_SNAPSHOT_SIZE];
+
+	uint16_t length = saveSnapshot(buffer, sizeof(buffer));
+	eeprom_update_block(buffer, (void *)eepromAddress, length);
+	return length;
+}
+
+bool NceCabBus::restoreSnapshotEEPROM(uint16_t eepromAddress)
+{
+	uint8_t buffer[NCE_CAB_BUS_SNAPSHOT_SIZE];
+
+	eeprom_read_block(buffer, (const void *)eepromAddress, SNAPSHOT_HEADER_SIZE);
+
+	uint16_t length = buffer[2] | ((uint16_t)buffer[3] << 8);
+	if (length > sizeof(buffer))
+		return false;
+
+	eeprom_read_block(buffer, (const void *)eepromAddress, length);
+	return restoreSnapshot(buffer, length);
+}
+#endif
+
+#if NCE_CAB_BUS_LCD
+	// The character at Col, Row as last sent to the LCD handlers, ' ' outside the display
+char NceCabBus::getLCDChar(uint8_t Col, uint8_t Row)
+{
+	if ((Col >= NCE_CAB_BUS_LCD_COLS) || (Row >= NCE_CAB_BUS_LCD_ROWS))
+		return ' ';
+
+	return lcdShadow[Row][Col];
+}
+
+void NceCabBus::shadowLCDText(uint8_t Col, uint8_t Row, const char *msg, uint8_t len)
+{
+	if (Row >= NCE_CAB_BUS_LCD_ROWS)
+		return;
+
+	for (uint8_t i = 0; (i < len) && ((Col + i) < NCE_CAB_BUS_LCD_COLS); i++)
+		lcdShadow[Row][Col + i] = msg[i];
+}
+
+void NceCabBus::shadowLCDChar(char ch, bool advanceCursor)
+{
+	if ((lcdShadowRow >= NCE_CAB_BUS_LCD_ROWS) || (lcdShadowCol >= NCE_CAB_BUS_LCD_COLS))
+		return;
+
+	lcdShadow[lcdShadowRow][lcdShadowCol] = ch;
+	if (advanceCursor)
+		lcdShadowCol++;
+}
+
+	// Cursor on / off and display shifts leave the text where it is
+void NceCabBus::shadowLCDCursorMode(CURSOR_MODE mode)
+{
+	if (mode == CURSOR_CLEAR_HOME)
+		memset(lcdShadow, ' ', sizeof(lcdShadow));
+
+	if ((mode == CURSOR_CLEAR_HOME) || (mode == CURSOR_HOME))
+	{
+		lcdShadowCol = 0;
+		lcdShadowRow = 0;
+	}
+}
+#endif
+
+#endif
@@ -0,0 +1,221 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusTimetable.cpp
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   Fast clock timetable. A table of fast time and action
+//            entries held in flash, sorted by time. Each fast clock
+//            broadcast moves the timetable on to the new time and runs
+//            the entries of every minute passed, so the work per
+//            broadcast only depends on the entries that are due.
+//
+//            A callback action calls the TimetableHandler straight away,
+//            a route action is queued with triggerRoute(), and macro and
+//            accessory actions are queued as Cab Bus frames that a smart
+//            cab sends on its next polls, one per poll, after any USB
+//            command and before the routes.
+//
+//            Only built when NCE_CAB_BUS_FAST_CLOCK and
+//            NCE_CAB_BUS_TIMETABLE are enabled.
+//
+//------------------------------------------------------------------------
+
+#include "NceCabBus.h"
+
+#if NCE_CAB_BUS_USE_TIMETABLE
+
+#define TIMETABLE_MINUTES_PER_DAY	1440
+
+#define TIMETABLE_ACTION_MASK		0xF000
+#define TIMETABLE_VALUE_MASK		0x0FFF
+#define TIMETABLE_ACTION_CALLBACK	0x0000
+#define TIMETABLE_ACTION_MACRO		0x1000
+#define TIMETABLE_ACTION_NORMAL		0x2000
+#define TIMETABLE_ACTION_REVERSE	0x3000
+#define TIMETABLE_ACTION_ROUTE		0x4000
+
+	// table is count entries in PROGMEM, sorted by time. Nothing runs until the next
+	// fast clock broadcast and then only the entries after the time it gives
+void NceCabBus::setTimetable(const NceTimetableEntry *table, uint16_t count)
+{
+	timetable = table;
+	timetableCount = count;
+	timetableNext = 0;
+	timetableTime = TIMETABLE_TIME_UNKNOWN;
+}
+
+void NceCabBus::setTimetableHandler(TimetableHandler funcPtr)
+{
+	func_TimetableHandler = funcPtr;
+}
+
+#if NCE_CAB_BUS_SMART_CAB
+	// Macro and accessory actions waiting for our polls
+uint8_t NceCabBus::getTimetablePending(void)
+{
+	return timetableQueueCount;
+}
+
+	// Macro and accessory actions dropped because the queue was full
+uint8_t NceCabBus::getTimetableOverflows(void)
+{
+	return timetableOverflows;
+}
+#endif
+
+	// Point timetableNext at the first entry after now
+void NceCabBus::syncTimetable(uint16_t now)
+{
+	uint16_t low = 0;
+	uint16_t high = timetableCount;
+
+	while (low < high)
+	{
+		uint16_t middle = (low + high) / 2;
+		if (pgm_read_word(&timetable[middle].time) <= now)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	timetableNext = low;
+	timetableTime = now;
+}
+
+	// Called after each fast clock time broadcast
+void NceCabBus::runTimetable(void)
+{
+	if (!timetable || (FastClockMinutes >= 60))
+		return;
+
+	uint8_t Hours = FastClockHours;
+	if (FastClockMode != FAST_CLOCK_24)
+		Hours = (Hours % 12) + ((FastClockMode == FAST_CLOCK_PM) ? 12 : 0);
+
+	if (Hours >= 24)
+		return;
+
+	uint16_t now = NCE_TIME(Hours, FastClockMinutes);
+	if (now == timetableTime)
+		return;
+
+	uint16_t elapsed = (now + TIMETABLE_MINUTES_PER_DAY - timetableTime) % TIMETABLE_MINUTES_PER_DAY;
+	if ((timetableTime == TIMETABLE_TIME_UNKNOWN) || (elapsed > NCE_CAB_BUS_TIMETABLE_CATCH_UP))
+	{
+		syncTimetable(now);
+		return;
+	}
+
+	while (elapsed--)
+	{
+		timetableTime++;
+		if (timetableTime == TIMETABLE_MINUTES_PER_DAY)
+		{
+			timetableTime = 0;
+			timetableNext = 0;
+		}
+
+		bool ran = false;
+		while ((timetableNext < timetableCount) && (pgm_read_word(&timetable[timetableNext].time) == timetableTime))
+		{
+			runTimetableAction(pgm_read_word(&timetable[timetableNext].action));
+			timetableNext++;
+			ran = true;
+		}
+
+		if (ran)
+			logEvent(LOG_EVENT_TIMETABLE, timetableTime / 60, timetableTime % 60);
+	}
+
+#if NCE_CAB_BUS_SMART_CAB && NCE_CAB_BUS_ISR_RECEIVE
+	noInterrupts();
+	updateISRReply();
+	interrupts();
+#endif
+}
+
+void NceCabBus::runTimetableAction(uint16_t action)
+{
+	switch (action & TIMETABLE_ACTION_MASK)
+	{
+	case TIMETABLE_ACTION_CALLBACK:
+		if (func_TimetableHandler)
+			func_TimetableHandler(action & TIMETABLE_VALUE_MASK, timetableTime / 60, timetableTime % 60);
+		break;
+
+#if NCE_CAB_BUS_SMART_CAB
+	case TIMETABLE_ACTION_MACRO:
+	case TIMETABLE_ACTION_NORMAL:
+	case TIMETABLE_ACTION_REVERSE:
+		if (timetableQueueCount >= NCE_CAB_BUS_TIMETABLE_QUEUE_SIZE)
+		{
+			if (timetableOverflows < 255)
+				timetableOverflows++;
+			break;
+		}
+
+		timetableQueue[(timetableQueueTail + timetableQueueCount) & (NCE_CAB_BUS_TIMETABLE_QUEUE_SIZE - 1)] = action;
+		timetableQueueCount++;
+		break;
+
+#if NCE_CAB_BUS_ROUTES
+	case TIMETABLE_ACTION_ROUTE:
+			// Routes are 0..127, bit 7 is NCE_ROUTE_FORCE, so a bigger value would wrap to another route
+		if ((action & TIMETABLE_VALUE_MASK) <= (0x7F | NCE_ROUTE_FORCE))
+			triggerRoute((uint8_t)(action & TIMETABLE_VALUE_MASK));
+		break;
+#endif
+#endif
+	}
+}
+
+#if NCE_CAB_BUS_SMART_CAB
+	// Builds the frame for the oldest queued action, the same frame each time until it is sent
+CabBusCommand *NceCabBus::nextTimetableFrame(void)
+{
+	uint16_t action = timetableQueue[timetableQueueTail];
+	uint16_t value = action & TIMETABLE_VALUE_MASK;
+
+	if ((action & TIMETABLE_ACTION_MASK) == TIMETABLE_ACTION_MACRO)
+	{
+		timetableFrame.data[0] = 0x50;
+		timetableFrame.data[1] = 0x00;
+		timetableFrame.data[2] = 0x01;
+		timetableFrame.data[3] = value;
+	}
+	else
+	{
+		timetableFrame.data[0] = 0x50 + (value >> 7);
+		timetableFrame.data[1] = value & 0x7F;
+		timetableFrame.data[2] = ((action & TIMETABLE_ACTION_MASK) == TIMETABLE_ACTION_REVERSE) ? 0x04 : 0x03;
+		timetableFrame.data[3] = 0x00;
+	}
+
+	timetableFrame.data[4] = calcChecksum(timetableFrame.data, 4);
+	timetableFrame.count = 5;
+	return &timetableFrame;
+}
+
+	// timetableFrame has gone out, move on to the next action
+void NceCabBus::timetableFrameSent(void)
+{
+#if NCE_CAB_BUS_ROUTES
+	uint16_t action = timetableQueue[timetableQueueTail];
+	if ((action & TIMETABLE_ACTION_MASK) != TIMETABLE_ACTION_MACRO)
+		setAccessoryState(action & TIMETABLE_VALUE_MASK, (action & TIMETABLE_ACTION_MASK) == TIMETABLE_ACTION_REVERSE);
+#endif
+
+	timetableFrame.count = 0;
+	timetableQueueTail = (timetableQueueTail + 1) & (NCE_CAB_BUS_TIMETABLE_QUEUE_SIZE - 1);
+	timetableQueueCount--;
+}
+#endif
+
+#endif
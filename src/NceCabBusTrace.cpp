@@ -0,0 +1,150 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusTrace.cpp
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   Binary trace of every RS485 and USB byte the library sees,
+//            written to a RAM ring in 2-3 bytes per byte so it can be left
+//            running without changing the bus timing. The record format is
+//            described in NceCabBus.h and extras/trace/TraceDecode.cpp reads
+//            it back on a PC.
+//
+//            Only built when NCE_CAB_BUS_TRACE is enabled.
+//
+//------------------------------------------------------------------------
+
+#include "NceCabBus.h"
+
+#if NCE_CAB_BUS_TRACE
+
+#define TRACE_RECORD_MAX	7	// tag + byte + 5 delta bytes for 32 bits
+
+	// traceByte() may already be running with interrupts off inside the RX interrupt,
+	// so on AVR put the interrupt flag back as it was rather than enabling it
+#ifdef SREG
+#define TRACE_LOCK()		uint8_t oldSREG = SREG; noInterrupts()
+#define TRACE_UNLOCK()		SREG = oldSREG
+#else
+#define TRACE_LOCK()		noInterrupts()
+#define TRACE_UNLOCK()		interrupts()
+#endif
+
+	// Called from both loop() and processByteFromISR() so the ring and the
+	// timestamp are only touched with interrupts off
+void NceCabBus::traceByte(uint8_t channel, uint8_t value)
+{
+	if (!traceEnabled)
+		return;
+
+	uint8_t record[TRACE_RECORD_MAX];
+	uint8_t length = 2;
+
+	TRACE_LOCK();
+
+	uint32_t now = micros();
+	uint32_t delta = now - traceLastMicros;
+
+	record[0] = channel | (delta & 0x1F);
+	record[1] = value;
+	delta >>= 5;
+
+	if (delta)
+	{
+		record[0] |= NCE_CAB_BUS_TRACE_MORE;
+		while (delta)
+		{
+			record[length] = delta & 0x7F;
+			delta >>= 7;
+			if (delta)
+				record[length] |= 0x80;
+			length++;
+		}
+	}
+
+		// Drop the record when full so the ring always holds a run of complete records,
+		// the next delta then spans the gap
+	if (traceCount + length > NCE_CAB_BUS_TRACE_SIZE)
+	{
+		if (traceDropped < 0xFFFF)
+			traceDropped++;
+	}
+	else
+	{
+		for (uint8_t i = 0; i < length; i++)
+		{
+			traceRing[traceHead] = record[i];
+			traceHead = (traceHead + 1) & (NCE_CAB_BUS_TRACE_SIZE - 1);
+		}
+		traceCount += length;
+		traceLastMicros = now;
+	}
+
+	TRACE_UNLOCK();
+}
+
+	// Start or stop tracing, starting clears the ring and the first delta counts from now
+void NceCabBus::setTraceEnabled(bool enabled)
+{
+	noInterrupts();
+	if (enabled && !traceEnabled)
+	{
+		traceHead = 0;
+		traceTail = 0;
+		traceCount = 0;
+		traceDropped = 0;
+		traceLastMicros = micros();
+	}
+	traceEnabled = enabled;
+	interrupts();
+}
+
+	// Copy up to size bytes of the trace into buffer and free them, returns the number copied.
+	// Use it to move the trace to a sink like SPI flash, records may be split between calls
+uint16_t NceCabBus::readTrace(uint8_t *buffer, uint16_t size)
+{
+	uint16_t count;
+
+	noInterrupts();
+	count = traceCount;
+	interrupts();
+
+	if (count > size)
+		count = size;
+
+	for (uint16_t i = 0; i < count; i++)
+	{
+		buffer[i] = traceRing[traceTail];
+		traceTail = (traceTail + 1) & (NCE_CAB_BUS_TRACE_SIZE - 1);
+	}
+
+	noInterrupts();
+	traceCount -= count;
+	interrupts();
+
+	return count;
+}
+
+	// Write the trace so far as raw binary to pOut, e.g. the debug Serial port
+void NceCabBus::dumpTrace(Print *pOut)
+{
+	uint8_t buffer[32];
+	uint16_t count;
+
+	while ((count = readTrace(buffer, sizeof(buffer))) > 0)
+		pOut->write(buffer, count);
+}
+
+	// Number of records dropped because the ring was full
+uint16_t NceCabBus::getTraceDropped(void)
+{
+	return traceDropped;
+}
+
+#endif
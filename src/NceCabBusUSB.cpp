@@ -0,0 +1,855 @@
+//------------------------------------------------------------------------
+//
+// Model Railroading with Arduino - NceCabBusUSB.cpp
+//
+// Copyright (c) 2019 Alex Shepherd
+//
+// This source file is subject of the GNU general public license 2,
+// that is available at the world-wide-web at
+// http://www.gnu.org/licenses/gpl.txt
+//
+//------------------------------------------------------------------------
+//
+// purpose:   Smart cab role - translates NCE USB Interface commands into
+//            Cab Bus frames and Cab Bus replies back into USB responses.
+//            Only built when NCE_CAB_BUS_SMART_CAB is enabled.
+//
+//------------------------------------------------------------------------
+
+#include "NceCabBus.h"
+
+#if NCE_CAB_BUS_SMART_CAB
+
+const uint8_t USBCommandLengths[] PROGMEM = {
+	1, // 0x80
+	1, // 0x81	Only Available with RS232 Interface
+	1, // 0x82	Only Available with RS232 Interface
+	1, // 0x83	Only Available with RS232 Interface
+	1, // 0x84	Only Available with RS232 Interface
+	1, // 0x85	Only Available with RS232 Interface
+	1, // 0x86	Only Available with RS232 Interface
+	1, // 0x87	Only Available with RS232 Interface
+	1, // 0x88	Only Available with RS232 Interface
+	1, // 0x89	Only Available with RS232 Interface
+	1, // 0x8A	Only Available with RS232 Interface
+	1, // 0x8B	Only Available with RS232 Interface
+	1, // 0x8C
+	1, // 0x8D	Only Available with RS232 Interface
+	1, // 0x8E	Only Available with RS232 Interface
+	1, // 0x8F	Only Available with RS232 Interface
+	1, // 0x90	Only Available with RS232 Interface
+	1, // 0x91	Only Available with RS232 Interface
+	1, // 0x92	Only Available with RS232 Interface
+	1, // 0x93	Only Available with RS232 Interface
+	1, // 0x94	Only Available with RS232 Interface
+	1, // 0x95	Only Available with RS232 Interface
+	1, // 0x96	Only Available with RS232 Interface
+	1, // 0x97	Only Available with RS232 Interface
+	1, // 0x98	Only Available with RS232 Interface
+	1, // 0x99	Only Available with RS232 Interface
+	1, // 0x9A	Only Available with RS232 Interface
+	2, // 0x9B
+	2, // 0x9C
+	1, // 0x9D	Only Available with RS232 Interface
+	1, // 0x9E 
+	1, // 0x9F
+	4, // 0xA0
+	3, // 0xA1
+	5, // 0xA2
+	1, // 0xA3	Only Available with RS232 Interface
+	1, // 0xA4	Only Available with RS232 Interface
+	1, // 0xA5	Only Available with RS232 Interface
+	3, // 0xA6
+	2, // 0xA7
+	4, // 0xA8
+	3, // 0xA9
+	1, // 0xAA
+	1, // 0xAB	Only Available with RS232 Interface
+	1, // 0xAC	Only Available with RS232 Interface
+	5, // 0xAD
+	6, // 0xAE
+	6, // 0xAF
+	5, // 0xB0	Reserved for future use
+	1, // 0xB1
+	1, // 0xB2	Only Available with RS232 Interface
+	3, // 0xB3
+	2, // 0xB4
+	2  // 0xB5
+};
+
+int8_t getUSBCommandLength(uint8_t Command)
+{
+#if NCE_CAB_BUS_ROUTES
+	if (Command == NCE_USB_VENDOR_ROUTE)
+		return 2;
+#endif
+
+	if( (Command < 0x80) || (Command > 0xB5))
+		return -1;
+		
+	uint8_t commandOffset = Command - 0x80;
+	return pgm_read_byte(&USBCommandLengths[commandOffset]);
+}
+
+uint8_t NceCabBus::calcChecksum(uint8_t *Buffer, uint8_t Length)
+ {
+    uint8_t checkSum = 0;
+    for(uint8_t i = 0; i < Length; i++)
+    	checkSum ^= Buffer[i];
+
+    return checkSum;
+}
+
+void NceCabBus::processUSBByte(uint8_t inByte)
+{
+	NCE_CAB_BUS_TRACE_BYTE(NCE_CAB_BUS_TRACE_USB_RX, inByte);
+
+#if NCE_CAB_BUS_ISR_RECEIVE
+	finishISRCommands();
+#endif
+
+	if (USBCommandBuffer.expectedLength)
+	{
+		if (USBCommandBuffer.count < USBCommandBuffer.expectedLength)
+		{
+			USBCommandBuffer.data[USBCommandBuffer.count] = inByte;
+			logEvent(LOG_EVENT_USB_ADD_BYTE, inByte, 0);
+			USBCommandBuffer.count++;
+		}
+	}
+	else
+	{
+		int8_t commandLength = getUSBCommandLength(inByte);
+		USBCommandBuffer.expectedLength = (commandLength > 0) ? commandLength : 1;	// Unknown opcodes get Not Supported straight away
+		USBCommandBuffer.data[0] = inByte;
+		USBCommandBuffer.count = 1;
+		usbCommandPending = true;
+
+		if (CabBusCommandBuffer.count || CabBusCommandBuffer1.count)
+			NCE_CAB_BUS_STAT_INC(usbCommandsOverflowed);
+
+		logEvent(LOG_EVENT_USB_NEW_COMMAND, inByte, USBCommandBuffer.expectedLength);
+	}
+
+	if (USBCommandBuffer.count >= USBCommandBuffer.expectedLength)
+	{
+		logBytes(LOG_EVENT_USB_PROCESS, USBCommandBuffer.data, USBCommandBuffer.count);
+
+#if NCE_CAB_BUS_STATS
+		uint16_t rejectedBefore = stats.usbCommandsRejected;
+#endif
+
+		switch (USBCommandBuffer.data[0])
+		{
+		case 0x80:	// NOP, dummy instruction Returns !
+		{
+			USBResponseBuffer.data[0] = (USB_COMMAND_COMPLETED_SUCCESSFULLY);
+			USBResponseBuffer.count = 1;
+			callUSBSendBytes(USBResponseBuffer.data, USBResponseBuffer.count);
+			USBResponseBuffer.count = 0;
+			break;
+		}
+
+		case 0x8C:	// NOP, dummy instruction Returns ! followed by CR/LF
+		{
+			USBResponseBuffer.data[0] = (USB_COMMAND_COMPLETED_SUCCESSFULLY);
+			USBResponseBuffer.data[1] = '\r';
+			USBResponseBuffer.data[2] = '\n';
+			USBResponseBuffer.count = 3;
+			callUSBSendBytes(USBResponseBuffer.data, USBResponseBuffer.count);
+			USBResponseBuffer.count = 0;
+			break;
+		}
+
+		case 0x9B: // 0x9B yy Return Status of AIU yy
+		{
+			
+			CabBusCommandBuffer.data[0] = 0x4E;
+			CabBusCommandBuffer.data[1] = 0x19;
+			CabBusCommandBuffer.data[2] = 0x03;
+			CabBusCommandBuffer.data[3] = USBCommandBuffer.data[1];
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+		
+
+		case 0x9C: // 0x9C xx Execute Macro number xx
+		{
+			if ((USBCommandBuffer.data[1] < 0) || (USBCommandBuffer.data[1] > 255))
+			{
+				sendUSBResponse(USB_ADDRESS_OUT_OF_RANGE);
+				break;
+			}
+
+			CabBusCommandBuffer.data[0] = 0x50;
+			CabBusCommandBuffer.data[1] = 0x00;
+			CabBusCommandBuffer.data[2] = 0x01;
+			CabBusCommandBuffer.data[3] = USBCommandBuffer.data[1];
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+
+
+		case 0x9E:	// Enter programming Track mode
+		{			
+						
+			CabBusCommandBuffer.data[0] = 0x4E;
+			CabBusCommandBuffer.data[1] = 0x1B;
+			CabBusCommandBuffer.data[2] = 0x00;
+			CabBusCommandBuffer.data[3] = 0x00;
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+
+		}
+
+
+		case 0x9F:	// Exit programming Track mode
+		{
+			
+			CabBusCommandBuffer.data[0] = 0x4E;
+			CabBusCommandBuffer.data[1] = 0x1A;
+			CabBusCommandBuffer.data[2] = 0x00;
+			CabBusCommandBuffer.data[3] = 0x00;
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+
+		case 0xA0:	// 0xA0 aaaa xx program CV aaaa with data xx in direct mode  
+		{
+			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
+			uint16_t datavalue = USBCommandBuffer.data[3];
+
+			CabBusCommandBuffer.data[0] = 0x4E;
+			CabBusCommandBuffer.data[1] = 0x40 + (CVaddress >> 6);
+			CabBusCommandBuffer.data[2] = (0x007F & (CVaddress << 1)) + (datavalue >> 7);
+			CabBusCommandBuffer.data[3] = 0x007F & datavalue;
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+
+		case 0xA1:	// 0xA1 aaaa Read CV aaaa in paged mode  
+		{
+			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
+
+			CabBusCommandBuffer.data[0] = 0x4E;
+			CabBusCommandBuffer.data[1] = 0x20 + (CVaddress >> 6);
+			CabBusCommandBuffer.data[2] = (0x007F & (CVaddress << 1));
+			CabBusCommandBuffer.data[3] = 0x00;
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+
+
+		case 0xA2: // Locomotive Control Command 0xA2 <addr_h> <addr_l> <op_1> <data_1>
+		{
+			uint16_t address = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
+			if ((address < 3) || (address > 9999))
+			{
+				sendUSBResponse(USB_ADDRESS_OUT_OF_RANGE);
+				break;
+			}
+			if (address > 127)
+			{
+			CabBusCommandBuffer.data[0] = 0x00FF & (address >> 7);				// addr_h 
+			}
+			else
+			{
+			CabBusCommandBuffer.data[0] = 0x4F;									// short addr_h
+			}
+			CabBusCommandBuffer.data[1] = 0x007F & address;							// addr_l
+			CabBusCommandBuffer.data[2] = USBCommandBuffer.data[3];					// op_1
+			CabBusCommandBuffer.data[3] = USBCommandBuffer.data[4];					//data_1
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+
+		case 0xA6:	// 0xA6 rr xx program register rr with data xx in register mode 
+		{
+
+			uint16_t datavalue = USBCommandBuffer.data[2];
+
+			CabBusCommandBuffer.data[0] = 0x4E;
+			CabBusCommandBuffer.data[1] = 0x1F;
+			CabBusCommandBuffer.data[2] = (USBCommandBuffer.data[2] >> 1);
+			CabBusCommandBuffer.data[3] = 0x007F & datavalue;
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+
+		case 0xA7:	// 0xA7 rr read register rr in register mode 
+		{
+
+
+			CabBusCommandBuffer.data[0] = 0x4E;
+			CabBusCommandBuffer.data[1] = 0x1E;
+			CabBusCommandBuffer.data[2] = (USBCommandBuffer.data[2] >> 1);
+			CabBusCommandBuffer.data[3] = 0x00;
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+
+		case 0xA8:	// 0xA8 aaaa xx program CV aaaa with data xx in direct mode 
+		{
+
+			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
+			uint16_t datavalue = USBCommandBuffer.data[3];
+
+			CabBusCommandBuffer.data[0] = 0x4E; 
+			CabBusCommandBuffer.data[1] = 0x50 + (CVaddress >> 6);
+			CabBusCommandBuffer.data[2] = (0x007F & (CVaddress << 1)) + (datavalue >> 7);
+			CabBusCommandBuffer.data[3] = 0x007F & datavalue;
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+
+		case 0xA9:	// 0xA9 aaaa Read CV aaaa in direct mode 
+		{
+			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
+
+			CabBusCommandBuffer.data[0] = 0x4E;
+			CabBusCommandBuffer.data[1] = 0x30 + (CVaddress >> 6);
+			CabBusCommandBuffer.data[2] = (0x007F & (CVaddress << 1));
+			CabBusCommandBuffer.data[3] = 0x00;
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+
+		case 0xAA:	// Return USB Interface firmware Version
+		{
+			USBResponseBuffer.data[0] = 7;
+			USBResponseBuffer.data[1] = 3;
+			USBResponseBuffer.data[2] = 3;
+			USBResponseBuffer.count = 3;
+			callUSBSendBytes(USBResponseBuffer.data, USBResponseBuffer.count);
+			USBResponseBuffer.count = 0;
+			break;
+		}
+
+		case 0xAD: // Accy/Signal and macro commands  0xAD <addr_h> <addr_l> <op_1> <data_1>
+		{
+			uint16_t address = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
+			if (address > 2044)
+			{
+				sendUSBResponse(USB_ADDRESS_OUT_OF_RANGE);
+				break;
+			}
+			CabBusCommandBuffer.data[0] = 0x0050 + (address >> 7);					// addr_h 
+			CabBusCommandBuffer.data[1] = 0x007F & address;							// addr_l
+			CabBusCommandBuffer.data[2] = USBCommandBuffer.data[3];					// op_1
+			CabBusCommandBuffer.data[3] = USBCommandBuffer.data[4];					//data_1
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+
+#if NCE_CAB_BUS_ROUTES
+				// Remember accessories set by JMRI so routes can skip them
+			if ((USBCommandBuffer.data[3] == 0x03) || (USBCommandBuffer.data[3] == 0x04))
+				setAccessoryState(address, USBCommandBuffer.data[3] == 0x04);
+#endif
+			break;
+		}
+
+
+		case 0xAE: // OP's Program loco CV 0xAE <addr_h> <addr_l> <cv_h> <cv_l> <data_1> 
+		{
+			uint16_t address = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
+			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[3] << 8) + USBCommandBuffer.data[4]);
+			uint16_t datavalue = USBCommandBuffer.data[5];
+
+			
+			if ((address < 0) || (address > 9999))
+			{
+				sendUSBResponse(USB_ADDRESS_OUT_OF_RANGE);
+				break;
+			}
+			
+
+			CabBusCommandBuffer.data[0] = 0x00FF & (address >> 7);
+			CabBusCommandBuffer.data[1] = 0x007F & address;
+			CabBusCommandBuffer.data[2] = 0x00;
+			CabBusCommandBuffer.data[3] = 0x00;
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+
+			CabBusCommandBuffer1.data[0] = 0x4E;
+			CabBusCommandBuffer1.data[1] = 0x60 + (CVaddress >> 6);
+			CabBusCommandBuffer1.data[2] = ((0x007F & (CVaddress << 1)) - 2) + (datavalue >> 7);
+			CabBusCommandBuffer1.data[3] = 0x007F & datavalue;
+			CabBusCommandBuffer1.data[4] = calcChecksum(CabBusCommandBuffer1.data, 4);
+			CabBusCommandBuffer1.count = 5;
+			break;
+		}
+
+		case 0xAF: // OP's Program accessory/signal 0xAF <addr_h> <addr_l> <cv_h> <cv_l> <data_1> 
+		{
+			uint16_t address = 0x0FFF & ((USBCommandBuffer.data[1] << 8) + USBCommandBuffer.data[2]);
+			uint16_t CVaddress = 0x0FFF & ((USBCommandBuffer.data[3] << 8) + USBCommandBuffer.data[4]);
+			uint16_t datavalue = USBCommandBuffer.data[5];
+			
+			
+			if ((address < 0) || (address > 2044))
+				{
+					sendUSBResponse(USB_ADDRESS_OUT_OF_RANGE);
+					break;
+				}
+				
+
+			CabBusCommandBuffer.data[0] = 0x00FF & (address >> 7);
+			CabBusCommandBuffer.data[1] = 0x007F & address;
+			CabBusCommandBuffer.data[2] = 0x00;
+			CabBusCommandBuffer.data[3] = 0x00;
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+
+			CabBusCommandBuffer1.data[0] = 0x4E;
+			CabBusCommandBuffer1.data[1] = 0x70 + (CVaddress >> 6);
+			CabBusCommandBuffer1.data[2] = ((0x007F & (CVaddress << 1)) - 2) + (datavalue >> 7);
+			CabBusCommandBuffer1.data[3] = 0x007F & datavalue;
+			CabBusCommandBuffer1.data[4] = calcChecksum(CabBusCommandBuffer1.data, 4);
+			CabBusCommandBuffer1.count = 5;
+			break;
+		}
+
+		case 0xB3: // 0xB3 yy xx Set the CAB context page memory read/write pointer to cab address yy  memory location xx
+				   // yy in the range of 0-255 and cabbus address ranging from 0-63	
+		{
+			
+			uint16_t memaddress = (USBCommandBuffer.data[1]);
+		/*
+			if ((USBCommandBuffer.data[1] < 0) || (USBCommandBuffer.data[1] > 255) ||
+				(USBCommandBuffer.data[2] < 0) || (USBCommandBuffer.data[2] > 63))
+			{
+				sendUSBResponse(USB_CV_ADDRESS_OR_DATA_OUT_OF_RANGE);
+				return;
+			}
+			*/
+
+			CabBusCommandBuffer.data[0] = 0x4E;
+			CabBusCommandBuffer.data[1] = 0x18;
+			CabBusCommandBuffer.data[2] = (memaddress << 1) + (USBCommandBuffer.data[2] >> 7);
+			CabBusCommandBuffer.data[3] = 0x07F & USBCommandBuffer.data[2];
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+
+		case 0xB4: // 0xB4 xx write 1 byte to cab bus memory at memory pointer location the pointer will increment after the write
+
+		{
+
+			uint16_t datavalue = (USBCommandBuffer.data[1]);
+
+			CabBusCommandBuffer.data[0] = 0x4E;
+			CabBusCommandBuffer.data[1] = 0x19;
+			CabBusCommandBuffer.data[2] = 0x00 + (datavalue >> 7);
+			CabBusCommandBuffer.data[3] = 0x07F & (datavalue);
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+
+			break;
+		}
+
+		case 0xB5: // 0xB5 xx return 1,2,4  bytes (indicated by xx = 1,2, or 4) from cab memory at memory pointer location the pointer will increment after the read
+
+		{
+
+			CabBusCommandBuffer.data[0] = 0x4E;
+			CabBusCommandBuffer.data[1] = 0x19;
+			CabBusCommandBuffer.data[2] = 0x02;
+			CabBusCommandBuffer.data[3] = USBCommandBuffer.data[1];
+			CabBusCommandBuffer.data[4] = calcChecksum(CabBusCommandBuffer.data, 4);
+			CabBusCommandBuffer.count = 5;
+			break;
+		}
+
+#if NCE_CAB_BUS_STATS
+		case NCE_USB_VENDOR_GET_STATS:	// Return the NceCabBusStats block, answered locally
+		{
+			NceCabBusStats statsCopy;
+			getStats(&statsCopy);
+			callUSBSendBytes((uint8_t *)&statsCopy, sizeof(statsCopy));
+			break;
+		}
+
+		case NCE_USB_VENDOR_CLEAR_STATS:	// Clear the statistics, returns !
+		{
+			clearStats();
+			sendUSBResponse(USB_COMMAND_COMPLETED_SUCCESSFULLY);
+			break;
+		}
+#endif
+
+#if NCE_CAB_BUS_ROUTES
+		case NCE_USB_VENDOR_ROUTE:	// 0xF2 <route> Queue route, or with NCE_ROUTE_FORCE to resend every accessory
+		{
+			uint8_t route = USBCommandBuffer.data[1];
+
+			if ((route & ~NCE_ROUTE_FORCE) >= routeCount)
+				sendUSBResponse(USB_ADDRESS_OUT_OF_RANGE);
+
+			else if (!triggerRoute(route))
+				sendUSBResponse(USB_BYTE_COUNT_OUT_OF_RANGE);
+
+			else
+				sendUSBResponse(USB_COMMAND_COMPLETED_SUCCESSFULLY);
+			break;
+		}
+#endif
+
+		default:	// Function which are Not Supported added to prevent code locking up
+		{
+
+			sendUSBResponse(USB_COMMAND_NOT_SUPPORTED);
+			break;
+		}
+		}
+
+#if NCE_CAB_BUS_STATS
+		if (stats.usbCommandsRejected == rejectedBefore)
+			stats.usbCommandsAccepted++;
+#endif
+
+		USBCommandBuffer.expectedLength = 0;
+		USBCommandBuffer.count = 0;
+
+#if NCE_CAB_BUS_MULTI_ADDRESS
+		queueSmartCabFrames();
+#endif
+
+			// Answered already unless a Cab Bus frame has to go out first
+		if (!CabBusCommandBuffer.count && !CabBusCommandBuffer1.count)
+			usbResponseSent();
+
+#if NCE_CAB_BUS_ISR_RECEIVE
+		noInterrupts();
+		updateISRReply();	// Publish any new Cab Bus frame for processByteFromISR() to send
+		interrupts();
+#endif
+	}
+}
+
+	// Decode the reply to a smart cab command as it arrives. Each data byte
+	// is split across two Cab Bus reply bytes, so a USB response byte is
+	// sent as soon as the second of its pair is received instead of
+	// waiting for the whole frame:
+	//   0xD8 st+hi2 lo6                          -> data, status
+	//   0xD9 st+hi4 lo4 hi2+lo6                  -> data, data, status
+	//   0xDA st+hi4 lo4 hi2+lo6 hi4 lo4 hi2+lo6  -> data x 4, status
+void NceCabBus::processResponseByte(uint8_t inByte)
+{
+#if NCE_CAB_BUS_MULTI_ADDRESS
+		// The command station replies after polling the address that sent the command,
+		// so with several addresses only take a reply that follows that poll
+	if ((inByte & CMD_TYPE_MASK) == CMD_TYPE_POLL)
+	{
+		responsePolledAddress = inByte & CMD_ASCII_MASK;
+		return;
+	}
+
+	if (extraCabAddressCount && (responsePolledAddress != replyAddress))
+		return;
+#endif
+
+	if ((inByte >= 0xD8) && (inByte <= 0xDA))
+	{
+		if (CabBusReplyBuffer.ReplySize)
+		{
+			NCE_CAB_BUS_STAT_INC(repliesOrphaned);
+
+				// Part of the old reply has gone to JMRI already. It is closed out so the host stays in
+				// step, which answers the command, so the new reply is ignored
+			if (CabBusReplyBuffer.count > 2)
+			{
+				closeOrphanedReply();
+				return;
+			}
+		}
+
+		CabBusReplyBuffer.opcode = inByte;
+		CabBusReplyBuffer.ReplySize = (inByte == 0xD8) ? 3 : ((inByte == 0xD9) ? 4 : 7);
+		CabBusReplyBuffer.count = 1;
+
+		logEvent(LOG_EVENT_REPLY, inByte, CabBusReplyBuffer.ReplySize);
+		return;
+	}
+
+	if (!CabBusReplyBuffer.ReplySize)
+		return;
+
+	uint8_t position = CabBusReplyBuffer.count++;
+	uint8_t lastByte = CabBusReplyBuffer.lastByte;
+	CabBusReplyBuffer.lastByte = inByte;
+
+	if (position == 1)
+	{
+			// Status is bits 4-5 of the first byte: 0 = success, 1..3 = USB_ADDRESS_OUT_OF_RANGE ('1') .. USB_CV_ADDRESS_OR_DATA_OUT_OF_RANGE ('3')
+		uint8_t status = (inByte >> 4) & 0x03;
+		CabBusReplyBuffer.status = status ? ('0' + status) : USB_COMMAND_COMPLETED_SUCCESSFULLY;
+		return;
+	}
+
+	if (CabBusReplyBuffer.opcode == 0xD8)
+		sendUSBByte(((lastByte & 0x03) << 6) | (inByte & 0x3F));
+
+	else if ((position == 2) || (position == 5))
+		sendUSBByte(((lastByte & 0x0F) << 4) | (inByte & 0x0F));
+
+	else if ((position == 3) || (position == 6))
+		sendUSBByte(((lastByte & 0x30) << 2) | (inByte & 0x3F));
+
+	if (CabBusReplyBuffer.count == CabBusReplyBuffer.ReplySize)
+	{
+		NCE_CAB_BUS_STAT_INC(repliesDecoded);
+		endUSBReply(CabBusReplyBuffer.status);
+	}
+}
+
+	// Ends the USB response to a reply. 0xB5 and 0x9B don't have a status byte in theirs
+void NceCabBus::endUSBReply(uint8_t status)
+{
+	CabBusReplyBuffer.ReplySize = 0;
+
+	uint8_t command = USBCommandBuffer.data[0];
+	if ((command != 0xB5) && !((command == 0x9B) && (CabBusReplyBuffer.opcode == 0xD9)))
+		sendUSBByte(status);
+
+	usbResponseSent();
+}
+
+	// Pads a reply that was cut short with 0 data bytes and ends it with an error status, so
+	// JMRI gets a response of the length it expects
+void NceCabBus::closeOrphanedReply(void)
+{
+	uint8_t dataBytes = (CabBusReplyBuffer.opcode == 0xD8) ? 1 : ((CabBusReplyBuffer.opcode == 0xD9) ? 2 : 4);
+
+		// A data byte goes out at reply positions 2, 3, 5 and 6
+	uint8_t sent = CabBusReplyBuffer.count - 2;
+	if (CabBusReplyBuffer.count > 4)
+		sent--;
+
+	while (sent++ < dataBytes)
+		sendUSBByte(0);
+
+	endUSBReply(USB_COMMAND_NOT_SUPPORTED);
+}
+
+void NceCabBus::sendUSBByte(uint8_t value)
+{
+	callUSBSendBytes(&value, 1);
+}
+
+void NceCabBus::sendUSBResponse(USB_RESPONSE_CODES response)
+{
+	if (response != USB_COMMAND_COMPLETED_SUCCESSFULLY)
+		NCE_CAB_BUS_STAT_INC(usbCommandsRejected);
+
+	sendUSBByte(response);
+	usbResponseSent();
+}
+
+	// The whole response to the USB command has been sent or buffered. A buffered response goes
+	// to the handler now, so it never waits on the sketch, unless service() is reading more
+	// commands and will flush them all at once
+void NceCabBus::usbResponseSent(void)
+{
+	usbCommandPending = false;
+
+#if NCE_CAB_BUS_USB_TX_BUFFER_SIZE
+	if (!usbTxHold)
+		flushUSB();
+#endif
+}
+
+	// Returns the next Cab Bus frame waiting to go out on our poll or NULL if none.
+	// USB commands go first, then timetable actions, queued routes use the polls left over
+CabBusCommand *NceCabBus::nextSmartCabCommand(void)
+{
+#if NCE_CAB_BUS_MULTI_ADDRESS
+	if (frameQueueCount)	// Older than anything in CabBusCommandBuffer
+		return &frameQueue[frameQueueTail];
+#endif
+
+	if (CabBusCommandBuffer.count)
+		return &CabBusCommandBuffer;
+
+	if (CabBusCommandBuffer1.count)
+		return &CabBusCommandBuffer1;
+
+#if NCE_CAB_BUS_USE_TIMETABLE
+	if (timetableQueueCount)
+		return nextTimetableFrame();
+#endif
+
+#if NCE_CAB_BUS_ROUTES
+	return nextRouteFrame();
+#else
+	return NULL;
+#endif
+}
+
+	// Called once pCommand, returned by nextSmartCabCommand(), has been sent
+void NceCabBus::smartCabCommandSent(CabBusCommand *pCommand)
+{
+#if NCE_CAB_BUS_ROUTES
+	if (pCommand == &routeFrame)
+	{
+		routeFrameSent();
+		return;
+	}
+#endif
+
+#if NCE_CAB_BUS_USE_TIMETABLE
+	if (pCommand == &timetableFrame)
+	{
+		timetableFrameSent();
+		return;
+	}
+#endif
+
+#if NCE_CAB_BUS_MULTI_ADDRESS
+	if (pCommand == &frameQueue[frameQueueTail])
+	{
+		frameQueueTail = (frameQueueTail + 1) & (NCE_CAB_BUS_SMART_CAB_QUEUE_SIZE - 1);
+		frameQueueCount--;
+		return;
+	}
+
+	replyAddress = ownPolledAddress;
+#endif
+
+	if (pCommand == &CabBusCommandBuffer)
+	{
+		CabBusCommandBuffer.count = 0;
+
+		// if not a read function send the reply here or not a two pass function prog on main or Accy
+		if (CabBusCommandBuffer1.count == 0)
+		{
+			if (needsUSBAcknowledge(USBCommandBuffer.data[0]))
+				sendUSBResponse(USB_COMMAND_COMPLETED_SUCCESSFULLY);
+		}
+	}
+
+	else if (pCommand == &CabBusCommandBuffer1)
+	{
+		CabBusCommandBuffer1.count = 0;
+
+		// Send the Acknowledge here if its a two pass function prog on main or Accy
+		if (needsUSBAcknowledge(USBCommandBuffer.data[0]))
+			sendUSBResponse(USB_COMMAND_COMPLETED_SUCCESSFULLY);
+	}
+}
+
+#if NCE_CAB_BUS_MULTI_ADDRESS
+	// With extra addresses move the frames of a command that only needs '!' into the
+	// shared queue and acknowledge it straight away, so JMRI sends the next command
+	// while they wait for a poll. Reads, and commands when the queue is full, stay in
+	// CabBusCommandBuffer and are answered when sent as with one address. The queue
+	// is sent in order so commands for the same loco or accessory keep their order
+void NceCabBus::queueSmartCabFrames(void)
+{
+	if (!extraCabAddressCount || !CabBusCommandBuffer.count || !needsUSBAcknowledge(USBCommandBuffer.data[0]))
+		return;
+
+	uint8_t frames = CabBusCommandBuffer1.count ? 2 : 1;
+	if (frameQueueCount + frames > NCE_CAB_BUS_SMART_CAB_QUEUE_SIZE)
+		return;
+
+	frameQueue[(frameQueueTail + frameQueueCount++) & (NCE_CAB_BUS_SMART_CAB_QUEUE_SIZE - 1)] = CabBusCommandBuffer;
+	CabBusCommandBuffer.count = 0;
+
+	if (CabBusCommandBuffer1.count)
+	{
+		frameQueue[(frameQueueTail + frameQueueCount++) & (NCE_CAB_BUS_SMART_CAB_QUEUE_SIZE - 1)] = CabBusCommandBuffer1;
+		CabBusCommandBuffer1.count = 0;
+	}
+
+	sendUSBResponse(USB_COMMAND_COMPLETED_SUCCESSFULLY);
+}
+#endif
+
+bool NceCabBus::needsUSBAcknowledge(uint8_t Command)
+{
+	return	(Command == 0x96) || (Command == 0x9E) || (Command == 0x9F) || (Command == 0xA0) ||
+			(Command == 0xA2) || (Command == 0xA6) || (Command == 0xA8) || (Command == 0xAD) ||
+			(Command == 0xAE) || (Command == 0xAF) || (Command == 0xB3) || (Command == 0xB4);
+}
+
+bool NceCabBus::sendSmartCabCommand(void)
+{
+	CabBusCommand *pCommand = nextSmartCabCommand();
+
+	if (!pCommand)
+		return false;
+
+	callRS485SendBytes(pCommand->data, pCommand->count);
+	logBytes(LOG_EVENT_SEND_RS485, pCommand->data, pCommand->count);
+
+	smartCabCommandSent(pCommand);
+	return true;
+}
+
+void NceCabBus::setUSBSendBytesHandler(USBSendBytes funcPtr)
+{
+	func_USBSendBytes = funcPtr;
+}
+
+	// True from the first byte of a USB command until the last byte of its response
+	// has been sent, so a host can tell where one response ends without knowing its length
+bool NceCabBus::isUSBCommandPending(void)
+{
+	return usbCommandPending;
+}
+
+#if NCE_CAB_BUS_USB_TX_BUFFER_SIZE
+	// Collect USB response bytes instead of calling the USBSendBytes handler for each one, so a
+	// reply decoded byte by byte goes out in one USB packet. Each response is handed over once
+	// complete, and service() hands over all of those to the commands it read in one go
+void NceCabBus::setUSBSendBuffering(bool enabled)
+{
+	if (!enabled)
+		flushUSB();
+
+	usbTxBuffering = enabled;
+}
+
+void NceCabBus::flushUSB(void)
+{
+	if (!usbTxCount)
+		return;
+
+	uint8_t count = usbTxCount;
+	usbTxCount = 0;
+	deliverUSBBytes(usbTxBuffer, count);
+}
+
+	// Responses are only ever appended, so JMRI still sees them in command order
+void NceCabBus::queueUSBBytes(uint8_t *values, uint8_t length)
+{
+	if (usbTxCount + length > NCE_CAB_BUS_USB_TX_BUFFER_SIZE)
+	{
+		flushUSB();
+
+			// Too big to buffer at all, e.g. the 0xF0 stats block
+		if (length > NCE_CAB_BUS_USB_TX_BUFFER_SIZE)
+		{
+			deliverUSBBytes(values, length);
+			return;
+		}
+	}
+
+	for (uint8_t i = 0; i < length; i++)
+		usbTxBuffer[usbTxCount++] = values[i];
+}
+#endif
+
+#endif